@@ -6,9 +6,15 @@
 
 namespace sampen {
 
+/**
+ * @param num_threads: The number of threads used by secds, e.g., to compute
+ * the samples in parallel.
+ */
 template <typename T>
 void SampleEntropySamplingExperiment(
-    SampleEntropyCalculatorSampling<T> &secds, unsigned n_computation) {
+    SampleEntropyCalculatorSampling<T> &secds, unsigned n_computation,
+    unsigned num_threads = 1) {
+  secds.set_num_threads(num_threads);
   vector<double> errs_sampen(n_computation);
   vector<double> errs_a(n_computation);
   vector<double> errs_b(n_computation);
@@ -0,0 +1,180 @@
+/**
+ * @file implicit_kdtree.h
+ *
+ * @brief Implements kd trees stored in flat arrays, which can replace
+ * KDCountingTree2K and KDTree2K.
+ *
+ * @details The tree is a complete binary tree in level order: the children
+ * of node i are 2i + 1 and 2i + 2, and its father is (i - 1) / 2. Each leaf
+ * holds a bucket of up to kLeafSize consecutive slots of a permutation of the
+ * points, so the slots covered by any node follow from its index. Bounding
+ * boxes, coordinates and counts are stored in arrays (one array per axis for
+ * boxes and coordinates), so no node is allocated individually.
+ *
+ * As with the trees of kdtree.h, a copy of a tree shares its geometry (the
+ * slots, coordinates and boxes) and has its own weighted counts.
+ */
+
+#ifndef __FAST_SAMPEN_IMPLICIT_KDTREE__
+#define __FAST_SAMPEN_IMPLICIT_KDTREE__
+
+#include <assert.h>
+#include <memory>
+#include <vector>
+
+#include "utils.h"
+
+namespace sampen {
+using std::vector;
+
+/**
+ * @brief The part of an implicit kd tree which is never modified after the
+ * construction, see KDTreeGeometry.
+ */
+template <typename T>
+struct ImplicitKDTreeGeometry {
+  vector<unsigned> index2slot;
+  // coords[axis * n + slot]
+  vector<T> coords;
+  // lower[axis * num_nodes + node], upper[axis * num_nodes + node]
+  vector<T> lower;
+  vector<T> upper;
+};
+
+template <typename T>
+class ImplicitKDTreeBase {
+public:
+  /// @brief The number of points in a leaf bucket.
+  static const unsigned kLeafSize = 8;
+
+  unsigned count() const { return _n; }
+  unsigned num_nodes() const { return _node_weights.size(); }
+
+  /**
+   * @brief Update the counting of a given point and its ancestors.
+   *
+   * @param position: The index of the point (in the points used to build the
+   * tree).
+   * @param d: The value to be added.
+   */
+  void UpdateCount(unsigned position, int d) {
+    assert(position < count() && "position >= count()");
+    if (d)
+      _UpdateSlot(_index2slot[position], d);
+  }
+
+  void Close(unsigned position) {
+    assert(position < count() && "position >= count()");
+    const unsigned slot = _index2slot[position];
+    const int w = _slot_weights[slot];
+    if (w != 0)
+      _UpdateSlot(slot, -w);
+  }
+
+protected:
+  /**
+   * @param K: The dimension of the bounding boxes.
+   * @param num_coords: The number of coordinates kept for each point
+   * (K <= num_coords <= points.dim()).
+   */
+  ImplicitKDTreeBase(unsigned K, unsigned num_coords,
+                     const TemplateView<T> &points, OutputLevel output_level);
+
+  void _UpdateSlot(unsigned slot, int d) {
+    _slot_weights[slot] += d;
+    unsigned node = _num_leaves - 1 + slot / kLeafSize;
+    while (true) {
+      _node_weights[node] += d;
+      if (node == 0)
+        break;
+      node = (node - 1) / 2;
+    }
+  }
+  bool _IsLeaf(unsigned node) const { return node + 1 >= _num_leaves; }
+  // The slots [first, last) covered by the node.
+  void _GetSlots(unsigned node, unsigned &first, unsigned &last) const {
+    const unsigned level = 31 - __builtin_clz(node + 1);
+    const unsigned capacity = (_num_leaves >> level) * kLeafSize;
+    first = (node + 1 - (1u << level)) * capacity;
+    last = first + capacity < _n ? first + capacity : _n;
+    if (first > _n)
+      first = _n;
+  }
+  T _Coord(unsigned axis, unsigned slot) const {
+    return _coords[axis * _n + slot];
+  }
+  T _Lower(unsigned axis, unsigned node) const {
+    return _lower[axis * num_nodes() + node];
+  }
+  T _Upper(unsigned axis, unsigned node) const {
+    return _upper[axis * num_nodes() + node];
+  }
+  void _Partition(vector<unsigned> &order, const TemplateView<T> &points,
+                  unsigned first, unsigned last, unsigned level,
+                  unsigned capacity);
+
+  unsigned K;
+  unsigned _num_coords;
+  unsigned _n;
+  // The number of leaves, which is a power of 2.
+  unsigned _num_leaves;
+  std::shared_ptr<const ImplicitKDTreeGeometry<T> > _geometry;
+  // The arrays of _geometry.
+  const unsigned *_index2slot;
+  const T *_coords;
+  const T *_lower;
+  const T *_upper;
+  vector<int> _slot_weights;
+  vector<int> _node_weights;
+  // The nodes to visit in CountRange().
+  vector<unsigned> _stack;
+  OutputLevel _output_level;
+};
+
+
+/**
+ * @brief An implicit kd tree with the same interface as KDCountingTree2K.
+ */
+template <typename T>
+class ImplicitKDCountingTree : public ImplicitKDTreeBase<T> {
+public:
+  ImplicitKDCountingTree(unsigned K, const TemplateView<T> &points,
+                         OutputLevel output_level)
+      : ImplicitKDTreeBase<T>(K, K, points, output_level) {}
+
+  /**
+   * @brief Count the weights of the points within the first K dimensions of
+   * range.
+   */
+  long long CountRange(const Range<T> &range, long long &num_nodes);
+};
+
+
+/**
+ * @brief An implicit kd tree with the same interface as KDTree2K. The
+ * bounding boxes cover the first K coordinates, and the (K + 1)-th
+ * coordinate is checked point by point.
+ */
+template <typename T>
+class ImplicitKDTree : public ImplicitKDTreeBase<T> {
+public:
+  /**
+   * @param num_last_axes: The number of the coordinates after the first K
+   * which are checked point by point (the last axes). The 2D templates, for
+   * example, grow by 2m + 1 pixels from m x m to (m + 1) x (m + 1).
+   */
+  ImplicitKDTree(unsigned K, const TemplateView<T> &points,
+                 OutputLevel output_level, unsigned num_last_axes = 1)
+      : ImplicitKDTreeBase<T>(K, K + num_last_axes, points, output_level) {}
+
+  /**
+   * @return {A, B}, where B counts the weights of the points within the first
+   * K dimensions of range and A those within all K + num_last_axes
+   * dimensions.
+   */
+  vector<long long> CountRange(const Range<T> &range, long long &num_nodes);
+};
+
+} // namespace sampen
+
+#endif // !__FAST_SAMPEN_IMPLICIT_KDTREE__
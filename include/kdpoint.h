@@ -4,6 +4,7 @@
 #include <iostream>
 #include <string.h>
 #include <vector>
+#include <algorithm>
 #include <assert.h>
 
 namespace sampen {
@@ -12,7 +13,7 @@ using std::vector;
 template <typename T>
 class LastAxisTreeNode;
 
-template <typename T>
+template <typename T, typename Counts>
 class RangeKDTree2KNode;
 
 template <typename T> class KDPoint {
@@ -114,6 +115,188 @@ private:
 };
 
 
+/**
+ * @brief A read-only view of a k-dimensional point whose coordinates are
+ * stored contiguously somewhere else (e.g. in a KDPointSet).
+ */
+template <typename T> class KDPointRef {
+public:
+  KDPointRef(const T *data = nullptr, unsigned dim = 0)
+      : _data(data), _dim(dim) {}
+  unsigned dim() const { return _dim; }
+  const T *data() const { return _data; }
+  const T& operator[](unsigned n) const { return _data[n]; }
+  bool Within(const KDPointRef<T> &p, T r, unsigned m) const {
+    for (unsigned i = 0; i < m; i++) {
+      T diff = _data[i] - p[i];
+      if (diff > r || -diff > r)
+        return false;
+    }
+    return true;
+  }
+  // Lexicographic order.
+  bool operator<(const KDPointRef &p) const {
+    for (unsigned i = 0; i < _dim; i++) {
+      if (_data[i] < p[i])
+        return true;
+      else if (_data[i] > p[i])
+        return false;
+    }
+    return false;
+  }
+  bool operator==(const KDPointRef &p) const {
+    for (unsigned i = 0; i < _dim; i++) {
+      if (_data[i] != p[i])
+        return false;
+    }
+    return true;
+  }
+
+private:
+  const T *_data;
+  unsigned _dim;
+};
+
+
+/**
+ * @brief A set of k-dimensional points stored in one contiguous buffer with
+ * a fixed stride, which replaces vector<KDPoint<T> > in the kd tree based
+ * calculators. Accessing a point returns a KDPointRef instead of a copy.
+ */
+template <typename T> class KDPointSet {
+public:
+  KDPointSet(size_t n = 0, unsigned dim = 0, int count = 0)
+      : _size(n), _dim(dim), _data(n * dim), _counts(n, count) {}
+  size_t size() const { return _size; }
+  unsigned dim() const { return _dim; }
+  const T *data() const { return _data.data(); }
+  KDPointRef<T> operator[](size_t i) const {
+    return KDPointRef<T>(_data.data() + i * _dim, _dim);
+  }
+  T *mutable_point(size_t i) { return _data.data() + i * _dim; }
+  int count(size_t i) const { return _counts[i]; }
+  void set_count(size_t i, int count) { _counts[i] = count; }
+  void increase_count(size_t i, int count) { _counts[i] += count; }
+  /**
+   * @brief Gather points (together with their counts) into a new set such
+   * that result[i] = (*this)[indices[i]].
+   */
+  KDPointSet<T> Select(const vector<unsigned> &indices) const {
+    const size_t n = indices.size();
+    KDPointSet<T> result(n, _dim);
+    for (size_t i = 0; i < n; ++i) {
+      const T *src = _data.data() + static_cast<size_t>(indices[i]) * _dim;
+      std::copy(src, src + _dim, result.mutable_point(i));
+      result._counts[i] = _counts[indices[i]];
+    }
+    return result;
+  }
+
+private:
+  size_t _size;
+  unsigned _dim;
+  std::vector<T> _data;
+  std::vector<int> _counts;
+};
+
+
+/**
+ * @brief A read-only view of k-dimensional points laid out in a buffer that
+ * is owned by someone else. The i-th point starts at data[offset(i)], where
+ * offset(i) = offsets[i] if offsets are given, and i * stride otherwise.
+ *
+ * With stride 1 the points are exactly the overlapping templates of a time
+ * series, so no template has to be materialized. The trailing templates that
+ * run over the end of the buffer (partial templates) may be included: they
+ * take the role of the auxiliary points, and only their available
+ * coordinates may be accessed.
+ */
+template <typename T> class TemplateView {
+public:
+  TemplateView() : _data(nullptr), _length(0), _size(0), _dim(0), _stride(1) {}
+  /**
+   * @brief The templates of length dim of the series data[0], ...,
+   * data[length - 1].
+   *
+   * @param include_partial: If true, the (dim - 1) trailing templates shorter
+   * than dim are included as well, such that size() == length.
+   */
+  TemplateView(const T *data, size_t length, unsigned dim,
+               bool include_partial = false)
+      : _data(data), _length(length),
+      _size(include_partial ? length : (length >= dim ? length - dim + 1 : 0)),
+      _dim(dim), _stride(1) {}
+  /// @brief Points starting at the given offsets of data.
+  TemplateView(const T *data, size_t length, unsigned dim,
+               vector<unsigned> &&offsets)
+      : _data(data), _length(length), _size(offsets.size()), _dim(dim),
+      _stride(1), _offsets(std::move(offsets)) {}
+  TemplateView(const KDPointSet<T> &points)
+      : _data(points.data()), _length(points.size() * points.dim()),
+      _size(points.size()), _dim(points.dim()), _stride(points.dim()) {}
+
+  size_t size() const { return _size; }
+  unsigned dim() const { return _dim; }
+  size_t offset(size_t i) const {
+    return _offsets.empty() ? i * _stride : _offsets[i];
+  }
+  KDPointRef<T> operator[](size_t i) const {
+    return KDPointRef<T>(_data + offset(i), _dim);
+  }
+  /// @brief The number of coordinates of the i-th point within the buffer.
+  unsigned length(size_t i) const {
+    const size_t remain = _length - offset(i);
+    return remain < _dim ? static_cast<unsigned>(remain) : _dim;
+  }
+  /// @brief The view of the points first, first + 1, ..., last - 1.
+  TemplateView<T> Slice(size_t first, size_t last) const {
+    TemplateView<T> result(*this);
+    result._size = last - first;
+    if (_offsets.empty()) {
+      result._data = _data + first * _stride;
+      result._length = _length - first * _stride;
+    } else {
+      result._offsets = vector<unsigned>(_offsets.begin() + first,
+                                         _offsets.begin() + last);
+    }
+    return result;
+  }
+  /**
+   * @brief Move the offsets out of the view (e.g. to reuse their
+   * allocation), which leaves the view empty.
+   */
+  vector<unsigned> ReleaseOffsets() {
+    _size = 0;
+    return std::move(_offsets);
+  }
+  /**
+   * @brief Lexicographic order, where a partial template precedes the
+   * templates it is a prefix of.
+   */
+  bool Less(size_t i1, size_t i2) const {
+    const T *p1 = _data + offset(i1);
+    const T *p2 = _data + offset(i2);
+    const unsigned l1 = length(i1), l2 = length(i2);
+    const unsigned l = l1 < l2 ? l1 : l2;
+    for (unsigned k = 0; k < l; ++k) {
+      if (p1[k] < p2[k])
+        return true;
+      else if (p1[k] > p2[k])
+        return false;
+    }
+    return l1 < l2;
+  }
+
+private:
+  const T *_data;
+  size_t _length;
+  size_t _size;
+  unsigned _dim;
+  unsigned _stride;
+  vector<unsigned> _offsets;
+};
+
+
 } // namespace sampen
 
 #endif // !__KDPOINT__
@@ -11,17 +11,24 @@
 #ifndef __FAST_SAMPEN_KDTREE__
 #define __FAST_SAMPEN_KDTREE__
 
+#include <algorithm>
 #include <iostream>
+#include <memory>
 #include <stdlib.h>
 
 #include "utils.h"
 
 namespace sampen {
 
+/**
+ * @brief Get the bounding box of the first K coordinates of the points whose
+ * indices are in [first, last).
+ */
 template <typename T>
-Range<T> GetRange(typename vector<KDPoint<T> >::const_iterator first,
-                  typename vector<KDPoint<T> >::const_iterator last,
-                  unsigned output_dim);
+Range<T> GetRange(const TemplateView<T> &points,
+                  vector<unsigned>::const_iterator first,
+                  vector<unsigned>::const_iterator last,
+                  unsigned K);
 
 // template<typename T, unsigned K, unsigned D>
 // Range<T, K> GetRange(typename vector<KDPointRKD<T, D>>::const_iterator first,
@@ -39,8 +46,9 @@ public:
    */
   KDCountingTreeNode(unsigned K, unsigned depth, KDCountingTreeNode *father,
                      vector<KDCountingTreeNode *> &leaves,
-                     typename vector<KDPoint<T> >::iterator first,
-                     typename vector<KDPoint<T> >::iterator last);
+                     const TemplateView<T> &points,
+                     vector<unsigned>::iterator first,
+                     vector<unsigned>::iterator last);
 
   ~KDCountingTreeNode() {
     if (_left_child)
@@ -88,21 +96,23 @@ private:
 template <typename T>
 class KDCountingTree {
 public:
-  KDCountingTree(unsigned K, const vector<KDPoint<T> > &points,
+  KDCountingTree(unsigned K, const TemplateView<T> &points,
                  OutputLevel output_level)
-      : K(K), _leaves(0), _root(nullptr), _points(points),
+      : K(K), _leaves(0), _root(nullptr),
       _index2leaf(points.size()), _output_level(output_level) {
     const size_t n = points.size();
     if (n == 0)
       return;
 
+    // The nodes partition the indices of the points instead of the points.
+    vector<unsigned> order(n);
     for (unsigned i = 0; i < n; ++i) {
-      _points[i].set_value(i);
+      order[i] = i;
     }
-    _root = new KDCountingTreeNode<T>(K, 0, nullptr, _leaves,
-                                      _points.begin(), _points.end());
+    _root = new KDCountingTreeNode<T>(K, 0, nullptr, _leaves, points,
+                                      order.begin(), order.end());
     for (unsigned i = 0; i < n; ++i) {
-      _index2leaf[_points[i].value()] = i;
+      _index2leaf[order[i]] = i;
     }
   }
   ~KDCountingTree() {
@@ -132,11 +142,34 @@ private:
   unsigned K;
   vector<KDCountingTreeNode<T> *> _leaves;
   KDCountingTreeNode<T> *_root;
-  vector<KDPoint<T> > _points;
   vector<unsigned> _index2leaf;
   OutputLevel _output_level;
 };
 
+/**
+ * @brief The part of a kd tree of nodes which is never modified after the
+ * construction: the nodes (with their bounding boxes and children) and the
+ * map from the points to the leaves. The weighted counts of the nodes are
+ * kept apart, in an array indexed by the ids of the nodes, so that one
+ * geometry can be shared by several trees with different open points.
+ */
+template <typename Node>
+struct KDTreeGeometry {
+  KDTreeGeometry() = default;
+  KDTreeGeometry(const KDTreeGeometry &) = delete;
+  KDTreeGeometry &operator=(const KDTreeGeometry &) = delete;
+  ~KDTreeGeometry() {
+    if (root)
+      delete root;
+  }
+
+  Node *root = nullptr;
+  vector<Node *> leaves;
+  vector<unsigned> index2leaf;
+  // The ids of the nodes are 0, 1, ..., num_nodes - 1, the root being 0.
+  unsigned num_nodes = 0;
+};
+
 template <typename T>
 class KDCountingTree2KNode {
 public:
@@ -146,12 +179,17 @@ public:
    * @param depth: The depth of the current node.
    * @param father: The father node of the current node.
    * @param[out] leaves: The vector of all leaves of this node.
+   * @param id: The id of the current node.
+   * @param[in, out] next_id: The first id not given to any node yet. The
+   * children of each node get consecutive ids.
    */
   KDCountingTree2KNode(unsigned K, unsigned depth,
                        KDCountingTree2KNode *father,
                        vector<KDCountingTree2KNode *> &leaves,
-                       typename vector<KDPoint<T> >::iterator first,
-                       typename vector<KDPoint<T> >::iterator last);
+                       const TemplateView<T> &points,
+                       vector<unsigned>::iterator first,
+                       vector<unsigned>::iterator last, unsigned id,
+                       unsigned &next_id);
 
   ~KDCountingTree2KNode() {
     for (unsigned i = 0; i < _num_child; i++) {
@@ -160,24 +198,23 @@ public:
     }
   }
 
-  long long CountRange(const Range<T> &range, long long &num_nodes,
+  /**
+   * @param weights: weights[id] is the weighted count of the node id.
+   */
+  long long CountRange(const Range<T> &range, const vector<int> &weights,
+                       long long &num_nodes,
                        vector<const KDCountingTree2KNode *> &q1,
                        vector<const KDCountingTree2KNode *> &q2) const;
 
-  double CountRangeEstimate(const Range<T> &range, long long &num_nodes,
+  double CountRangeEstimate(const Range<T> &range, const vector<int> &weights,
+                            long long &num_nodes,
                             vector<const KDCountingTree2KNode *> &q1,
                             vector<const KDCountingTree2KNode *> &q2,
                             unsigned max_depth) const;
-  void UpdateCount(int d) {
-    KDCountingTree2KNode *node = this;
-    while (node) {
-      node->_weighted_count += d;
-      node = node->_father;
-    }
-  }
 
+  unsigned id() const { return _id; }
+  const KDCountingTree2KNode *father() const { return _father; }
   unsigned num_child() const { return _num_child; }
-  int weighted_count() const { return _weighted_count; }
 
   unsigned num_nodes() const {
     unsigned result = 1;
@@ -192,35 +229,51 @@ private:
   unsigned _depth;
   // The number of points.
   unsigned _count;
-  // The weighted count.
-  int _weighted_count;
+  // The index of the weighted count of this node.
+  unsigned _id;
+  // The id of the first child; the other children follow it.
+  unsigned _first_child_id;
   KDCountingTree2KNode *_father;
   Range<T> _range;
   vector<KDCountingTree2KNode *> _children;
   unsigned _num_child;
 };
 
+/**
+ * @brief A kd tree counting the weights of the points within a range.
+ *
+ * A copy of a tree shares its geometry and has its own weighted counts, so
+ * the copies can be updated and queried by different threads at the cost of
+ * one int per node each.
+ */
 template <typename T>
 class KDCountingTree2K {
 public:
-  KDCountingTree2K(unsigned K, const vector<KDPoint<T> > &points,
+  KDCountingTree2K(unsigned K, const TemplateView<T> &points,
                    OutputLevel output_level)
-      : K(K), _leaves(0), _root(nullptr), _points(points),
-      _index2leaf(points.size()), _q1(points.size()), _q2(points.size()),
+      : K(K), _q1(points.size()), _q2(points.size()),
       _output_level(output_level) {
     clock_t t = clock();
     const size_t n = points.size();
+    std::shared_ptr<KDTreeGeometry<KDCountingTree2KNode<T> > > geometry =
+        std::make_shared<KDTreeGeometry<KDCountingTree2KNode<T> > >();
+    _geometry = geometry;
     if (n == 0)
       return;
 
+    vector<unsigned> order(n);
     for (unsigned i = 0; i < n; ++i) {
-      _points[i].set_value(i);
+      order[i] = i;
     }
-    _root = new KDCountingTree2KNode<T>(K, 0, nullptr, _leaves,
-                                        _points.begin(), _points.end());
+    geometry->num_nodes = 1;
+    geometry->root = new KDCountingTree2KNode<T>(
+        K, 0, nullptr, geometry->leaves, points, order.begin(), order.end(), 0,
+        geometry->num_nodes);
+    geometry->index2leaf.resize(n);
     for (unsigned i = 0; i < n; ++i) {
-      _index2leaf[_points[i].value()] = i;
+      geometry->index2leaf[order[i]] = i;
     }
+    _weights.assign(geometry->num_nodes, 0);
 
     t = clock() - t;
     if (_output_level == Debug) {
@@ -230,14 +283,10 @@ public:
     }
   }
 
-  ~KDCountingTree2K() {
-    if (_root)
-      delete _root;
-  }
-
   long long CountRange(const Range<T> &range, long long &num_nodes) {
-    if (_root)
-      return _root->CountRange(range, num_nodes, _q1, _q2);
+    if (_geometry->root)
+      return _geometry->root->CountRange(range, _weights, num_nodes, _q1,
+                                         _q2);
     return 0;
   }
 
@@ -250,33 +299,35 @@ public:
    */
   void UpdateCount(unsigned position, int d) {
     assert(position < count() && "position >= count()");
-    position = _index2leaf[position];
     if (d)
-      _leaves[position]->UpdateCount(d);
+      _UpdateCount(_Leaf(position), d);
   }
 
   void Close(unsigned position) {
     assert(position < count() && "position >= count()");
-    position = _index2leaf[position];
-    int w = _leaves[position]->weighted_count();
+    const KDCountingTree2KNode<T> *leaf = _Leaf(position);
+    const int w = _weights[leaf->id()];
     if (w != 0)
-      _leaves[position]->UpdateCount(-w);
+      _UpdateCount(leaf, -w);
   }
 
-  unsigned count() const { return _leaves.size(); }
+  unsigned count() const { return _geometry->leaves.size(); }
 
-  unsigned num_nodes() const {
-    if (_root)
-      return _root->num_nodes();
-    return 0;
-  }
+  unsigned num_nodes() const { return _geometry->num_nodes; }
 
 private:
+  const KDCountingTree2KNode<T> *_Leaf(unsigned position) const {
+    return _geometry->leaves[_geometry->index2leaf[position]];
+  }
+  void _UpdateCount(const KDCountingTree2KNode<T> *node, int d) {
+    for (; node; node = node->father())
+      _weights[node->id()] += d;
+  }
+
   unsigned K;
-  vector<KDCountingTree2KNode<T> *> _leaves;
-  KDCountingTree2KNode<T> *_root;
-  vector<KDPoint<T> > _points;
-  vector<unsigned> _index2leaf;
+  std::shared_ptr<const KDTreeGeometry<KDCountingTree2KNode<T> > > _geometry;
+  // _weights[id] is the weighted count of the node id.
+  vector<int> _weights;
   vector<const KDCountingTree2KNode<T> *> _q1;
   vector<const KDCountingTree2KNode<T> *> _q2;
   OutputLevel _output_level;
@@ -285,29 +336,31 @@ private:
 template <typename T>
 class KDTree2KNode {
 public:
+  /**
+   * @param id, next_id: See KDCountingTree2KNode.
+   */
   KDTree2KNode(unsigned K, unsigned depth, KDTree2KNode *father,
                vector<KDTree2KNode *> &leaves,
-               typename vector<KDPoint<T>>::iterator first,
-               typename vector<KDPoint<T>>::iterator last,
-               unsigned leaf_left);
+               const TemplateView<T> &points,
+               vector<unsigned>::iterator first,
+               vector<unsigned>::iterator last,
+               unsigned leaf_left, unsigned id, unsigned &next_id);
   ~KDTree2KNode() {
     for (unsigned i = 0; i < _num_child; i++)
       delete _children[i];
   }
+  /**
+   * @param weights: See KDCountingTree2KNode::CountRange.
+   */
   vector<long long> CountRange(const Range<T> &range,
+                               const vector<int> &weights,
                                long long &num_nodes,
                                const vector<KDTree2KNode *> &leaves,
                                vector<const KDTree2KNode *> &q1,
                                vector<const KDTree2KNode *> &q2) const;
-  void UpdateCount(int d) {
-    KDTree2KNode *node = this;
-    while (node) {
-      node->_weighted_count += d;
-      node = node->_father;
-    }
-  }
   unsigned count() const { return _count; }
-  int weighted_count() const { return _weighted_count; }
+  unsigned id() const { return _id; }
+  const KDTree2KNode *father() const { return _father; }
   // TODD: This can be optimized.
   unsigned num_child() const { return _num_child; }
   unsigned num_nodes() const {
@@ -324,10 +377,12 @@ private:
   unsigned _depth;
   // The number of points (whether account or not) in this node.
   unsigned _count;
-  // Or more precisely, effective_count. Some points in the tree may be closed
-  // so as to skipped counting these unnecessary points, without deleting them
-  // from the tree.
-  int _weighted_count;
+  // The index of the weighted count, or more precisely, effective count of
+  // this node. Some points in the tree may be closed so as to skipped
+  // counting these unnecessary points, without deleting them from the tree.
+  unsigned _id;
+  // The id of the first child; the other children follow it.
+  unsigned _first_child_id;
   // The index of the first leaf in the current node.
   unsigned _leaf_left;
   Range<T> _range;
@@ -337,28 +392,38 @@ private:
 };
 
 
+/**
+ * @brief See KDCountingTree2K for the sharing of the geometry by copies.
+ */
 template <typename T>
 class KDTree2K {
 public:
-  KDTree2K(unsigned K, const vector<KDPoint<T> > &points,
+  KDTree2K(unsigned K, const TemplateView<T> &points,
            OutputLevel output_level)
-      : K(K), _root(nullptr), _leaves(0), _points(points),
-          _index2leaf(points.size()), _q1(points.size()), _q2(points.size()),
+      : K(K), _q1(points.size()), _q2(points.size()),
           _output_level(output_level) {
     clock_t t = clock();
 
     const size_t n = points.size();
+    std::shared_ptr<KDTreeGeometry<KDTree2KNode<T> > > geometry =
+        std::make_shared<KDTreeGeometry<KDTree2KNode<T> > >();
+    _geometry = geometry;
     if (n == 0)
       return;
 
+    vector<unsigned> order(n);
     for (unsigned i = 0; i < n; ++i) {
-      _points[i].set_value(i);
+      order[i] = i;
     }
-    _root = new KDTree2KNode<T>(K, 0, nullptr, _leaves,
-                                _points.begin(), _points.end(), 0);
+    geometry->num_nodes = 1;
+    geometry->root = new KDTree2KNode<T>(K, 0, nullptr, geometry->leaves,
+                                         points, order.begin(), order.end(), 0,
+                                         0, geometry->num_nodes);
+    geometry->index2leaf.resize(n);
     for (unsigned i = 0; i < n; ++i) {
-      _index2leaf[_points[i].value()] = i;
+      geometry->index2leaf[order[i]] = i;
     }
+    _weights.assign(geometry->num_nodes, 0);
 
     t = clock() - t;
     if (_output_level == Debug) {
@@ -367,46 +432,45 @@ public:
       std::cout << static_cast<double>(t) / CLOCKS_PER_SEC << " seconds. \n";
     }
   }
-  ~KDTree2K() {
-    if (_root)
-      delete _root;
-  }
   vector<long long> CountRange(const Range<T> &range,
                                long long &num_nodes) {
-    if (_root) {
-      return _root->CountRange(range, num_nodes, _leaves, _q1, _q2);
+    if (_geometry->root) {
+      return _geometry->root->CountRange(range, _weights, num_nodes,
+                                         _geometry->leaves, _q1, _q2);
     }
     return vector<long long>({0, 0});
   }
   void UpdateCount(unsigned position, int d) {
     assert(position < count() && "position >= count()");
-    position = _index2leaf[position];
     if (d)
-      _leaves[position]->UpdateCount(d);
+      _UpdateCount(_Leaf(position), d);
   }
 
   void Close(unsigned position) {
     assert(position < count() && "position >= count()");
-    position = _index2leaf[position];
-    int w = _leaves[position]->weighted_count();
+    const KDTree2KNode<T> *leaf = _Leaf(position);
+    const int w = _weights[leaf->id()];
     if (w != 0)
-      _leaves[position]->UpdateCount(-w);
+      _UpdateCount(leaf, -w);
   }
 
-  unsigned count() const { return _leaves.size(); }
+  unsigned count() const { return _geometry->leaves.size(); }
 
-  unsigned num_nodes() const {
-    if (_root)
-      return _root->num_nodes();
-    return 0;
-  }
+  unsigned num_nodes() const { return _geometry->num_nodes; }
 
 private:
+  const KDTree2KNode<T> *_Leaf(unsigned position) const {
+    return _geometry->leaves[_geometry->index2leaf[position]];
+  }
+  void _UpdateCount(const KDTree2KNode<T> *node, int d) {
+    for (; node; node = node->father())
+      _weights[node->id()] += d;
+  }
+
   unsigned K;
-  KDTree2KNode<T> *_root;
-  vector<KDTree2KNode<T> *> _leaves;
-  vector<KDPoint<T>> _points;
-  vector<unsigned> _index2leaf;
+  std::shared_ptr<const KDTreeGeometry<KDTree2KNode<T> > > _geometry;
+  // _weights[id] is the weighted count of the node id.
+  vector<int> _weights;
   vector<const KDTree2KNode<T> *> _q1;
   vector<const KDTree2KNode<T> *> _q2;
   OutputLevel _output_level;
@@ -416,24 +480,31 @@ private:
 template <typename T>
 class LastAxisTreeNode {
 public:
+  /**
+   * @param[in, out] next_id: The id of the current node, which is increased
+   * by the number of the internal nodes constructed.
+   */
   LastAxisTreeNode(typename vector<LastAxisTreeNode<T> >::iterator first,
                    typename vector<LastAxisTreeNode<T> >::iterator last,
-                   T lower, T upper, LastAxisTreeNode<T> *parent)
-      : _is_leaf(false), _weighted_count(0), _count(last - first),
+                   T lower, T upper, LastAxisTreeNode<T> *parent,
+                   unsigned &next_id)
+      : _is_leaf(false), _id(next_id++), _count(last - first),
       _lower(lower), _upper(upper), _parent(parent) {
     const unsigned count = this->count();
     const unsigned median = count / 2;
     if (count > 3) {
       _left_child = new LastAxisTreeNode<T>(
           first, first + median, this->lower(), (first + median - 1)->upper(),
-          this);
+          this, next_id);
       _right_child = new LastAxisTreeNode<T>(
-          first + median, last, (first + median)->lower(), this->upper(), this);
+          first + median, last, (first + median)->lower(), this->upper(), this,
+          next_id);
     } else if (count == 3) {
       first->_parent = this;
       _left_child = &(*first);
       _right_child = new LastAxisTreeNode<T>(
-          first + median, last, (first + median)->lower(), this->upper(), this);
+          first + median, last, (first + median)->lower(), this->upper(), this,
+          next_id);
     } else if (count == 2) {
       first->_parent = this;
       _left_child = &(*first);
@@ -445,8 +516,8 @@ public:
       _right_child = &(*first);
     }
   }
-  LastAxisTreeNode(T value)
-      : _is_leaf(true), _weighted_count(0), _count(1),
+  LastAxisTreeNode(T value, unsigned id)
+      : _is_leaf(true), _id(id), _count(1),
       _lower(value), _upper(value), _parent(nullptr),
       _left_child(nullptr), _right_child(nullptr) {} 
   ~LastAxisTreeNode() {
@@ -457,32 +528,36 @@ public:
       delete _right_child;
     }
   }
-  int CountRange(T lower, T upper) const {
+  /**
+   * @param weights: weights[id] is the weighted count of the node id.
+   */
+  int CountRange(T lower, T upper, const int *weights) const {
     if (lower <= _lower && _upper <= upper) {
-      return weighted_count();
+      return weights[_id];
     }
     if (upper < _lower || _upper < lower) {
       return 0;
     }
-    return _left_child->CountRange(lower, upper) +\
-        _right_child->CountRange(lower, upper);
+    return _left_child->CountRange(lower, upper, weights) +\
+        _right_child->CountRange(lower, upper, weights);
   }
 
   T lower() const { return _lower; }
   T upper() const { return _upper; }
   bool is_leaf() const { return _is_leaf; }
-  int weighted_count() const { return _weighted_count; }
+  unsigned id() const { return _id; }
   unsigned count() const { return _count; }
-  void UpdateCount(int x) {
-    LastAxisTreeNode<T> *curr = this;
+  void UpdateCount(int x, int *weights) const {
+    const LastAxisTreeNode<T> *curr = this;
     while (curr) {
-      curr->_weighted_count += x;
+      weights[curr->_id] += x;
       curr = curr->_parent;
     }
   }
 private:
   bool _is_leaf;
-  int _weighted_count;
+  // The index of the weighted count of this node.
+  unsigned _id;
   unsigned _count;
   T _lower;
   T _upper;
@@ -495,27 +570,28 @@ private:
 template <typename T>
 class LastAxisTree {
 public:
-  // Note that nodes must be increasingly ordered.
-  LastAxisTree(vector<LastAxisTreeNode<T> > &&nodes)
+  // Note that nodes must be increasingly ordered. The ids of the internal
+  // nodes start from next_id (see LastAxisTreeNode).
+  LastAxisTree(vector<LastAxisTreeNode<T> > &&nodes, unsigned &next_id)
       : _leaf_nodes(std::move(nodes)), _root(nullptr) {
     if (_leaf_nodes.size() > 1) {
       _root = new LastAxisTreeNode<T>(_leaf_nodes.begin(),
                                       _leaf_nodes.end(),
                                       _leaf_nodes.front().lower(),
                                       _leaf_nodes.back().upper(),
-                                      nullptr);
+                                      nullptr, next_id);
     } else if (_leaf_nodes.size() == 1) {
       _root = &_leaf_nodes[0];
     }
   }
-  LastAxisTree(const vector<LastAxisTreeNode<T> > &nodes)
+  LastAxisTree(const vector<LastAxisTreeNode<T> > &nodes, unsigned &next_id)
       : _leaf_nodes(nodes), _root(nullptr) {
     if (_leaf_nodes.size() > 1) {
       _root = new LastAxisTreeNode<T>(_leaf_nodes.begin(),
                                       _leaf_nodes.end(),
                                       _leaf_nodes.front().lower(),
                                       _leaf_nodes.back().upper(),
-                                      nullptr);
+                                      nullptr, next_id);
     } else if (_leaf_nodes.size() == 1) {
       _root = &_leaf_nodes[0];
     }
@@ -525,51 +601,355 @@ public:
       delete _root;
     }
   }
-  int CountRange(T lower, T upper) const {
+  int CountRange(T lower, T upper, const int *weights) const {
     if (_root) {
-      return _root->CountRange(lower, upper);
+      return _root->CountRange(lower, upper, weights);
     }
     return 0;
   }
   const vector<LastAxisTreeNode<T> >& leaf_nodes() const { return _leaf_nodes; }
   vector<LastAxisTreeNode<T> >& leaf_nodes() { return _leaf_nodes; }
-  int weighted_count() const { return _root->weighted_count(); }
+  int weighted_count(const int *weights) const {
+    return weights[_root->id()];
+  }
 private:
   vector<LastAxisTreeNode<T> > _leaf_nodes;
   LastAxisTreeNode<T> *_root;
 };
 
 
+/**
+ * @brief The counts of the last axis of the nodes of RangeKDTree2K, with a
+ * LastAxisTree for each node. Updating a point walks the parent pointers
+ * from its leaf to the root of each tree containing the point.
+ *
+ * The structure is not modified once built. The counts themselves are kept
+ * by the caller in an array of num_counts() ints, indexed by the ids of the
+ * nodes of the LastAxisTrees.
+ */
 template <typename T>
+class LastAxisTreeCounts {
+public:
+  /// @brief The bounds of a query on the last axis.
+  struct Bounds {
+    T lower, upper;
+  };
+  /// @brief What a child needs to get its bounds from those of its father.
+  struct Link {};
+
+  /// @param n: The number of points.
+  explicit LastAxisTreeCounts(unsigned n) : _point_nodes(n) {}
+  LastAxisTreeCounts(const LastAxisTreeCounts &) = delete;
+  LastAxisTreeCounts &operator=(const LastAxisTreeCounts &) = delete;
+  ~LastAxisTreeCounts() {
+    for (LastAxisTree<T> *tree : _trees)
+      delete tree;
+  }
+
+  /**
+   * @brief Add the counts of a node. The nodes are added in preorder.
+   *
+   * @param values: The last coordinates of the points in the node, in
+   * increasing order.
+   * @param labels: labels[i] is the index of the child containing the i-th
+   * point, or empty for leaves.
+   * @param num_children: The number of children of the node.
+   * @param father_id: The id of the father, which is ignored for the root.
+   * @return The id of the counts of the node.
+   */
+  unsigned AddNode(const vector<T> &values,
+                   const vector<unsigned short> &labels,
+                   unsigned num_children, unsigned father_id) {
+    vector<LastAxisTreeNode<T> > nodes;
+    nodes.reserve(values.size());
+    for (T value : values)
+      nodes.emplace_back(value, _num_counts++);
+    _trees.push_back(new LastAxisTree<T>(std::move(nodes), _num_counts));
+    return _trees.size() - 1;
+  }
+  /// @brief The point of the given index is the rank-th point of node id.
+  void AddPoint(unsigned index, unsigned id, unsigned rank) {
+    _point_nodes[index].push_back(&_trees[id]->leaf_nodes()[rank]);
+  }
+  /// @brief Called once all the nodes and points are added.
+  void Finalize() {}
+  /// @brief The size of the array of the counts.
+  unsigned num_counts() const { return _num_counts; }
+
+  void UpdateCount(unsigned index, int d, int *counts) const {
+    for (const LastAxisTreeNode<T> *node : _point_nodes[index])
+      node->UpdateCount(d, counts);
+  }
+  /// @brief The bounds of [lower, upper] at the root.
+  Bounds Search(T lower, T upper) const { return {lower, upper}; }
+  /// @brief The link from node id to the given child.
+  Link GetLink(unsigned id, unsigned child) const { return Link(); }
+  /// @brief The bounds at a child, given the bounds at its father.
+  Bounds Cascade(const Link &link, const Bounds &bounds) const {
+    return bounds;
+  }
+  /// @brief Count the points of node id whose last coordinates are within
+  /// the bounds.
+  int CountRange(unsigned id, const Bounds &bounds, const int *counts) const {
+    return _trees[id]->CountRange(bounds.lower, bounds.upper, counts);
+  }
+
+private:
+  vector<LastAxisTree<T> *> _trees;
+  // The leaves of the trees containing each point.
+  vector<vector<const LastAxisTreeNode<T> *> > _point_nodes;
+  unsigned _num_counts = 0;
+};
+
+
+/**
+ * @brief The same as LastAxisTreeCounts, but the counts of each node are kept
+ * in a Fenwick tree over the ranks of the last coordinates. The sorted last
+ * coordinates and the counts of all the nodes are concatenated into two
+ * arrays, and the (node, rank) slots of each point are stored together, so
+ * an update is a few strided adds in contiguous memory and a query is two
+ * binary searches within the node. As in LastAxisTreeCounts, the counts
+ * themselves are kept by the caller.
+ */
+template <typename T>
+class LastAxisFenwickCounts {
+public:
+  struct Bounds {
+    T lower, upper;
+  };
+  struct Link {};
+  explicit LastAxisFenwickCounts(unsigned n)
+      : _offsets(1, 0), _point_first(n + 1, 0) {}
+
+  unsigned AddNode(const vector<T> &values,
+                   const vector<unsigned short> &labels,
+                   unsigned num_children, unsigned father_id) {
+    _values.insert(_values.end(), values.begin(), values.end());
+    _offsets.push_back(_values.size());
+    return _offsets.size() - 2;
+  }
+  void AddPoint(unsigned index, unsigned id, unsigned rank) {
+    _pending.push_back({index, id, rank});
+  }
+  void Finalize();
+  unsigned num_counts() const { return _values.size(); }
+
+  void UpdateCount(unsigned index, int d, int *counts) const {
+    const unsigned last = _point_first[index + 1];
+    for (unsigned i = _point_first[index]; i < last; ++i) {
+      const Slot &slot = _slots[i];
+      for (unsigned j = slot.rank + 1; j <= slot.size; j += j & (0u - j))
+        counts[slot.offset + j - 1] += d;
+    }
+  }
+  Bounds Search(T lower, T upper) const { return {lower, upper}; }
+  Link GetLink(unsigned id, unsigned child) const { return Link(); }
+  Bounds Cascade(const Link &link, const Bounds &bounds) const {
+    return bounds;
+  }
+  int CountRange(unsigned id, const Bounds &bounds, const int *counts) const {
+    const unsigned offset = _offsets[id];
+    const T *first = _values.data() + offset;
+    const T *last = _values.data() + _offsets[id + 1];
+    const unsigned lo = std::lower_bound(first, last, bounds.lower) - first;
+    const unsigned hi = std::upper_bound(first, last, bounds.upper) - first;
+    if (lo >= hi)
+      return 0;
+    return _Prefix(counts, offset, hi) - _Prefix(counts, offset, lo);
+  }
+
+private:
+  struct Slot {
+    // The position of the first count of the node, the number of points in
+    // the node and the rank of the point in the node.
+    unsigned offset, size, rank;
+  };
+  struct PendingSlot {
+    unsigned index, id, rank;
+  };
+  // The sum of the counts of the first k ranks of the node.
+  static int _Prefix(const int *counts, unsigned offset, unsigned k) {
+    int result = 0;
+    for (; k; k &= k - 1)
+      result += counts[offset + k - 1];
+    return result;
+  }
+
+  // The values of node id are _values[_offsets[id], _offsets[id + 1]).
+  vector<T> _values;
+  vector<unsigned> _offsets;
+  // The slots of point i are _slots[_point_first[i], _point_first[i + 1]).
+  vector<Slot> _slots;
+  vector<unsigned> _point_first;
+  // The slots added before Finalize().
+  vector<PendingSlot> _pending;
+};
+
+
+/**
+ * @brief The same as LastAxisFenwickCounts, but the ranks are found by
+ * fractional cascading: only the root keeps its sorted values, and each node
+ * keeps, for each child, a bit vector of the ranks of the points going to
+ * the child, with the number of bits set before each word. The ranks of a
+ * query (or of a point) in a child then follow from those in its father in
+ * constant time, without any search, and no per-point list of nodes is kept.
+ *
+ * This takes about 20% less memory than LastAxisFenwickCounts, but the
+ * cascade runs on every node visited by a query, which makes the queries
+ * 10-20% slower, so it is only worth it when memory is the limit.
+ */
+template <typename T>
+class LastAxisCascadeCounts {
+public:
+  /// @brief The ranks [lo, hi) of the points of a node within the query.
+  struct Bounds {
+    unsigned lo, hi;
+  };
+  struct Link {
+    // The first word of the child, and the distance between its words.
+    unsigned first_word, stride;
+  };
+  explicit LastAxisCascadeCounts(unsigned n) : _root_ranks(n) {}
+
+  unsigned AddNode(const vector<T> &values,
+                   const vector<unsigned short> &labels,
+                   unsigned num_children, unsigned father_id);
+  void AddPoint(unsigned index, unsigned id, unsigned rank) {
+    // The ranks in the other nodes are cascaded from the root.
+    if (id == 0)
+      _root_ranks[index] = rank;
+  }
+  void Finalize() {}
+  unsigned num_counts() const { return _num_counts; }
+
+  void UpdateCount(unsigned index, int d, int *counts) const {
+    unsigned id = 0, rank = _root_ranks[index];
+    while (true) {
+      const Node &node = _nodes[id];
+      for (unsigned j = rank + 1; j <= node.size; j += j & (0u - j))
+        counts[node.offset + j - 1] += d;
+      if (node.num_children == 0)
+        break;
+      // Find the child containing the point.
+      const Word *words =
+          _words.data() + node.first_word + (rank / 64) * node.num_children;
+      const unsigned long long bit = 1ull << (rank % 64);
+      unsigned child = 0;
+      while (!(words[child].bits & bit))
+        ++child;
+      rank = words[child].rank + _PopCount(words[child].bits & (bit - 1));
+      id = _child_ids[node.first_child + child];
+    }
+  }
+  Bounds Search(T lower, T upper) const {
+    const T *first = _root_values.data();
+    const T *last = first + _root_values.size();
+    const unsigned lo = std::lower_bound(first, last, lower) - first;
+    const unsigned hi = std::upper_bound(first, last, upper) - first;
+    return {lo, hi};
+  }
+  Link GetLink(unsigned id, unsigned child) const {
+    return {_nodes[id].first_word + child, _nodes[id].num_children};
+  }
+  Bounds Cascade(const Link &link, const Bounds &bounds) const {
+    if (bounds.lo >= bounds.hi)
+      return {0, 0};
+    return {_Bridge(link, bounds.lo), _Bridge(link, bounds.hi)};
+  }
+  int CountRange(unsigned id, const Bounds &bounds, const int *counts) const {
+    if (bounds.lo >= bounds.hi)
+      return 0;
+    const unsigned offset = _nodes[id].offset;
+    return _Prefix(counts, offset, bounds.hi) -
+           _Prefix(counts, offset, bounds.lo);
+  }
+
+private:
+  struct Node {
+    // The counts of the node are counts[offset, offset + size).
+    unsigned offset, size;
+    unsigned num_children;
+    // The ids of the children start at _child_ids[first_child].
+    unsigned first_child;
+    // The words of child c covering the ranks [64 * w, 64 * w + 64) are
+    // _words[first_word + w * num_children + c].
+    unsigned first_word;
+  };
+  struct Word {
+    // Bit b tells whether the point of rank 64 * w + b goes to the child.
+    unsigned long long bits;
+    // The number of points of the child before rank 64 * w.
+    unsigned rank;
+  };
+
+  // The sum of the counts of the first k ranks of the node.
+  int _Prefix(const int *counts, unsigned offset, unsigned k) const {
+    int result = 0;
+    for (; k; k &= k - 1)
+      result += counts[offset + k - 1];
+    return result;
+  }
+  // The number of the first k points of the father which go to the child.
+  unsigned _Bridge(const Link &link, unsigned k) const {
+    const Word &word = _words[link.first_word + (k / 64) * link.stride];
+    const unsigned long long mask = (1ull << (k % 64)) - 1;
+    return word.rank + _PopCount(word.bits & mask);
+  }
+  // Portable popcount, which is much faster than the library call
+  // __builtin_popcountll compiles to without -mpopcnt.
+  static unsigned _PopCount(unsigned long long x) {
+    x -= (x >> 1) & 0x5555555555555555ull;
+    x = (x & 0x3333333333333333ull) + ((x >> 2) & 0x3333333333333333ull);
+    x = (x + (x >> 4)) & 0x0f0f0f0f0f0f0f0full;
+    return (x * 0x0101010101010101ull) >> 56;
+  }
+
+  // The sorted last coordinates of all the points.
+  vector<T> _root_values;
+  vector<Node> _nodes;
+  vector<unsigned> _child_ids;
+  vector<Word> _words;
+  unsigned _num_counts = 0;
+  // The rank of each point at the root.
+  vector<unsigned> _root_ranks;
+};
+
+
+template <typename T, typename Counts>
 class RangeKDTree2KNode {
 public:
+  /**
+   * @param id, next_id: See KDCountingTree2KNode.
+   */
   RangeKDTree2KNode(
      unsigned K, unsigned depth, RangeKDTree2KNode *father,
      vector<RangeKDTree2KNode *> &leaves,
-     typename vector<KDPointRKD<T> >::iterator first,
-     typename vector<KDPointRKD<T> >::iterator last,
-     unsigned leaf_left);
+     const TemplateView<T> &points,
+     vector<int> &rank_last_axis,
+     Counts &counts,
+     vector<unsigned>::iterator first,
+     vector<unsigned>::iterator last,
+     unsigned leaf_left, unsigned id, unsigned &next_id);
   ~RangeKDTree2KNode() {
     for (unsigned i = 0; i < _num_child; i++)
       delete _children[i];
-    if (_subtree) {
-      delete _subtree;
-    }
   }
+  /**
+   * @param weights: See KDCountingTree2KNode::CountRange.
+   * @param last_axis_counts: The counts of the last axis, see Counts.
+   */
   vector<long long> CountRange(const Range<T> &range,
+                               const vector<int> &weights,
                                long long &num_nodes,
-                               const vector<RangeKDTree2KNode *> &leaves,
+                               const Counts &counts,
+                               const int *last_axis_counts,
                                vector<const RangeKDTree2KNode *> &q1,
-                               vector<const RangeKDTree2KNode *> &q2) const;
-  void UpdateCount(int d) {
-    RangeKDTree2KNode *node = this;
-    while (node) {
-      node->_weighted_count += d;
-      node = node->_father;
-    }
-  }
+                               vector<const RangeKDTree2KNode *> &q2,
+                               vector<typename Counts::Bounds> &b1,
+                               vector<typename Counts::Bounds> &b2) const;
   unsigned count() const { return _count; }
-  int weighted_count() const { return _weighted_count; }
+  unsigned id() const { return _id; }
+  const RangeKDTree2KNode *father() const { return _father; }
   // TODD: This can be optimized.
   unsigned num_child() const { return _num_child; }
   unsigned num_nodes() const {
@@ -586,36 +966,52 @@ private:
   unsigned _depth;
   // The number of points (whether account or not) in this node.
   unsigned _count;
-  // Or more precisely, effective_count. Some points in the tree may be closed
-  // so as to skipped counting these unnecessary points, without deleting them
-  // from the tree.
-  int _weighted_count;
+  // The index of the weighted count, or more precisely, effective count of
+  // this node. Some points in the tree may be closed so as to skipped
+  // counting these unnecessary points, without deleting them from the tree.
+  unsigned _id;
+  // The id of the first child; the other children follow it.
+  unsigned _first_child_id;
   // The index of the first leaf in the current node.
   unsigned _leaf_left;
   Range<T> _range;
   unsigned _num_child;
   // For non-leaf nodes for fast searching.
   // vector<T> _last_axis_array;
-  LastAxisTree<T> *_subtree;
+  // The id of the counts of the last axis in Counts.
+  unsigned _subtree_id;
+  // Where the bounds of the last axis at this node are cascaded from.
+  typename Counts::Link _link;
 };
 
 
-template <typename T>
+/**
+ * @brief See KDCountingTree2K for the sharing of the geometry by copies. The
+ * structure of the counts of the last axis is shared as well, and each copy
+ * keeps its own counts.
+ *
+ * @tparam Counts: The counts of the last axis of the nodes, which is
+ * LastAxisFenwickCounts, LastAxisCascadeCounts or LastAxisTreeCounts.
+ */
+template <typename T, typename Counts = LastAxisFenwickCounts<T> >
 class RangeKDTree2K {
 public:
-  RangeKDTree2K(unsigned K, const vector<KDPointRKD<T> > &points,
+  RangeKDTree2K(unsigned K, const TemplateView<T> &points,
                 OutputLevel output_level)
       : K(K),
-        _root(nullptr),
-        _leaves(0),
-        _points(points),
-        _index2leaf(points.size()),
         _q1(points.size()),
         _q2(points.size()),
+        _b1(points.size()),
+        _b2(points.size()),
         _output_level(output_level) {
     clock_t t = clock();
 
     const size_t n = points.size();
+    std::shared_ptr<KDTreeGeometry<RangeKDTree2KNode<T, Counts> > > geometry =
+        std::make_shared<KDTreeGeometry<RangeKDTree2KNode<T, Counts> > >();
+    std::shared_ptr<Counts> counts = std::make_shared<Counts>(n);
+    _geometry = geometry;
+    _counts = counts;
     if (n == 0)
       return;
     
@@ -626,19 +1022,27 @@ public:
     }
     std::sort(order_last_axis.begin(), order_last_axis.end(), 
               [&points, K] (int i, int j) { return points[i][K] < points[j][K]; });
+    std::vector<int> rank_last_axis(n);
     for (unsigned i = 0; i < n; ++i) {
-      _points[order_last_axis[i]].set_rank_last_axis(i);
+      rank_last_axis[order_last_axis[i]] = i;
     }
 
     // For mapping from index to leaf.
+    vector<unsigned> order(n);
     for (unsigned i = 0; i < n; ++i) {
-      _points[i].set_value(i);
+      order[i] = i;
     }
-    _root = new RangeKDTree2KNode<T>(
-        K, 0, nullptr, _leaves, _points.begin(), _points.end(), 0);
+    geometry->num_nodes = 1;
+    geometry->root = new RangeKDTree2KNode<T, Counts>(
+        K, 0, nullptr, geometry->leaves, points, rank_last_axis, *counts,
+        order.begin(), order.end(), 0, 0, geometry->num_nodes);
+    geometry->index2leaf.resize(n);
     for (unsigned i = 0; i < n; ++i) {
-      _index2leaf[_points[i].value()] = i;
+      geometry->index2leaf[order[i]] = i;
     }
+    counts->Finalize();
+    _weights.assign(geometry->num_nodes, 0);
+    _last_axis_counts.assign(counts->num_counts(), 0);
 
     t = clock() - t;
     if (_output_level == Debug) {
@@ -647,59 +1051,56 @@ public:
       std::cout << static_cast<double>(t) / CLOCKS_PER_SEC << " seconds. \n";
     }
   }
-  ~RangeKDTree2K() {
-    if (_root)
-      delete _root;
-  }
   vector<long long> CountRange(const Range<T> &range,
                                long long &num_nodes) {
-    if (_root) {
-      return _root->CountRange(range, num_nodes, _leaves, _q1, _q2);
+    if (_geometry->root) {
+      return _geometry->root->CountRange(range, _weights, num_nodes, *_counts,
+                                         _last_axis_counts.data(), _q1, _q2,
+                                         _b1, _b2);
     }
     return vector<long long>({0, 0});
   }
   void UpdateCount(unsigned position, int d) {
     assert(position < count() && "position >= count()");
-    position = _index2leaf[position];
-    if (d) {
-      _leaves[position]->UpdateCount(d);
-      auto subtree_nodes = _points[position].subtree_nodes();
-      for (LastAxisTreeNode<T> *node: subtree_nodes) {
-        node->UpdateCount(d);
-      }
-    }
+    if (d)
+      _UpdateCount(position, d);
   }
 
   void Close(unsigned position) {
     assert(position < count() && "position >= count()");
-    position = _index2leaf[position];
-    int w = _leaves[position]->weighted_count();
-    if (w != 0) {
-      _leaves[position]->UpdateCount(-w);
-      auto subtree_nodes = _points[position].subtree_nodes();
-      for (LastAxisTreeNode<T> *node: subtree_nodes) {
-        node->UpdateCount(-w);
-      }
-    }
+    const int w = _weights[_Leaf(position)->id()];
+    if (w != 0)
+      _UpdateCount(position, -w);
   }
 
-  unsigned count() const { return _leaves.size(); }
+  unsigned count() const { return _geometry->leaves.size(); }
 
-  unsigned num_nodes() const {
-    if (_root)
-      return _root->num_nodes();
-    return 0;
-  }
+  unsigned num_nodes() const { return _geometry->num_nodes; }
 
 private:
+  const RangeKDTree2KNode<T, Counts> *_Leaf(unsigned position) const {
+    return _geometry->leaves[_geometry->index2leaf[position]];
+  }
+  void _UpdateCount(unsigned position, int d) {
+    for (const RangeKDTree2KNode<T, Counts> *node = _Leaf(position); node;
+         node = node->father())
+      _weights[node->id()] += d;
+    _counts->UpdateCount(position, d, _last_axis_counts.data());
+  }
+
   unsigned K;
-  RangeKDTree2KNode<T> *_root;
-  vector<RangeKDTree2KNode<T> *> _leaves;
-  vector<KDPointRKD<T> > _points;
-  vector<unsigned> _index2leaf;
+  std::shared_ptr<const KDTreeGeometry<RangeKDTree2KNode<T, Counts> > >
+      _geometry;
+  std::shared_ptr<const Counts> _counts;
+  // _weights[id] is the weighted count of the node id.
+  vector<int> _weights;
+  vector<int> _last_axis_counts;
   // Buffers for searching without recursion.
-  vector<const RangeKDTree2KNode<T> *> _q1;
-  vector<const RangeKDTree2KNode<T> *> _q2;
+  vector<const RangeKDTree2KNode<T, Counts> *> _q1;
+  vector<const RangeKDTree2KNode<T, Counts> *> _q2;
+  // The bounds of the last axis of the nodes in _q1 and _q2.
+  vector<typename Counts::Bounds> _b1;
+  vector<typename Counts::Bounds> _b2;
   OutputLevel _output_level;
 };
 } // namespace sampen
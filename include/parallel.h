@@ -0,0 +1,145 @@
+/**
+ * @file parallel.h
+ *
+ * @brief Helpers for running independent tasks on several threads.
+ */
+
+#ifndef __FAST_SAMPEN_PARALLEL__
+#define __FAST_SAMPEN_PARALLEL__
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace sampen {
+
+/**
+ * @brief Get the number of hardware threads (at least 1).
+ */
+inline unsigned GetNumHardwareThreads() {
+  const unsigned n = std::thread::hardware_concurrency();
+  return n ? n : 1;
+}
+
+/**
+ * @brief Run f(0), f(1), ..., f(num_tasks - 1) on at most num_threads
+ * threads. Each thread fetches the next task as soon as it finishes one, so
+ * tasks of unequal cost are balanced.
+ *
+ * @note If num_threads <= 1, the tasks are run in order in the calling
+ * thread.
+ */
+template <typename F>
+void ParallelFor(unsigned num_tasks, unsigned num_threads, F f) {
+  if (num_threads > num_tasks)
+    num_threads = num_tasks;
+  if (num_threads <= 1) {
+    for (unsigned i = 0; i < num_tasks; ++i)
+      f(i);
+    return;
+  }
+
+  std::atomic<unsigned> next(0);
+  auto worker = [&next, num_tasks, &f]() {
+    unsigned i;
+    while ((i = next.fetch_add(1)) < num_tasks)
+      f(i);
+  };
+  std::vector<std::thread> threads;
+  threads.reserve(num_threads - 1);
+  for (unsigned i = 1; i < num_threads; ++i)
+    threads.emplace_back(worker);
+  worker();
+  for (std::thread &t : threads)
+    t.join();
+}
+
+/**
+ * @brief Run process(worker, i) for i = 0, 1, ..., num_tasks - 1 on at most
+ * num_threads threads, and emit(i, result) with the result of each task in
+ * the order of the tasks, as soon as all the tasks before it are done.
+ *
+ * Each thread is a worker, 0 <= worker < num_threads, which fetches the next
+ * task as soon as it finishes one, so a worker may keep its buffers over its
+ * tasks. The calls of emit are serialized.
+ */
+template <typename Result, typename Process, typename Emit>
+void ParallelForOrdered(unsigned num_tasks, unsigned num_threads,
+                        Process process, Emit emit) {
+  std::vector<Result> results(num_tasks);
+  std::vector<bool> done(num_tasks, false);
+  unsigned next_emit = 0;
+  std::mutex mutex;
+  std::atomic<unsigned> next(0);
+  ParallelFor(num_threads, num_threads, [&](unsigned worker) {
+    unsigned i;
+    while ((i = next.fetch_add(1)) < num_tasks) {
+      Result result = process(worker, i);
+      std::lock_guard<std::mutex> lock(mutex);
+      results[i] = std::move(result);
+      done[i] = true;
+      for (; next_emit < num_tasks && done[next_emit]; ++next_emit) {
+        emit(next_emit, results[next_emit]);
+        results[next_emit] = Result();
+      }
+    }
+  });
+}
+
+/**
+ * @brief A queue of at most capacity items between producer and consumer
+ * threads. Push blocks while the queue is full and Pop while it is empty, so
+ * that the producers run at most capacity items ahead of the consumers.
+ */
+template <typename T> class BoundedQueue {
+public:
+  explicit BoundedQueue(size_t capacity)
+      : _capacity(std::max<size_t>(capacity, 1)), _closed(false) {}
+  BoundedQueue(const BoundedQueue &) = delete;
+  BoundedQueue &operator=(const BoundedQueue &) = delete;
+
+  void Push(T item) {
+    std::unique_lock<std::mutex> lock(_mutex);
+    _not_full.wait(lock, [this] { return _items.size() < _capacity; });
+    _items.push_back(std::move(item));
+    _not_empty.notify_one();
+  }
+
+  /**
+   * @brief Takes the oldest item.
+   * @return false if the queue is closed and no item is left.
+   */
+  bool Pop(T &item) {
+    std::unique_lock<std::mutex> lock(_mutex);
+    _not_empty.wait(lock, [this] { return !_items.empty() || _closed; });
+    if (_items.empty())
+      return false;
+    item = std::move(_items.front());
+    _items.pop_front();
+    _not_full.notify_one();
+    return true;
+  }
+
+  /// @brief No more items are pushed. The waiting consumers are woken up.
+  void Close() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _closed = true;
+    _not_empty.notify_all();
+  }
+
+private:
+  const size_t _capacity;
+  bool _closed;
+  std::deque<T> _items;
+  std::mutex _mutex;
+  std::condition_variable _not_empty;
+  std::condition_variable _not_full;
+};
+
+} // namespace sampen
+
+#endif // !__FAST_SAMPEN_PARALLEL__
@@ -83,6 +83,14 @@ public:
     _computed = true;
   }
   virtual std::string get_method_name() { return _Method(); }
+  /**
+   * @brief Set the number of threads used for the computation. Calculators
+   * that do not support multithreading ignore it.
+   */
+  void set_num_threads(unsigned num_threads) {
+    _num_threads = num_threads ? num_threads : 1;
+  }
+  unsigned get_num_threads() const { return _num_threads; }
 
 protected:
   virtual void _ComputeSampleEntropy() = 0;
@@ -95,6 +103,7 @@ protected:
   long long _a, _b;
   bool _computed = false;
   double _elapsed_seconds;
+  unsigned _num_threads = 1;
 };
 
 #define USING_CALCULATOR_FIELDS \
@@ -108,6 +117,7 @@ protected:
   using SampleEntropyCalculator<T>::_b; \
   using SampleEntropyCalculator<T>::_output_level; \
   using SampleEntropyCalculator<T>::_elapsed_seconds; \
+  using SampleEntropyCalculator<T>::_num_threads; \
   using SampleEntropyCalculator<T>::get_a; \
   using SampleEntropyCalculator<T>::get_b;
 
@@ -215,6 +225,7 @@ protected:
   using SampleEntropyCalculatorSampling<T>::_b; \
   using SampleEntropyCalculatorSampling<T>::_output_level; \
   using SampleEntropyCalculatorSampling<T>::_elapsed_seconds; \
+  using SampleEntropyCalculatorSampling<T>::_num_threads; \
   using SampleEntropyCalculatorSampling<T>::_sample_size; \
   using SampleEntropyCalculatorSampling<T>::_sample_num; \
   using SampleEntropyCalculatorSampling<T>::_a_vec; \
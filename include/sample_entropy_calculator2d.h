@@ -7,6 +7,7 @@
 #include <type_traits>
 #include <vector>
 
+#include "parallel.h"
 #include "random_sampler.h"
 #include "sample_entropy_calculator.h"
 #include "utils.h"
@@ -23,6 +24,68 @@ struct entropyInfos{
   double b_norm;
 };
 
+/**
+ * @brief Counts the matched pairs of the templates of a 2D series directly.
+ *
+ * The pairs are grouped by the displacement between the two templates. For
+ * one displacement, the per-pixel matches of the image against the image
+ * shifted by the displacement are computed row by row, and a template pair
+ * matches if all the pixels of its window match, which is found by AND-ing
+ * shifted copies of the rows. Every step runs over contiguous bytes, so it
+ * is vectorized by the compiler and the rows stay in the cache, instead of
+ * comparing each pair with strided accesses over the window. The
+ * displacements are distributed over num_threads threads.
+ *
+ * @param data: The image, stored row by row.
+ * @return {A, B}, the same as SampleEntropyCalculator2DDirect.
+ */
+template <typename T>
+vector<long long> ComputeAB2DDirect(const T *data, unsigned width,
+                                    unsigned height, T r, unsigned m,
+                                    unsigned moving_step_size,
+                                    unsigned dilation_factor,
+                                    unsigned num_threads = 1);
+
+/**
+ * @brief Counts the matched pairs of the templates of a 2D series with a kd
+ * tree.
+ *
+ * Each template is a point of (m + 1)^2 coordinates. The kd tree is built
+ * over the m x m window, and the 2m + 1 pixels extending it to
+ * (m + 1) x (m + 1) are checked point by point, like the last axis of the 1D
+ * kd trees, so A and B are counted in one query. The points are sorted by
+ * their first pixel and only those within the range of the current point
+ * are inserted into the tree. The queries are split into chunks, each with
+ * its own tree, which are counted on num_threads threads.
+ *
+ * @return {A, B}, the same as ComputeAB2DDirect.
+ */
+template <typename T>
+vector<long long> ComputeAB2DKD(const T *data, unsigned width,
+                                unsigned height, T r, unsigned m,
+                                unsigned moving_step_size,
+                                unsigned dilation_factor,
+                                unsigned num_threads = 1);
+
+/**
+ * @brief Counts the matched pairs among some templates of a 2D series.
+ *
+ * The windows of the templates are gathered once into a buffer of
+ * (m + 1)^2 x n values, stored coordinate by coordinate, so that a template
+ * is compared with a block of the following ones by contiguous loops which
+ * the compiler vectorizes. The m x m window is compared first, which gives
+ * B, and then the 2m + 1 pixels extending it, which gives A. The rest of a
+ * block is skipped once none of its templates matches.
+ *
+ * @param origins: The top left pixels (y, x) of the n templates.
+ * @return {A, B}, the same as comparing the pairs with _IsMatchedK and
+ * _IsMatchedNext of SampleEntropyCalculator2D.
+ */
+template <typename T>
+vector<long long> ComputeAB2DSampled(
+    const T *data, unsigned width, T r, unsigned m, unsigned dilation_factor,
+    const vector<std::array<unsigned, 2> > &origins);
+
 template <typename T,
           typename =
               typename std::enable_if<std::is_arithmetic<T>::value, T>::type>
@@ -113,6 +176,9 @@ public:
     _computed = true;
   }
   virtual std::string get_method_name() { return _Method(); }
+  void set_num_threads(unsigned num_threads) {
+    _num_threads = num_threads ? num_threads : 1;
+  }
 protected:
   unsigned GetNumTemplates() const {
     const unsigned window_size = _dilation_factor * K + 1;
@@ -178,6 +244,7 @@ protected:
   long long _b = -1;
   bool _computed = false;
   double _elapsed_seconds;
+  unsigned _num_threads = 1;
 };
 
 
@@ -202,6 +269,7 @@ protected:
   using SampleEntropyCalculator2D<T>::_output_level;\
   using SampleEntropyCalculator2D<T>::_elapsed_seconds;\
   using SampleEntropyCalculator2D<T>::_num_templates;\
+  using SampleEntropyCalculator2D<T>::_num_threads;\
   using SampleEntropyCalculator2D<T>::_IsMatchedK;\
   using SampleEntropyCalculator2D<T>::_IsMatchedNext;
 
@@ -219,7 +287,7 @@ public:
                                     double real_entropy, double real_a_norm,
                                     double real_b_norm, bool random_,
                                     OutputLevel output_level)
-      : SampleEntropyCalculator2D<T>(first, last, m, r, width, height,
+      : SampleEntropyCalculator2D<T>(first, last, r, m, width, height,
                                      moving_step_size, dilation_factor,
                                      output_level),
         _sample_size(sample_size), _sample_num(sample_num),
@@ -238,7 +306,7 @@ public:
                                     double real_entropy, double real_a_norm,
                                     double real_b_norm, bool random_,
                                     OutputLevel output_level)
-      : SampleEntropyCalculator2DSampling(data.cbegin(), data.cend(), m, r,
+      : SampleEntropyCalculator2DSampling(data.cbegin(), data.cend(), r, m,
                                           width, height, moving_step_size,
                                           dilation_factor,
                                           sample_size, sample_num,
@@ -346,6 +414,7 @@ protected:
   using SampleEntropyCalculator2DSampling<T>::_random;\
   using SampleEntropyCalculator2DSampling<T>::_a_vec;\
   using SampleEntropyCalculator2DSampling<T>::_b_vec;\
+  using SampleEntropyCalculator2DSampling<T>::_num_threads;\
   using SampleEntropyCalculator2DSampling<T>::_IsMatchedK;\
   using SampleEntropyCalculator2DSampling<T>::_IsMatchedNext;
 
@@ -369,115 +438,59 @@ protected:
   virtual void _ComputeSampleEntropy() override;
 };
 
+template <typename T>
+class SampleEntropyCalculator2DKD : public SampleEntropyCalculator2D<T> {
+public:
+  USING_CALCULATOR2D_FIELDS
+protected:
+  virtual std::string _Method() const override { return "kd tree"; }
+  virtual void _ComputeSampleEntropy() override;
+};
+
 
 // Implementation
 template <typename T>
 void SampleEntropyCalculator2DDirect<T>::_ComputeSampleEntropy() {
-  long long a = 0;
-  long long b = 0;
-  const unsigned end_x = _width - _window_size + 1;
-  const unsigned end_y = _height - _window_size + 1;
-  // Compare template (i, j) and template (k, l).
-  for (unsigned i = 0; i < end_y; i += _moving_step_size) {
-    for (unsigned j = 0; j < end_x; j += _moving_step_size) {
-      for (unsigned k = i + _moving_step_size; k < end_y;
-          k += _moving_step_size) {
-        if (_IsMatchedK(i, j, k, j)) {
-          b++;
-          if (_IsMatchedNext(i, j, k, j)) {
-            a++;
-          }
-        }
-      }
-      for (unsigned k = 0; k < end_y; k += _moving_step_size) {
-        for (unsigned l = j + _moving_step_size; l < end_x;
-            l += _moving_step_size) {
-          if (_IsMatchedK(i, j, k, l)) {
-            b++;
-            if (_IsMatchedNext(i, j, k, l)) {
-              a++;
-            }
-          }        
-        }
-      }
-    }
-  }
-  _a = a;
-  _b = b;
+  const vector<long long> ab = ComputeAB2DDirect(
+      _data.data(), _width, _height, _r, K, _moving_step_size,
+      _dilation_factor, _num_threads);
+  _a = ab[0];
+  _b = ab[1];
+}
+
+template <typename T>
+void SampleEntropyCalculator2DKD<T>::_ComputeSampleEntropy() {
+  const vector<long long> ab = ComputeAB2DKD(
+      _data.data(), _width, _height, _r, K, _moving_step_size,
+      _dilation_factor, _num_threads);
+  _a = ab[0];
+  _b = ab[1];
 }
 
 
 template <typename T>
 void SampleEntropyCalculator2DSamplingDirect<T>::_ComputeSampleEntropy() {
-  std::cout << "SampleEntropyCalculator2DSamplingDirect start !\n";
   unsigned num_templates = _num_steps_x * _num_steps_y;
   RandomIndicesSamplerWR sampler(num_templates, _sample_size, _sample_num,
                                  RandomType::SWR_UNIFORM, _random);
   const auto random_indices_array = sampler.GetSampleArrays();   // 二维数组，N_0 * N_1
-  _a_vec.clear();
-  _b_vec.clear();
-  for (unsigned sample_i = 0; sample_i < random_indices_array.size(); ++sample_i) {
+  const unsigned sample_num = random_indices_array.size();
+  _a_vec.assign(sample_num, 0);
+  _b_vec.assign(sample_num, 0);
+  // The samples are independent, so they are distributed over the threads.
+  ParallelFor(sample_num, _num_threads, [&](unsigned sample_i) {
     const auto& random_indices = random_indices_array[sample_i];
     std::vector<std::array<unsigned, 2> > random_indices_xy;
+    random_indices_xy.reserve(random_indices.size());
     for (auto index: random_indices) {  // 二维样本熵，一维样本熵采样得到转换为二维坐标
       random_indices_xy.push_back({_moving_step_size * (index / _num_steps_x),
                                    _moving_step_size * (index % _num_steps_x)});
     }
-    long long a = 0;
-    long long b = 0;
-    for (unsigned i = 0; i < _sample_size - 1; ++i) {
-      const auto& index_xy = random_indices_xy[i];
-      for (unsigned j = i + 1; j < _sample_size; ++j) {
-        try{
-        const auto& index_xy2 = random_indices_xy[j];
-        if (_IsMatchedK(index_xy[0], index_xy[1], index_xy2[0], index_xy2[1])) {
-          ++b;
-          if (_IsMatchedNext(index_xy[0], index_xy[1], index_xy2[0], index_xy2[1])) {
-            ++a;
-          }
-        }
-        }
-        catch(...){
-          std::cout << "异常" << std::endl;
-        }
-
-      }
-    }
-    _a_vec.push_back(a);
-    _b_vec.push_back(b);
-  }
-
-  // unsigned num_templates = _num_steps_x * _num_steps_y;
-  // RandomIndicesSamplerWR sampler(num_templates, _sample_size, _sample_num,
-  //                                RandomType::SWR_UNIFORM, _random);
-  // const auto random_indices_array = sampler.GetSampleArrays();   // 二维数组，N_0 * N_1
-  // _a_vec.clear();
-  // _b_vec.clear();
-  // for (unsigned sample_i = 0; sample_i < random_indices_array.size(); ++sample_i) {
-  //   const auto& random_indices = random_indices_array[sample_i];
-  //   std::vector<std::array<unsigned, 2> > random_indices_xy;
-  //   for (auto index: random_indices) {  // 二维样本熵，一维样本熵采样得到转换为二维坐标
-  //     random_indices_xy.push_back({_moving_step_size * (index / _num_steps_x),
-  //                                  _moving_step_size * (index % _num_steps_x)});
-  //   }
-  //   long long a = 0;
-  //   long long b = 0;
-  //   for (unsigned i = 0; i < _sample_size - 1; ++i) {
-  //     const auto& index_xy = random_indices_xy[i];
-  //     for (unsigned j = i + 1; j < _sample_size; ++j) {
-  //       const auto& index_xy2 = random_indices_xy[j];
-  //       if (_IsMatchedK(index_xy[0], index_xy[1], index_xy2[0], index_xy2[1])) {
-  //         ++b;
-  //         if (_IsMatchedNext(index_xy[0], index_xy[1], index_xy2[0], index_xy2[1])) {
-  //           ++a;
-  //         }
-  //       }
-  //     }
-  //   }
-  //   _a_vec.push_back(a);
-  //   _b_vec.push_back(b);
-  // }
-
+    const vector<long long> ab = ComputeAB2DSampled(
+        _data.data(), _width, _r, K, _dilation_factor, random_indices_xy);
+    _a_vec[sample_i] = ab[0];
+    _b_vec[sample_i] = ab[1];
+  });
 }
 } // namespace sampen
 
@@ -22,8 +22,64 @@ namespace sampen {
 template <typename T>
 vector<long long> _ComputeABFastDirect(const T *y, unsigned n, T r, unsigned m);
 
+/**
+ * @brief The same as _ComputeABFastDirect, with identical results, but the
+ * runs are updated without branches (with AVX2 or AVX-512 if the CPU
+ * supports them) and the lags are split into blocks which are processed on
+ * num_threads threads.
+ */
+template <typename T>
+vector<long long> ComputeABFastDirect(const T *y, unsigned n, T r, unsigned m,
+                                      unsigned num_threads = 1);
+
+/**
+ * @brief Computes A and B for several thresholds in one pass over the pairs.
+ *
+ * The distance of each pair of templates is mapped to the index of the
+ * smallest threshold it is within, and the counts of each index (a
+ * histogram) are summed up in the end.
+ *
+ * @param r: The thresholds, in any order.
+ * @return {a_0, b_0, a_1, b_1, ...}, where (a_k, b_k) is the same as the
+ * result of ComputeABFastDirect with r[k].
+ */
+template <typename T>
+vector<long long> ComputeABDirectMultiR(const T *y, unsigned n,
+                                        const vector<T> &r, unsigned m,
+                                        unsigned num_threads = 1);
+
+/**
+ * @brief The same as ComputeABDirectMultiR, but with few thresholds, where
+ * the histogram costs more than a pass per threshold, ComputeABFastDirect is
+ * called for each threshold instead.
+ */
+template <typename T>
+vector<long long> ComputeABFastDirectMultiR(const T *y, unsigned n,
+                                            const vector<T> &r, unsigned m,
+                                            unsigned num_threads = 1);
+
+/**
+ * @brief Computes A and B for each m in [min_m, max_m] in one pass over the
+ * pairs. The runs of matches are saturated at max_m + 1 instead of m + 1, and
+ * the number of runs of each length gives the counts of every m.
+ *
+ * @return {a_0, b_0, a_1, b_1, ...}, where (a_k, b_k) is the same as the
+ * result of ComputeABFastDirect with m = min_m + k.
+ */
+template <typename T>
+vector<long long> ComputeABDirectMultiM(const T *y, unsigned n, T r,
+                                        unsigned min_m, unsigned max_m,
+                                        unsigned num_threads = 1);
+
+/**
+ * @brief Counts the matched pairs of the (m + 1)-dimensional points directly.
+ *
+ * @param points: The templates of length m + 1.
+ * @return {A, B}, where B counts the pairs matched in the first m
+ * coordinates and A the pairs matched in all m + 1 coordinates.
+ */
 template <typename T>
-vector<long long> ComputeABDirect(const vector<KDPoint<T> > &points, T r);
+vector<long long> ComputeABDirect(const TemplateView<T> &points, T r);
 
 template <typename T>
 class SampleEntropyCalculatorDirect : public SampleEntropyCalculator<T> {
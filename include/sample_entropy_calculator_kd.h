@@ -3,6 +3,7 @@
 #include <iostream>
 #include <vector>
 
+#include "implicit_kdtree.h"
 #include "kdtree.h"
 #include "sample_entropy_calculator.h"
 #include "random_sampler.h"
@@ -41,29 +42,55 @@ private:
 
 template <typename T> class MatchedPairsCalculatorSampling {
 public:
-  MatchedPairsCalculatorSampling(unsigned m, OutputLevel output_level)
-      : K(m), _output_level(output_level) {}
+  /**
+   * @param num_threads: The samples are processed on up to num_threads
+   * threads, each with its own counts over the shared grid points.
+   */
+  MatchedPairsCalculatorSampling(unsigned m, OutputLevel output_level,
+                                 unsigned num_threads = 1)
+      : K(m), _output_level(output_level), _num_threads(num_threads) {}
+  /**
+   * @param indices: The indices of sample_num samples of equal size, stored
+   * one after another. The indices are positions of the non-auxiliary
+   * templates in sorted order, and may be repeated.
+   * @return The number of matched pairs of each sample.
+   */
   vector<long long> ComputeA(typename vector<T>::const_iterator first,
-                             typename vector<T>::const_iterator last,
+                             typename vector<T>::const_iterator last, T r,
                              unsigned sample_num,
-                             const vector<unsigned> &indices, T r);
+                             const vector<unsigned> &indices);
 
 private:
   unsigned K;
   OutputLevel _output_level;
+  unsigned _num_threads;
 };
 
+// Unlike MatchedPairsCalculatorSampling, each sampled template is paired with
+// all the templates, not only the sampled ones.
 template <typename T> class MatchedPairsCalculatorSampling2 {
 public:
-  MatchedPairsCalculatorSampling2(unsigned m, OutputLevel output_level)
-      : K(m), _output_level(output_level) {}
+  /**
+   * @param num_threads: See MatchedPairsCalculatorSampling.
+   */
+  MatchedPairsCalculatorSampling2(unsigned m, OutputLevel output_level,
+                                  unsigned num_threads = 1)
+      : K(m), _output_level(output_level), _num_threads(num_threads) {}
   long long ComputeA(typename vector<T>::const_iterator first,
                      typename vector<T>::const_iterator last, T r,
                      vector<unsigned> &indices);
+  /**
+   * @brief See MatchedPairsCalculatorSampling::ComputeA.
+   */
+  vector<long long> ComputeA(typename vector<T>::const_iterator first,
+                             typename vector<T>::const_iterator last, T r,
+                             unsigned sample_num,
+                             const vector<unsigned> &indices);
 
 private:
   unsigned K;
   OutputLevel _output_level;
+  unsigned _num_threads;
 };
 
 
@@ -160,12 +187,7 @@ public:
       : SampleEntropyCalculatorSampling<T>(
             data, r, m, sample_size, sample_num, real_entropy,
             real_a_norm, real_b_norm, output_level),
-        _rtype(rtype), _random(random_) {
-    if (sample_num != 1) {
-      std::cerr << "Only support the parameter sample_num == 1.\n" << std::endl;
-      exit(-1);
-    }
-  }
+        _rtype(rtype), _random(random_) {}
   std::string get_result_str() override {
     std::stringstream ss;
     ss << this->SampleEntropyCalculatorSampling<T>::get_result_str();
@@ -175,11 +197,13 @@ public:
   }
 
   double get_a_norm() override {
-    double norm = static_cast<double>(_n - K - 1) * _sample_size;
+    double norm =
+        static_cast<double>(_n - K - 1) * _sample_size * _sample_num;
     return get_a() / norm;
   }
   virtual double get_b_norm() override {
-    double norm = static_cast<double>(_n - K - 1) * _sample_size;
+    double norm =
+        static_cast<double>(_n - K - 1) * _sample_size * _sample_num;
     return get_b() / norm;
   }
 protected:
@@ -189,15 +213,16 @@ protected:
       std::cerr << ", K = " << K << ")" << std::endl;
       exit(-1);
     }
-    vector<unsigned> indices = GetSampleIndices(
-        _rtype, _n - K, _sample_size, _sample_num, _random)[0];
-
-    MatchedPairsCalculatorSampling2<T> b_cal(K, this->_output_level);
-    MatchedPairsCalculatorSampling2<T> a_cal(K + 1, this->_output_level);
-    _b = b_cal.ComputeA(_data.cbegin(), _data.cend() - 1, _r, indices);
-    _a = a_cal.ComputeA(_data.cbegin(), _data.cend(), _r, indices);
-    _a_vec = std::vector<long long>(1, _a);
-    _b_vec = std::vector<long long>(1, _b);
+    const vector<unsigned> indices = Flatten(GetSampleIndices(
+        _rtype, _n - K, _sample_size, _sample_num, _random));
+
+    MatchedPairsCalculatorSampling2<T> b_cal(K, _output_level, _num_threads);
+    MatchedPairsCalculatorSampling2<T> a_cal(K + 1, _output_level,
+                                             _num_threads);
+    _b_vec = b_cal.ComputeA(_data.cbegin(), _data.cend() - 1, _r, _sample_num,
+                            indices);
+    _a_vec = a_cal.ComputeA(_data.cbegin(), _data.cend(), _r, _sample_num,
+                            indices);
   }
   std::string _Method() const override {
     return std::string("kd tree (Mao) sampling");
@@ -208,61 +233,158 @@ protected:
 };
 
 
+/**
+ * @brief The presorting and the grid points of ABCalculatorLiu and
+ * ABCalculatorRKD. A calculator keeps them over its calls of ComputeAB, so
+ * that computing one series after another (as in the batch mode) reuses
+ * their allocations.
+ */
+template <typename T> struct KDGridBuffers {
+  SortTemplatesBuffers<T> sort;
+  vector<unsigned> rank2index;
+  vector<unsigned> index2rank;
+  Bounds bounds;
+  // The work space of GetRankBounds.
+  vector<T> values;
+  vector<unsigned> points_count_indices;
+  vector<unsigned> grid_offsets;
+};
+
+
 template <typename T> class ABCalculatorLiu {
 public:
-  ABCalculatorLiu(unsigned m, OutputLevel output_level)
-      :K(m), _output_level(output_level) {}
+  /**
+   * @param num_threads: If greater than 1, the range counting is split into
+   * chunks of consecutive ranks, each of which has its own kd tree, and the
+   * chunks are processed concurrently.
+   */
+  ABCalculatorLiu(unsigned m, OutputLevel output_level,
+                  unsigned num_threads = 1)
+      :K(m), _output_level(output_level), _num_threads(num_threads) {}
   vector<long long> ComputeAB(typename vector<T>::const_iterator first,
                               typename vector<T>::const_iterator last, T r);
+  /**
+   * @brief Computes A and B for each of the thresholds. The presorting, the
+   * grid points and the kd tree are shared by all the thresholds, and only
+   * the rank bounds are computed for each. With more than one thread, the
+   * thresholds are distributed among the threads, each with its own tree.
+   *
+   * @return {a_0, b_0, a_1, b_1, ...}, the results of r[0], r[1], ...
+   */
+  vector<long long> ComputeAB(typename vector<T>::const_iterator first,
+                              typename vector<T>::const_iterator last,
+                              const vector<T> &r);
+  /**
+   * @brief Computes A and B for each template length from m (given to the
+   * constructor, at least 2) to max_m. The presorting of the (max_m + 1)-templates
+   * orders the shorter templates as well, so it is shared by all the
+   * template lengths together with the rank bounds and the inverse map,
+   * over which the grid points of each length are windows. Only the kd tree
+   * is built for each length.
+   *
+   * @return {a_m, b_m, a_{m + 1}, b_{m + 1}, ..., a_max_m, b_max_m}.
+   */
+  vector<long long> ComputeABMultiM(typename vector<T>::const_iterator first,
+                                    typename vector<T>::const_iterator last,
+                                    T r, unsigned max_m);
 
 private:
   unsigned K;
   OutputLevel _output_level;
+  unsigned _num_threads;
+  KDGridBuffers<T> _buffers;
 };
 
 
 template <typename T>
 class ABCalculatorSamplingLiu {
 public:
-  ABCalculatorSamplingLiu(unsigned m, OutputLevel output_level)
-      :K(m), _output_level(output_level) {}
+  /**
+   * @param num_threads: The samples are processed on up to num_threads
+   * threads, each with its own counts over one shared kd tree.
+   */
+  ABCalculatorSamplingLiu(unsigned m, OutputLevel output_level,
+                          unsigned num_threads = 1)
+      :K(m), _output_level(output_level), _num_threads(num_threads) {}
+  /**
+   * @param indices: The indices of sample_num samples of equal size, stored
+   * one after another. The indices of each sample are increasing.
+   * @return {a_0, b_0, a_1, b_1, ...}, the results of each sample.
+   */
   vector<long long> ComputeAB(typename vector<T>::const_iterator first,
-                              typename vector<T>::const_iterator last,
+                              typename vector<T>::const_iterator last, T r,
                               unsigned sample_num,
-                              const vector<unsigned> &indices, T r);
+                              const vector<unsigned> &indices);
 
 private:
   unsigned K;
   OutputLevel _output_level;
+  unsigned _num_threads;
 };
 
 
 template <typename T>
 class ABCalculatorRKD {
 public:
-  ABCalculatorRKD(unsigned m, OutputLevel output_level)
-      :K(m), _output_level(output_level) {}
+  /**
+   * @param num_threads: See ABCalculatorLiu.
+   * @param cascade_counts: If true, the trees keep the counts of their last
+   * axis in LastAxisCascadeCounts instead of LastAxisFenwickCounts, which
+   * takes about 20% less memory but is slower.
+   */
+  ABCalculatorRKD(unsigned m, OutputLevel output_level,
+                  unsigned num_threads = 1, bool cascade_counts = false)
+      :K(m), _output_level(output_level), _num_threads(num_threads),
+       _cascade_counts(cascade_counts) {}
   vector<long long> ComputeAB(typename vector<T>::const_iterator first,
                               typename vector<T>::const_iterator last, T r);
+  /**
+   * @brief See ABCalculatorLiu::ComputeAB.
+   */
+  vector<long long> ComputeAB(typename vector<T>::const_iterator first,
+                              typename vector<T>::const_iterator last,
+                              const vector<T> &r);
+  /**
+   * @brief See ABCalculatorLiu::ComputeABMultiM.
+   */
+  vector<long long> ComputeABMultiM(typename vector<T>::const_iterator first,
+                                    typename vector<T>::const_iterator last,
+                                    T r, unsigned max_m);
 
 private:
   unsigned K;
   OutputLevel _output_level;
+  unsigned _num_threads;
+  bool _cascade_counts;
+  KDGridBuffers<T> _buffers;
 };
 
 
 template <typename T>
 class ABCalculatorSamplingRKD {
 public:
-  ABCalculatorSamplingRKD(unsigned m, OutputLevel output_level)
-      :K(m), _output_level(output_level) {}
+  /**
+   * @param num_threads: See ABCalculatorSamplingLiu.
+   * @param cascade_counts: See ABCalculatorRKD.
+   */
+  ABCalculatorSamplingRKD(unsigned m, OutputLevel output_level,
+                          unsigned num_threads = 1,
+                          bool cascade_counts = false)
+      :K(m), _output_level(output_level), _num_threads(num_threads),
+       _cascade_counts(cascade_counts) {}
+  /**
+   * @brief See ABCalculatorSamplingLiu::ComputeAB.
+   */
   vector<long long> ComputeAB(typename vector<T>::const_iterator first,
-                              typename vector<T>::const_iterator last,
-                              T r, const vector<unsigned> &indices);
+                              typename vector<T>::const_iterator last, T r,
+                              unsigned sample_num,
+                              const vector<unsigned> &indices);
 
 private:
   unsigned K;
   OutputLevel _output_level;
+  unsigned _num_threads;
+  bool _cascade_counts;
 };
 
 
@@ -288,7 +410,7 @@ protected:
       std::cerr << ", K = " << K << ")" << std::endl;
       exit(-1);
     }
-    ABCalculatorLiu<T> abc(K, this->_output_level);
+    ABCalculatorLiu<T> abc(K, this->_output_level, _num_threads);
     vector<long long> result = abc.ComputeAB(_data.cbegin(), _data.cend(), _r);
     _a = result[0];
     _b = result[1];
@@ -348,15 +470,16 @@ protected:
       std::cerr << ", K = " << K << ")" << std::endl;
       exit(-1);
     }
-    vector<unsigned> indices = GetSampleIndices(
-        _rtype, _n - K, _sample_size, _sample_num, _random)[0];
+    const vector<unsigned> indices = Flatten(GetSampleIndices(
+        _rtype, _n - K, _sample_size, _sample_num, _random));
 
-    MatchedPairsCalculatorSampling<T> b_cal(K, this->_output_level);
-    MatchedPairsCalculatorSampling<T> a_cal(K + 1, this->_output_level);
+    MatchedPairsCalculatorSampling<T> b_cal(K, _output_level, _num_threads);
+    MatchedPairsCalculatorSampling<T> a_cal(K + 1, _output_level,
+                                            _num_threads);
     _a_vec =
-        a_cal.ComputeA(_data.cbegin(), _data.cend(), _sample_num, indices, _r);
-    _b_vec =
-        b_cal.ComputeA(_data.cbegin(), _data.cend(), _sample_num, indices, _r);
+        a_cal.ComputeA(_data.cbegin(), _data.cend(), _r, _sample_num, indices);
+    _b_vec = b_cal.ComputeA(_data.cbegin(), _data.cend() - 1, _r, _sample_num,
+                            indices);
   }
 
   std::string _Method() const override {
@@ -403,13 +526,7 @@ public:
       : SampleEntropyCalculatorSampling<T>(
             data, r, m, sample_size, sample_num, real_entropy, real_a_norm,
             real_b_norm, output_level),
-        _rtype(rtype), _random(random_) {
-          
-    if (sample_num != 1) {
-      std::cerr << "Only support the parameter sample_num == 1.\n" << std::endl;
-      exit(-1);
-    }
-  }
+        _rtype(rtype), _random(random_) {}
 
   std::string get_result_str() override {
     std::stringstream ss;
@@ -434,12 +551,12 @@ protected:
       std::cerr << ", K = " << K << ")" << std::endl;
       exit(-1);
     }
-    vector<unsigned> indices = GetSampleIndices(
-        _rtype, _n - K, _sample_size, _sample_num, _random)[0];
+    const vector<unsigned> indices = Flatten(GetSampleIndices(
+        _rtype, _n - K, _sample_size, _sample_num, _random));
 
-    ABCalculatorSamplingLiu<T> ab_cal(K, _output_level);
+    ABCalculatorSamplingLiu<T> ab_cal(K, _output_level, _num_threads);
     vector<long long> results = ab_cal.ComputeAB(_data.cbegin(), _data.cend(),
-                                                 _sample_num, indices, _r);
+                                                 _r, _sample_num, indices);
 
     _a_vec = vector<long long>(_sample_num);
     _b_vec = vector<long long>(_sample_num);
@@ -474,6 +591,11 @@ public:
     return ss.str();
   }
 
+  /// @brief See the cascade_counts of ABCalculatorRKD.
+  void set_cascade_counts(bool cascade_counts) {
+    _cascade_counts = cascade_counts;
+  }
+
   USING_CALCULATOR_FIELDS
 protected:
   void _ComputeSampleEntropy() override {
@@ -482,13 +604,15 @@ protected:
       std::cerr << ", K = " << K << ")" << std::endl;
       exit(-1);
     }
-    ABCalculatorRKD<T> abc(K, this->_output_level);
+    ABCalculatorRKD<T> abc(K, this->_output_level, _num_threads,
+                           _cascade_counts);
     vector<long long> result = abc.ComputeAB(_data.cbegin(), _data.cend(), _r);
     _a = result[0];
     _b = result[1];
   }
   std::string _Method() const override { return std::string("range kd tree"); }
 
+  bool _cascade_counts = false;
 };
 
 
@@ -524,12 +648,7 @@ public:
       : SampleEntropyCalculatorSampling<T>(
             data, r, m, sample_size, sample_num, real_entropy,
             real_a_norm, real_b_norm, output_level),
-        _rtype(rtype), _random(random_) {
-    if (sample_num != 1) {
-      std::cerr << "Only support the parameter sample_num == 1.\n" << std::endl;
-      exit(-1);
-    }
-  }
+        _rtype(rtype), _random(random_) {}
 
   std::string get_result_str() override {
     std::stringstream ss;
@@ -546,6 +665,10 @@ public:
        << "----------------------------------------\n";
     return ss.str();
   }
+  /// @brief See the cascade_counts of ABCalculatorRKD.
+  void set_cascade_counts(bool cascade_counts) {
+    _cascade_counts = cascade_counts;
+  }
 
 protected:
   void _ComputeSampleEntropy() override {
@@ -554,12 +677,13 @@ protected:
       std::cerr << ", K = " << K << ")" << std::endl;
       exit(-1);
     }
-    vector<unsigned> indices = GetSampleIndices(
-        _rtype, _n - K, _sample_size, _sample_num, _random)[0];
+    const vector<unsigned> indices = Flatten(GetSampleIndices(
+        _rtype, _n - K, _sample_size, _sample_num, _random));
 
-    ABCalculatorSamplingRKD<T> ab_cal(K, _output_level);
+    ABCalculatorSamplingRKD<T> ab_cal(K, _output_level, _num_threads,
+                                      _cascade_counts);
     vector<long long> results = ab_cal.ComputeAB(_data.cbegin(), _data.cend(),
-                                                 _r, indices);
+                                                 _r, _sample_num, indices);
 
     _a_vec = vector<long long>(_sample_num);
     _b_vec = vector<long long>(_sample_num);
@@ -575,6 +699,7 @@ protected:
   USING_SAMPLING_FIELDS
   RandomType _rtype;
   bool _random;
+  bool _cascade_counts = false;
 };
 } // namespace sampen
 
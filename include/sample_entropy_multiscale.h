@@ -0,0 +1,59 @@
+/**
+ * @file sample_entropy_multiscale.h
+ *
+ * @brief Multiscale sample entropy (MSE) of a 1D series.
+ *
+ * @details The series of scale s is the coarse-grained series whose i-th
+ * sample aggregates the samples s * i, ..., s * i + s - 1 of the original
+ * series, and the sample entropy of every scale is computed with the same
+ * threshold r. The coarse-grained samples are kept as sums rather than
+ * means, and the threshold of scale s is s * r, which gives the same
+ * matches as the means with r but stays exact for integer series.
+ */
+
+#ifndef __SAMPLE_ENTROPY_MULTISCALE__
+#define __SAMPLE_ENTROPY_MULTISCALE__
+
+#include <vector>
+
+#include "utils.h"
+
+namespace sampen {
+using std::vector;
+
+// The coarse-grained series of at least this length are computed with the
+// range kd tree, and the shorter ones with the fast direct method.
+const unsigned kMultiscaleKDMinLength = 50000;
+
+struct MultiscaleSampleEntropyResult {
+  unsigned scale;
+  // The length of the coarse-grained series.
+  unsigned n;
+  long long a;
+  long long b;
+  double entropy;
+  // Whether the range kd tree (rather than the fast direct method) is used.
+  bool kd;
+};
+
+/**
+ * @brief Computes the sample entropy of the scales 1, ..., max_scale.
+ *
+ * The scales are distributed over num_threads threads, each of which
+ * coarse-grains into its own buffer, reused for all of its scales. The scales
+ * whose series are not longer than m + 1 are left out.
+ *
+ * @param r: The threshold of all the scales (not scaled with the standard
+ * deviation).
+ * @param kd_min_length: The coarse-grained series at least this long are
+ * computed with the range kd tree, the others with the fast direct method.
+ */
+template <typename T>
+vector<MultiscaleSampleEntropyResult> ComputeMultiscaleSampleEntropy(
+    const vector<T> &data, T r, unsigned m, unsigned max_scale,
+    unsigned num_threads = 1,
+    unsigned kd_min_length = kMultiscaleKDMinLength);
+
+} // namespace sampen
+
+#endif // !__SAMPLE_ENTROPY_MULTISCALE__
@@ -0,0 +1,109 @@
+/**
+ * @file sample_entropy_streaming.h
+ *
+ * @brief Computes sample entropy over a sliding window of an unbounded
+ * series, one sample at a time.
+ *
+ * @details Each template of length m + 1 is inserted when its last sample
+ * arrives and removed when its first sample leaves the window. An insertion
+ * adds the matches of the new template with the templates in the window to A
+ * and B, and a removal subtracts the matches of the old one, so that A and B
+ * always equal those of the window.
+ *
+ * The templates in the window are kept in a few static kd trees
+ * (ImplicitKDTree) in the manner of the logarithmic method: every tree holds a
+ * contiguous run of templates, from the oldest (and largest) tree to the
+ * newest. A new template comes as a tree of its own, and neighbouring trees
+ * are merged whenever the older one is not more than twice as large as the
+ * newer one, so that there are O(log W) trees and every template is rebuilt
+ * O(log W) times. A removed template is closed in its tree, and the oldest
+ * tree is rebuilt once half of it is closed.
+ */
+
+#ifndef __SAMPLE_ENTROPY_STREAMING__
+#define __SAMPLE_ENTROPY_STREAMING__
+
+#include <vector>
+
+#include "implicit_kdtree.h"
+#include "utils.h"
+
+namespace sampen {
+using std::vector;
+
+template <typename T> class StreamingSampleEntropy {
+public:
+  /**
+   * @param window: The number of the latest samples the results refer to.
+   * It should be greater than m.
+   */
+  StreamingSampleEntropy(unsigned window, T r, unsigned m);
+
+  /// @brief Append a sample and update A and B to the new window.
+  void Push(T x);
+
+  /// @brief The number of samples pushed so far.
+  unsigned long long num_pushed() const { return _num_pushed; }
+  /// @brief The number of samples in the current window.
+  unsigned size() const {
+    return _num_pushed < _window ? static_cast<unsigned>(_num_pushed)
+                                 : _window;
+  }
+  /// @brief The number of templates (of length m + 1) in the current window.
+  unsigned num_templates() const { return size() > K ? size() - K : 0; }
+  long long get_a() const { return _a; }
+  long long get_b() const { return _b; }
+  /**
+   * @brief The sample entropy of the current window, the same as that of a
+   * calculator built on the last size() samples.
+   */
+  double get_entropy() const {
+    return ComputeSampen(static_cast<double>(_a), static_cast<double>(_b),
+                         size() - K, K);
+  }
+
+private:
+  // The templates [first, first + size) of a tree, of which those before
+  // first + num_closed have been closed.
+  struct Block {
+    Block(unsigned long long first, unsigned size,
+          const TemplateView<T> &points)
+        : first(first), size(size), num_closed(0),
+          tree(points.dim() - 1, points, Silent) {}
+    unsigned live() const { return size - num_closed; }
+
+    unsigned long long first;
+    unsigned size;
+    unsigned num_closed;
+    ImplicitKDTree<T> tree;
+  };
+
+  const T *_Template(unsigned long long index) const {
+    return _samples.data() + (index - _samples_offset);
+  }
+  // Add (sign = 1) or subtract (sign = -1) the matches of the template with
+  // the templates in the trees.
+  void _Count(unsigned long long index, int sign);
+  void _Insert(unsigned long long index);
+  void _Remove(unsigned long long index);
+  // Rebuild the templates [first, last) into a tree.
+  Block _Build(unsigned long long first, unsigned long long last);
+  void _Merge(unsigned i);
+
+  const unsigned _window;
+  const T _r;
+  const unsigned K;
+  unsigned long long _num_pushed;
+  long long _a;
+  long long _b;
+  // _samples[i] is the (_samples_offset + i)-th sample.
+  vector<T> _samples;
+  unsigned long long _samples_offset;
+  // From the oldest to the newest.
+  vector<Block> _blocks;
+  long long _num_nodes;
+};
+
+} // namespace sampen
+
+#endif // !__SAMPLE_ENTROPY_STREAMING__
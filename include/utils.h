@@ -12,12 +12,14 @@
 #include <algorithm>
 #include <assert.h>
 #include <chrono>
+#include <cstdint>
 #include <fstream>
 #include <iterator>
 #include <limits>
 #include <numeric>
 #include <sstream>
 #include <string>
+#include <type_traits>
 #include <vector>
 
 #ifdef DEBUG
@@ -65,7 +67,7 @@ enum OutputLevel {
 };
 
 struct Bounds {
-  Bounds(size_t n) : lower_bounds(n), upper_bounds(n) {}
+  Bounds(size_t n = 0) : lower_bounds(n), upper_bounds(n) {}
   vector<unsigned> lower_bounds;
   vector<unsigned> upper_bounds;
 };
@@ -87,17 +89,93 @@ double ComputeSampen(double A, double B, unsigned N, unsigned m);
 /**
  * @brief Read data from file.
  *
+ * The file is mapped into memory and split into chunks at line (multirecord)
+ * or token (simple) boundaries, which are parsed on num_threads threads and
+ * concatenated in order. The chunks are parsed in waves, so that reading the
+ * first n values of a large file stops soon after enough values are found.
+ *
  * @param[out] result where to store the read result
  * @param filename the name of the file to read
+ * @param input_type: simple (one value per token) or multirecord (the second
+ * value of each line).
+ * @param n: The number of values to read. If 0, all the values are read.
+ * @param line_offset: The number of values (simple) or lines (multirecord)
+ * to skip.
+ * @return The number of bytes parsed.
+ */
+template <typename T>
+size_t ReadData(std::vector<T> &result, const std::string &filename,
+                const std::string &input_type = "simple", unsigned n = 0,
+                unsigned line_offset = 0, unsigned num_threads = 1);
+
+/**
+ * @brief Same as ReadData, but warns and returns false instead of exiting if
+ * the file can not be read or parsed, so that one broken file does not stop
+ * a batch.
+ *
+ * @param[out] num_bytes The number of bytes parsed.
+ */
+template <typename T>
+bool TryReadData(std::vector<T> &result, size_t &num_bytes,
+                 const std::string &filename,
+                 const std::string &input_type = "simple", unsigned n = 0,
+                 unsigned line_offset = 0, unsigned num_threads = 1);
+
+/**
+ * @brief Read data from a raw little-endian binary file, which is mapped
+ * into memory read-only, so that skipping and truncating are pointer
+ * arithmetic and the values are converted in one pass.
+ *
+ * @param value_type: The type of the values in the file, one of int16,
+ * int32, float32 and float64.
+ * @param n: The number of values to read. If 0, all the values after offset
+ * are read.
+ * @param offset: The number of values to skip.
+ * @return The number of bytes read.
+ */
+template <typename T>
+size_t ReadBinaryData(std::vector<T> &result, const std::string &filename,
+                      const std::string &value_type, unsigned n = 0,
+                      unsigned offset = 0);
+
+/**
+ * @brief Same as ReadBinaryData, but warns and returns false instead of
+ * exiting if the file can not be read.
+ *
+ * @param[out] num_bytes The number of bytes read.
  */
 template <typename T>
-void ReadData(std::vector<T> &result, std::string filename,
-              std::string input_type = "simple", unsigned n = 0);
+bool TryReadBinaryData(std::vector<T> &result, size_t &num_bytes,
+                       const std::string &filename,
+                       const std::string &value_type, unsigned n = 0,
+                       unsigned offset = 0);
+
+/// @brief Whether the type is one of the value types of ReadBinaryData.
+bool IsBinaryValueType(const std::string &value_type);
+
+/**
+ * @brief Get the input files of a batch.
+ *
+ * @param path: A directory, whose regular files are taken in the order of
+ * their names (hidden files are skipped), or a manifest file with one file
+ * name per line. Blank lines and lines starting with '#' of the manifest are
+ * skipped, and relative names are relative to the directory of the manifest.
+ */
+vector<string> GetBatchInputFiles(const string &path);
 
 template <typename T> double ComputeVariance(const vector<T> &data);
 
 template <typename T> T ComputeSum(const vector<T> &data);
 
+/// @brief Concatenate the vectors.
+template <typename T>
+vector<T> Flatten(const vector<vector<T> > &vectors) {
+  vector<T> result;
+  for (const vector<T> &v : vectors)
+    result.insert(result.end(), v.cbegin(), v.cend());
+  return result;
+}
+
 /**
  * @brief Merge repeated points by setting count.
  *
@@ -152,12 +230,117 @@ vector<KDPoint<unsigned> > Map2Grid(const vector<KDPoint<T> > &points,
 template <typename T>
 Bounds GetRankBounds(const vector<KDPoint<T> > &points, T r);
 
+/**
+ * @brief The same as above, except that the points are given by a view and
+ * a sorting permutation, so the sorted points need not be materialized.
+ *
+ * @param rank2index: The points sorted in ascending order of the first
+ * coordinate are points[rank2index[0]], points[rank2index[1]], ...
+ */
+template <typename T>
+Bounds GetRankBounds(const TemplateView<T> &points,
+                     const vector<unsigned> &rank2index, T r);
+
+/**
+ * @brief The same as above, except that the result is stored in bounds and
+ * values is the buffer of the sorted first coordinates, so that both keep
+ * their allocations over calls.
+ */
+template <typename T>
+void GetRankBounds(const TemplateView<T> &points,
+                   const vector<unsigned> &rank2index, T r, Bounds &bounds,
+                   vector<T> &values);
+
+/**
+ * @brief Sorts the n templates of length dim of data[0], ..., data[n - 1],
+ * including the (dim - 1) trailing partial ones, in the order of
+ * TemplateView::Less.
+ *
+ * The values are radix sorted once, and the order of the templates of length
+ * 2k is derived from that of length k with two counting sorts, since a
+ * template of length 2k is the template of length k at i followed by the one
+ * at i + k (prefix doubling, as in suffix array construction). There is no
+ * comparison of templates, and the cost is O(n log dim).
+ *
+ * @return rank2index: The templates sorted in ascending order are those
+ * starting at rank2index[0], rank2index[1], ...
+ */
+template <typename T>
+vector<unsigned> SortTemplates(const T *data, unsigned n, unsigned dim);
+
+/**
+ * @brief The work space of SortTemplates. It may be kept over calls, so that
+ * sorting the templates of one series after another allocates only when a
+ * series is longer than all the previous ones.
+ */
+template <typename T> struct SortTemplatesBuffers {
+  // The radix keys, of 32 bits for int and 64 bits for double.
+  typedef typename std::conditional<sizeof(T) <= 4, uint32_t, uint64_t>::type
+      Key;
+  vector<Key> keys;
+  vector<Key> keys_tmp;
+  vector<unsigned> order_tmp;
+  vector<unsigned> rank;
+  vector<unsigned> rank_tmp;
+  vector<unsigned> count;
+};
+
+/**
+ * @brief The same as above, except that the result is stored in rank2index
+ * and the work space is given.
+ */
+template <typename T>
+void SortTemplates(const T *data, unsigned n, unsigned dim,
+                   vector<unsigned> &rank2index,
+                   SortTemplatesBuffers<T> &buffers);
+
+/**
+ * @brief Get the inverse map of rank2index, extended cyclically by dim
+ * elements, i.e., result[i] = index2rank[i % n] for i < n + dim.
+ */
+vector<unsigned> GetInverseMapCyclic(const vector<unsigned> &rank2index,
+                                     unsigned dim);
+
+/// @brief The same as above, with the result stored in index2rank.
+void GetInverseMapCyclic(const vector<unsigned> &rank2index, unsigned dim,
+                         vector<unsigned> &index2rank);
+
+/*
+ * @brief Maps the points at the given ranks to grids without materializing
+ * them.
+ *
+ * The grid point of the point at rank p is (q(p), q^2(p), ..., q^dim(p)),
+ * where q maps the rank of a template to the rank of the next template,
+ * i.e., it is the window index2rank[rank2index[p] + 1, ..., rank2index[p] +
+ * dim], so the result is a view over index2rank.
+ *
+ * @param index2rank: Given by GetInverseMapCyclic(rank2index, dim). It must
+ * outlive the result.
+ * @param ranks: The ranks of the points to map.
+ */
+TemplateView<unsigned> Map2Grid(const vector<unsigned> &index2rank,
+                                const vector<unsigned> &rank2index,
+                                const vector<unsigned> &ranks, unsigned dim);
+
+/*
+ * @brief The same as above, except that the offsets of the result take the
+ * allocation of offsets, which may be given back by
+ * TemplateView::ReleaseOffsets.
+ */
+TemplateView<unsigned> Map2Grid(const vector<unsigned> &index2rank,
+                                const vector<unsigned> &rank2index,
+                                const vector<unsigned> &ranks, unsigned dim,
+                                vector<unsigned> &&offsets);
+
 /*
  * @brief Given a point (in grid), get the bound.
  */
 Range<unsigned> GetHyperCube(const KDPoint<unsigned> &point,
                              const Bounds &bounds);
 
+Range<unsigned> GetHyperCube(const KDPointRef<unsigned> &point,
+                             const Bounds &bounds);
+
 class ArgumentParser {
 public:
   ArgumentParser(int argc, char *argv[]) : arg_list(argv, argv + argc) {}
@@ -166,6 +349,8 @@ public:
   long getArgLong(const string &arg, long default_);
   double getArgDouble(const string &arg, double default_);
   std::vector<int> getArgIntArray(const string &arg);
+  // Comma separated values, e.g. 0.1,0.15,0.2.
+  std::vector<double> getArgDoubleArray(const string &arg);
 
 private:
   vector<string> arg_list;
@@ -312,55 +497,6 @@ inline long long CountRangeLastAxis(T lower, T upper,
 //////////////////////////////////////////////////////////////////////////
 // Implementation
 //////////////////////////////////////////////////////////////////////////
-template <typename T>
-void ReadData(std::vector<T> &result, std::string filename,
-              std::string input_type, unsigned n, unsigned line_offset) {
-  ifstream ifs(filename);
-  if (!ifs.is_open()) {
-    std::cerr << "Cannot open file! (filename: " << filename << ")\n";
-    exit(-1);
-  }
-  unsigned org_n = n;
-  if (n == 0) {
-    n = 1024 * 1024;
-  } else {
-    result.reserve(n);
-    result.resize(n);
-  }
-  unsigned count = 0;
-  unsigned result_i = 0;
-  T x = 0;
-  if (input_type == "simple") {
-    while (count < n + line_offset && ifs >> x) {
-      if (count >= line_offset) {
-        result[result_i] = x;
-        ++result_i;
-      }
-      ++count;
-    }
-  } else if (input_type == "multirecord") {
-    std::string line;
-    while (count < n + line_offset && std::getline(ifs, line)) {
-      std::istringstream iss(line);
-      if (!(iss >> x >> x)) {
-        MSG_ERROR(-1, "Input file foramt error.\n");
-      }
-      if (count >= line_offset) {
-        result[result_i] = x;
-        ++result_i;
-      }
-      ++count;
-    }
-  } else {
-    MSG_ERROR(-1, "Invalid input-type: %s\n", input_type.c_str());
-  }
-  if (org_n && org_n != result.size()) {
-    MSG_WARNING(-1, "Cannot read %u element from file %s. Only %zu read.\n",
-                org_n, filename.c_str(), result.size());
-  }
-  ifs.close();
-}
-
 template <typename T>
 vector<KDPoint<T> > GetKDPoints(typename vector<T>::const_iterator first,
                                 typename vector<T>::const_iterator last,
@@ -575,6 +711,52 @@ Bounds GetRankBounds(const vector<KDPoint<T> > &points, T r) {
   return bounds;
 }
 
+template <typename T>
+Bounds GetRankBounds(const TemplateView<T> &points,
+                     const vector<unsigned> &rank2index, T r) {
+  Bounds bounds;
+  vector<T> values;
+  GetRankBounds(points, rank2index, r, bounds, values);
+  return bounds;
+}
+
+template <typename T>
+void GetRankBounds(const TemplateView<T> &points,
+                   const vector<unsigned> &rank2index, T r, Bounds &bounds,
+                   vector<T> &values) {
+  const size_t n = rank2index.size();
+  bounds.lower_bounds.resize(n);
+  bounds.upper_bounds.resize(n);
+  values.resize(n);
+  T *data = values.data();
+  for (size_t i = 0; i < n; i++)
+    data[i] = points[rank2index[i]][0];
+
+  size_t k = 0;
+  for (size_t i = 0; i < n; i++) {
+    while (data[k] + r < data[i])
+      k++;
+    bounds.lower_bounds[i] = k;
+  }
+  k = n - 1;
+  for (size_t i = n; i > 0; i--) {
+    while (data[k] - r > data[i - 1])
+      k--;
+    bounds.upper_bounds[i - 1] = k;
+  }
+}
+
+template <typename T>
+Range<T> GetHyperCubeR(const KDPointRef<T> &point, T r) {
+  const unsigned K = point.dim();
+  Range<T> result(K);
+  for (size_t i = 0; i < K; ++i) {
+    result.lower_ranges[i] = point[i] - r;
+    result.upper_ranges[i] = point[i] + r;
+  }
+  return result;
+}
+
 
 
 template <typename T>
@@ -100,3 +100,18 @@ cdef extern from "sample_entropy_calculator_direct.h" namespace "sampen":
     vector[long long] get_b_vec()
     string get_method_name()
     void ComputeSampleEntropy()
+
+cdef extern from "sample_entropy_multiscale.h" namespace "sampen":
+  cdef const unsigned kMultiscaleKDMinLength
+
+  cdef struct MultiscaleSampleEntropyResult:
+    unsigned scale
+    unsigned n
+    long long a
+    long long b
+    double entropy
+    bool kd
+
+  vector[MultiscaleSampleEntropyResult] ComputeMultiscaleSampleEntropy[T](
+    const vector[T] &data, T r, unsigned m, unsigned max_scale,
+    unsigned num_threads, unsigned kd_min_length) except +
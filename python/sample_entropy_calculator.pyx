@@ -8,6 +8,8 @@ from sample_entropy_calculator cimport SampleEntropyCalculatorRKD
 from sample_entropy_calculator cimport SampleEntropyCalculatorFastDirect
 from sample_entropy_calculator cimport SampleEntropyCalculatorDirect
 from sample_entropy_calculator cimport SampleEntropyCalculatorSamplingDirect
+from sample_entropy_calculator cimport ComputeMultiscaleSampleEntropy
+from sample_entropy_calculator cimport kMultiscaleKDMinLength
 
 cdef extern from "random_sampler.h":
   cpdef enum RandomType 'RandomType':
@@ -216,4 +218,16 @@ cdef class SampEnSamplingD:
     return self.c_.get_b_norm()
 
   def b_list(self):
-    return self.c_.get_b_vec()
\ No newline at end of file
+    return self.c_.get_b_vec()
+
+def multiscale_sampen(const vector[double] &data, double r, unsigned m,
+                      unsigned max_scale, unsigned num_threads=1,
+                      unsigned kd_min_length=kMultiscaleKDMinLength):
+  """Compute the multiscale sample entropy of the scales 1, ..., max_scale.
+
+  Returns a list with a dict per scale, whose keys are scale, n (the length
+  of the coarse-grained series), a, b, entropy and kd (whether the range kd
+  tree was used rather than the fast direct method).
+  """
+  return ComputeMultiscaleSampleEntropy[double](
+      data, r, m, max_scale, num_threads, kd_min_length)
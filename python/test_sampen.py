@@ -19,6 +19,10 @@ if __name__ == '__main__':
                             sampen.RandomType.SWR_UNIFORM, False, False, 0)
   print('SampEn: %.4f' % s.entropy())
   print('Time: %.4f' % s.time())
+
+  print('Testing multiscale_sampen...')
+  for scale in sampen.multiscale_sampen(d, r, m, 20):
+    print('Scale %d: %.4f' % (scale['scale'], scale['entropy']))
   
   h, w = 200, 200
   image = np.random.randn(h * w)
@@ -0,0 +1,92 @@
+// Compares the counts backends of RangeKDTree2K in the sliding window loop.
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <numeric>
+#include <vector>
+
+#include "kdtree.h"
+#include "utils.h"
+
+using namespace sampen;
+using std::cout;
+using std::endl;
+using std::vector;
+
+char usage[] = "Usage: %s [-n <N>] [-m <M>] [-r <R>]\n\n"
+               "Runs the sliding window loop of the range kd tree method on a\n"
+               "random walk of length N (default: 100000) with template length\n"
+               "M (default: 3) and integer threshold R (default: 8), once for\n"
+               "each counts backend of RangeKDTree2K.\n";
+
+// The points are sorted by the first coordinate. Points whose first
+// coordinates fall behind the window are closed, and each point is queried
+// before being opened.
+template <typename Tree>
+void RunSlidingLoop(const char *name, const TemplateView<int> &points,
+                    unsigned m, int r) {
+  Timer timer;
+  Tree tree(m, points, Silent);
+  const double build_seconds = timer.ElapsedSeconds();
+
+  timer.SetStartingPointNow();
+  long long a = 0, b = 0, num_nodes = 0;
+  unsigned j = 0;
+  for (unsigned i = 0; i < points.size(); ++i) {
+    while (points[j][0] < points[i][0] - r)
+      tree.Close(j++);
+    const vector<long long> ab =
+        tree.CountRange(GetHyperCubeR(points[i], r), num_nodes);
+    a += ab[0];
+    b += ab[1];
+    tree.UpdateCount(i, 1);
+  }
+  timer.StopTimer();
+  cout << name << ": build " << build_seconds << " s, sliding "
+       << timer.ElapsedSeconds() << " s, a = " << a << ", b = " << b << endl;
+}
+
+int main(int argc, char *argv[]) {
+  unsigned n = 100000, m = 3;
+  int r = 8;
+  for (int i = 1; i < argc; ++i) {
+    if (i + 1 < argc && !strcmp(argv[i], "-n")) {
+      n = atoi(argv[++i]);
+    } else if (i + 1 < argc && !strcmp(argv[i], "-m")) {
+      m = atoi(argv[++i]);
+    } else if (i + 1 < argc && !strcmp(argv[i], "-r")) {
+      r = atoi(argv[++i]);
+    } else {
+      printf(usage, argv[0]);
+      exit(-1);
+    }
+  }
+  if (n <= m || m == 0) {
+    std::cerr << "n should be greater than m, and m should be positive.\n";
+    exit(-1);
+  }
+
+  vector<int> data(n);
+  int x = 0;
+  srand(0);
+  for (unsigned i = 0; i < n; ++i) {
+    x += rand() % 21 - 10;
+    data[i] = x;
+  }
+
+  const unsigned num_points = n - m;
+  vector<unsigned> offsets(num_points);
+  std::iota(offsets.begin(), offsets.end(), 0);
+  std::sort(offsets.begin(), offsets.end(),
+            [&data](unsigned i, unsigned j) { return data[i] < data[j]; });
+  const TemplateView<int> points(data.data(), n, m + 1, std::move(offsets));
+
+  RunSlidingLoop<RangeKDTree2K<int, LastAxisTreeCounts<int> > >(
+      "last-axis trees", points, m, r);
+  RunSlidingLoop<RangeKDTree2K<int, LastAxisFenwickCounts<int> > >(
+      "Fenwick trees", points, m, r);
+  RunSlidingLoop<RangeKDTree2K<int, LastAxisCascadeCounts<int> > >(
+      "cascaded Fenwick trees", points, m, r);
+  return 0;
+}
@@ -35,9 +35,14 @@ char usage[] =
     "                        multirecord, then each line contains <NUM_RECORD> + 1\n"
     "                        columns, of which the first indicates the line number\n"
     "                        and the remaining columns are instances of the records.\n"
+    "                        If set to binary, then the file holds raw little-endian\n"
+    "                        values of the type given by --input-type, and it is\n"
+    "                        mapped into memory instead of parsed.\n"
     "                        The default value is simple.\n"
     "--input-type <TYPE>     The data type of the input data, either int or float.\n"
-    "                        Default: double.\n"
+    "                        Default: double. With --input-format binary, one of\n"
+    "                        int16, int32 (computed as int), float32 or float64\n"
+    "                        (computed as double). Default: float64.\n"
     "-r <R>                  The threshold argument in sample entropy.\n"
     "-m <M>                  The template length argument of sample entropy. Note\n"
     "                        that this program only supports 2 <= m <= 10.\n"
@@ -58,6 +63,9 @@ char usage[] =
     "    An array of sample numbers (N_1) that computations should take on. The\n"
     "    default value is `10,20,...,250`. Note that your command should not contain\n"
     "    `...`.\n"
+    "--threads N\n"
+    "    The number of threads among which the samples are distributed, and on which\n"
+    "    text input is parsed. Default: 1.\n"
     "Options:\n"
     "--random\n"
     "    If this option is enabled, the random seed will be set randomly.\n"
@@ -105,6 +113,7 @@ struct Argument {
   bool random_, variance;
   bool q, u, swr, presort, grid;
   bool kdtree_sample;
+  unsigned num_threads;
   RandomType rtype;
   void PrintArguments() const;
 } arg;
@@ -117,10 +126,12 @@ int main(int argc, char *argv[]) {
 #endif
   ParseArgument(argc, argv);
 
-  if (arg.input_type == "double") {
+  if (arg.input_type == "double" || arg.input_type == "float32" ||
+      arg.input_type == "float64") {
     using Type = double;
     SampleEntropyN0N1<Type>();
-  } else if (arg.input_type == "int") {
+  } else if (arg.input_type == "int" || arg.input_type == "int16" ||
+             arg.input_type == "int32") {
     using Type = int;
     SampleEntropyN0N1<Type>();
   } else {
@@ -141,6 +152,7 @@ void Argument::PrintArguments() const {
   std::cout << "\tthreshold: " << arg.r << std::endl;
   std::cout << "\trandom: " << arg.random_ << std::endl;
   std::cout << "\tquasi type: " << random_type_names[arg.rtype] << std::endl;
+  std::cout << "\tthreads: " << arg.num_threads << std::endl;
   if (!arg.sample_sizes.empty()) {
     std::cout << "\tsample size array: ";
     for (auto sample_size : sample_sizes) {
@@ -176,15 +188,21 @@ void ParseArgument(int argc, char *argv[]) {
   arg.input_format = parser.getArg("--input-format");
   if (arg.input_format.size() == 0)
     arg.input_format = "simple";
-  if (arg.input_format != "simple" && arg.input_format != "multirecord") {
+  if (arg.input_format != "simple" && arg.input_format != "multirecord" &&
+      arg.input_format != "binary") {
     cerr << "Invalid argument: --input-format " << arg.input_format;
-    cerr << ", should be either simple or multirecord. \n";
+    cerr << ", should be simple, multirecord or binary. \n";
     exit(-1);
   }
 
   arg.input_type = parser.getArg("--input-type");
   if (arg.input_type.size() == 0)
-    arg.input_type = "double";
+    arg.input_type = arg.input_format == "binary" ? "float64" : "double";
+  if (arg.input_format == "binary" && !IsBinaryValueType(arg.input_type)) {
+    cerr << "Invalid argument: --input-type " << arg.input_type;
+    cerr << ", should be int16, int32, float32 or float64 for binary input. \n";
+    exit(-1);
+  }
 
   arg.data_length = parser.getArgLong("-n", 1000010);
 
@@ -211,6 +229,14 @@ void ParseArgument(int argc, char *argv[]) {
   arg.line_offset =
       static_cast<unsigned>(parser.getArgLong("--line-offset", 0));
 
+  long num_threads = parser.getArgLong("--threads", 1);
+  if (num_threads <= 0) {
+    cerr << "Specify a positive number of threads with --threads N. \n";
+    cerr << _usage;
+    exit(-1);
+  }
+  arg.num_threads = static_cast<unsigned>(num_threads);
+
   string output_level = parser.getArg("--output-level");
   if (output_level.size() == 0)
     arg.output_level = Info;
@@ -288,8 +314,22 @@ void ParseArgument(int argc, char *argv[]) {
 template <typename T> void SampleEntropyN0N1() {
   const unsigned K = arg.template_length;
   vector<T> data;
-  ReadData<T>(data, arg.filename, arg.input_format, arg.data_length,
-              arg.line_offset);
+  SysTimer read_timer;
+  size_t bytes_read;
+  if (arg.input_format == "binary") {
+    bytes_read = ReadBinaryData<T>(data, arg.filename, arg.input_type,
+                                   arg.data_length, arg.line_offset);
+  } else {
+    bytes_read = ReadData<T>(data, arg.filename, arg.input_format,
+                             arg.data_length, arg.line_offset,
+                             arg.num_threads);
+  }
+  read_timer.StopTimer();
+  if (arg.output_level >= Info) {
+    const double seconds = read_timer.ElapsedSeconds();
+    MSG_INFO("Read %zu bytes in %.3f seconds (%.1f MB/s).\n", bytes_read,
+             seconds, seconds > 0 ? bytes_read / seconds / 1e6 : 0.);
+  }
 
   unsigned n = data.size();
   if (n <= K) {
@@ -337,14 +377,14 @@ template <typename T> void SampleEntropyN0N1() {
             data, r_scaled, K, sample_size, sample_num,
             sec.get_entropy(), sec.get_a_norm(), sec.get_b_norm(), SWR_UNIFORM,
             arg.random_, arg.output_level);
-        SampleEntropySamplingExperiment(secds, n_computation);
+        SampleEntropySamplingExperiment(secds, n_computation, arg.num_threads);
       }
       if (arg.u) {
         SampleEntropyCalculatorSamplingDirect<T> secds(
             data, r_scaled, K, sample_size, sample_num,
             sec.get_entropy(), sec.get_a_norm(), sec.get_b_norm(), UNIFORM,
             arg.random_, false, arg.output_level);
-        SampleEntropySamplingExperiment(secds, n_computation);
+        SampleEntropySamplingExperiment(secds, n_computation, arg.num_threads);
       }
 
       if (arg.swr) {
@@ -352,7 +392,7 @@ template <typename T> void SampleEntropyN0N1() {
             data, r_scaled, K, sample_size, sample_num,
             sec.get_entropy(), sec.get_a_norm(), sec.get_b_norm(), SWR_UNIFORM,
             arg.random_, false, arg.output_level);
-        SampleEntropySamplingExperiment(secds, n_computation);
+        SampleEntropySamplingExperiment(secds, n_computation, arg.num_threads);
       }
       if (arg.q) {
         SampleEntropyCalculatorSamplingDirect<T> secds(
@@ -360,13 +400,13 @@ template <typename T> void SampleEntropyN0N1() {
             sec.get_entropy(), sec.get_a_norm(), sec.get_b_norm(), arg.rtype,
             arg.random_, false, arg.output_level);
 
-        SampleEntropySamplingExperiment(secds, n_computation);
+        SampleEntropySamplingExperiment(secds, n_computation, arg.num_threads);
         if (arg.presort) {
           SampleEntropyCalculatorSamplingDirect<T> secds(
               data, r_scaled, K, sample_size, sample_num,
               sec.get_entropy(), sec.get_a_norm(), sec.get_b_norm(), arg.rtype,
               arg.random_, true, arg.output_level);
-          SampleEntropySamplingExperiment(secds, n_computation);
+          SampleEntropySamplingExperiment(secds, n_computation, arg.num_threads);
         }
       }
 
@@ -375,13 +415,13 @@ template <typename T> void SampleEntropyN0N1() {
             data, r_scaled, K, sample_size, sample_num,
             sec.get_entropy(), sec.get_a_norm(), sec.get_b_norm(), GRID,
             arg.random_, false, arg.output_level);
-        SampleEntropySamplingExperiment(secds, n_computation);
+        SampleEntropySamplingExperiment(secds, n_computation, arg.num_threads);
         if (arg.presort) {
           SampleEntropyCalculatorSamplingDirect<T> secds(
               data, r_scaled, K, sample_size, sample_num,
               sec.get_entropy(), sec.get_a_norm(), sec.get_b_norm(), GRID,
               arg.random_, true, arg.output_level);
-          SampleEntropySamplingExperiment(secds, n_computation);
+          SampleEntropySamplingExperiment(secds, n_computation, arg.num_threads);
         }
       }
     }
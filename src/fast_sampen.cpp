@@ -1,13 +1,19 @@
+#include <atomic>
+#include <chrono>
+#include <cmath>
 #include <cstring>
 #include <fstream>
 #include <iostream>
+#include <sstream>
 #include <string>
 #include <time.h>
 
 #include "experiment.h"
+#include "parallel.h"
 #include "random_sampler.h"
 #include "sample_entropy_calculator_direct.h"
 #include "sample_entropy_calculator_kd.h"
+#include "sample_entropy_multiscale.h"
 #include "utils.h"
 
 using namespace sampen;
@@ -25,18 +31,45 @@ char usage[] =
     "The default method is the sliding kd-tree method.\n"
     "Arguments:\n"
     "--input <INPUT>         The file name of the input file.\n"
+    "--batch <PATH>          Compute the sample entropy of many files in one process\n"
+    "                        instead of --input. <PATH> is either a directory, whose\n"
+    "                        files are taken in the order of their names, or a\n"
+    "                        manifest with one file name per line. The files are\n"
+    "                        distributed among the --threads threads, and one row\n"
+    "                        per file, method and threshold is written. Only the\n"
+    "                        direct, fast direct (the default), range kd tree and kd\n"
+    "                        tree (Liu) methods are supported. A file that can not\n"
+    "                        be read gets one row per threshold with the method\n"
+    "                        'read error', and the other files are still computed.\n"
+    "--batch-output <FILE>   Where the rows of --batch are written. Default: stdout.\n"
+    "--batch-format <FORMAT> The format of the rows of --batch, csv or jsonl.\n"
+    "                        Default: csv.\n"
     "--input-format <FORMAT> The format of the input file. Should be either 'simple'\n"
     "                        or 'multirecord'. If set to simple, then each line of the\n"
     "                        input file contains exactly one column; if set to\n"
     "                        multirecord, then each line contains <NUM_RECORD> + 1\n"
     "                        columns, of which the first indicates the line number\n"
     "                        and the remaining columns are instances of the records.\n"
+    "                        If set to binary, then the file holds raw little-endian\n"
+    "                        values of the type given by --input-type, and it is\n"
+    "                        mapped into memory instead of parsed.\n"
     "                        The default value is simple.\n"
     "--input-type <TYPE>     The data type of the input data, either int or " "float.\n"
-    "                        Default: double.\n"
-    "-r <R>                  The threshold argument in sample entropy.\n"
+    "                        Default: double. With --input-format binary, one of\n"
+    "                        int16, int32 (computed as int), float32 or float64\n"
+    "                        (computed as double). Default: float64.\n"
+    "-r <R>                  The threshold argument in sample entropy. A comma\n"
+    "                        separated list of thresholds (e.g. 0.1,0.15,0.2) is\n"
+    "                        computed by the direct, range kd tree and kd tree\n"
+    "                        (Liu) methods. The kd tree methods share the\n"
+    "                        presorting and the tree among the thresholds, and the\n"
+    "                        direct one makes one pass for all of them (histogram\n"
+    "                        of thresholds) if there are at least 32.\n"
     "-m <M>                  The template length argument of sample entropy. Note\n"
     "                        that this program only supports 2 <= m <= 10.\n"
+    "--max-m <M1>            If greater than <M>, sample entropy is computed for\n"
+    "                        each template length from <M> to <M1> in one pass by\n"
+    "                        the direct, range kd tree and kd tree (Liu) methods.\n"
     "-n <N>                  If the length of the signal specified by <FILENAME> is\n"
     "                        greater than <N>, then it would be truncated to be of\n"
     "                        length <N>. If <N> is 0, then the the original length\n"
@@ -48,7 +81,20 @@ char usage[] =
     "                        debugging.\n"
     "--quasi-type <TYPE>     The type of the quasi-random sequence for sampling,\n"
     "                        can be one of the following: sobol, halton,\n"
-    "                        reversehalton or niederreiter_2. Default: sobol.\n\n"
+    "                        reversehalton or niederreiter_2. Default: sobol.\n"
+    "--multiscale            If this option is on, then the multiscale sample entropy\n"
+    "                        of the scales 1, ..., <D> is computed, with the range kd\n"
+    "                        tree for the long coarse-grained series and the fast\n"
+    "                        direct method for the short ones.\n"
+    "--multiscale-depth <D>  The number of scales. Default: 20.\n"
+    "--multiscale-kd-length <L>\n"
+    "                        The coarse-grained series of at least <L> samples are\n"
+    "                        computed with the range kd tree. Default: 50000.\n"
+    "--threads <N>           The number of threads used by the fast direct, range\n"
+    "                        kd tree and kd tree (Liu) methods, and among which the\n"
+    "                        samples of the sampling methods are distributed. Text\n"
+    "                        input is also parsed on <N> threads.\n"
+    "                        Default: 1.\n\n"
     "Options:\n"
     "-d | --direct           If this option is on, then (plain) direct method will be\n"
     "                        conducted.\n"
@@ -57,6 +103,11 @@ char usage[] =
     "-skd | --sliding-kdtree If this option is on, then sliding-kd tree method will be\n"
     "                        conducted.\n"
     "-rkd | --range-kdtree   If this option is on, then the range kd tree will be run.\n"
+    "--rkd-cascade           With -rkd, the range kd tree finds the ranks of the last\n"
+    "                        axis by fractional cascading, which takes about 20%\n"
+    "                        less memory but is slower.\n"
+    "-lkd | --liu-kdtree     If this option is on, then the kd tree (Liu) method will\n"
+    "                        be run.\n"
     "--simple-kdtree         If this option is on, then trivial kd tree based method\n"
     "                        (without sliding window of the first component) will be\n"
     "                         run.\n"
@@ -89,29 +140,50 @@ void ParseArgument(int argc, char *argv[]);
 
 struct Argument {
   unsigned template_length;
+  // The largest template length, if several are computed at once.
+  unsigned max_template_length;
   unsigned line_offset;
   string filename;
+  // The directory or manifest of --batch, and where its rows are written.
+  string batch;
+  string batch_output;
+  string batch_format;
   string input_format;
   string input_type;
   unsigned data_length;
   unsigned sample_size;
   unsigned sample_num;
   double r;
+  // All the thresholds given by -r, of which r is the first.
+  vector<double> r_values;
   OutputLevel output_level;
   bool fast_direct;
   bool direct;
   bool kdtree_sample;
   bool simple_kdtree;
   bool rkd;
+  // Whether the range kd tree uses LastAxisCascadeCounts.
+  bool rkd_cascade;
+  bool lkd;
   bool skd;
   bool random_, variance;
   bool q, u, swr, presort, grid;
+  bool multiscale;
+  unsigned multiscale_depth;
+  unsigned multiscale_kd_length;
   unsigned n_computation;
+  unsigned num_threads;
   RandomType rtype;
   void PrintArguments() const;
 } arg;
 
 template <typename T> void SampleEntropyN0N1();
+template <typename T>
+void SampleEntropyMultiR(const vector<T> &data, double std_dev);
+template <typename T> void SampleEntropyMultiM(const vector<T> &data, T r);
+template <typename T>
+void SampleEntropyMultiscale(const vector<T> &data, T r);
+template <typename T> void SampleEntropyBatch();
 
 int main(int argc, char *argv[]) {
 #ifdef DEBUG
@@ -119,10 +191,18 @@ int main(int argc, char *argv[]) {
 #endif
   ParseArgument(argc, argv);
 
-  if (arg.input_type == "double") {
-    SampleEntropyN0N1<double>();
-  } else if (arg.input_type == "int") {
-    SampleEntropyN0N1<int>();
+  if (arg.input_type == "double" || arg.input_type == "float32" ||
+      arg.input_type == "float64") {
+    if (arg.batch.size())
+      SampleEntropyBatch<double>();
+    else
+      SampleEntropyN0N1<double>();
+  } else if (arg.input_type == "int" || arg.input_type == "int16" ||
+             arg.input_type == "int32") {
+    if (arg.batch.size())
+      SampleEntropyBatch<int>();
+    else
+      SampleEntropyN0N1<int>();
   } else {
     cerr << "Invalid argument: -type " << arg.input_type << ".\n";
     cerr << "File: " << __FILE__ << ", Line: " << __LINE__ << std::endl;
@@ -137,14 +217,21 @@ void Argument::PrintArguments() const {
   std::cout << "\tinput type: " << arg.input_type << std::endl;
   std::cout << "\tline offset: " << arg.line_offset << std::endl;
   std::cout << "\tdata length: " << arg.data_length << std::endl;
-  std::cout << "\tm (template length): " << arg.template_length << std::endl;
-  std::cout << "\tr (threshold): " << arg.r << std::endl;
+  std::cout << "\tm (template length): " << arg.template_length;
+  if (arg.max_template_length > arg.template_length)
+    std::cout << " to " << arg.max_template_length;
+  std::cout << std::endl;
+  std::cout << "\tr (threshold): ";
+  for (unsigned i = 0; i < arg.r_values.size(); ++i)
+    std::cout << (i ? ", " : "") << arg.r_values[i];
+  std::cout << std::endl;
   std::cout << "\tsample num (N1): " << arg.sample_num << std::endl;
   std::cout << "\tsample size (N0): " << arg.sample_size << std::endl;
   std::cout << "\tuse kd tree based sampling: " << arg.kdtree_sample << std::endl;
   std::cout << "\tuse simple kd tree: " << arg.simple_kdtree << std::endl;
   std::cout << "\trandom: " << arg.random_ << std::endl;
   std::cout << "\tquasi type: " << random_type_names[arg.rtype] << std::endl;
+  std::cout << "\tthreads: " << arg.num_threads << std::endl;
   std::cout << "\toutput level: ";
   switch (arg.output_level) {
   case OutputLevel::Info: std::cout << "Info" << std::endl; break;
@@ -164,7 +251,8 @@ void ParseArgument(int argc, char *argv[]) {
   sprintf(_usage, usage, argv[0]);
   long result_long;
   arg.filename = parser.getArg("--input");
-  if (arg.filename.size() == 0) {
+  arg.batch = parser.getArg("--batch");
+  if (arg.filename.size() == 0 && arg.batch.size() == 0) {
     cerr << "Specify a filename with --input <INPUT>." << endl;
     cerr << _usage;
     exit(-1);
@@ -173,22 +261,35 @@ void ParseArgument(int argc, char *argv[]) {
   arg.input_format = parser.getArg("--input-format");
   if (arg.input_format.size() == 0)
     arg.input_format = "simple";
-  if (arg.input_format != "simple" && arg.input_format != "multirecord") {
+  if (arg.input_format != "simple" && arg.input_format != "multirecord" &&
+      arg.input_format != "binary") {
     cerr << "Invalid argument: --input-format " << arg.input_format;
-    cerr << ", should be either simple or multirecord. \n";
+    cerr << ", should be simple, multirecord or binary. \n";
     exit(-1);
   }
 
   arg.input_type = parser.getArg("--input-type");
   if (arg.input_type.size() == 0)
-    arg.input_type = "double";
+    arg.input_type = arg.input_format == "binary" ? "float64" : "double";
+  if (arg.input_format == "binary" && !IsBinaryValueType(arg.input_type)) {
+    cerr << "Invalid argument: --input-type " << arg.input_type;
+    cerr << ", should be int16, int32, float32 or float64 for binary input. \n";
+    exit(-1);
+  }
 
-  arg.r = parser.getArgDouble("-r", -1.);
-  if (arg.r < 0) {
+  arg.r_values = parser.getArgDoubleArray("-r");
+  for (double r : arg.r_values) {
+    if (r < 0) {
+      arg.r_values.clear();
+      break;
+    }
+  }
+  if (arg.r_values.empty()) {
     cerr << "Specify a positive threshold with -r <R>. " << endl;
     cerr << _usage;
     exit(-1);
   }
+  arg.r = arg.r_values[0];
 
   string template_length = parser.getArg("-m");
   if (template_length.size() == 0) {
@@ -203,10 +304,26 @@ void ParseArgument(int argc, char *argv[]) {
     }
   }
 
+  result_long = parser.getArgLong("--max-m", arg.template_length);
+  if (result_long < arg.template_length || result_long > 10) {
+    cerr << "Specify the largest template length with --max-m <M1> ";
+    cerr << "(M <= M1 <= 10). \n";
+    exit(-1);
+  }
+  arg.max_template_length = static_cast<unsigned>(result_long);
+
   arg.data_length = static_cast<unsigned>(parser.getArgLong("-n", 0));
   arg.line_offset =
       static_cast<unsigned>(parser.getArgLong("--line-offset", 0));
 
+  result_long = parser.getArgLong("--threads", 1);
+  if (result_long <= 0) {
+    cerr << "Specify a positive number of threads with --threads <N>. \n";
+    cerr << _usage;
+    exit(-1);
+  }
+  arg.num_threads = static_cast<unsigned>(result_long);
+
   string output_level = parser.getArg("--output-level");
   if (output_level.size() == 0)
     arg.output_level = Info;
@@ -227,12 +344,84 @@ void ParseArgument(int argc, char *argv[]) {
   arg.fast_direct = parser.isOption("--fast-direct") || parser.isOption("-fd");
   arg.simple_kdtree = parser.isOption("--simple-kdtree");
   arg.rkd = parser.isOption("-rkd") || parser.isOption("--range-kdtree");
+  arg.rkd_cascade = parser.isOption("--rkd-cascade");
+  arg.lkd = parser.isOption("-lkd") || parser.isOption("--liu-kdtree");
   arg.skd = parser.isOption("-skd") || parser.isOption("--sliding-kdtree");
   arg.q = parser.isOption("-q");
   arg.u = parser.isOption("-u") || parser.isOption("--uniform");
   arg.swr = parser.isOption("--swr");
   arg.grid = parser.isOption("--grid");
   arg.kdtree_sample = parser.isOption("--kdtree-sample");
+  if (arg.batch.size()) {
+    arg.batch_output = parser.getArg("--batch-output");
+    arg.batch_format = parser.getArg("--batch-format");
+    if (arg.batch_format.size() == 0)
+      arg.batch_format = "csv";
+    if (arg.batch_format != "csv" && arg.batch_format != "jsonl") {
+      cerr << "Invalid argument: --batch-format " << arg.batch_format;
+      cerr << ", should be csv or jsonl. \n";
+      exit(-1);
+    }
+    if (arg.skd || arg.simple_kdtree || arg.q || arg.u || arg.swr ||
+        arg.grid || arg.kdtree_sample || parser.isOption("--multiscale") ||
+        arg.max_template_length > arg.template_length) {
+      cerr << "Only the direct, fast direct, range kd tree and kd tree (Liu) "
+              "methods with one template length accept --batch. \n";
+      exit(-1);
+    }
+    if ((arg.rkd || arg.lkd) && arg.template_length < 2) {
+      cerr << "The kd tree methods need -m <M> with M >= 2. \n";
+      exit(-1);
+    }
+    if (!arg.direct && !arg.rkd && !arg.lkd)
+      arg.fast_direct = true;
+  }
+  arg.multiscale = parser.isOption("--multiscale");
+  if (arg.multiscale) {
+    result_long = parser.getArgLong("--multiscale-depth", 20);
+    if (result_long <= 0) {
+      cerr << "Specify a positive number of scales with ";
+      cerr << "--multiscale-depth <D>. \n";
+      exit(-1);
+    }
+    arg.multiscale_depth = static_cast<unsigned>(result_long);
+    result_long =
+        parser.getArgLong("--multiscale-kd-length", kMultiscaleKDMinLength);
+    if (result_long <= 0) {
+      cerr << "Specify a positive length with --multiscale-kd-length <L>. \n";
+      exit(-1);
+    }
+    arg.multiscale_kd_length = static_cast<unsigned>(result_long);
+    if (arg.r_values.size() > 1 ||
+        arg.max_template_length > arg.template_length) {
+      cerr << "Several thresholds with -r or --max-m can not be combined ";
+      cerr << "with --multiscale. \n";
+      exit(-1);
+    }
+  }
+  if (arg.r_values.size() > 1 &&
+      (arg.skd || arg.simple_kdtree || arg.q || arg.u || arg.swr ||
+       arg.grid || arg.kdtree_sample)) {
+    cerr << "Only the direct, fast direct, range kd tree and kd tree (Liu) "
+            "methods accept several thresholds with -r. \n";
+    exit(-1);
+  }
+  if (arg.max_template_length > arg.template_length) {
+    if (arg.skd || arg.simple_kdtree || arg.q || arg.u || arg.swr ||
+        arg.grid || arg.kdtree_sample) {
+      cerr << "Only the direct, fast direct, range kd tree and kd tree (Liu) "
+              "methods accept --max-m. \n";
+      exit(-1);
+    }
+    if (arg.r_values.size() > 1) {
+      cerr << "Several thresholds with -r can not be combined with --max-m. \n";
+      exit(-1);
+    }
+    if ((arg.rkd || arg.lkd) && arg.template_length < 2) {
+      cerr << "The kd tree methods need -m <M> with M >= 2. \n";
+      exit(-1);
+    }
+  }
   if (arg.q || arg.u || arg.swr || arg.grid || arg.kdtree_sample) {
     arg.random_ = parser.isOption("--random");
     arg.variance = parser.isOption("--variance");
@@ -280,11 +469,26 @@ void ParseArgument(int argc, char *argv[]) {
 template <typename T> void SampleEntropyN0N1() {
   const unsigned K = arg.template_length;
   vector<T> data;
-  ReadData<T>(data, arg.filename, arg.input_format, arg.data_length,
-              arg.line_offset);
+  SysTimer read_timer;
+  size_t bytes_read;
+  if (arg.input_format == "binary") {
+    bytes_read = ReadBinaryData<T>(data, arg.filename, arg.input_type,
+                                   arg.data_length, arg.line_offset);
+  } else {
+    bytes_read = ReadData<T>(data, arg.filename, arg.input_format,
+                             arg.data_length, arg.line_offset,
+                             arg.num_threads);
+  }
+  read_timer.StopTimer();
+  if (arg.output_level >= Info) {
+    const double seconds = read_timer.ElapsedSeconds();
+    MSG_INFO("Read %zu bytes in %.3f seconds (%.1f MB/s).\n", bytes_read,
+             seconds, seconds > 0 ? bytes_read / seconds / 1e6 : 0.);
+  }
   unsigned n = data.size();
-  if (n <= K) {
-    MSG_ERROR(-1, "Data length n %d is to short (K = %d).\n", n, K);
+  if (n <= arg.max_template_length) {
+    MSG_ERROR(-1, "Data length n %d is to short (K = %d).\n", n,
+              arg.max_template_length);
   }
 
   double var = ComputeVariance(data);
@@ -301,7 +505,19 @@ template <typename T> void SampleEntropyN0N1() {
   cout << "========================================\n";
   arg.PrintArguments();
   std::cout << "\tstd: " << sqrt(var) << std::endl;
+  if (arg.r_values.size() > 1) {
+    SampleEntropyMultiR(data, sqrt(var));
+    return;
+  }
   std::cout << "\tr (scaled): " << r_scaled << std::endl;
+  if (arg.max_template_length > K) {
+    SampleEntropyMultiM(data, r_scaled);
+    return;
+  }
+  if (arg.multiscale) {
+    SampleEntropyMultiscale(data, r_scaled);
+    return;
+  }
 
   double precise_entropy = 0;
   double precise_a_norm = 0;
@@ -319,6 +535,7 @@ template <typename T> void SampleEntropyN0N1() {
   if (arg.fast_direct) {
     SampleEntropyCalculatorFastDirect<T> secfd(data, r_scaled, K,
                                                arg.output_level);
+    secfd.set_num_threads(arg.num_threads);
     secfd.ComputeSampleEntropy();
     cout << secfd.get_result_str();
     precise_entropy = secfd.get_entropy();
@@ -337,6 +554,17 @@ template <typename T> void SampleEntropyN0N1() {
   
   if (arg.rkd) {
     SampleEntropyCalculatorRKD<T> secd(data, r_scaled, K, arg.output_level);
+    secd.set_num_threads(arg.num_threads);
+    secd.set_cascade_counts(arg.rkd_cascade);
+    secd.ComputeSampleEntropy();
+    cout << secd.get_result_str();
+    precise_entropy = secd.get_entropy();
+    precise_a_norm = secd.get_a_norm();
+    precise_b_norm = secd.get_b_norm();
+  }
+  if (arg.lkd) {
+    SampleEntropyCalculatorLiu<T> secd(data, r_scaled, K, arg.output_level);
+    secd.set_num_threads(arg.num_threads);
     secd.ComputeSampleEntropy();
     cout << secd.get_result_str();
     precise_entropy = secd.get_entropy();
@@ -361,7 +589,7 @@ template <typename T> void SampleEntropyN0N1() {
         data, r_scaled, K, arg.sample_size, arg.sample_num,
         precise_entropy, precise_a_norm, precise_b_norm, UNIFORM,
         arg.random_, false, arg.output_level);
-    SampleEntropySamplingExperiment(secds, n_computation);
+    SampleEntropySamplingExperiment(secds, n_computation, arg.num_threads);
   }
   if (arg.kdtree_sample) {
     SampleEntropyCalculatorSampling<T> *calculator = nullptr;
@@ -369,7 +597,8 @@ template <typename T> void SampleEntropyN0N1() {
         data, r_scaled, K, arg.sample_size, arg.sample_num,
         precise_entropy, precise_a_norm, precise_b_norm, SWR_UNIFORM,
         arg.random_, arg.output_level);
-    SampleEntropySamplingExperiment(*calculator, n_computation);
+    SampleEntropySamplingExperiment(*calculator, n_computation,
+                                    arg.num_threads);
     delete calculator;
   }
   if (arg.swr) {
@@ -385,7 +614,7 @@ template <typename T> void SampleEntropyN0N1() {
         data, r_scaled, K, arg.sample_size, arg.sample_num,
         precise_entropy, precise_a_norm, precise_b_norm, SWR_UNIFORM,
         arg.random_, false, arg.output_level);
-    SampleEntropySamplingExperiment(secds, n_computation);
+    SampleEntropySamplingExperiment(secds, n_computation, arg.num_threads);
   }
   if (arg.q) {
     SampleEntropyCalculatorSamplingDirect<T> secds(
@@ -393,13 +622,13 @@ template <typename T> void SampleEntropyN0N1() {
         precise_entropy, precise_a_norm, precise_b_norm, arg.rtype,
         arg.random_, false, arg.output_level);
 
-    SampleEntropySamplingExperiment(secds, n_computation);
+    SampleEntropySamplingExperiment(secds, n_computation, arg.num_threads);
     if (arg.presort) {
       SampleEntropyCalculatorSamplingDirect<T> secds(
           data, r_scaled, K, arg.sample_size, arg.sample_num,
           precise_entropy, precise_a_norm, precise_b_norm, arg.rtype,
           arg.random_, true, arg.output_level);
-      SampleEntropySamplingExperiment(secds, n_computation);
+      SampleEntropySamplingExperiment(secds, n_computation, arg.num_threads);
     }
   }
 
@@ -408,13 +637,13 @@ template <typename T> void SampleEntropyN0N1() {
         data, r_scaled, K, arg.sample_size, arg.sample_num,
         precise_entropy, precise_a_norm, precise_b_norm, GRID,
         arg.random_, false, arg.output_level);
-    SampleEntropySamplingExperiment(secds, n_computation);
+    SampleEntropySamplingExperiment(secds, n_computation, arg.num_threads);
     if (arg.presort) {
       SampleEntropyCalculatorSamplingDirect<T> secds(
           data, r_scaled, K, arg.sample_size, arg.sample_num,
           precise_entropy, precise_a_norm, precise_b_norm, GRID,
           arg.random_, true, arg.output_level);
-      SampleEntropySamplingExperiment(secds, n_computation);
+      SampleEntropySamplingExperiment(secds, n_computation, arg.num_threads);
     }
   }
   if (arg.output_level > sampen::Silent) {
@@ -423,3 +652,330 @@ template <typename T> void SampleEntropyN0N1() {
   cout << "========================================";
   cout << "========================================\n";
 }
+
+// Print the results of several thresholds computed by one method.
+template <typename T>
+void PrintMultiRResult(const string &method, unsigned n, unsigned K,
+                       const vector<T> &r_scaled,
+                       const vector<long long> &ab, double seconds) {
+  const double norm = static_cast<double>(n - K - 1) * (n - K);
+  cout << "----------------------------------------"
+       << "----------------------------------------\n"
+       << method << " (" << r_scaled.size() << " thresholds): \n";
+  for (unsigned k = 0; k < r_scaled.size(); ++k) {
+    const long long a = ab[2 * k], b = ab[2 * k + 1];
+    cout << "\tr: " << arg.r_values[k] << ", r (scaled): " << r_scaled[k]
+         << ", sampen: "
+         << ComputeSampen(static_cast<double>(a), static_cast<double>(b),
+                          n - K, K)
+         << ", a (norm): " << a / norm << ", b (norm): " << b / norm;
+    if (arg.output_level >= Info)
+      cout << ", a: " << a << ", b: " << b;
+    cout << "\n";
+  }
+  cout << "\ttime: " << seconds << "\n";
+}
+
+template <typename T>
+void SampleEntropyMultiR(const vector<T> &data, double std_dev) {
+  const unsigned K = arg.template_length;
+  const unsigned n = data.size();
+  vector<T> r_scaled;
+  for (double r : arg.r_values)
+    r_scaled.push_back(static_cast<T>(std_dev * r));
+
+  if (arg.direct || arg.fast_direct) {
+    Timer timer;
+    const vector<long long> ab = ComputeABFastDirectMultiR<T>(
+        data.data(), n, r_scaled, K, arg.num_threads);
+    timer.StopTimer();
+    PrintMultiRResult("fast direct", n, K, r_scaled, ab,
+                      timer.ElapsedSeconds());
+  }
+  if (arg.rkd) {
+    Timer timer;
+    ABCalculatorRKD<T> abc(K, arg.output_level, arg.num_threads,
+                           arg.rkd_cascade);
+    const vector<long long> ab =
+        abc.ComputeAB(data.cbegin(), data.cend(), r_scaled);
+    timer.StopTimer();
+    PrintMultiRResult("range kd tree", n, K, r_scaled, ab,
+                      timer.ElapsedSeconds());
+  }
+  if (arg.lkd) {
+    Timer timer;
+    ABCalculatorLiu<T> abc(K, arg.output_level, arg.num_threads);
+    const vector<long long> ab =
+        abc.ComputeAB(data.cbegin(), data.cend(), r_scaled);
+    timer.StopTimer();
+    PrintMultiRResult("kd tree (Liu)", n, K, r_scaled, ab,
+                      timer.ElapsedSeconds());
+  }
+
+  if (arg.output_level > sampen::Silent) {
+    ReportVmPeak();
+  }
+  cout << "========================================";
+  cout << "========================================\n";
+}
+
+// Print the results of several template lengths computed by one method.
+void PrintMultiMResult(const string &method, unsigned n,
+                       const vector<long long> &ab, double seconds) {
+  cout << "----------------------------------------"
+       << "----------------------------------------\n"
+       << method << " (m = " << arg.template_length << " to "
+       << arg.max_template_length << "): \n";
+  for (unsigned K = arg.template_length; K <= arg.max_template_length; ++K) {
+    const unsigned k = K - arg.template_length;
+    const long long a = ab[2 * k], b = ab[2 * k + 1];
+    const double norm = static_cast<double>(n - K - 1) * (n - K);
+    cout << "\tm: " << K << ", sampen: "
+         << ComputeSampen(static_cast<double>(a), static_cast<double>(b),
+                          n - K, K)
+         << ", a (norm): " << a / norm << ", b (norm): " << b / norm;
+    if (arg.output_level >= Info)
+      cout << ", a: " << a << ", b: " << b;
+    cout << "\n";
+  }
+  cout << "\ttime: " << seconds << "\n";
+}
+
+template <typename T> void SampleEntropyMultiM(const vector<T> &data, T r) {
+  const unsigned min_m = arg.template_length, max_m = arg.max_template_length;
+  const unsigned n = data.size();
+
+  if (arg.direct || arg.fast_direct) {
+    Timer timer;
+    const vector<long long> ab = ComputeABDirectMultiM<T>(
+        data.data(), n, r, min_m, max_m, arg.num_threads);
+    timer.StopTimer();
+    PrintMultiMResult("fast direct", n, ab, timer.ElapsedSeconds());
+  }
+  if (arg.rkd) {
+    Timer timer;
+    ABCalculatorRKD<T> abc(min_m, arg.output_level, arg.num_threads,
+                           arg.rkd_cascade);
+    const vector<long long> ab =
+        abc.ComputeABMultiM(data.cbegin(), data.cend(), r, max_m);
+    timer.StopTimer();
+    PrintMultiMResult("range kd tree", n, ab, timer.ElapsedSeconds());
+  }
+  if (arg.lkd) {
+    Timer timer;
+    ABCalculatorLiu<T> abc(min_m, arg.output_level, arg.num_threads);
+    const vector<long long> ab =
+        abc.ComputeABMultiM(data.cbegin(), data.cend(), r, max_m);
+    timer.StopTimer();
+    PrintMultiMResult("kd tree (Liu)", n, ab, timer.ElapsedSeconds());
+  }
+
+  if (arg.output_level > sampen::Silent) {
+    ReportVmPeak();
+  }
+  cout << "========================================";
+  cout << "========================================\n";
+}
+
+template <typename T>
+void SampleEntropyMultiscale(const vector<T> &data, T r) {
+  const unsigned K = arg.template_length;
+  Timer timer;
+  const vector<MultiscaleSampleEntropyResult> results =
+      ComputeMultiscaleSampleEntropy(data, r, K, arg.multiscale_depth,
+                                     arg.num_threads,
+                                     arg.multiscale_kd_length);
+  timer.StopTimer();
+  cout << "----------------------------------------"
+       << "----------------------------------------\n"
+       << "multiscale sample entropy (" << results.size() << " scales): \n";
+  for (const MultiscaleSampleEntropyResult &result : results) {
+    const double norm = static_cast<double>(result.n - K - 1) * (result.n - K);
+    cout << "\tscale: " << result.scale << ", n: " << result.n
+         << ", sampen: " << result.entropy
+         << ", a (norm): " << result.a / norm
+         << ", b (norm): " << result.b / norm;
+    if (arg.output_level >= Info) {
+      cout << ", a: " << result.a << ", b: " << result.b << ", method: "
+           << (result.kd ? "range kd tree" : "fast direct");
+    }
+    cout << "\n";
+  }
+  cout << "\ttime: " << timer.ElapsedSeconds() << "\n";
+
+  if (arg.output_level > sampen::Silent) {
+    ReportVmPeak();
+  }
+  cout << "========================================";
+  cout << "========================================\n";
+}
+
+// Quotes a field of a CSV row if needed.
+string CsvField(const string &s) {
+  if (s.find_first_of(",\"\n") == string::npos)
+    return s;
+  string quoted = "\"";
+  for (char c : s) {
+    if (c == '"')
+      quoted += '"';
+    quoted += c;
+  }
+  return quoted + "\"";
+}
+
+string JsonString(const string &s) {
+  string quoted = "\"";
+  for (char c : s) {
+    if (c == '"' || c == '\\') {
+      quoted += '\\';
+      quoted += c;
+    } else if (static_cast<unsigned char>(c) < 0x20) {
+      char buffer[8];
+      snprintf(buffer, sizeof(buffer), "\\u%04x", c);
+      quoted += buffer;
+    } else {
+      quoted += c;
+    }
+  }
+  return quoted + "\"";
+}
+
+// Writes one row of --batch. The numbers that are not finite (e.g., the
+// entropy of a record that is too short) are left empty (csv) or null
+// (jsonl).
+void WriteBatchRow(std::ostream &os, const string &filename, unsigned n,
+                   double r, double r_scaled, const string &method,
+                   long long a, long long b, double seconds) {
+  const unsigned K = arg.template_length;
+  const double entropy =
+      n > K + 1 ? ComputeSampen(static_cast<double>(a),
+                                static_cast<double>(b), n - K, K)
+                : NAN;
+  const bool csv = arg.batch_format == "csv";
+  const auto number = [&os, csv](double x) -> std::ostream & {
+    if (std::isfinite(x))
+      return os << x;
+    return os << (csv ? "" : "null");
+  };
+  if (csv) {
+    os << CsvField(filename) << "," << n << "," << K << "," << r << ",";
+    number(r_scaled) << "," << method << "," << a << "," << b << ",";
+    number(entropy) << "," << seconds << "\n";
+  } else {
+    os << "{\"file\": " << JsonString(filename) << ", \"n\": " << n
+       << ", \"m\": " << K << ", \"r\": " << r << ", \"r_scaled\": ";
+    number(r_scaled) << ", \"method\": \"" << method << "\", \"a\": " << a
+                     << ", \"b\": " << b << ", \"sampen\": ";
+    number(entropy) << ", \"time\": " << seconds << "}\n";
+  }
+}
+
+template <typename T> void SampleEntropyBatch() {
+  const vector<string> files = GetBatchInputFiles(arg.batch);
+  std::ofstream ofs;
+  if (arg.batch_output.size()) {
+    ofs.open(arg.batch_output);
+    if (!ofs.is_open()) {
+      MSG_ERROR(-1, "Cannot open file %s.\n", arg.batch_output.c_str());
+    }
+  }
+  std::ostream &os = arg.batch_output.size() ? ofs : cout;
+  if (arg.batch_format == "csv")
+    os << "file,n,m,r,r_scaled,method,a,b,sampen,time\n" << std::flush;
+
+  const unsigned K = arg.template_length;
+  SysTimer batch_timer;
+  std::atomic<size_t> bytes_read(0);
+  // Every worker keeps its data buffer and its calculators (with their
+  // presorting and grid buffers) over all of its files.
+  struct Worker {
+    Worker(unsigned K, size_t num_r)
+        : r_scaled(num_r), rkd(K, Silent, 1, arg.rkd_cascade),
+          liu(K, Silent) {}
+    vector<T> data;
+    vector<T> r_scaled;
+    ABCalculatorRKD<T> rkd;
+    ABCalculatorLiu<T> liu;
+  };
+  vector<Worker> workers(arg.num_threads, Worker(K, arg.r_values.size()));
+  // The rows of each file are written (and flushed, so that they survive an
+  // interrupted run) in the order of the files, as soon as the files before
+  // it are done.
+  ParallelForOrdered<string>(
+      files.size(), arg.num_threads,
+      [&](unsigned w, unsigned i) {
+        vector<T> &data = workers[w].data;
+        vector<T> &r_scaled = workers[w].r_scaled;
+        std::ostringstream ss;
+        ss.precision(10);
+        size_t num_bytes = 0;
+        const bool ok =
+            arg.input_format == "binary"
+                ? TryReadBinaryData<T>(data, num_bytes, files[i],
+                                       arg.input_type, arg.data_length,
+                                       arg.line_offset)
+                : TryReadData<T>(data, num_bytes, files[i], arg.input_format,
+                                 arg.data_length, arg.line_offset);
+        bytes_read += num_bytes;
+        if (!ok) {
+          // A file that can not be read gets one "read error" row per
+          // threshold, and the batch goes on with the other files.
+          for (unsigned k = 0; k < r_scaled.size(); ++k) {
+            WriteBatchRow(ss, files[i], 0, arg.r_values[k], NAN, "read error",
+                          0, 0, 0.);
+          }
+          return ss.str();
+        }
+        const unsigned n = data.size();
+        const double std_dev = n > 1 ? sqrt(ComputeVariance(data)) : 0.;
+        for (unsigned k = 0; k < r_scaled.size(); ++k)
+          r_scaled[k] = static_cast<T>(std_dev * arg.r_values[k]);
+
+        const auto write_rows = [&](const string &method,
+                                    const vector<long long> &ab,
+                                    double seconds) {
+          for (unsigned k = 0; k < r_scaled.size(); ++k) {
+            WriteBatchRow(ss, files[i], n, arg.r_values[k], r_scaled[k], method,
+                          ab.size() ? ab[2 * k] : 0,
+                          ab.size() ? ab[2 * k + 1] : 0, seconds);
+          }
+        };
+        const auto compute = [&](const string &method) {
+          const auto start = std::chrono::steady_clock::now();
+          vector<long long> ab;
+          if (n <= K + 1) {
+            // Too short, every row gets an empty entropy.
+          } else if (method == "fast direct") {
+            ab = ComputeABFastDirectMultiR<T>(data.data(), n, r_scaled, K);
+          } else if (method == "range kd tree") {
+            ABCalculatorRKD<T> &abc = workers[w].rkd;
+            ab = r_scaled.size() == 1
+                     ? abc.ComputeAB(data.cbegin(), data.cend(), r_scaled[0])
+                     : abc.ComputeAB(data.cbegin(), data.cend(), r_scaled);
+          } else {
+            ABCalculatorLiu<T> &abc = workers[w].liu;
+            ab = r_scaled.size() == 1
+                     ? abc.ComputeAB(data.cbegin(), data.cend(), r_scaled[0])
+                     : abc.ComputeAB(data.cbegin(), data.cend(), r_scaled);
+          }
+          write_rows(method, ab,
+                     std::chrono::duration<double>(
+                         std::chrono::steady_clock::now() - start)
+                         .count());
+        };
+        // The direct method gives the same counts as the fast direct one.
+        if (arg.direct || arg.fast_direct)
+          compute("fast direct");
+        if (arg.rkd)
+          compute("range kd tree");
+        if (arg.lkd)
+          compute("kd tree (Liu)");
+        return ss.str();
+      },
+      [&os](unsigned, const string &rows) { os << rows << std::flush; });
+  batch_timer.StopTimer();
+  if (arg.batch_output.size() && arg.output_level >= Info) {
+    MSG_INFO("Processed %zu files (%zu bytes) in %.3f seconds.\n",
+             files.size(), bytes_read.load(), batch_timer.ElapsedSeconds());
+  }
+}
@@ -0,0 +1,267 @@
+#include "implicit_kdtree.h"
+
+#include <algorithm>
+#include <limits>
+#include <numeric>
+#include <time.h>
+
+namespace sampen {
+
+template <typename T>
+ImplicitKDTreeBase<T>::ImplicitKDTreeBase(unsigned K, unsigned num_coords,
+                                          const TemplateView<T> &points,
+                                          OutputLevel output_level)
+    : K(K), _num_coords(num_coords), _n(points.size()), _num_leaves(1),
+      _slot_weights(_n, 0), _output_level(output_level) {
+  assert(K <= num_coords && (_n == 0 || num_coords <= points.dim()));
+  clock_t t = clock();
+
+  unsigned depth = 0;
+  while (_num_leaves * kLeafSize < _n) {
+    _num_leaves <<= 1;
+    ++depth;
+  }
+  const unsigned n_nodes = 2 * _num_leaves - 1;
+  _node_weights.assign(n_nodes, 0);
+  // In a depth first traversal at most one sibling per level is pending.
+  _stack.resize(depth + 2);
+
+  std::shared_ptr<ImplicitKDTreeGeometry<T> > geometry =
+      std::make_shared<ImplicitKDTreeGeometry<T> >();
+  _geometry = geometry;
+  vector<unsigned> &index2slot = geometry->index2slot;
+  vector<T> &coords = geometry->coords;
+  vector<T> &lower_bounds = geometry->lower;
+  vector<T> &upper_bounds = geometry->upper;
+  index2slot.resize(_n);
+  coords.resize(static_cast<size_t>(num_coords) * _n);
+  lower_bounds.assign(K * n_nodes, std::numeric_limits<T>::max());
+  upper_bounds.assign(K * n_nodes, std::numeric_limits<T>::lowest());
+  _index2slot = index2slot.data();
+  _coords = coords.data();
+  _lower = lower_bounds.data();
+  _upper = upper_bounds.data();
+
+  vector<unsigned> order(_n);
+  std::iota(order.begin(), order.end(), 0);
+  _Partition(order, points, 0, _n, 0, _num_leaves * kLeafSize);
+  for (unsigned slot = 0; slot < _n; ++slot) {
+    index2slot[order[slot]] = slot;
+    const KDPointRef<T> point = points[order[slot]];
+    for (unsigned axis = 0; axis < num_coords; ++axis)
+      coords[axis * _n + slot] = point[axis];
+  }
+
+  // Bounding boxes of the leaves, and then of the other nodes bottom up.
+  for (unsigned node = _num_leaves - 1; node < n_nodes; ++node) {
+    unsigned first, last;
+    _GetSlots(node, first, last);
+    for (unsigned axis = 0; axis < K; ++axis) {
+      T &lower = lower_bounds[axis * n_nodes + node];
+      T &upper = upper_bounds[axis * n_nodes + node];
+      for (unsigned slot = first; slot < last; ++slot) {
+        const T x = _Coord(axis, slot);
+        if (x < lower)
+          lower = x;
+        if (x > upper)
+          upper = x;
+      }
+    }
+  }
+  for (unsigned node = _num_leaves - 1; node-- > 0;) {
+    for (unsigned axis = 0; axis < K; ++axis) {
+      const unsigned i = axis * n_nodes;
+      lower_bounds[i + node] = std::min(lower_bounds[i + 2 * node + 1],
+                                        lower_bounds[i + 2 * node + 2]);
+      upper_bounds[i + node] = std::max(upper_bounds[i + 2 * node + 1],
+                                        upper_bounds[i + 2 * node + 2]);
+    }
+  }
+
+  t = clock() - t;
+  if (_output_level == Debug) {
+    std::cout << "[DEBUG] The time consumed to build an implicit kd tree (K = "
+              << K << "): ";
+    std::cout << static_cast<double>(t) / CLOCKS_PER_SEC << " seconds. \n";
+  }
+}
+
+// Split the slots [first, last) at the middle of the capacity of the node,
+// along the axis level % K.
+template <typename T>
+void ImplicitKDTreeBase<T>::_Partition(vector<unsigned> &order,
+                                       const TemplateView<T> &points,
+                                       unsigned first, unsigned last,
+                                       unsigned level, unsigned capacity) {
+  if (K == 0 || last - first <= 1 || capacity <= kLeafSize)
+    return;
+  const unsigned half = capacity / 2;
+  const unsigned mid = first + half;
+  if (mid >= last) {
+    // The right child is empty.
+    _Partition(order, points, first, last, level + 1, half);
+    return;
+  }
+  const unsigned axis = level % K;
+  std::nth_element(order.begin() + first, order.begin() + mid,
+                   order.begin() + last,
+                   [&points, axis](unsigned i1, unsigned i2) {
+                     return points[i1][axis] < points[i2][axis];
+                   });
+  _Partition(order, points, first, mid, level + 1, half);
+  _Partition(order, points, mid, last, level + 1, half);
+}
+
+
+template <typename T>
+long long ImplicitKDCountingTree<T>::CountRange(const Range<T> &range,
+                                                long long &num_nodes) {
+  if (this->_n == 0 || this->_node_weights[0] == 0)
+    return 0;
+  const unsigned K = this->K;
+  const T *lower_ranges = range.lower_ranges.data();
+  const T *upper_ranges = range.upper_ranges.data();
+  unsigned *stack = this->_stack.data();
+
+  long long result = 0;
+  unsigned top = 0;
+  stack[top++] = 0;
+  while (top) {
+    const unsigned node = stack[--top];
+    ++num_nodes;
+    bool within = true;
+    bool disjoint = false;
+    for (unsigned i = 0; i < K; ++i) {
+      const T a = this->_Lower(i, node), b = this->_Upper(i, node);
+      if (a > upper_ranges[i] || b < lower_ranges[i]) {
+        disjoint = true;
+        break;
+      }
+      if (a < lower_ranges[i] || b > upper_ranges[i])
+        within = false;
+    }
+    if (disjoint)
+      continue;
+    if (within) {
+      result += this->_node_weights[node];
+    } else if (this->_IsLeaf(node)) {
+      unsigned first, last;
+      this->_GetSlots(node, first, last);
+      for (unsigned slot = first; slot < last; ++slot) {
+        const int w = this->_slot_weights[slot];
+        if (w == 0)
+          continue;
+        bool in = true;
+        for (unsigned i = 0; i < K && in; ++i) {
+          const T x = this->_Coord(i, slot);
+          in = lower_ranges[i] <= x && x <= upper_ranges[i];
+        }
+        if (in)
+          result += w;
+      }
+    } else {
+      // This criterion is critical!
+      if (this->_node_weights[2 * node + 2])
+        stack[top++] = 2 * node + 2;
+      if (this->_node_weights[2 * node + 1])
+        stack[top++] = 2 * node + 1;
+    }
+  }
+  return result;
+}
+
+
+template <typename T>
+vector<long long> ImplicitKDTree<T>::CountRange(const Range<T> &range,
+                                                long long &num_nodes) {
+  vector<long long> result({0, 0});
+  if (this->_n == 0 || this->_node_weights[0] == 0)
+    return result;
+  const unsigned K = this->K;
+  const T *lower_ranges = range.lower_ranges.data();
+  const T *upper_ranges = range.upper_ranges.data();
+  const T lower_last = lower_ranges[K], upper_last = upper_ranges[K];
+  const T *last_axis = this->_coords + K * this->_n;
+  const int *weights = this->_slot_weights.data();
+  unsigned *stack = this->_stack.data();
+  const unsigned n = this->_n, num_coords = this->_num_coords;
+  // Whether the last axes of the point in the slot are within range. The
+  // first one is checked apart, since it is the only one in 1D.
+  const auto within_last = [&](unsigned slot) {
+    if (last_axis[slot] < lower_last || upper_last < last_axis[slot])
+      return false;
+    for (unsigned i = K + 1, offset = n; i < num_coords; ++i, offset += n) {
+      const T x = last_axis[offset + slot];
+      if (x < lower_ranges[i] || upper_ranges[i] < x)
+        return false;
+    }
+    return true;
+  };
+
+  long long a = 0, b = 0;
+  unsigned top = 0;
+  stack[top++] = 0;
+  while (top) {
+    const unsigned node = stack[--top];
+    ++num_nodes;
+    bool within = true;
+    bool disjoint = false;
+    for (unsigned i = 0; i < K; ++i) {
+      const T lower = this->_Lower(i, node), upper = this->_Upper(i, node);
+      if (lower > upper_ranges[i] || upper < lower_ranges[i]) {
+        disjoint = true;
+        break;
+      }
+      if (lower < lower_ranges[i] || upper > upper_ranges[i])
+        within = false;
+    }
+    if (disjoint)
+      continue;
+    if (within) {
+      b += this->_node_weights[node];
+      // Check the last coordinates.
+      unsigned first, last;
+      this->_GetSlots(node, first, last);
+      for (unsigned slot = first; slot < last; ++slot) {
+        if (weights[slot] && within_last(slot))
+          a += weights[slot];
+      }
+    } else if (this->_IsLeaf(node)) {
+      unsigned first, last;
+      this->_GetSlots(node, first, last);
+      for (unsigned slot = first; slot < last; ++slot) {
+        const int w = weights[slot];
+        if (w == 0)
+          continue;
+        bool in = true;
+        for (unsigned i = 0; i < K && in; ++i) {
+          const T x = this->_Coord(i, slot);
+          in = lower_ranges[i] <= x && x <= upper_ranges[i];
+        }
+        if (in) {
+          b += w;
+          if (within_last(slot))
+            a += w;
+        }
+      }
+    } else {
+      if (this->_node_weights[2 * node + 2])
+        stack[top++] = 2 * node + 2;
+      if (this->_node_weights[2 * node + 1])
+        stack[top++] = 2 * node + 1;
+    }
+  }
+  result[0] = a;
+  result[1] = b;
+  return result;
+}
+
+#define INSTANTIATE_IMPLICIT_KDTREE(TYPE) \
+template class ImplicitKDTreeBase<TYPE>; \
+template class ImplicitKDCountingTree<TYPE>; \
+template class ImplicitKDTree<TYPE>;
+
+INSTANTIATE_IMPLICIT_KDTREE(double)
+INSTANTIATE_IMPLICIT_KDTREE(int)
+INSTANTIATE_IMPLICIT_KDTREE(unsigned)
+} // namespace sampen
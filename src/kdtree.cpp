@@ -4,6 +4,7 @@
 #include "kdtree.h"
 #include "utils.h"
 #include <cstddef>
+#include <numeric>
 namespace sampen {
 
 template<typename T>
@@ -18,74 +19,24 @@ void KDCountingTree<T>::Print() {
 
 
 template<typename T>
-Range<T> GetRange(typename vector<KDPoint<T>>::const_iterator first,
-                  typename vector<KDPoint<T>>::const_iterator last) {
+Range<T> GetRange(const TemplateView<T> &points,
+                  vector<unsigned>::const_iterator first,
+                  vector<unsigned>::const_iterator last,
+                  unsigned K) {
   const size_t n = last - first;
-  const unsigned K = first->dim();
-  Range<T> range(K);
-
-  T maximum[K];
-  T minimum[K];
-  for (unsigned i = 0; i < K; ++i) {
-    minimum[i] = (*first)[i];
-    maximum[i] = minimum[i];
-  }
-  for (size_t j = 0; j < (n - 1) / 2; ++j) {
-    const KDPoint<T> &point1 = *(first + 2 * j + 1);
-    const KDPoint<T> &point2 = *(first + 2 * (j + 1));
-    for (unsigned i = 0; i < K; ++i) {
-      T curr1 = point1[i];
-      T curr2 = point2[i];
-      if (curr1 < curr2) {
-        if (maximum[i] < curr2)
-          maximum[i] = curr2;
-        if (minimum[i] > curr1)
-          minimum[i] = curr1;
-      } else {
-        if (maximum[i] < curr1)
-          maximum[i] = curr1;
-        if (minimum[i] > curr2)
-          minimum[i] = curr2;
-      }
-    }
-  }
-
-  // last one
-  if (n % 2 == 0) {
-    const KDPoint<T> &point = *(first + n - 1);
-    for (unsigned i = 0; i < K; ++i) {
-      T curr = point[i];
-      if (maximum[i] < curr)
-        maximum[i] = curr;
-      if (minimum[i] > curr)
-        minimum[i] = curr;
-    }
-  }
-  for (unsigned i = 0; i < K; ++i) {
-    range.lower_ranges[i] = minimum[i];
-    range.upper_ranges[i] = maximum[i];
-  }
-  return range;
-}
-
-
-template<typename T>
-Range<T> GetRangeRKD(typename vector<KDPointRKD<T>>::const_iterator first,
-                     typename vector<KDPointRKD<T>>::const_iterator last) {
-  const size_t n = last - first;
-  const unsigned K = first->dim() - 1;
   assert(n > 0);
   Range<T> range(K);
 
   T maximum[K];
   T minimum[K];
+  const KDPointRef<T> point0 = points[*first];
   for (unsigned i = 0; i < K; ++i) {
-    minimum[i] = (*first)[i];
+    minimum[i] = point0[i];
     maximum[i] = minimum[i];
   }
   for (size_t j = 0; j < (n - 1) / 2; ++j) {
-    const KDPointRKD<T> &point1 = *(first + 2 * j + 1);
-    const KDPointRKD<T> &point2 = *(first + 2 * (j + 1));
+    const KDPointRef<T> point1 = points[*(first + 2 * j + 1)];
+    const KDPointRef<T> point2 = points[*(first + 2 * (j + 1))];
     for (unsigned i = 0; i < K; ++i) {
       T curr1 = point1[i];
       T curr2 = point2[i];
@@ -105,7 +56,7 @@ Range<T> GetRangeRKD(typename vector<KDPointRKD<T>>::const_iterator first,
 
   // last one
   if (n % 2 == 0) {
-    const KDPointRKD<T> &point = *(first + n - 1);
+    const KDPointRef<T> point = points[*(first + n - 1)];
     for (unsigned i = 0; i < K; ++i) {
       T curr = point[i];
       if (maximum[i] < curr)
@@ -170,26 +121,25 @@ void KDCountingTreeNode<T>::Print() {
 template<typename T>
 KDCountingTreeNode<T>::KDCountingTreeNode(
     unsigned K, unsigned depth, KDCountingTreeNode *father,
-    vector<KDCountingTreeNode *> &leaves,
-    typename vector<KDPoint<T>>::iterator first,
-    typename vector<KDPoint<T>>::iterator last)
+    vector<KDCountingTreeNode *> &leaves, const TemplateView<T> &points,
+    vector<unsigned>::iterator first, vector<unsigned>::iterator last)
     : K(K), _depth(depth), _count(last - first), _weighted_count(0),
         _father(father), _left_child(nullptr), _right_child(nullptr) {
-  _range = GetRange<T>(first, last);
+  _range = GetRange<T>(points, first, last, K);
   if (_count == 1) {
     leaves.push_back(this);
     return;
   }
 
+  const unsigned dim = depth % K;
   std::nth_element(first, first + _count / 2, last,
-                   [depth, K](const KDPoint<T> &p1, const KDPoint<T> &p2) {
-                     const unsigned dim = depth % K;
-                     return p1[dim] < p2[dim];
+                   [&points, dim](unsigned i1, unsigned i2) {
+                     return points[i1][dim] < points[i2][dim];
                    });
 
-  _left_child = new KDCountingTreeNode<T>(K, _depth + 1, this, leaves, first,
-                                          first + _count / 2);
-  _right_child = new KDCountingTreeNode<T>(K, _depth + 1, this, leaves,
+  _left_child = new KDCountingTreeNode<T>(K, _depth + 1, this, leaves, points,
+                                          first, first + _count / 2);
+  _right_child = new KDCountingTreeNode<T>(K, _depth + 1, this, leaves, points,
                                            first + _count / 2, last);
 }
 
@@ -274,12 +224,12 @@ long long KDCountingTreeNode<T>::CountRange(const Range<T> &range,
 template<typename T>
 KDCountingTree2KNode<T>::KDCountingTree2KNode(
     unsigned K, unsigned depth, KDCountingTree2KNode *father,
-    vector<KDCountingTree2KNode *> &leaves,
-    typename vector<KDPoint<T> >::iterator first,
-    typename vector<KDPoint<T> >::iterator last)
-    : K(K), _depth(depth), _count(last - first), _weighted_count(0),
+    vector<KDCountingTree2KNode *> &leaves, const TemplateView<T> &points,
+    vector<unsigned>::iterator first, vector<unsigned>::iterator last,
+    unsigned id, unsigned &next_id)
+    : K(K), _depth(depth), _count(last - first), _id(id), _first_child_id(0),
         _father(father) {
-  _range = GetRange<T>(first, last);
+  _range = GetRange<T>(points, first, last, K);
   if (_count == 1) {
     _num_child = 0;
     leaves.push_back(this);
@@ -300,19 +250,25 @@ KDCountingTree2KNode<T>::KDCountingTree2KNode(
       median = splitter1 + (splitter2 - splitter1) / 2;
       splitters[j * spacing + spacing / 2] = median;
       std::nth_element(first + splitter1, first + median, first + splitter2,
-                       [&i](const KDPoint<T> &p1, const KDPoint<T> &p2) {
-                         return p1[i] < p2[i];
+                       [&points, i](unsigned i1, unsigned i2) {
+                         return points[i1][i] < points[i2][i];
                        });
     }
   }
 
+  // The children get consecutive ids, so that their weighted counts are next
+  // to each other.
+  _first_child_id = next_id;
+  for (unsigned i = 0; i < (1u << K); i++)
+    next_id += splitters[i] != splitters[i + 1];
   unsigned k = 0;
   for (unsigned i = 0; i < (1u << K); i++) {
     splitter1 = splitters[i];
     splitter2 = splitters[i + 1];
     if (splitter1 != splitter2) {
       KDCountingTree2KNode<T> *child = new KDCountingTree2KNode<T>(
-          K, _depth + 1, this, leaves, first + splitter1, first + splitter2);
+          K, _depth + 1, this, leaves, points, first + splitter1,
+          first + splitter2, _first_child_id + k, next_id);
       _children.push_back(child);
       k++;
     }
@@ -323,10 +279,10 @@ KDCountingTree2KNode<T>::KDCountingTree2KNode(
 
 template<typename T>
 long long KDCountingTree2KNode<T>::CountRange(
-    const Range<T> &range, long long &num_nodes,
+    const Range<T> &range, const vector<int> &weights, long long &num_nodes,
     vector<const KDCountingTree2KNode *> &q1,
     vector<const KDCountingTree2KNode *> &q2) const {
-  if (weighted_count() == 0)
+  if (weights[_id] == 0)
     return 0;
   enum CASE { NOT_INTER, WITHIN, INTER };
 
@@ -357,13 +313,13 @@ long long KDCountingTree2KNode<T>::CountRange(
 
       switch (_case) {
         case WITHIN: {
-          result += static_cast<long long>(curr->_weighted_count);
+          result += static_cast<long long>(weights[curr->_id]);
           break;
         }
         case INTER: {
           for (unsigned i = 0; i < curr->num_child(); ++i) {
             // This criterion is critical!
-            if (curr->_children[i]->_weighted_count) {
+            if (weights[curr->_first_child_id + i]) {
               q2[n2] = curr->_children[i];
               ++n2;
             }
@@ -398,11 +354,11 @@ double InteractRatio(const Range<T>& current_range,
 
 template<typename T>
 double KDCountingTree2KNode<T>::CountRangeEstimate(
-    const Range<T> &range, long long &num_nodes,
+    const Range<T> &range, const vector<int> &weights, long long &num_nodes,
     vector<const KDCountingTree2KNode *> &q1,
     vector<const KDCountingTree2KNode *> &q2,
     unsigned max_depth) const {
-  if (weighted_count() == 0)
+  if (weights[_id] == 0)
     return 0;
   enum CASE { NOT_INTER, WITHIN, INTER };
 
@@ -433,20 +389,20 @@ double KDCountingTree2KNode<T>::CountRangeEstimate(
 
       switch (_case) {
         case WITHIN: {
-          result += static_cast<double>(curr->_weighted_count);
+          result += static_cast<double>(weights[curr->_id]);
           break;
         }
         case INTER: {
           if (max_depth != 0) {
             for (unsigned i = 0; i < curr->num_child(); ++i) {
               // This criterion is critical!
-              if (curr->_children[i]->_weighted_count) {
+              if (weights[curr->_first_child_id + i]) {
                 q2[n2] = curr->_children[i];
                 ++n2;
               }
             }
           } else {
-            result += static_cast<double>(curr->weighted_count())
+            result += static_cast<double>(weights[curr->_id])
                 * InteractRatio(curr->_range, range);
           }
           break;
@@ -463,24 +419,80 @@ double KDCountingTree2KNode<T>::CountRangeEstimate(
   return result;
 }
 
-template<typename T>
-RangeKDTree2KNode<T>::RangeKDTree2KNode(
+template <typename T>
+void LastAxisFenwickCounts<T>::Finalize() {
+  // Group the slots by points.
+  for (const PendingSlot &slot : _pending)
+    ++_point_first[slot.index + 1];
+  std::partial_sum(_point_first.begin(), _point_first.end(),
+                   _point_first.begin());
+  vector<unsigned> next(_point_first.begin(), _point_first.end() - 1);
+  _slots.resize(_pending.size());
+  for (const PendingSlot &slot : _pending) {
+    const unsigned id = slot.id;
+    _slots[next[slot.index]++] = {
+        _offsets[id], _offsets[id + 1] - _offsets[id], slot.rank};
+  }
+  vector<PendingSlot>().swap(_pending);
+}
+
+template <typename T>
+unsigned LastAxisCascadeCounts<T>::AddNode(
+    const vector<T> &values, const vector<unsigned short> &labels,
+    unsigned num_children, unsigned father_id) {
+  const unsigned id = _nodes.size();
+  const unsigned size = values.size();
+  assert(labels.size() == (num_children ? size : 0));
+  if (id == 0) {
+    _root_values = values;
+  } else {
+    // The children of a node are added in order, after the node itself.
+    unsigned *child_ids = _child_ids.data() + _nodes[father_id].first_child;
+    while (*child_ids != 0)
+      ++child_ids;
+    *child_ids = id;
+  }
+  // The words cover the ranks [0, size].
+  const unsigned num_words = size / 64 + 1;
+  const unsigned first_word = _words.size();
+  _nodes.push_back({_num_counts, size, num_children,
+                    static_cast<unsigned>(_child_ids.size()), first_word});
+  _num_counts += size;
+  _child_ids.resize(_child_ids.size() + num_children, 0);
+
+  _words.resize(first_word + num_words * num_children, Word{0, 0});
+  Word *words = _words.data() + first_word;
+  for (unsigned i = 0; i < labels.size(); ++i)
+    words[(i / 64) * num_children + labels[i]].bits |= 1ull << (i % 64);
+  for (unsigned i = num_children; i < num_words * num_children; ++i) {
+    const Word &previous = words[i - num_children];
+    words[i].rank = previous.rank + _PopCount(previous.bits);
+  }
+  return id;
+}
+
+template<typename T, typename Counts>
+RangeKDTree2KNode<T, Counts>::RangeKDTree2KNode(
     unsigned K, unsigned depth, RangeKDTree2KNode *father,
     vector<RangeKDTree2KNode *> &leaves,
-    typename vector<KDPointRKD<T> >::iterator first,
-    typename vector<KDPointRKD<T> >::iterator last,
-    unsigned leaf_left)
+    const TemplateView<T> &points,
+    vector<int> &rank_last_axis,
+    Counts &counts,
+    vector<unsigned>::iterator first,
+    vector<unsigned>::iterator last,
+    unsigned leaf_left, unsigned id, unsigned &next_id)
     : K(K), _father(father), _depth(depth), _count(last - first),
-        _weighted_count(0), _leaf_left(leaf_left), _subtree(nullptr) {
+        _id(id), _first_child_id(0), _leaf_left(leaf_left) {
   assert(_count > 0);
-  _range = GetRangeRKD<T>(first, last);
+  _range = GetRange<T>(points, first, last, K);
 
   if (_count == 1) {
     _num_child = 0;
     leaves.push_back(this);
-    _subtree = new LastAxisTree<T>(
-        vector<LastAxisTreeNode<T> >(1, LastAxisTreeNode<T>((*first)[K])));
-    first->AddSubtreeNode(&_subtree->leaf_nodes()[0]);
+    _subtree_id = counts.AddNode(vector<T>(1, points[*first][K]),
+                                 vector<unsigned short>(), 0,
+                                 father ? father->_subtree_id : 0);
+    counts.AddPoint(*first, _subtree_id, 0);
     return;
   }
 
@@ -499,8 +511,8 @@ RangeKDTree2KNode<T>::RangeKDTree2KNode(
       splitters[j * spacing + spacing / 2] = median;
       std::nth_element(
           first + splitter1, first + median, first + splitter2,
-          [&i](const KDPoint<T> &p1, const KDPoint<T> &p2) {
-            return p1[i] < p2[i];
+          [&points, i](unsigned i1, unsigned i2) {
+            return points[i1][i] < points[i2][i];
           });
     }
   }
@@ -508,22 +520,35 @@ RangeKDTree2KNode<T>::RangeKDTree2KNode(
   // Reverse mapping.
   std::vector<int> order_last_axis(count());
   for (unsigned i = 0; i < count(); ++i) {
-    order_last_axis[(first + i)->rank_last_axis()] = i;
+    order_last_axis[rank_last_axis[*(first + i)]] = i;
   }
 
-  std::vector<LastAxisTreeNode<T> > subtree_leaf_nodes;
+  // The children are the non-empty parts.
+  std::vector<unsigned short> part2child(1u << K);
+  unsigned num_children = 0;
+  for (unsigned i = 0; i < (1u << K); ++i) {
+    part2child[i] = num_children;
+    if (splitters[i] != splitters[i + 1])
+      ++num_children;
+  }
+
+  std::vector<T> subtree_values;
+  std::vector<unsigned short> subtree_labels;
+  subtree_values.reserve(count());
+  subtree_labels.reserve(count());
   std::vector<std::vector<int> > sub_order_last_axis(1u << K);
   for (unsigned i = 0; i < count(); ++i) {
     int index = order_last_axis[i];
-    T last_axis_value = (first + index)->operator[](K);
-    subtree_leaf_nodes.emplace_back(LastAxisTreeNode<T>(last_axis_value));
+    subtree_values.push_back(points[*(first + index)][K]);
     int node_index = BinarySearchIndexNoCheck(splitters, index);
     sub_order_last_axis[node_index].push_back(index);
+    subtree_labels.push_back(part2child[node_index]);
   }
-  _subtree = new LastAxisTree<T>(std::move(subtree_leaf_nodes));
+  _subtree_id = counts.AddNode(subtree_values, subtree_labels, num_children,
+                               father ? father->_subtree_id : 0);
   for (unsigned i = 0; i < count(); ++i) {
     int index = order_last_axis[i];
-    (first + index)->AddSubtreeNode(&_subtree->leaf_nodes()[i]);
+    counts.AddPoint(*(first + index), _subtree_id, i);
   }
   
   // Adjust rank of the last axis after partition.
@@ -531,21 +556,26 @@ RangeKDTree2KNode<T>::RangeKDTree2KNode(
     const auto &current_sub_order_last_axis = sub_order_last_axis[i];
     size_t size = current_sub_order_last_axis.size();
     for (unsigned j = 0; j < size; ++j) {
-      (first + current_sub_order_last_axis[j])->set_rank_last_axis(j);
+      rank_last_axis[*(first + current_sub_order_last_axis[j])] = j;
     }
   }
   
-  // Construct children.
+  // Construct children, with consecutive ids.
+  _first_child_id = next_id;
+  next_id += num_children;
   unsigned k = 0;
   for (unsigned i = 0; i < (1u << K); i++) {
     splitter1 = splitters[i];
     splitter2 = splitters[i + 1];
     if (splitter1 != splitter2) {
-      RangeKDTree2KNode<T> *child =
-          new RangeKDTree2KNode<T>(K, _depth + 1, this, leaves,
-                                   first + splitter1,
-                                   first + splitter2,
-                                   leaf_left + splitter1);
+      RangeKDTree2KNode<T, Counts> *child =
+          new RangeKDTree2KNode<T, Counts>(K, _depth + 1, this, leaves, points,
+                                           rank_last_axis, counts,
+                                           first + splitter1,
+                                           first + splitter2,
+                                           leaf_left + splitter1,
+                                           _first_child_id + k, next_id);
+      child->_link = counts.GetLink(_subtree_id, k);
       _children.push_back(child);
       k++;
     }
@@ -555,20 +585,25 @@ RangeKDTree2KNode<T>::RangeKDTree2KNode(
 
 
 // Non-recursive version.
-template<typename T>
-vector<long long> RangeKDTree2KNode<T>::CountRange(
-    const Range<T> &range, long long &num_nodes,
-    const vector<RangeKDTree2KNode *> &leaves,
+template<typename T, typename Counts>
+vector<long long> RangeKDTree2KNode<T, Counts>::CountRange(
+    const Range<T> &range, const vector<int> &weights, long long &num_nodes,
+    const Counts &counts, const int *last_axis_counts,
     vector<const RangeKDTree2KNode *> &q1,
-    vector<const RangeKDTree2KNode *> &q2) const {
+    vector<const RangeKDTree2KNode *> &q2,
+    vector<typename Counts::Bounds> &b1,
+    vector<typename Counts::Bounds> &b2) const {
   vector<long long> result({0, 0});
-  if (weighted_count() == 0)
+  if (weights[_id] == 0)
     return result;
 
   enum CASE { NOT_INTER, WITHIN, INTER };
 
-  // Nodes to count.
+  // Nodes to count, with the bounds of the last axis at their fathers. The
+  // bounds are searched at this node only, and are passed down to the
+  // children which are not disjoint from the range.
   q1[0] = this;
+  b1[0] = counts.Search(range.lower_ranges[K], range.upper_ranges[K]);
   unsigned n1 = 1, n2 = 0;
 
   T a, b, c, d;
@@ -591,21 +626,24 @@ vector<long long> RangeKDTree2KNode<T>::CountRange(
         }
       }
 
+      if (_case == NOT_INTER)
+        continue;
+      const typename Counts::Bounds bounds =
+          curr == this ? b1[j] : counts.Cascade(curr->_link, b1[j]);
       switch (_case) {
         case WITHIN: {
-          result[1] += static_cast<long long>(curr->_weighted_count);
-          T last_axis_low = range.lower_ranges[K];
-          T last_axis_high = range.upper_ranges[K];
-          int result_subtree = curr->_subtree->CountRange(last_axis_low,
-                                                          last_axis_high);
+          result[1] += static_cast<long long>(weights[curr->_id]);
+          int result_subtree =
+              counts.CountRange(curr->_subtree_id, bounds, last_axis_counts);
           result[0] += result_subtree;
           break;
         }
         case INTER: {
           for (unsigned i = 0; i < curr->num_child(); ++i) {
             // This criterion is critical!
-            if (curr->_children[i]->_weighted_count) {
+            if (weights[curr->_first_child_id + i]) {
               q2[n2] = curr->_children[i];
+              b2[n2] = bounds;
               ++n2;
             }
           }
@@ -616,6 +654,7 @@ vector<long long> RangeKDTree2KNode<T>::CountRange(
       }
     }
     std::swap(q1, q2);
+    std::swap(b1, b2);
     n1 = n2;
     n2 = 0;
   }
@@ -626,17 +665,18 @@ vector<long long> RangeKDTree2KNode<T>::CountRange(
 template<typename T>
 KDTree2KNode<T>::KDTree2KNode(
     unsigned K, unsigned depth, KDTree2KNode *father,
-    vector<KDTree2KNode *> &leaves,
-    typename vector<KDPoint<T>>::iterator first,
-    typename vector<KDPoint<T>>::iterator last, unsigned leaf_left)
+    vector<KDTree2KNode *> &leaves, const TemplateView<T> &points,
+    vector<unsigned>::iterator first,
+    vector<unsigned>::iterator last, unsigned leaf_left, unsigned id,
+    unsigned &next_id)
     : K(K), _father(father), _depth(depth), _count(last - first),
-        _weighted_count(0), _leaf_left(leaf_left) {
+        _id(id), _first_child_id(0), _leaf_left(leaf_left) {
   assert(_count > 0);
-  _range = GetRange<T>(first, last);
+  _range = GetRange<T>(points, first, last, K);
 
   if (_count == 1) {
     _num_child = 0;
-    _last_axis = (*first)[K];
+    _last_axis = points[*first][K];
     leaves.push_back(this);
     return;
   }
@@ -656,22 +696,27 @@ KDTree2KNode<T>::KDTree2KNode(
       splitters[j * spacing + spacing / 2] = median;
       std::nth_element(
           first + splitter1, first + median, first + splitter2,
-          [&i](const KDPoint<T> &p1, const KDPoint<T> &p2) {
-            return p1[i] < p2[i];
+          [&points, i](unsigned i1, unsigned i2) {
+            return points[i1][i] < points[i2][i];
           });
     }
   }
 
+  // See KDCountingTree2KNode.
+  _first_child_id = next_id;
+  for (unsigned i = 0; i < (1u << K); i++)
+    next_id += splitters[i] != splitters[i + 1];
   unsigned k = 0;
   for (unsigned i = 0; i < (1u << K); i++) {
     splitter1 = splitters[i];
     splitter2 = splitters[i + 1];
     if (splitter1 != splitter2) {
       KDTree2KNode<T> *child =
-          new KDTree2KNode<T>(K, _depth + 1, this, leaves,
+          new KDTree2KNode<T>(K, _depth + 1, this, leaves, points,
                               first + splitter1,
                               first + splitter2,
-                              leaf_left + splitter1);
+                              leaf_left + splitter1, _first_child_id + k,
+                              next_id);
       _children.push_back(child);
       k++;
     }
@@ -682,11 +727,11 @@ KDTree2KNode<T>::KDTree2KNode(
 // Non-recursive version.
 template<typename T>
 vector<long long> KDTree2KNode<T>::CountRange(
-    const Range<T> &range, long long &num_nodes,
+    const Range<T> &range, const vector<int> &weights, long long &num_nodes,
     const vector<KDTree2KNode *> &leaves, vector<const KDTree2KNode *> &q1,
     vector<const KDTree2KNode *> &q2) const {
   vector<long long> result({0, 0});
-  if (weighted_count() == 0)
+  if (weights[_id] == 0)
     return result;
 
   enum CASE { NOT_INTER, WITHIN, INTER };
@@ -717,10 +762,10 @@ vector<long long> KDTree2KNode<T>::CountRange(
 
       switch (_case) {
         case WITHIN: {
-          result[1] += static_cast<long long>(curr->_weighted_count);
+          result[1] += static_cast<long long>(weights[curr->_id]);
           // Check last coordinate.
           for (unsigned i = 0; i < curr->_count; ++i) {
-            if (leaves[curr->_leaf_left + i]->weighted_count() == 0)
+            if (weights[leaves[curr->_leaf_left + i]->_id] == 0)
               continue;
             T last_axis = leaves[curr->_leaf_left + i]->_last_axis;
             if (range.lower_ranges[K] <= last_axis &&
@@ -733,7 +778,7 @@ vector<long long> KDTree2KNode<T>::CountRange(
         case INTER: {
           for (unsigned i = 0; i < curr->num_child(); ++i) {
             // This criterion is critical!
-            if (curr->_children[i]->_weighted_count) {
+            if (weights[curr->_first_child_id + i]) {
               q2[n2] = curr->_children[i];
               ++n2;
             }
@@ -757,10 +802,16 @@ template class KDCountingTree2K<TYPE>; \
 template class KDCountingTree<TYPE>; \
 template class KDTree2K<TYPE>; \
 template class RangeKDTree2K<TYPE>; \
+template class RangeKDTree2K<TYPE, LastAxisCascadeCounts<TYPE> >; \
+template class RangeKDTree2K<TYPE, LastAxisTreeCounts<TYPE> >; \
+template class LastAxisFenwickCounts<TYPE>; \
+template class LastAxisCascadeCounts<TYPE>; \
 template class KDCountingTree2KNode<TYPE>; \
 template class KDCountingTreeNode<TYPE>; \
 template class KDTree2KNode<TYPE>; \
-template class RangeKDTree2KNode<TYPE>;
+template class RangeKDTree2KNode<TYPE, LastAxisFenwickCounts<TYPE> >; \
+template class RangeKDTree2KNode<TYPE, LastAxisCascadeCounts<TYPE> >; \
+template class RangeKDTree2KNode<TYPE, LastAxisTreeCounts<TYPE> >;
 
 
 INSTANTIATE_KDTREE(double)
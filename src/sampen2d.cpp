@@ -28,12 +28,14 @@ struct Argument {
   unsigned moving_step_size;
   unsigned dilation_factor;
   bool sampling;
+  bool kdtree;
   bool random_;
   bool multiscale;
   unsigned multiscale_depth;
   double multiscale_factor;
   unsigned sample_size;
   unsigned sample_num;
+  unsigned num_threads;
   std::string image_filename;
   sampen::OutputLevel output_level;
 } arg;
@@ -70,10 +72,16 @@ char usage[] =
     "        This argument affects the number of scales we use to compute SampEn2D\n"
     "        when option --multiscale is on.\n"
     "    --multiscale-factor <FACTOR>\n"
-    "        The scaling factor of resizing when computing multiscale SampEn2D.\n\n"
+    "        The scaling factor of resizing when computing multiscale SampEn2D.\n"
+    "    --threads <N> (default = 1)\n"
+    "        The number of threads computing SampEn2D. The sampling method runs\n"
+    "        the experiments on different threads.\n\n"
     "Options:\n"
     "    --sampling\n"
     "        Use sampling method to estimate SampEn2D.\n"
+    "    --kdtree\n"
+    "        Count the matched pairs with a kd tree instead of comparing all\n"
+    "        the pairs of templates, which is much faster on large images.\n"
     "    --multiscale\n"  // 小波分析，图像缩放算样本熵，算出一组样本熵（400*400，200*200，100*100，)
     "        Compute multiscale SampEn2D.\n"
     "    -r | --random\n"
@@ -100,6 +108,7 @@ void ParseArgument(int argc, char *argv[]) {
   arg.output_level =
       static_cast<sampen::OutputLevel>(parser.getArgLong("--output-level", 0));
   arg.sampling = parser.isOption("--sampling");
+  arg.kdtree = parser.isOption("--kdtree");
   arg.multiscale = parser.isOption("--multiscale");
   arg.multiscale_depth = parser.getArgLong("--multiscale-depth", 1);
   arg.multiscale_factor = parser.getArgDouble("--multiscale-factor", 0.5);
@@ -107,6 +116,12 @@ void ParseArgument(int argc, char *argv[]) {
     MSG_ERROR(-1, "Invalid argument for --multiscale-depth, positive integer "
                   "required.\n");
   }
+  long num_threads = parser.getArgLong("--threads", 1);
+  if (num_threads <= 0) {
+    MSG_ERROR(-1, "Invalid argument for --threads, positive integer "
+                  "required.\n");
+  }
+  arg.num_threads = static_cast<unsigned>(num_threads);
   if (arg.image_filename.empty()) {
     std::cerr << "Input image file name is required.\n";
     std::cerr << "Usage: " << argv[0] << usage;
@@ -151,11 +166,16 @@ std::vector<double> ComputeMultiscaleSampEn2D(Magick::Image image, double r,
               data.cbegin(), data.cend(), r, m, width, height, 1, 1,
               arg.sample_size, arg.sample_num, 0., 0., 0., arg.random_,
               arg.output_level);
+    } else if (arg.kdtree) {
+      calculator = std::make_shared<SampleEntropyCalculator2DKD<int>>(
+          data.cbegin(), data.cend(), r, m, width, height, 1, 1,
+          arg.output_level);
     } else {
       calculator = std::make_shared<SampleEntropyCalculator2DDirect<int>>(
           data.cbegin(), data.cend(), r, m, width, height, 1, 1,
           arg.output_level);
     }
+    calculator->set_num_threads(arg.num_threads);
     std::cout << "SampEn2D (Scale " << i
         << ", h: " << height << ", w: " << width << "): "
         << calculator->get_entropy()
@@ -236,6 +256,7 @@ int main(int argc, char *argv[]) {
         arg.moving_step_size, arg.dilation_factor, arg.sample_size,
         arg.sample_num, sampen2d, a_norm, b_norm, arg.random_,
         arg.output_level);
+    sec2dds.set_num_threads(arg.num_threads);
     std::cout << sec2dds.get_result_str();
   }
   if (arg.multiscale) {   // 步长
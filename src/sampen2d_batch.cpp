@@ -1,10 +1,15 @@
+#include <algorithm>
+#include <atomic>
 #include <iostream>
 #include <math.h>
 #include <memory>
+#include <mutex>
 #include <ostream>
 #include <fstream>
+#include <set>
+#include <sstream>
+#include <thread>
 #include <vector>
-#include <dirent.h>
 
 #include "Magick++.h"
 #include "Magick++/Functions.h"
@@ -14,6 +19,7 @@
 #include "MagickCore/image.h"
 
 #include "MagickCore/pixel.h"
+#include "parallel.h"
 #include "sample_entropy_calculator2d.h"
 #include "utils.h"
 
@@ -29,12 +35,17 @@ struct Argument {
   unsigned moving_step_size;
   unsigned dilation_factor;
   bool sampling;
+  bool kdtree;
   bool random_;
   bool multiscale;
   unsigned multiscale_depth;
   double multiscale_factor;
   unsigned sample_size;
   unsigned sample_num;
+  unsigned num_threads;
+  unsigned num_decode_threads;
+  unsigned queue_size;
+  bool resume;
   std::string image_filename;
   std::string result_savepath;
   sampen::OutputLevel output_level;
@@ -42,14 +53,18 @@ struct Argument {
 
 // clang-format off
 char usage[] =
-    " --input <INPUT_IMAGE_FILENAME> -r <R> (default = 0.3)\\\n"
+    " --input <INPUT_IMAGE_DIRECTORY> --savepath <CSV> -r <R> (default = 0.3)\\\n"
     "    -m <M> (default = 1) --moving-step-size <STEP_SIZE>(default = 1)\\\n"
     "    --dilation-factor <FACTOR> (default = 1)\n\n"
     "Arguments:\n"
     "    --output-level <LEVEL> (default = 0)\n"
     "        Can be 0, 1 or 2, amongst which 0 is most silent and 2 is most verbose.\n"
-    "    --input <IMAGE_FILENAME>\n"
-    "        The filename of the image to calculate SampEn2D.\n"
+    "    --input <IMAGE_DIRECTORY>\n"
+    "        The directory of the images to calculate SampEn2D, or a manifest file\n"
+    "        with one image filename per line.\n"
+    "    --savepath <CSV>\n"
+    "        The CSV file of the results. A row is appended as soon as an image is\n"
+    "        done.\n"
     "    -r <R> (default = 0.3)\n"
     "        Threshold for template matching. Note that in actual computation,\n"
     "        this value will be scaled by the standard deviation of the input image.\n"
@@ -72,12 +87,25 @@ char usage[] =
     "        This argument affects the number of scales we use to compute SampEn2D\n"
     "        when option --multiscale is on.\n"
     "    --multiscale-factor <FACTOR>\n"
-    "        The scaling factor of resizing when computing multiscale SampEn2D.\n\n"
+    "        The scaling factor of resizing when computing multiscale SampEn2D.\n"
+    "    --threads <N> (default = 1)\n"
+    "        The number of threads computing SampEn2D.\n"
+    "    --decode-threads <N> (default = 1)\n"
+    "        The number of threads reading and decoding the images.\n"
+    "    --queue-size <Q> (default = 2 * <N>)\n"
+    "        The number of decoded images waiting to be computed at most, which\n"
+    "        bounds the memory used by the decoded images.\n\n"
     "Options:\n"
     "    --sampling\n"
     "        Use sampling method to estimate SampEn2D.\n"
+    "    --kdtree\n"
+    "        Count the matched pairs with a kd tree instead of comparing all\n"
+    "        the pairs of templates, which is much faster on large images.\n"
     "    --multiscale\n"
     "        Compute multiscale SampEn2D.\n"
+    "    --resume\n"
+    "        Skip the images which already have a row in <CSV>, and append the\n"
+    "        rows of the others, so that an interrupted run can be continued.\n"
     "    -r | --random\n"
     "        Set seed randomly.\n"
     "    -h | --help\n"
@@ -103,9 +131,11 @@ void ParseArgument(int argc, char *argv[]) {
   arg.output_level =
       static_cast<sampen::OutputLevel>(parser.getArgLong("--output-level", 0));
   arg.sampling = parser.isOption("--sampling");
+  arg.kdtree = parser.isOption("--kdtree");
   arg.multiscale = parser.isOption("--multiscale");
   arg.multiscale_depth = parser.getArgLong("--multiscale-depth", 1);
   arg.multiscale_factor = parser.getArgDouble("--multiscale-factor", 0.5);
+  arg.resume = parser.isOption("--resume");
   if (arg.multiscale_depth <= 0) {
     MSG_ERROR(-1, "Invalid argument for --multiscale-depth, positive integer "
                   "required.\n");
@@ -115,6 +145,25 @@ void ParseArgument(int argc, char *argv[]) {
     std::cerr << "Usage: " << argv[0] << usage;
     exit(-1);
   }
+  if (arg.result_savepath.empty()) {
+    std::cerr << "The CSV file of the results is required (--savepath).\n";
+    std::cerr << "Usage: " << argv[0] << usage;
+    exit(-1);
+  }
+  long num_threads = parser.getArgLong("--threads", 1);
+  long num_decode_threads = parser.getArgLong("--decode-threads", 1);
+  if (num_threads <= 0 || num_decode_threads <= 0) {
+    MSG_ERROR(-1, "Invalid argument for --threads or --decode-threads, "
+                  "positive integer required.\n");
+  }
+  arg.num_threads = static_cast<unsigned>(num_threads);
+  arg.num_decode_threads = static_cast<unsigned>(num_decode_threads);
+  long queue_size = parser.getArgLong("--queue-size", 2 * num_threads);
+  if (queue_size <= 0) {
+    MSG_ERROR(-1, "Invalid argument for --queue-size, positive integer "
+                  "required.\n");
+  }
+  arg.queue_size = static_cast<unsigned>(queue_size);
   if (arg.sampling) {
     arg.sample_size = parser.getArgLong("--sample-size", 1024);
     arg.sample_num = parser.getArgLong("--sample-num", 20);
@@ -124,14 +173,15 @@ void ParseArgument(int argc, char *argv[]) {
 
 std::vector<double> ComputeMultiscaleSampEn2D(Magick::Image image, double r,
                                               int m, int depth, double factor,
-                                              bool sampling) {
+                                              bool sampling,
+                                              std::ostream &os) {
   image.type(Magick::GrayscaleType);
   image.channel(Magick::RedChannel);
 
   int width = image.columns();
   int height = image.rows();
   std::vector<double> result;
-  PrintSeperator('-');
+  os << std::string(80, '-') << std::endl;
   for (int i = 0; i < depth; ++i) {
     width = static_cast<int>(static_cast<double>(width) * factor);
     height = static_cast<int>(static_cast<double>(height) * factor);
@@ -154,12 +204,16 @@ std::vector<double> ComputeMultiscaleSampEn2D(Magick::Image image, double r,
               data.cbegin(), data.cend(), r, m, width, height, 1, 1,
               arg.sample_size, arg.sample_num, 0., 0., 0., arg.random_,
               arg.output_level);
+    } else if (arg.kdtree) {
+      calculator = std::make_shared<SampleEntropyCalculator2DKD<int>>(
+          data.cbegin(), data.cend(), r, m, width, height, 1, 1,
+          arg.output_level);
     } else {
       calculator = std::make_shared<SampleEntropyCalculator2DDirect<int>>(
           data.cbegin(), data.cend(), r, m, width, height, 1, 1,
           arg.output_level);
     }
-    std::cout << "SampEn2D (Scale " << i
+    os << "SampEn2D (Scale " << i
         << ", h: " << height << ", w: " << width << "): "
         << calculator->get_entropy()
         << std::endl;
@@ -175,143 +229,206 @@ struct entropyInfos {
   double b_norm;
 };
 
-int main(int argc, char *argv[]) {
-  Magick::InitializeMagick(argv[0]);
-  ParseArgument(argc, argv);
-
-  const char* dir_path = arg.image_filename.c_str();
-  DIR* dir = opendir(dir_path);
-  std::string image_path;
-
-  std::cout << "-----------------------------------------" ;
-  std::cout << dir_path << "start!" ;
-  std::cout << "-----------------------------------------" << std::endl;
-  if (dir) {
-        struct dirent* entry;
-        std::vector<std::string> fileList;
-
-        while ((entry = readdir(dir)) != nullptr) {
-            // Ignore "." and ".." entries
-            if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
-                fileList.push_back(entry->d_name);
-            }
-        }
-
-        closedir(dir);
-
-        std::vector<sampen::entropyInfos> infos;
-
-        int count = 0;
-        // Now fileList contains names of files and directories excluding "." and ".."
-        for (const std::string& filename : fileList) {
-          // if (count < 3){
-            Magick::Image image;
-            image_path = arg.image_filename.c_str() + filename;
-            std::cout << image_path << std::endl;
+// An image handed from the decode stage to the compute stage.
+struct DecodedImage {
+  std::string name;
+  unsigned width;
+  unsigned height;
+  // The first channel of the cropped rectangle.
+  std::vector<int> data;
+  // The whole image, kept only for --multiscale.
+  Magick::Image image;
+};
 
-            image.read(image_path);
+// Reads the image and extracts the pixels of the rectangle. Returns false
+// (with a warning) if the image can not be used, so that one broken file does
+// not stop the batch.
+bool DecodeImage(const std::string &path, DecodedImage &decoded) {
+  Magick::Image image;
+  try {
+    image.read(path);
+  } catch (const Magick::Exception &e) {
+    MSG_WARNING(-1, "Cannot read image %s (%s).\n", path.c_str(), e.what());
+    return false;
+  }
+  image.type(Magick::GrayscaleType);
+  image.channel(Magick::RedChannel);
 
-            unsigned width = image.columns();
-            unsigned height = image.rows();
+  const unsigned width = image.columns();
+  const unsigned height = image.rows();
+  decoded.width = arg.width ? arg.width : width - std::min(arg.x, width);
+  decoded.height = arg.height ? arg.height : height - std::min(arg.y, height);
+  if (arg.x + decoded.width > width || arg.y + decoded.height > height) {
+    MSG_WARNING(-1, "Specified rectangle is outside the geometry of %s.\n",
+                path.c_str());
+    return false;
+  }
+  auto num_channels = image.channels();
+  auto pixels =
+      image.getConstPixels(arg.x, arg.y, decoded.width, decoded.height);
+  decoded.data.resize(decoded.width * decoded.height);
+  for (size_t i = 0; i < decoded.data.size(); ++i) {
+    decoded.data[i] = static_cast<int>(pixels[i * num_channels]);
+  }
+  if (arg.multiscale)
+    decoded.image = image;
+  return true;
+}
 
-            image.type(Magick::GrayscaleType);
-            image.channel(Magick::RedChannel);
+// Computes SampEn2D of the image. The report goes to log and the CSV rows
+// to rows.
+void ComputeImage(DecodedImage &decoded, std::ostream &log,
+                  std::ostream &rows) {
+  log << std::string(80, '=') << std::endl;
+  log << "Sample Entropy (2D) Computation Setting:\n";
+  log << "\tfilename: " << decoded.name << std::endl;
+  log << "\tr: " << arg.r << std::endl;
+  log << "\tm: " << arg.m << std::endl;
+  log << "\tx: " << arg.x << std::endl;
+  log << "\ty: " << arg.y << std::endl;
+  log << "\tw: " << decoded.width << std::endl;
+  log << "\th: " << decoded.height << std::endl;
+  log << "\tmoving-step-size: " << arg.moving_step_size << std::endl;
+  log << "\tdilation-factor: " << arg.dilation_factor << std::endl;
+  log << "\tmultiscale-depth: " << arg.multiscale_depth << std::endl;
+  if (arg.multiscale_depth) {
+      log << "\tmultiscale-factor: " << arg.multiscale_factor << std::endl;
+  }
 
-            arg.width = width;
-            arg.height = height;
-            // if (arg.width == 0)
-            //   arg.width = width;
-            // if (arg.height == 0)
-            //   arg.height = height;
-            if (arg.x + arg.width > width || arg.y + arg.height > height) {
-              MSG_ERROR(-1, "Specified rectangle is outside the image geometry.\n");
-            }
-            // Print arguments.
-            PrintSeperator('=');
-            std::cout << "Sample Entropy (2D) Computation Setting:\n";
-            std::cout << "\tfilename: " << image.fileName() << std::endl;
-            std::cout << "\twidth: " << image.columns() << std::endl;
-            std::cout << "\theight: " << image.rows() << std::endl;
-            std::cout << "\tnum_channels: " << image.channels() << std::endl;
-            std::cout << "\tr: " << arg.r << std::endl;
-            std::cout << "\tm: " << arg.m << std::endl;
-            std::cout << "\tx: " << arg.x << std::endl;
-            std::cout << "\ty: " << arg.y << std::endl;
-            std::cout << "\tw: " << arg.width << std::endl;
-            std::cout << "\th: " << arg.height << std::endl;
-            std::cout << "\tmoving-step-size: " << arg.moving_step_size << std::endl;
-            std::cout << "\tdilation-factor: " << arg.dilation_factor << std::endl;
-            std::cout << "\tmultiscale-depth: " << arg.multiscale_depth << std::endl;
-            if (arg.multiscale_depth) {
-                std::cout << "\tmultiscale-factor: " << arg.multiscale_factor << std::endl;
-            }
+  const std::vector<int> &data = decoded.data;
+  auto var = sampen::ComputeVariance(data);
+  double r = sqrt(var) * arg.r;
 
+  std::shared_ptr<sampen::SampleEntropyCalculator2D<int>> sec2dd;
+  if (arg.kdtree) {
+    sec2dd = std::make_shared<sampen::SampleEntropyCalculator2DKD<int>>(
+        data.begin(), data.end(), r, arg.m, decoded.width, decoded.height,
+        arg.moving_step_size, arg.dilation_factor, arg.output_level);
+  } else {
+    sec2dd = std::make_shared<sampen::SampleEntropyCalculator2DDirect<int>>(
+        data.begin(), data.end(), r, arg.m, decoded.width, decoded.height,
+        arg.moving_step_size, arg.dilation_factor, arg.output_level);
+  }
+  sec2dd->ComputeSampleEntropy();
+  log << sec2dd->get_result_str();
+  std::vector<sampen::entropyInfos> infos;
+  infos.push_back(sec2dd->get_result(decoded.name));
 
-            auto num_channels = image.channels();
-            auto pixels = image.getConstPixels(arg.x, arg.y, arg.width, arg.height);
-            std::vector<int> data(arg.width * arg.height * 1);
-            for (size_t i = 0; i < data.size(); ++i) {
-              data[i] = static_cast<int>(pixels[i * num_channels]);
-            }
-            auto var = sampen::ComputeVariance(data);
-            double r = sqrt(var) * arg.r;
-            // arg.r = sqrt(var) * arg.r;
+  if (arg.sampling) {
+    sampen::SampleEntropyCalculator2DSamplingDirect<int> sec2dds(
+        data.cbegin(), data.cend(), r, arg.m, decoded.width,
+        decoded.height, arg.moving_step_size, arg.dilation_factor,
+        arg.sample_size, arg.sample_num, sec2dd->get_entropy(),
+        sec2dd->get_a_norm(), sec2dd->get_b_norm(), arg.random_,
+        arg.output_level);
+    log << sec2dds.get_result_str();
+    infos.push_back(sec2dds.get_result(decoded.name));
+  }
+  if (arg.multiscale) {
+    ComputeMultiscaleSampEn2D(decoded.image, arg.r, arg.m,
+                              arg.multiscale_depth, arg.multiscale_factor,
+                              false, log);
+  }
+  log << std::string(80, '=') << std::endl;
 
-            sampen::SampleEntropyCalculator2DDirect<int> sec2dd(
-                data.begin(), data.end(), r, arg.m, arg.width, arg.height,
-                arg.moving_step_size, arg.dilation_factor, arg.output_level);
-            // sampen::SampleEntropyCalculator2DDirect<int> sec2dd(
-            //     data.begin(), data.end(), arg.r, arg.m, arg.width, arg.height,
-            //     arg.moving_step_size, arg.dilation_factor, arg.output_level);
-            sec2dd.ComputeSampleEntropy();
-            std::cout << sec2dd.get_result_str();
-            infos.push_back(sec2dd.get_result(filename));
+  for (const sampen::entropyInfos &info : infos) {
+    rows << info.imageName << ","
+         << info.sampen2d << ","
+         << info.a_norm << ","
+         << info.b_norm << std::endl;
+  }
+}
 
-            double sampen2d = sec2dd.get_entropy();
-            double a_norm = sec2dd.get_a_norm();
-            double b_norm = sec2dd.get_b_norm();
+// Keeps the complete rows of an existing CSV file (dropping a row cut off by
+// a crash) and returns the names of the images in them.
+std::set<std::string> LoadFinishedImages(const std::string &savepath) {
+  std::set<std::string> finished;
+  std::ifstream ifs(savepath);
+  if (!ifs.is_open())
+    return finished;
+  std::stringstream buffer;
+  buffer << ifs.rdbuf();
+  ifs.close();
+  std::string text = buffer.str();
+  text.erase(text.find_last_of('\n') == std::string::npos
+                 ? 0
+                 : text.find_last_of('\n') + 1);
+  std::istringstream iss(text);
+  std::string line;
+  // The header.
+  std::getline(iss, line);
+  while (std::getline(iss, line))
+    finished.insert(line.substr(0, line.find(',')));
+  std::ofstream(savepath) << text;
+  return finished;
+}
 
-            if (arg.sampling) {
-              sampen::SampleEntropyCalculator2DSamplingDirect<int> sec2dds(
-                  data.cbegin(), data.cend(), arg.r, arg.m, arg.width, arg.height,
-                  arg.moving_step_size, arg.dilation_factor, arg.sample_size,
-                  arg.sample_num, sampen2d, a_norm, b_norm, arg.random_,
-                  arg.output_level);
-              std::cout << sec2dds.get_result_str();
-              infos.push_back(sec2dds.get_result(filename));
-            }
-            if (arg.multiscale) {
-              ComputeMultiscaleSampEn2D(image, arg.r, arg.m, arg.multiscale_depth,
-                                        arg.multiscale_factor, false);
-            }
-            PrintSeperator('=');
-        // count ++;
-        // } else {
-        //   break;
-        // }
-        }
+int main(int argc, char *argv[]) {
+  Magick::InitializeMagick(argv[0]);
+  ParseArgument(argc, argv);
 
-        std::ofstream outputFile(arg.result_savepath);
-        if (outputFile.is_open()) {
-        // 写入表头
-        outputFile << "image_name,entropy,a(norm),b(norm)" << std::endl;
+  std::cout << "-----------------------------------------" ;
+  std::cout << arg.image_filename << " start!" ;
+  std::cout << "-----------------------------------------" << std::endl;
 
-        // 写入数据
-        for (const sampen::entropyInfos& info : infos) {
-            outputFile << info.imageName << ","
-                       << info.sampen2d << ","
-                       << info.a_norm << ","
-                       << info.b_norm<< std::endl;
-            }
+  std::vector<std::string> paths = GetBatchInputFiles(arg.image_filename);
+  const std::set<std::string> finished =
+      arg.resume ? LoadFinishedImages(arg.result_savepath)
+                 : std::set<std::string>();
+  std::ofstream outputFile(arg.result_savepath, arg.resume && finished.size()
+                                                    ? std::ios::app
+                                                    : std::ios::trunc);
+  if (!outputFile.is_open()) {
+    std::cerr << "Error opening file." << std::endl;
+    return 1;
+  }
+  if (!arg.resume || finished.empty())
+    outputFile << "image_name,entropy,a(norm),b(norm)" << std::endl;
 
-        outputFile.close();
-        std::cout << "CSV file saved." << std::endl;
-        } else {
-            std::cerr << "Error opening file." << std::endl;
-            return 1;
-        }
-        
-    } else {
-        std::cerr << "Error reading directory." << std::endl;
+  // The decode threads take the images from a shared counter and hand them
+  // to the compute threads through a bounded queue, so that decoding
+  // overlaps with computing while at most queue_size images wait in memory.
+  // The rows of each image are appended and flushed as soon as it is done.
+  BoundedQueue<DecodedImage> queue(arg.queue_size);
+  std::atomic<size_t> next_path(0);
+  std::atomic<unsigned> num_decoders(arg.num_decode_threads);
+  std::mutex output_mutex;
+  size_t num_done = 0;
+  std::vector<std::thread> decoders;
+  for (unsigned t = 0; t < arg.num_decode_threads; ++t) {
+    decoders.emplace_back([&]() {
+      size_t i;
+      while ((i = next_path.fetch_add(1)) < paths.size()) {
+        DecodedImage decoded;
+        const std::string &path = paths[i];
+        decoded.name = path.substr(path.find_last_of('/') + 1);
+        if (finished.count(decoded.name))
+          continue;
+        if (DecodeImage(path, decoded))
+          queue.Push(std::move(decoded));
+      }
+      if (--num_decoders == 0)
+        queue.Close();
+    });
+  }
+  ParallelFor(arg.num_threads, arg.num_threads, [&](unsigned) {
+    DecodedImage decoded;
+    while (queue.Pop(decoded)) {
+      std::stringstream log, rows;
+      ComputeImage(decoded, log, rows);
+      std::lock_guard<std::mutex> lock(output_mutex);
+      std::cout << log.str();
+      outputFile << rows.str();
+      outputFile.flush();
+      ++num_done;
     }
+  });
+  for (std::thread &t : decoders)
+    t.join();
+
+  outputFile.close();
+  std::cout << num_done << " images computed";
+  if (finished.size())
+    std::cout << " (" << finished.size() << " finished before)";
+  std::cout << ". CSV file saved." << std::endl;
 }
@@ -3,20 +3,21 @@
 //
 
 #include "sample_entropy_calculator_kd.h"
+#include "parallel.h"
 #include "utils.h"
 
+#include <array>
+#include <numeric>
+
 namespace sampen {
 
 template <typename T>
 long long MatchedPairsCalculatorSimpleKD<T>::ComputeA(
     typename vector<T>::const_iterator first,
     typename vector<T>::const_iterator last, T r) {
-  vector<T> data_(first, last);
-  // Construct Points and merge repeated points.
-  vector<KDPoint<T> > points =
-      GetKDPoints<T>(data_.cbegin(), data_.cend(), K, 1);
+  const TemplateView<T> points(&*first, last - first, K);
 
-  KDCountingTree2K<T> tree(K, points, _output_level);
+  ImplicitKDCountingTree<T> tree(K, points, _output_level);
 
   // Perform counting.
   long long result = 0;
@@ -28,7 +29,7 @@ long long MatchedPairsCalculatorSimpleKD<T>::ComputeA(
   Timer timer;
   timer.SetStartingPointNow();
   for (unsigned i = 1; i < n_count; i++) {
-    tree.UpdateCount(i - 1, points[i].count());
+    tree.UpdateCount(i - 1, 1);
     const Range<T> range = GetHyperCubeR<T>(points[i], r);
     long long current_count = tree.CountRange(range, num_nodes);
     result += current_count;
@@ -56,53 +57,29 @@ long long MatchedPairsCalculatorMao<T>::ComputeA(
     typename vector<T>::const_iterator first,
     typename vector<T>::const_iterator last, T r) {
   const size_t n = last - first;
-  vector<T> data_(first, last);
-  // Add K - 1 auxiliary points.
-  T minimum = *std::min_element(first, last);
-  for (size_t i = 0; i < K - 1; i++)
-    data_.push_back(minimum);
-  // Construct Points and merge repeated points.
-  vector<KDPoint<T> > points =
-      GetKDPoints<T>(data_.cbegin(), data_.cend(), K, 1);
-  for (size_t i = points.size() - K + 1; i < points.size(); ++i) {
-    points[i].set_count(0);
-  }
-  vector<KDPoint<T> > sorted_points(points);
+  const TemplateView<T> points(&*first, n, K, true);
   // The mapping p, from rank to original index
-  vector<unsigned> rank2index(n);
-  for (size_t i = 0; i < n; i++)
-    rank2index.at(i) = i;
-
   Timer timer;
-  std::sort(rank2index.begin(), rank2index.end(),
-            [&points](unsigned i1, unsigned i2) {
-              return (points[i1] < points[i2]);
-            });
+  const vector<unsigned> rank2index =
+      SortTemplates(&*first, n, points.dim());
   timer.StopTimer();
   if (_output_level >= Info) {
     std::cout << "[INFO] Time consumed in presorting: "
               << timer.ElapsedSeconds() << "s\n";
   }
 
-  for (size_t i = 0; i < n; i++)
-    sorted_points[i] = points[rank2index[i]];
-
-  // MergeRepeatedPoints(sorted_points, rank2index);
-
-  const Bounds bounds = GetRankBounds(sorted_points, r);
-  const vector<KDPoint<unsigned> > points_grid =
-      Map2Grid(sorted_points, rank2index);
+  const Bounds bounds = GetRankBounds(points, rank2index, r);
+  const vector<unsigned> index2rank = GetInverseMapCyclic(rank2index, K - 1);
 
-  // Construct kd tree.
-  vector<KDPoint<unsigned> > points_count;
+  // Construct kd tree over the grid points of the non-auxiliary points.
   vector<unsigned> points_count_indices;
   for (unsigned i = 0; i < n; i++) {
-    if (points_grid[i].count()) {
-      points_count.push_back(points_grid[i]);
+    if (rank2index[i] < n - K + 1)
       points_count_indices.push_back(i);
-    }
   }
-  KDCountingTree2K<unsigned> tree(K - 1, points_count, _output_level);
+  const TemplateView<unsigned> points_count =
+      Map2Grid(index2rank, rank2index, points_count_indices, K - 1);
+  ImplicitKDCountingTree<unsigned> tree(K - 1, points_count, _output_level);
 
   // Perform counting.
   long long result = 0;
@@ -122,8 +99,6 @@ long long MatchedPairsCalculatorMao<T>::ComputeA(
     const unsigned rank1 = points_count_indices[i];
 
     unsigned upperbound = bounds.upper_bounds[rank1];
-    long long count_repeated = static_cast<long long>(points_count[i].count());
-    result += (count_repeated - 1) * count_repeated / 2;
 
     if (upperbound < points_count_indices[i + 1])
       continue;
@@ -135,14 +110,13 @@ long long MatchedPairsCalculatorMao<T>::ComputeA(
     while (j < n_count && points_count_indices[j] <= upperbound_prev)
       ++j;
     while (j < n_count && points_count_indices[j] <= upperbound) {
-      tree.UpdateCount(j, points_count[j].count());
+      tree.UpdateCount(j, 1);
       ++num_opened;
       ++j;
     }
 
     const Range<unsigned> range = GetHyperCube(points_count[i], bounds);
-    long long current_count =
-        tree.CountRange(range, num_nodes) * count_repeated;
+    long long current_count = tree.CountRange(range, num_nodes);
     result += current_count;
     ++num_countrange_called;
     upperbound_prev = upperbound;
@@ -169,96 +143,46 @@ long long MatchedPairsCalculatorMao<T>::ComputeA(
 }
 
 
-template <typename T>
-long long MatchedPairsCalculatorSampling2<T>::ComputeA(
-    typename vector<T>::const_iterator first,
-    typename vector<T>::const_iterator last, T r,
-    std::vector<unsigned> &sample_indices) {
-  const size_t n = last - first;
-  assert(n - K + 1 >= sample_indices.size());
-  vector<T> data_(first, last);
-  // Add K - 1 auxiliary points.
-  T minimum = *std::min_element(first, last);
-  for (size_t i = 0; i < K - 1; ++i)
-    data_.push_back(minimum);
-
-  // Construct points in k-dimensional space and merge repeated points.
-  vector<KDPoint<T> > points =
-      GetKDPoints<T>(data_.cbegin(), data_.cend(), K, 1);
-  for (size_t i = points.size() - K + 1; i < points.size(); ++i) {
-    points[i].set_count(0);
-  }
-
-  vector<KDPoint<T> > sorted_points(points);
-  // The mapping p, from rank to original index
-  vector<unsigned> rank2index(n);
-  for (size_t i = 0; i < n; i++)
-    rank2index.at(i) = i;
-  Timer timer;
-  std::sort(rank2index.begin(), rank2index.end(),
-            [&points](unsigned i1, unsigned i2) {
-              return (points[i1] < points[i2]);
-            });
-  timer.StopTimer();
-  if (_output_level >= Info) {
-    std::cout << "[INFO] Time consumed in presorting: "
-              << timer.ElapsedSeconds() << "s\n";
-  }
-
-  for (size_t i = 0; i < n; i++)
-    sorted_points[i] = points[rank2index[i]];
-
-  const Bounds bounds = GetRankBounds(sorted_points, r);
-  // Map values of each coordinate to the rank given by sorting.
-  // Since the value at first dimension equal to the index of that point
-  // in the sorted array, we can reduce the dimension of the points by 1.
-  const vector<KDPoint<unsigned> > points_grid =
-      Map2Grid(sorted_points, rank2index);
-
-  // Construct kd tree.
-  vector<KDPoint<unsigned> > points_count;
-  vector<unsigned> points_count_indices;
-  // Only use points with positive count to construct the kd tree.
-  for (unsigned i = 0; i < n; i++) {
-    if (points_grid[i].count()) {
-      points_count.push_back(points_grid[i]);
-      points_count_indices.push_back(i);
-    }
-  }
-  KDCountingTree2K<unsigned> tree(K - 1, points_count, _output_level);
-
-  // Perform counting.
+namespace {
+/*
+ * Count the matched pairs of one sample, given by the number of times each
+ * grid point is sampled. If against_all is true, then each sampled point is
+ * paired with all the points after it (in the order of rank), as in Mao's
+ * sampling; otherwise only with the sampled points after it, and the repeated
+ * samples of a point are pairs of each other. All the points are closed
+ * afterwards, so that the tree can be reused.
+ */
+long long SamplingCountA(ImplicitKDCountingTree<unsigned> &tree,
+                         const TemplateView<unsigned> &points_count,
+                         const vector<unsigned> &points_count_indices,
+                         const Bounds &bounds, const vector<int> &counts,
+                         bool against_all, std::array<long long, 3> &stats) {
+  const unsigned n_count = points_count.size();
   long long result = 0;
-  // The number of nodes has been visited.
-  long long num_nodes = 0;
-  long long num_countrange_called = 0;
-  long long num_opened = 0;
   unsigned upperbound_prev = 0;
-
-  const unsigned n_count = points_count.size();
-  int i_sample_indices = 0;
-  for (size_t i = 0; i < sample_indices.size() - 1; ++i) {
-    assert(sample_indices[i + 1] > sample_indices[i]);
-  }
-  timer.SetStartingPointNow();
-  for (unsigned i = 0; i < n_count; ++i) {
-    const unsigned rank1 = points_count_indices[i];
-    unsigned upperbound = bounds.upper_bounds[rank1];
+  // The points before next_close are closed, and those before j_end may have
+  // been opened.
+  unsigned next_close = 0, j_end = 0;
+  for (unsigned i = 0; i + 1 < n_count; ++i) {
+    if (counts[i] == 0)
+      continue;
 
     // Close nodes whose value of the first dimension are outside bounds.
-    if (i_sample_indices > 0) {
-      for (unsigned k = sample_indices[i_sample_indices - 1] + 1; k <= i; ++k) {
-        tree.Close(k);
-      }
+    if (against_all) {
+      for (; next_close <= i; ++next_close)
+        tree.Close(next_close);
+    } else {
+      tree.Close(i);
     }
 
-    if (sample_indices[i_sample_indices] != i) {
-      continue;
-    }
-    if (upperbound < points_count_indices[i + 1]) {
-      ++i_sample_indices;
+    const unsigned rank1 = points_count_indices[i];
+    const unsigned upperbound = bounds.upper_bounds[rank1];
+    const long long count_repeated = counts[i];
+    if (!against_all)
+      result += (count_repeated - 1) * count_repeated / 2;
+
+    if (upperbound < points_count_indices[i + 1])
       continue;
-    }
 
     // Update tree.
     if (upperbound_prev < rank1)
@@ -267,202 +191,130 @@ long long MatchedPairsCalculatorSampling2<T>::ComputeA(
     while (j < n_count && points_count_indices[j] <= upperbound_prev)
       ++j;
     while (j < n_count && points_count_indices[j] <= upperbound) {
-      tree.UpdateCount(j, points_count[j].count());
-      ++num_opened;
+      const int weight = against_all ? 1 : counts[j];
+      if (weight) {
+        tree.UpdateCount(j, weight);
+        ++stats[2];
+      }
       ++j;
     }
+    if (j_end < j)
+      j_end = j;
 
     const Range<unsigned> range = GetHyperCube(points_count[i], bounds);
-    result += tree.CountRange(range, num_nodes);
-    ++num_countrange_called;
+    result += tree.CountRange(range, stats[0]) * count_repeated;
+    ++stats[1];
     upperbound_prev = upperbound;
-    ++i_sample_indices;
   }
-  timer.StopTimer();
-
-  assert(i_sample_indices == static_cast<int>(sample_indices.size()));
-
-  if (_output_level >= Info) {
-    MSG_INFO("Time consumed in range counting: %lf seconds\n",
-             timer.ElapsedSeconds());
-  }
-
-  if (_output_level == Debug) {
-    MSG_DEBUG("The number of nodes (K = %u): %u\n", K, tree.num_nodes());
-    MSG_DEBUG("The number of leaf nodes (K = %u): %u\n", K, n_count);
-    MSG_DEBUG("The number of calls for CountRange(): %lld",
-              num_countrange_called);
-    MSG_DEBUG("The number of times to open node: %lld", num_opened);
-    MSG_DEBUG("The number of nodes visited: %lld", num_nodes);
+  if (!against_all) {
+    const long long count_last = counts[n_count - 1];
+    result += (count_last - 1) * count_last / 2;
   }
+  for (unsigned k = next_close; k < j_end; ++k)
+    tree.Close(k);
   return result;
 }
 
-
-vector<unsigned>
-MergeRepeatedIndices(typename vector<unsigned>::const_iterator first,
-                     typename vector<unsigned>::const_iterator last) {
-  size_t length = last - first;
-  vector<unsigned> counts(length, 0);
-  unsigned i = 0, k = 0;
-  while (i < length) {
-    unsigned count = 0;
-    while (k < length && *(first + k) == *(first + i)) {
-      ++k;
-      ++count;
-    }
-    counts[i] = count;
-    i = k;
-  }
-  return counts;
-}
-
-
+/*
+ * The common part of MatchedPairsCalculatorSampling and
+ * MatchedPairsCalculatorSampling2. The samples share the presorting, the
+ * bounds and the grid points, which are computed once. The samples are
+ * distributed over the threads in a round robin manner. The counting tree is
+ * built once, and each thread counts on its own copy of it, which shares the
+ * geometry and only has its own counts, and which is reused for all of its
+ * samples.
+ *
+ * @param indices: The indices of sample_num samples of equal size, stored one
+ * after another. The indices are positions of the non-auxiliary templates in
+ * sorted order.
+ */
 template <typename T>
-vector<long long> MatchedPairsCalculatorSampling<T>::ComputeA(
+vector<long long> ComputeASamplingKD(
     typename vector<T>::const_iterator first,
-    typename vector<T>::const_iterator last, unsigned sample_num,
-    const vector<unsigned> &indices, T r) {
-  const size_t n = last - first;
-  const size_t sample_size = indices.size() / sample_num;
-  vector<T> data_(first, last);
-  // Add K - 1 auxiliary points.
-  T minimum = *std::min_element(first, last);
-  // TODO: !! For debug here.
-  for (size_t i = 0; i < K - 1; i++)
-    data_.push_back(minimum);
-  // Construct Points and merge repeated points.
-  vector<KDPoint<T> > points =
-      GetKDPoints<T>(data_.cbegin(), data_.cend(), K, 0);
+    typename vector<T>::const_iterator last, T r, unsigned K,
+    unsigned sample_num, const vector<unsigned> &indices, bool against_all,
+    unsigned num_threads, OutputLevel output_level) {
+  const unsigned n = last - first;
+  assert(sample_num > 0 && indices.size() % sample_num == 0);
+  const unsigned sample_size = indices.size() / sample_num;
+  const TemplateView<T> points(&*first, n, K, true);
   // The mapping p, from rank to original index
-  vector<unsigned> rank2index(n);
-  for (size_t i = 0; i < n; i++)
-    rank2index.at(i) = i;
-
   Timer timer;
-  std::sort(rank2index.begin(), rank2index.end(),
-            [&points](unsigned i1, unsigned i2) {
-              return (points[i1] < points[i2]);
-            });
+  const vector<unsigned> rank2index =
+      SortTemplates(&*first, n, points.dim());
   timer.StopTimer();
-  if (_output_level == Info) {
+  if (output_level >= Info) {
     std::cout << "[INFO] Time consumed in presorting: "
               << timer.ElapsedSeconds() << "s\n";
   }
 
-  vector<KDPoint<T> > sorted_points(points.cbegin(), points.cend());
-  for (size_t i = 0; i < n; i++)
-    sorted_points[i] = points[rank2index[i]];
-
-  // MergeRepeatedPoints(sorted_points, rank2index);
-
-  const Bounds bounds = GetRankBounds(sorted_points, r);
-  vector<KDPoint<unsigned>> points_grid =
-      Map2Grid(sorted_points, rank2index, false);
-
-  vector<vector<unsigned>> sample_groups(n);
-  for (unsigned i = 0; i < sample_num * sample_size; ++i) {
-    unsigned index = indices[i];
-    points_grid[index].increase_count(1);
-    sample_groups[index].push_back(i / sample_size);
-  }
+  const Bounds bounds = GetRankBounds(points, rank2index, r);
+  // Map values of each coordinate to the rank given by sorting.
+  // Since the value at first dimension equal to the index of that point
+  // in the sorted array, we can reduce the dimension of the points by 1.
+  const vector<unsigned> index2rank = GetInverseMapCyclic(rank2index, K - 1);
 
-  // Construct kd tree.
-  vector<KDPoint<unsigned> > points_count;
+  // Only use non-auxiliary points to construct the kd tree.
   vector<unsigned> points_count_indices;
-  vector<vector<unsigned>> indices_count(sample_num);
   for (unsigned i = 0; i < n; i++) {
-    if (points_grid[i].count()) {
-      for (unsigned j = 0; j < sample_groups[i].size(); ++j) {
-        indices_count[sample_groups[i][j]].push_back(points_count.size());
-      }
-      points_count.push_back(points_grid[i]);
+    if (rank2index[i] < n - K + 1)
       points_count_indices.push_back(i);
-    }
   }
-
-  KDCountingTree2K<unsigned> tree(K - 1, points_count, _output_level);
-
-  // Perform counting.
-  // The number of nodes has been visited.
-  long long num_nodes = 0;
-  long long num_countrange_called = 0;
-  long long num_opened = 0;
-  unsigned upperbound_prev = 0;
-
+  const TemplateView<unsigned> points_count =
+      Map2Grid(index2rank, rank2index, points_count_indices, K - 1);
   const unsigned n_count = points_count.size();
+  for (unsigned index : indices) {
+    if (index >= n_count) {
+      MSG_ERROR(-1, "The sample index (%u) is out of range (%u).\n", index,
+                n_count);
+    }
+  }
 
   timer.SetStartingPointNow();
-  for (unsigned i = 0; i < n_count; ++i) {
-    points_count[i].set_count(0);
-  }
+  const unsigned num_workers = std::min(std::max(num_threads, 1u), sample_num);
   vector<long long> results(sample_num);
-  for (unsigned k = 0; k < sample_num; ++k) {
-    for (unsigned i = 0; i < indices_count[k].size(); ++i) {
-      points_count[indices_count[k][i]].increase_count(1);
+  // The number of nodes visited, the number of calls for CountRange() and
+  // the number of times to open node, of each worker.
+  vector<std::array<long long, 3> > worker_stats(num_workers);
+  const ImplicitKDCountingTree<unsigned> prototype(K - 1, points_count, Silent);
+  ParallelFor(num_workers, num_workers, [&](unsigned w) {
+    ImplicitKDCountingTree<unsigned> tree(prototype);
+    worker_stats[w].fill(0);
+    // The number of times each point is sampled in the current sample.
+    vector<int> counts(n_count, 0);
+    for (unsigned k = w; k < sample_num; k += num_workers) {
+      const unsigned *sample = indices.data() + k * sample_size;
+      for (unsigned i = 0; i < sample_size; ++i)
+        ++counts[sample[i]];
+      results[k] = SamplingCountA(tree, points_count, points_count_indices,
+                                  bounds, counts, against_all,
+                                  worker_stats[w]);
+      for (unsigned i = 0; i < sample_size; ++i)
+        counts[sample[i]] = 0;
     }
-    long long result = 0;
-    for (unsigned i = 0; i < n_count - 1; ++i) {
-      if (points_count[i].count() == 0)
-        continue;
-
-      // Close current node.
-      tree.Close(i);
-
-      const unsigned rank1 = points_count_indices[i];
-      unsigned upperbound = bounds.upper_bounds[rank1];
-      long long count_repeated =
-          static_cast<long long>(points_count[i].count());
-      result += (count_repeated - 1) * count_repeated / 2;
-
-      if (upperbound < points_count_indices[i + 1])
-        continue;
-
-      // Update tree.
-      if (upperbound_prev < rank1)
-        upperbound_prev = rank1;
-      unsigned j = i + 1;
-      while (j < n_count && points_count_indices[j] <= upperbound_prev)
-        ++j;
-      while (j < n_count && points_count_indices[j] <= upperbound) {
-        if (points_count[j].count()) {
-          tree.UpdateCount(j, points_count[j].count());
-          ++num_opened;
-        }
-        ++j;
-      }
-
-      const Range<unsigned> range =
-          GetHyperCube(points_count[i], bounds);
-      result += tree.CountRange(range, num_nodes) * count_repeated;
-      ++num_countrange_called;
-      upperbound_prev = upperbound;
-    }
-    tree.Close(n_count - 1);
-    results[k] = result;
-
-    // Close points for current sample group.
-    for (unsigned i = 0; i < indices_count[k].size(); ++i) {
-      points_count[indices_count[k][i]].set_count(0);
-    }
-  }
+  });
   timer.StopTimer();
 
-  if (_output_level >= Info) {
+  if (output_level >= Info) {
     std::cout << "[INFO] Time consumed in range counting: "
               << timer.ElapsedSeconds() << " seconds\n";
   }
-  if (_output_level == Debug) {
-    std::cout << "[DEBUG] The number of nodes (K = " << K << "): ";
-    std::cout << tree.num_nodes() << std::endl;
+  if (output_level == Debug) {
+    std::array<long long, 3> stats = {{0, 0, 0}};
+    for (const auto &worker : worker_stats) {
+      for (unsigned i = 0; i < 3; ++i)
+        stats[i] += worker[i];
+    }
+    std::cout << "[DEBUG] The number of copies of the tree: " << num_workers
+              << std::endl;
     std::cout << "[DEBUG] The number of leaf nodes (K = " << K << "): ";
     std::cout << n_count << std::endl;
     std::cout << "[DEBUG] The number of calls for CountRange(): ";
-    std::cout << num_countrange_called << std::endl;
+    std::cout << stats[1] << std::endl;
     std::cout << "[DEBUG] The number of times to open node: ";
-    std::cout << num_opened << std::endl;
+    std::cout << stats[2] << std::endl;
     std::cout << "[DEBUG] The number of nodes visited (K = " << K << "): ";
-    std::cout << num_nodes << std::endl;
+    std::cout << stats[0] << std::endl;
     std::cout << "[DEBUG] The numbers of the matched pairs: \n";
     for (unsigned i = 0; i < sample_num; ++i) {
       if (i)
@@ -471,239 +323,269 @@ vector<long long> MatchedPairsCalculatorSampling<T>::ComputeA(
         std::cout << results[i];
     }
     std::cout << std::endl;
-    for (unsigned i = 0; i < sample_num; ++i) {
-      std::cout << "[DEBUG] Sample indices (count): \n";
-      for (unsigned j = 0; j < sample_size; ++j) {
-        std::cout << indices_count[i][j] << ", ";
-      }
-      std::cout << std::endl;
-    }
   }
   return results;
 }
+} // namespace
 
-template <typename T>
-inline vector<long long>
-ABCalculatorLiu<T>::ComputeAB(typename vector<T>::const_iterator first,
-                              typename vector<T>::const_iterator last, T r) {
-  const unsigned n = last - first;
-  vector<T> data_(first, last);
-  // Add K - 1 auxiliary points.
-  T minimum = *std::min_element(first, last);
-  for (size_t i = 0; i < K; i++)
-    data_.push_back(minimum);
-  // Construct Points and merge repeated points.
-  const vector<KDPoint<T> > points =
-      GetKDPoints<T>(data_.cbegin(), data_.cend(), K + 1, 1);
-
-  vector<KDPoint<T> > sorted_points(points);
-  // The mapping p, from rank to original index
-  vector<unsigned> rank2index(n);
-  for (size_t i = 0; i < n; i++)
-    rank2index.at(i) = i;
 
-  Timer timer;
-  std::sort(rank2index.begin(), rank2index.end(),
-            [&points](unsigned i1, unsigned i2) {
-              return (points[i1] < points[i2]);
-            });
-  for (size_t i = 0; i < n; i++)
-    sorted_points[i] = points[rank2index[i]];
-  timer.StopTimer();
-  if (_output_level >= Info) {
-    std::cout << "[INFO] Time consumed in presorting: "
-              << timer.ElapsedSeconds() << " seconds\n";
+template <typename T>
+long long MatchedPairsCalculatorSampling2<T>::ComputeA(
+    typename vector<T>::const_iterator first,
+    typename vector<T>::const_iterator last, T r,
+    std::vector<unsigned> &sample_indices) {
+  for (size_t i = 1; i < sample_indices.size(); ++i) {
+    assert(sample_indices[i] > sample_indices[i - 1]);
   }
+  return ComputeASamplingKD<T>(first, last, r, K, 1, sample_indices, true,
+                               _num_threads, _output_level)[0];
+}
 
-  // MergeRepeatedPoints(sorted_points, rank2index);
-  CloseAuxiliaryPoints(sorted_points, rank2index);
 
-  const Bounds bounds = GetRankBounds(sorted_points, r);
-  const vector<KDPoint<unsigned> > points_grid =
-      Map2Grid(sorted_points, rank2index);
+template <typename T>
+vector<long long> MatchedPairsCalculatorSampling2<T>::ComputeA(
+    typename vector<T>::const_iterator first,
+    typename vector<T>::const_iterator last, T r, unsigned sample_num,
+    const vector<unsigned> &sample_indices) {
+  return ComputeASamplingKD<T>(first, last, r, K, sample_num, sample_indices,
+                               true, _num_threads, _output_level);
+}
 
-  // Construct kd tree.
-  vector<KDPoint<unsigned> > points_count;
-  vector<unsigned> points_count_indices;
-  for (unsigned i = 0; i < n; i++) {
-    if (points_grid[i].count()) {
-      points_count.push_back(points_grid[i]);
-      points_count_indices.push_back(i);
+
+vector<unsigned>
+MergeRepeatedIndices(typename vector<unsigned>::const_iterator first,
+                     typename vector<unsigned>::const_iterator last) {
+  size_t length = last - first;
+  vector<unsigned> counts(length, 0);
+  unsigned i = 0, k = 0;
+  while (i < length) {
+    unsigned count = 0;
+    while (k < length && *(first + k) == *(first + i)) {
+      ++k;
+      ++count;
     }
+    counts[i] = count;
+    i = k;
   }
-  KDTree2K<unsigned> tree(K - 1, points_count, _output_level);
+  return counts;
+}
 
-  // Perform counting.
-  vector<long long> result({0, 0});
-  // The number of nodes has been visited.
+
+template <typename T>
+vector<long long> MatchedPairsCalculatorSampling<T>::ComputeA(
+    typename vector<T>::const_iterator first,
+    typename vector<T>::const_iterator last, T r, unsigned sample_num,
+    const vector<unsigned> &indices) {
+  return ComputeASamplingKD<T>(first, last, r, K, sample_num, indices, false,
+                               _num_threads, _output_level);
+}
+
+// Statistics of the sliding range counting, for debugging.
+struct SlidingCountStats {
+  long long num_chunks = 0;
+  long long num_tree_nodes = 0;
   long long num_nodes = 0;
   long long num_countrange_called = 0;
   long long num_opened = 0;
-  unsigned upperbound_prev = 0;
-
-  const unsigned n_count = points_count.size();
+  void Add(const SlidingCountStats &stats) {
+    num_chunks += stats.num_chunks;
+    num_tree_nodes += stats.num_tree_nodes;
+    num_nodes += stats.num_nodes;
+    num_countrange_called += stats.num_countrange_called;
+    num_opened += stats.num_opened;
+  }
+};
+
+/*
+ * Count the matched pairs between the grid points points_count[i],
+ * first <= i < last, and the points after them (in the order of rank).
+ *
+ * The points are inserted into the tree when the upper bound of the current
+ * point reaches them, and removed when they become the current point. Since
+ * the upper bounds are nondecreasing, only the points up to the upper bound
+ * of points_count[last - 1] are ever needed, so the tree is built over
+ * these points only. Hence disjoint ranges of queries can be counted
+ * independently.
+ */
+template <typename Tree>
+vector<long long> SlidingCountAB(const TemplateView<unsigned> &points_count,
+                                 const vector<unsigned> &points_count_indices,
+                                 const Bounds &bounds, unsigned K,
+                                 unsigned first, unsigned last,
+                                 OutputLevel output_level,
+                                 SlidingCountStats &stats) {
+  const unsigned upperbound_last =
+      bounds.upper_bounds[points_count_indices[last - 1]];
+  unsigned end = std::upper_bound(points_count_indices.cbegin() + last,
+                                  points_count_indices.cend(),
+                                  upperbound_last) -
+                 points_count_indices.cbegin();
+  // The point following the last query is always needed.
+  if (end < last + 1)
+    end = last + 1;
+  Tree tree(K - 1, points_count.Slice(first, end), output_level);
+
+  // Indices relative to first.
+  const unsigned *ranks = points_count_indices.data() + first;
+  const unsigned n_local = end - first;
+  const unsigned n_query = last - first;
 
-  timer.SetStartingPointNow();
-  for (unsigned i = 0; i < n_count - 1; i++) {
+  vector<long long> result({0, 0});
+  unsigned upperbound_prev = 0;
+  for (unsigned i = 0; i < n_query; i++) {
     // Close current node.
     tree.Close(i);
 
-    const unsigned rank1 = points_count_indices[i];
+    const unsigned rank1 = ranks[i];
     unsigned upperbound = bounds.upper_bounds[rank1];
 
-    if (upperbound < points_count_indices[i + 1])
+    if (upperbound < ranks[i + 1])
       continue;
     // Update tree.
     if (upperbound_prev < rank1)
       upperbound_prev = rank1;
     unsigned j = i + 1;
-    while (j < n_count && points_count_indices[j] <= upperbound_prev)
+    while (j < n_local && ranks[j] <= upperbound_prev)
       ++j;
-    while (j < n_count && points_count_indices[j] <= upperbound) {
-      tree.UpdateCount(j, points_count[j].count());
-      ++num_opened;
+    while (j < n_local && ranks[j] <= upperbound) {
+      tree.UpdateCount(j, 1);
+      ++stats.num_opened;
       ++j;
     }
 
-    const Range<unsigned> range = GetHyperCube(points_count[i], bounds);
-    vector<long long> ab = tree.CountRange(range, num_nodes);
+    const Range<unsigned> range =
+        GetHyperCube(points_count[first + i], bounds);
+    vector<long long> ab = tree.CountRange(range, stats.num_nodes);
 
     result[0] += ab[0];
     result[1] += ab[1];
-    ++num_countrange_called;
+    ++stats.num_countrange_called;
     upperbound_prev = upperbound;
   }
-  timer.StopTimer();
+  ++stats.num_chunks;
+  stats.num_tree_nodes += tree.num_nodes();
+  return result;
+}
 
-  if (_output_level >= Info) {
-    std::cout << "[INFO] Time consumed in range counting: "
-              << timer.ElapsedSeconds() << " seconds\n";
-  }
-  if (_output_level == Debug) {
-    std::cout << "[DEBUG] The number of nodes (K = " << K << "): ";
-    std::cout << tree.num_nodes() << std::endl;
-    std::cout << "[DEBUG] The number of leaf nodes (K = " << K << "): ";
-    std::cout << n_count << std::endl;
-    std::cout << "[DEBUG] The number of calls for CountRange(): ";
-    std::cout << num_countrange_called << std::endl;
-    std::cout << "[DEBUG] The number times to open node: ";
-    std::cout << num_opened << std::endl;
-    std::cout << "[DEBUG] The number of nodes visited (K = " << K << "): ";
-    std::cout << num_nodes << std::endl;
-  }
+/*
+ * Run SlidingCountAB over all the points. With more than one thread, the
+ * queries are split into chunks of consecutive ranks which are counted
+ * concurrently, each with its own tree. There are a few more chunks than
+ * threads, since the chunks are not equally expensive. The results are
+ * summed up in the order of chunks.
+ */
+template <typename Tree>
+vector<long long> ParallelSlidingCountAB(
+    const TemplateView<unsigned> &points_count,
+    const vector<unsigned> &points_count_indices, const Bounds &bounds,
+    unsigned K, unsigned num_threads, OutputLevel output_level,
+    SlidingCountStats &stats) {
+  const unsigned num_queries = points_count.size() - 1;
+  unsigned num_chunks = num_threads > 1 ? 4 * num_threads : 1;
+  if (num_chunks > num_queries)
+    num_chunks = num_queries;
+
+  vector<vector<long long> > chunk_results(num_chunks);
+  vector<SlidingCountStats> chunk_stats(num_chunks);
+  ParallelFor(num_chunks, num_threads, [&](unsigned c) {
+    const unsigned first =
+        static_cast<unsigned long long>(num_queries) * c / num_chunks;
+    const unsigned last =
+        static_cast<unsigned long long>(num_queries) * (c + 1) / num_chunks;
+    chunk_results[c] = SlidingCountAB<Tree>(
+        points_count, points_count_indices, bounds, K, first, last,
+        output_level, chunk_stats[c]);
+  });
 
+  vector<long long> result({0, 0});
+  for (unsigned c = 0; c < num_chunks; ++c) {
+    result[0] += chunk_results[c][0];
+    result[1] += chunk_results[c][1];
+    stats.Add(chunk_stats[c]);
+  }
   return result;
 }
 
-
+/*
+ * Presort the templates of [first, last) and map the non-auxiliary points to
+ * grid points, all in buffers. The result is a view over buffers.index2rank,
+ * whose offsets are to be given back to buffers.grid_offsets.
+ */
 template <typename T>
-inline vector<long long>
-ABCalculatorRKD<T>::ComputeAB(typename vector<T>::const_iterator first,
-                              typename vector<T>::const_iterator last, T r) {
+TemplateView<unsigned> GetGridPoints(typename vector<T>::const_iterator first,
+                                     typename vector<T>::const_iterator last,
+                                     unsigned K, KDGridBuffers<T> &buffers,
+                                     OutputLevel output_level) {
   const unsigned n = last - first;
-  vector<T> data_(first, last);
-  // Add K - 1 auxiliary points.
-  T minimum = *std::min_element(first, last);
-  for (size_t i = 0; i < K; i++)
-    data_.push_back(minimum);
-  // Construct Points and merge repeated points.
-  const vector<KDPoint<T> > points =
-      GetKDPoints<T>(data_.cbegin(), data_.cend(), K + 1, 1);
-
-  vector<KDPoint<T> > sorted_points(points.size());
   // The mapping p, from rank to original index
-  vector<unsigned> rank2index(n);
-  for (size_t i = 0; i < n; i++)
-    rank2index.at(i) = i;
-
   Timer timer;
-  std::sort(rank2index.begin(), rank2index.end(),
-            [&points](unsigned i1, unsigned i2) {
-              return (points[i1] < points[i2]);
-            });
-  for (size_t i = 0; i < n; i++)
-    sorted_points[i] = points[rank2index[i]];
+  SortTemplates(&*first, n, K + 1, buffers.rank2index, buffers.sort);
   timer.StopTimer();
-  if (_output_level >= Info) {
+  if (output_level >= Info) {
     std::cout << "[INFO] Time consumed in presorting: "
               << timer.ElapsedSeconds() << " seconds\n";
   }
 
-  // MergeRepeatedPoints(sorted_points, rank2index);
-  CloseAuxiliaryPoints(sorted_points, rank2index);
-
-  const Bounds bounds = GetRankBounds(sorted_points, r);
-  const vector<KDPoint<unsigned> > points_grid =
-      Map2Grid(sorted_points, rank2index);
-
-  // Construct kd tree.
-  vector<KDPointRKD<unsigned> > points_count;
-  vector<unsigned> points_count_indices;
+  const vector<unsigned> &rank2index = buffers.rank2index;
+  GetInverseMapCyclic(rank2index, K, buffers.index2rank);
+  vector<unsigned> &points_count_indices = buffers.points_count_indices;
+  points_count_indices.clear();
   for (unsigned i = 0; i < n; i++) {
-    if (points_grid[i].count()) {
-      points_count.push_back(KDPointRKD<unsigned>(points_grid[i]));
+    if (rank2index[i] < n - K)
       points_count_indices.push_back(i);
-    }
   }
-  RangeKDTree2K<unsigned> tree(K - 1, points_count, _output_level);
-
-  // Perform counting.
-  vector<long long> result({0, 0});
-  // The number of nodes has been visited.
-  long long num_nodes = 0;
-  long long num_countrange_called = 0;
-  long long num_opened = 0;
-  unsigned upperbound_prev = 0;
+  return Map2Grid(buffers.index2rank, rank2index, points_count_indices, K,
+                  std::move(buffers.grid_offsets));
+}
 
+/*
+ * The common part of the single threshold ABCalculatorLiu::ComputeAB and
+ * ABCalculatorRKD::ComputeAB, which differ only in the type of the tree.
+ */
+template <typename Tree, typename T>
+vector<long long> ComputeABSlidingKD(typename vector<T>::const_iterator first,
+                                     typename vector<T>::const_iterator last,
+                                     T r, unsigned K, unsigned num_threads,
+                                     OutputLevel output_level,
+                                     KDGridBuffers<T> &buffers) {
+  const unsigned n = last - first;
+  const TemplateView<T> points(&*first, n, K + 1, true);
+  TemplateView<unsigned> points_count =
+      GetGridPoints(first, last, K, buffers, output_level);
+  GetRankBounds(points, buffers.rank2index, r, buffers.bounds,
+                buffers.values);
   const unsigned n_count = points_count.size();
-
-  timer.SetStartingPointNow();
-  for (unsigned i = 0; i < n_count - 1; i++) {
-    // Close current node.
-    tree.Close(i);
-
-    const unsigned rank1 = points_count_indices[i];
-    unsigned upperbound = bounds.upper_bounds[rank1];
-
-    if (upperbound < points_count_indices[i + 1])
-      continue;
-    // Update tree.
-    if (upperbound_prev < rank1)
-      upperbound_prev = rank1;
-    unsigned j = i + 1;
-    while (j < n_count && points_count_indices[j] <= upperbound_prev)
-      ++j;
-    while (j < n_count && points_count_indices[j] <= upperbound) {
-      tree.UpdateCount(j, points_count[j].count());
-      ++num_opened;
-      ++j;
-    }
-
-    const Range<unsigned> range = GetHyperCube(points_count[i], bounds);
-    vector<long long> ab = tree.CountRange(range, num_nodes);
-
-    result[0] += ab[0];
-    result[1] += ab[1];
-    ++num_countrange_called;
-    upperbound_prev = upperbound;
+  if (n_count < 2) {
+    buffers.grid_offsets = points_count.ReleaseOffsets();
+    return vector<long long>({0, 0});
   }
+
+  // Construct kd trees over the grid points of the non-auxiliary points.
+  Timer timer;
+  SlidingCountStats stats;
+  vector<long long> result = ParallelSlidingCountAB<Tree>(
+      points_count, buffers.points_count_indices, buffers.bounds, K,
+      num_threads, output_level, stats);
   timer.StopTimer();
+  buffers.grid_offsets = points_count.ReleaseOffsets();
 
-  if (_output_level >= Info) {
+  if (output_level >= Info) {
     std::cout << "[INFO] Time consumed in range counting: "
               << timer.ElapsedSeconds() << " seconds\n";
   }
-  if (_output_level == Debug) {
+  if (output_level == Debug) {
+    std::cout << "[DEBUG] The number of chunks: ";
+    std::cout << stats.num_chunks << std::endl;
     std::cout << "[DEBUG] The number of nodes (K = " << K << "): ";
-    std::cout << tree.num_nodes() << std::endl;
+    std::cout << stats.num_tree_nodes << std::endl;
     std::cout << "[DEBUG] The number of leaf nodes (K = " << K << "): ";
     std::cout << n_count << std::endl;
     std::cout << "[DEBUG] The number of calls for CountRange(): ";
-    std::cout << num_countrange_called << std::endl;
+    std::cout << stats.num_countrange_called << std::endl;
     std::cout << "[DEBUG] The number times to open node: ";
-    std::cout << num_opened << std::endl;
+    std::cout << stats.num_opened << std::endl;
     std::cout << "[DEBUG] The number of nodes visited (K = " << K << "): ";
-    std::cout << num_nodes << std::endl;
+    std::cout << stats.num_nodes << std::endl;
   }
 
   return result;
@@ -711,73 +593,51 @@ ABCalculatorRKD<T>::ComputeAB(typename vector<T>::const_iterator first,
 
 
 template <typename T>
-vector<long long> ABCalculatorSamplingLiu<T>::ComputeAB(
-    typename vector<T>::const_iterator first,
-    typename vector<T>::const_iterator last, unsigned sample_num,
-    const vector<unsigned> &sample_indices, T r) {
-  const unsigned n = last - first;
-  vector<T> data_(first, last);
-  // Add K auxiliary points.
-  T minimum = *std::min_element(first, last);
-  for (size_t i = 0; i < K; i++)
-    data_.push_back(minimum);
-  // Construct Points and merge repeated points.
-  const vector<KDPoint<T>> points =
-      GetKDPoints<T>(data_.cbegin(), data_.cend(), K + 1, 1);
-
-  vector<KDPoint<T> > sorted_points(points);
-  // The mapping p, from rank to original index
-  vector<unsigned> rank2index(n);
-  for (size_t i = 0; i < n; i++)
-    rank2index.at(i) = i;
-
-  Timer timer;
-  std::sort(rank2index.begin(), rank2index.end(),
-            [&points](unsigned i1, unsigned i2) {
-              return (points[i1] < points[i2]);
-            });
-  for (size_t i = 0; i < n; i++)
-    sorted_points[i] = points[rank2index[i]];
-  timer.StopTimer();
-  if (_output_level >= Info) {
-    std::cout << "[INFO] Time consumed in presorting: "
-              << timer.ElapsedSeconds() << "s\n";
-  }
-
-  const Bounds bounds = GetRankBounds(sorted_points, r);
-  vector<KDPoint<unsigned> > points_grid =
-      Map2Grid(sorted_points, rank2index);
+inline vector<long long>
+ABCalculatorLiu<T>::ComputeAB(typename vector<T>::const_iterator first,
+                              typename vector<T>::const_iterator last, T r) {
+  return ComputeABSlidingKD<ImplicitKDTree<unsigned>, T>(
+      first, last, r, K, _num_threads, _output_level, _buffers);
+}
 
 
-  // Construct kd tree.
-  vector<KDPoint<unsigned> > points_count;
-  vector<unsigned> points_count_indices;
-  vector<vector<unsigned>> indices_count(sample_num);
-  for (unsigned i = 0; i < n; i++) {
-    if (points_grid[i].count()) {
-      points_count.push_back(points_grid[i]);
-      points_count_indices.push_back(i);
-    }
+template <typename T>
+inline vector<long long>
+ABCalculatorRKD<T>::ComputeAB(typename vector<T>::const_iterator first,
+                              typename vector<T>::const_iterator last, T r) {
+  if (_cascade_counts) {
+    return ComputeABSlidingKD<
+        RangeKDTree2K<unsigned, LastAxisCascadeCounts<unsigned> >, T>(
+        first, last, r, K, _num_threads, _output_level, _buffers);
   }
-  KDTree2K<unsigned> tree(K - 1, points_count, _output_level);
-
-  // The number of nodes has been visited.
-  long long num_nodes = 0;
-  long long num_countrange_called = 0;
-  long long num_opened = 0;
-  unsigned upperbound_prev = 0;
-
-  const unsigned n_count = points_count.size();
+  return ComputeABSlidingKD<RangeKDTree2K<unsigned>, T>(
+      first, last, r, K, _num_threads, _output_level, _buffers);
+}
 
 
-  for (size_t i = 0; i < sample_indices.size() - 1; ++i) {
-    assert(sample_indices[i + 1] > sample_indices[i]);
+/*
+ * Count the matched pairs between the sampled grid points
+ * points_count[sample_indices[k]], 0 <= k < sample_size, and the points after
+ * them (in the order of rank). The sample indices must be increasing. All
+ * the points are closed afterwards, so that the tree can be reused.
+ */
+template <typename Tree>
+vector<long long> SamplingSlidingCountAB(
+    Tree &tree, const TemplateView<unsigned> &points_count,
+    const vector<unsigned> &points_count_indices, const Bounds &bounds,
+    const unsigned *sample_indices, unsigned sample_size,
+    SlidingCountStats &stats) {
+  for (unsigned k = 1; k < sample_size; ++k) {
+    assert(sample_indices[k] > sample_indices[k - 1]);
   }
-  timer.SetStartingPointNow();
-  int i_sample_indices = 0;
-  long long result_a = 0;
-  long long result_b = 0;
-  for (unsigned i = 0; i < n_count - 1; ++i) {
+  const unsigned n_count = points_count.size();
+  unsigned i_sample_indices = 0;
+  unsigned upperbound_prev = 0;
+  // The points before j_end may have been opened.
+  unsigned j_end = 0;
+  vector<long long> result({0, 0});
+  for (unsigned i = 0; i + 1 < n_count && i_sample_indices < sample_size;
+       ++i) {
     const unsigned rank1 = points_count_indices[i];
     unsigned upperbound = bounds.upper_bounds[rank1];
 
@@ -803,178 +663,360 @@ vector<long long> ABCalculatorSamplingLiu<T>::ComputeAB(
     while (j < n_count && points_count_indices[j] <= upperbound_prev)
       ++j;
     while (j < n_count && points_count_indices[j] <= upperbound) {
-      tree.UpdateCount(j, points_count[j].count());
-      ++num_opened;
+      tree.UpdateCount(j, 1);
+      ++stats.num_opened;
       ++j;
     }
+    if (j_end < j)
+      j_end = j;
 
     const Range<unsigned> range = GetHyperCube(points_count[i], bounds);
-    const auto ab = tree.CountRange(range, num_nodes);
-    result_a += ab[0];
-    result_b += ab[1];
-    ++num_countrange_called;
+    const auto ab = tree.CountRange(range, stats.num_nodes);
+    result[0] += ab[0];
+    result[1] += ab[1];
+    ++stats.num_countrange_called;
     upperbound_prev = upperbound;
     ++i_sample_indices;
   }
+  for (unsigned k = 0; k < j_end; ++k)
+    tree.Close(k);
+  return result;
+}
+
+/*
+ * Run SamplingSlidingCountAB for each of the sample_num samples, which are
+ * stored one after another in sample_indices. The samples are distributed
+ * over the threads in a round robin manner. The tree is built once, and each
+ * thread counts on its own copy, which is reused for all of its samples. The
+ * copies share the geometry of the tree and only have their own counts, so
+ * a thread costs a count array rather than a tree.
+ *
+ * @return {a_0, b_0, a_1, b_1, ...}, where (a_k, b_k) is the result of the
+ * k-th sample.
+ */
+template <typename Tree>
+vector<long long> ParallelSamplingCountAB(
+    const TemplateView<unsigned> &points_count,
+    const vector<unsigned> &points_count_indices, const Bounds &bounds,
+    unsigned K, unsigned sample_num, const vector<unsigned> &sample_indices,
+    unsigned num_threads, OutputLevel output_level, SlidingCountStats &stats) {
+  const unsigned sample_size = sample_indices.size() / sample_num;
+  const unsigned num_workers = std::min(std::max(num_threads, 1u), sample_num);
+
+  vector<long long> results(2 * sample_num, 0);
+  vector<SlidingCountStats> worker_stats(num_workers);
+  const Tree prototype(K - 1, points_count, output_level);
+  ParallelFor(num_workers, num_workers, [&](unsigned w) {
+    Tree tree(prototype);
+    for (unsigned s = w; s < sample_num; s += num_workers) {
+      const vector<long long> ab = SamplingSlidingCountAB(
+          tree, points_count, points_count_indices, bounds,
+          sample_indices.data() + s * sample_size, sample_size,
+          worker_stats[w]);
+      results[2 * s] = ab[0];
+      results[2 * s + 1] = ab[1];
+    }
+    ++worker_stats[w].num_chunks;
+  });
+  for (unsigned w = 0; w < num_workers; ++w)
+    stats.Add(worker_stats[w]);
+  stats.num_tree_nodes += prototype.num_nodes();
+  return results;
+}
 
+/*
+ * The common part of ABCalculatorSamplingLiu and ABCalculatorSamplingRKD,
+ * which differ only in the type of the tree.
+ */
+template <typename Tree, typename T>
+vector<long long> ComputeABSamplingKD(
+    typename vector<T>::const_iterator first,
+    typename vector<T>::const_iterator last, T r, unsigned K,
+    unsigned sample_num, const vector<unsigned> &sample_indices,
+    unsigned num_threads, OutputLevel output_level) {
+  const unsigned n = last - first;
+  assert(sample_num > 0 && sample_indices.size() % sample_num == 0);
+  assert(n - K + 1 >= sample_indices.size() / sample_num);
+  const TemplateView<T> points(&*first, n, K + 1, true);
+  // The mapping p, from rank to original index
+  Timer timer;
+  const vector<unsigned> rank2index =
+      SortTemplates(&*first, n, points.dim());
   timer.StopTimer();
+  if (output_level >= Info) {
+    std::cout << "[INFO] Time consumed in presorting: "
+              << timer.ElapsedSeconds() << "s\n";
+  }
 
-  if (_output_level >= Info) {
+  const Bounds bounds = GetRankBounds(points, rank2index, r);
+  const vector<unsigned> index2rank = GetInverseMapCyclic(rank2index, K);
+
+  // The grid points of the non-auxiliary points.
+  vector<unsigned> points_count_indices;
+  for (unsigned i = 0; i < n; i++) {
+    if (rank2index[i] < n - K)
+      points_count_indices.push_back(i);
+  }
+  const TemplateView<unsigned> points_count =
+      Map2Grid(index2rank, rank2index, points_count_indices, K);
+
+  timer.SetStartingPointNow();
+  SlidingCountStats stats;
+  vector<long long> results = ParallelSamplingCountAB<Tree>(
+      points_count, points_count_indices, bounds, K, sample_num,
+      sample_indices, num_threads, output_level, stats);
+  timer.StopTimer();
+
+  if (output_level >= Info) {
     std::cout << "[INFO] Time consumed in range counting: "
               << timer.ElapsedSeconds() << " seconds\n";
   }
-  if (_output_level == Debug) {
+  if (output_level == Debug) {
+    std::cout << "[DEBUG] The number of copies of the tree: ";
+    std::cout << stats.num_chunks << std::endl;
     std::cout << "[DEBUG] The number of nodes (K = " << K << "): ";
-    std::cout << tree.num_nodes() << std::endl;
+    std::cout << stats.num_tree_nodes << std::endl;
     std::cout << "[DEBUG] The number of leaf nodes (K = " << K << "): ";
-    std::cout << n_count << std::endl;
+    std::cout << points_count.size() << std::endl;
     std::cout << "[DEBUG] The number of calls for CountRange(): ";
-    std::cout << num_countrange_called << std::endl;
+    std::cout << stats.num_countrange_called << std::endl;
     std::cout << "[DEBUG] The number times to open node: ";
-    std::cout << num_opened << std::endl;
+    std::cout << stats.num_opened << std::endl;
     std::cout << "[DEBUG] The number of nodes visited (K = " << K << "): ";
-    std::cout << num_nodes << std::endl;
+    std::cout << stats.num_nodes << std::endl;
   }
-  vector<long long> results(2);
-  results[0] = result_a;
-  results[1] = result_b;
   return results;
 }
 
 
+template <typename T>
+vector<long long> ABCalculatorSamplingLiu<T>::ComputeAB(
+    typename vector<T>::const_iterator first,
+    typename vector<T>::const_iterator last, T r, unsigned sample_num,
+    const vector<unsigned> &sample_indices) {
+  return ComputeABSamplingKD<ImplicitKDTree<unsigned>, T>(
+      first, last, r, K, sample_num, sample_indices, _num_threads,
+      _output_level);
+}
+
+
 template <typename T>
 vector<long long> ABCalculatorSamplingRKD<T>::ComputeAB(
     typename vector<T>::const_iterator first,
-    typename vector<T>::const_iterator last, T r,
+    typename vector<T>::const_iterator last, T r, unsigned sample_num,
     const vector<unsigned> &sample_indices) {
+  if (_cascade_counts) {
+    return ComputeABSamplingKD<
+        RangeKDTree2K<unsigned, LastAxisCascadeCounts<unsigned> >, T>(
+        first, last, r, K, sample_num, sample_indices, _num_threads,
+        _output_level);
+  }
+  return ComputeABSamplingKD<RangeKDTree2K<unsigned>, T>(
+      first, last, r, K, sample_num, sample_indices, _num_threads,
+      _output_level);
+}
+
+
+/*
+ * The common part of the multi-threshold ABCalculatorLiu::ComputeAB and
+ * ABCalculatorRKD::ComputeAB. The grid points depend on the ranks only, so
+ * the tree built over them serves every threshold: each threshold is a pass
+ * of SamplingSlidingCountAB with all the points as the sample, which leaves
+ * the tree closed for the next threshold. The thresholds are distributed
+ * among the workers, each with a copy of one tree, i.e. with its own counts
+ * over the shared geometry.
+ */
+template <typename Tree, typename T>
+vector<long long> ComputeABMultiRKD(typename vector<T>::const_iterator first,
+                                    typename vector<T>::const_iterator last,
+                                    const vector<T> &r, unsigned K,
+                                    unsigned num_threads,
+                                    OutputLevel output_level,
+                                    KDGridBuffers<T> &buffers) {
   const unsigned n = last - first;
-  assert(n - K + 1 >= sample_indices.size());
-  vector<T> data_(first, last);
-  // Add K auxiliary points.
-  T minimum = *std::min_element(first, last);
-  for (size_t i = 0; i < K; i++)
-    data_.push_back(minimum);
-  // Construct Points and set the count of auxiliary point to 0.
-  vector<KDPoint<T>> points =
-      GetKDPoints<T>(data_.cbegin(), data_.cend(), K + 1, 1);
-  for (size_t i = points.size() - K; i < points.size(); ++i) {
-    points[i].set_count(0);
-  }
-
-  vector<KDPoint<T> > sorted_points(points);
-  // The mapping p, from rank to original index
-  vector<unsigned> rank2index(n);
-  for (size_t i = 0; i < n; i++)
-    rank2index.at(i) = i;
+  const unsigned num_r = r.size();
+  vector<long long> results(2 * num_r, 0);
+  const TemplateView<T> points(&*first, n, K + 1, true);
+  TemplateView<unsigned> points_count =
+      GetGridPoints(first, last, K, buffers, output_level);
+  const vector<unsigned> &rank2index = buffers.rank2index;
+  const vector<unsigned> &points_count_indices = buffers.points_count_indices;
+  const unsigned n_count = points_count.size();
+  if (n_count < 2 || num_r == 0) {
+    buffers.grid_offsets = points_count.ReleaseOffsets();
+    return results;
+  }
+  vector<unsigned> all_indices(n_count);
+  std::iota(all_indices.begin(), all_indices.end(), 0);
 
   Timer timer;
-  std::sort(rank2index.begin(), rank2index.end(),
-            [&points](unsigned i1, unsigned i2) {
-              return (points[i1] < points[i2]);
-            });
-
+  const unsigned num_workers = std::min(std::max(num_threads, 1u), num_r);
+  vector<SlidingCountStats> worker_stats(num_workers);
+  const Tree prototype(K - 1, points_count, output_level);
+  ParallelFor(num_workers, num_workers, [&](unsigned w) {
+    Tree tree(prototype);
+    Bounds bounds;
+    vector<T> values;
+    for (unsigned k = w; k < num_r; k += num_workers) {
+      GetRankBounds(points, rank2index, r[k], bounds, values);
+      const vector<long long> ab = SamplingSlidingCountAB(
+          tree, points_count, points_count_indices, bounds,
+          all_indices.data(), n_count, worker_stats[w]);
+      results[2 * k] = ab[0];
+      results[2 * k + 1] = ab[1];
+    }
+    ++worker_stats[w].num_chunks;
+  });
+  SlidingCountStats stats;
+  for (unsigned w = 0; w < num_workers; ++w)
+    stats.Add(worker_stats[w]);
+  stats.num_tree_nodes = prototype.num_nodes();
   timer.StopTimer();
-  if (_output_level >= Info) {
-    std::cout << "[INFO] Time consumed in presorting: "
-              << timer.ElapsedSeconds() << "s\n";
+  buffers.grid_offsets = points_count.ReleaseOffsets();
+
+  if (output_level >= Info) {
+    std::cout << "[INFO] Time consumed in range counting (" << num_r
+              << " thresholds): " << timer.ElapsedSeconds() << " seconds\n";
   }
+  if (output_level == Debug) {
+    std::cout << "[DEBUG] The number of copies of the tree: ";
+    std::cout << stats.num_chunks << std::endl;
+    std::cout << "[DEBUG] The number of nodes (K = " << K << "): ";
+    std::cout << stats.num_tree_nodes << std::endl;
+    std::cout << "[DEBUG] The number of calls for CountRange(): ";
+    std::cout << stats.num_countrange_called << std::endl;
+    std::cout << "[DEBUG] The number times to open node: ";
+    std::cout << stats.num_opened << std::endl;
+    std::cout << "[DEBUG] The number of nodes visited (K = " << K << "): ";
+    std::cout << stats.num_nodes << std::endl;
+  }
+  return results;
+}
 
-  for (size_t i = 0; i < n; i++)
-    sorted_points[i] = points[rank2index[i]];
 
-  const Bounds bounds = GetRankBounds(sorted_points, r);
-  vector<KDPoint<unsigned> > points_grid =
-      Map2Grid(sorted_points, rank2index);
+template <typename T>
+vector<long long>
+ABCalculatorLiu<T>::ComputeAB(typename vector<T>::const_iterator first,
+                              typename vector<T>::const_iterator last,
+                              const vector<T> &r) {
+  return ComputeABMultiRKD<ImplicitKDTree<unsigned>, T>(
+      first, last, r, K, _num_threads, _output_level, _buffers);
+}
 
-  // Construct kd tree.
-  vector<KDPointRKD<unsigned> > points_count;
-  vector<unsigned> points_count_indices;
-  for (unsigned i = 0; i < n; i++) {
-    if (points_grid[i].count()) {
-      points_count.push_back(points_grid[i]);
-      points_count_indices.push_back(i);
-    }
-  }
-  RangeKDTree2K<unsigned> tree(K - 1, points_count, _output_level);
 
-  // Perform counting.
-  long long result_a = 0;
-  long long result_b = 0;
-  // The number of nodes has been visited.
-  long long num_nodes = 0;
-  long long num_countrange_called = 0;
-  long long num_opened = 0;
-  unsigned upperbound_prev = 0;
+template <typename T>
+vector<long long>
+ABCalculatorRKD<T>::ComputeAB(typename vector<T>::const_iterator first,
+                              typename vector<T>::const_iterator last,
+                              const vector<T> &r) {
+  if (_cascade_counts) {
+    return ComputeABMultiRKD<
+        RangeKDTree2K<unsigned, LastAxisCascadeCounts<unsigned> >, T>(
+        first, last, r, K, _num_threads, _output_level, _buffers);
+  }
+  return ComputeABMultiRKD<RangeKDTree2K<unsigned>, T>(
+      first, last, r, K, _num_threads, _output_level, _buffers);
+}
 
-  const unsigned n_count = points_count.size();
-  int i_sample_indices = 0;
 
-  for (size_t i = 0; i < sample_indices.size() - 1; ++i) {
-    assert(sample_indices[i + 1] > sample_indices[i]);
+/*
+ * The common part of ABCalculatorLiu::ComputeABMultiM and
+ * ABCalculatorRKD::ComputeABMultiM. The order of the (max_m + 1)-templates
+ * is also an order of the shorter templates, and the rank bounds only
+ * depend on the first coordinate, so the presorting, the bounds and the
+ * inverse map are computed once. The grid points of the template length K
+ * are the windows of length K of the inverse map (see Map2Grid), restricted
+ * to the non-auxiliary points of that length.
+ */
+template <typename Tree, typename T>
+vector<long long> ComputeABMultiMKD(typename vector<T>::const_iterator first,
+                                    typename vector<T>::const_iterator last,
+                                    T r, unsigned min_m, unsigned max_m,
+                                    unsigned num_threads,
+                                    OutputLevel output_level) {
+  assert(2 <= min_m && min_m <= max_m);
+  const unsigned n = last - first;
+  vector<long long> results;
+  const TemplateView<T> points(&*first, n, max_m + 1, true);
+  // The mapping p, from rank to original index
+  Timer timer;
+  const vector<unsigned> rank2index =
+      SortTemplates(&*first, n, points.dim());
+  timer.StopTimer();
+  if (output_level >= Info) {
+    std::cout << "[INFO] Time consumed in presorting: "
+              << timer.ElapsedSeconds() << " seconds\n";
   }
-  timer.SetStartingPointNow();
-  for (unsigned i = 0; i < n_count - 1; ++i) {
-    const unsigned rank1 = points_count_indices[i];
-    unsigned upperbound = bounds.upper_bounds[rank1];
 
-    // Close nodes whose value of the first dimension are outside bounds.
-    if (i_sample_indices > 0) {
-      for (unsigned k = sample_indices[i_sample_indices - 1] + 1; k <= i; ++k) {
-        tree.Close(k);
-      }
-    }
+  const Bounds bounds = GetRankBounds(points, rank2index, r);
+  const vector<unsigned> index2rank = GetInverseMapCyclic(rank2index, max_m);
 
-    if (sample_indices[i_sample_indices] != i) {
-      continue;
+  for (unsigned K = min_m; K <= max_m; ++K) {
+    // The grid points of the non-auxiliary points.
+    vector<unsigned> points_count_indices;
+    for (unsigned i = 0; i < n; i++) {
+      if (rank2index[i] + K < n)
+        points_count_indices.push_back(i);
     }
-    if (upperbound < points_count_indices[i + 1]) {
-      ++i_sample_indices;
+    const TemplateView<unsigned> points_count =
+        Map2Grid(index2rank, rank2index, points_count_indices, K);
+    if (points_count.size() < 2) {
+      results.push_back(0);
+      results.push_back(0);
       continue;
     }
 
-    // Update tree.
-    if (upperbound_prev < rank1)
-      upperbound_prev = rank1;
-    unsigned j = i + 1;
-    while (j < n_count && points_count_indices[j] <= upperbound_prev)
-      ++j;
-    while (j < n_count && points_count_indices[j] <= upperbound) {
-      tree.UpdateCount(j, points_count[j].count());
-      ++num_opened;
-      ++j;
+    timer.SetStartingPointNow();
+    SlidingCountStats stats;
+    const vector<long long> ab = ParallelSlidingCountAB<Tree>(
+        points_count, points_count_indices, bounds, K, num_threads,
+        output_level, stats);
+    timer.StopTimer();
+    results.insert(results.end(), ab.begin(), ab.end());
+
+    if (output_level >= Info) {
+      std::cout << "[INFO] Time consumed in range counting (m = " << K
+                << "): " << timer.ElapsedSeconds() << " seconds\n";
+    }
+    if (output_level == Debug) {
+      std::cout << "[DEBUG] The number of chunks: ";
+      std::cout << stats.num_chunks << std::endl;
+      std::cout << "[DEBUG] The number of nodes (K = " << K << "): ";
+      std::cout << stats.num_tree_nodes << std::endl;
+      std::cout << "[DEBUG] The number of calls for CountRange(): ";
+      std::cout << stats.num_countrange_called << std::endl;
+      std::cout << "[DEBUG] The number times to open node: ";
+      std::cout << stats.num_opened << std::endl;
+      std::cout << "[DEBUG] The number of nodes visited (K = " << K << "): ";
+      std::cout << stats.num_nodes << std::endl;
     }
-
-    const Range<unsigned> range = GetHyperCube(points_count[i], bounds);
-    const auto ab = tree.CountRange(range, num_nodes);
-    result_a += ab[0];
-    result_b += ab[1];
-    ++num_countrange_called;
-    upperbound_prev = upperbound;
-    ++i_sample_indices;
   }
+  return results;
+}
 
-  timer.StopTimer();
 
-  if (_output_level >= Info) {
-    std::cout << "[INFO] Time consumed in range counting: "
-              << timer.ElapsedSeconds() << " seconds\n";
-  }
-  if (_output_level == Debug) {
-    std::cout << "[DEBUG] The number of nodes (K = " << K << "): ";
-    std::cout << tree.num_nodes() << std::endl;
-    std::cout << "[DEBUG] The number of leaf nodes (K = " << K << "): ";
-    std::cout << n_count << std::endl;
-    std::cout << "[DEBUG] The number of calls for CountRange(): ";
-    std::cout << num_countrange_called << std::endl;
-    std::cout << "[DEBUG] The number times to open node: ";
-    std::cout << num_opened << std::endl;
-    std::cout << "[DEBUG] The number of nodes visited (K = " << K << "): ";
-    std::cout << num_nodes << std::endl;
+template <typename T>
+vector<long long>
+ABCalculatorLiu<T>::ComputeABMultiM(typename vector<T>::const_iterator first,
+                                    typename vector<T>::const_iterator last,
+                                    T r, unsigned max_m) {
+  return ComputeABMultiMKD<ImplicitKDTree<unsigned>, T>(
+      first, last, r, K, max_m, _num_threads, _output_level);
+}
+
+
+template <typename T>
+vector<long long>
+ABCalculatorRKD<T>::ComputeABMultiM(typename vector<T>::const_iterator first,
+                                    typename vector<T>::const_iterator last,
+                                    T r, unsigned max_m) {
+  if (_cascade_counts) {
+    return ComputeABMultiMKD<
+        RangeKDTree2K<unsigned, LastAxisCascadeCounts<unsigned> >, T>(
+        first, last, r, K, max_m, _num_threads, _output_level);
   }
-  vector<long long> results(2);
-  results[0] = result_a;
-  results[1] = result_b;
-  return results;
+  return ComputeABMultiMKD<RangeKDTree2K<unsigned>, T>(
+      first, last, r, K, max_m, _num_threads, _output_level);
 }
 
 
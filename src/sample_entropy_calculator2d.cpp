@@ -1,2 +1,405 @@
 #include "sample_entropy_calculator2d.h"
 
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <numeric>
+
+#include "implicit_kdtree.h"
+#include "parallel.h"
+
+namespace sampen {
+
+namespace {
+// The geometry of the templates of an image. The template origins are
+// (step * ty, step * tx) for ty < num_y and tx < num_x, and the pixels of a
+// template of length K are (y + dilation * a, x + dilation * b) for
+// a, b < K.
+template <typename T> struct TemplateGrid2D {
+  const T *data;
+  unsigned width;
+  T r;
+  unsigned K;
+  unsigned step;
+  unsigned dilation;
+  unsigned num_x;
+  unsigned num_y;
+};
+
+// Per-thread rows for one displacement.
+struct DisplacementScratch {
+  // The per-pixel matches of the current row.
+  vector<uint8_t> match;
+  // The last dilation * K + 1 rows of horizontal matches of length K
+  // (ring_k) and K + 1 (ring_k1), and the vertical matches of one template
+  // row.
+  vector<uint8_t> ring_k;
+  vector<uint8_t> ring_k1;
+  vector<uint8_t> acc;
+};
+
+// Counts the number of nonzero bytes among p[0], p[step], p[2 * step], ...
+// (count bytes in total).
+inline unsigned long long CountStrided(const uint8_t *p, unsigned count,
+                                       unsigned step) {
+  unsigned long long sum = 0;
+  if (step == 1) {
+    unsigned partial = 0;
+    for (unsigned x = 0; x < count; ++x)
+      partial += p[x];
+    return partial;
+  }
+  for (unsigned x = 0; x < count; x += step)
+    sum += p[x];
+  return sum;
+}
+
+// out[x] = AND of rows[slot(a)][x] over a = 0, ..., num_rows - 1, where the
+// rows are dilation apart in the ring starting at first_slot.
+inline void AndRows(const uint8_t *ring, unsigned row_length,
+                    unsigned ring_size, unsigned first_slot, unsigned dilation,
+                    unsigned num_rows, unsigned count, uint8_t *out) {
+  memcpy(out, ring + static_cast<size_t>(first_slot) * row_length, count);
+  unsigned slot = first_slot;
+  for (unsigned a = 1; a < num_rows; ++a) {
+    slot += dilation;
+    if (slot >= ring_size)
+      slot -= ring_size;
+    const uint8_t *row = ring + static_cast<size_t>(slot) * row_length;
+    for (unsigned x = 0; x < count; ++x)
+      out[x] &= row[x];
+  }
+}
+
+/*
+ * Counts the matched pairs of the templates (ty, tx) and (ty + dy, tx + dx)
+ * (in units of the step). The rows of the image are visited once: each row
+ * is compared with the displaced row pixel by pixel, the matches of K and
+ * K + 1 consecutive pixels (dilation apart) are kept in a ring of the last
+ * dilation * K + 1 rows, and once a template row is complete, its matches of
+ * K (resp. K + 1) consecutive rows give B (resp. A).
+ */
+template <typename T>
+void CountDisplacement(const TemplateGrid2D<T> &grid, int dy, unsigned dx,
+                       DisplacementScratch &scratch, long long &a,
+                       long long &b) {
+  const unsigned K = grid.K, s = grid.step, d = grid.dilation;
+  const int num_y = static_cast<int>(grid.num_y);
+  const unsigned ty_begin = static_cast<unsigned>(std::max(0, -dy));
+  const unsigned ty_end = static_cast<unsigned>(std::min(num_y, num_y - dy));
+  if (ty_begin >= ty_end || dx >= grid.num_x)
+    return;
+  // The columns of the template origins, and of their pixels.
+  const unsigned count = s * (grid.num_x - dx - 1) + 1;
+  const unsigned span = d * K;
+  const unsigned match_count = count + span;
+  const unsigned ring_size = span + 1;
+  scratch.match.resize(match_count);
+  scratch.ring_k.resize(static_cast<size_t>(ring_size) * count);
+  scratch.ring_k1.resize(static_cast<size_t>(ring_size) * count);
+  scratch.acc.resize(count);
+  uint8_t *match = scratch.match.data();
+  uint8_t *acc = scratch.acc.data();
+
+  const T r = grid.r;
+  const unsigned y_begin = s * ty_begin;
+  const unsigned y_end = s * (ty_end - 1) + span + 1;
+  const long long shift =
+      static_cast<long long>(dy) * s * grid.width + static_cast<long long>(dx) * s;
+  long long a_sum = 0, b_sum = 0;
+  for (unsigned y = y_begin, slot = 0; y < y_end; ++y) {
+    const T *row1 = grid.data + static_cast<size_t>(y) * grid.width;
+    const T *row2 = row1 + shift;
+    for (unsigned x = 0; x < match_count; ++x)
+      match[x] = (row1[x] <= row2[x] + r) & (row2[x] <= row1[x] + r);
+
+    uint8_t *row_k = scratch.ring_k.data() + static_cast<size_t>(slot) * count;
+    uint8_t *row_k1 =
+        scratch.ring_k1.data() + static_cast<size_t>(slot) * count;
+    memcpy(row_k, match, count);
+    for (unsigned k = 1; k < K; ++k) {
+      const uint8_t *p = match + k * d;
+      for (unsigned x = 0; x < count; ++x)
+        row_k[x] &= p[x];
+    }
+    const uint8_t *last = match + span;
+    for (unsigned x = 0; x < count; ++x)
+      row_k1[x] = row_k[x] & last[x];
+
+    // The template row starting span rows above is complete.
+    if (y >= y_begin + span && (y - span - y_begin) % s == 0) {
+      const unsigned first_slot = slot + 1 == ring_size ? 0 : slot + 1;
+      AndRows(scratch.ring_k.data(), count, ring_size, first_slot, d, K,
+              count, acc);
+      b_sum += CountStrided(acc, count, s);
+      AndRows(scratch.ring_k1.data(), count, ring_size, first_slot, d, K + 1,
+              count, acc);
+      a_sum += CountStrided(acc, count, s);
+    }
+    slot = slot + 1 == ring_size ? 0 : slot + 1;
+  }
+  a += a_sum;
+  b += b_sum;
+}
+
+// The templates of the image, or false if the image is smaller than the
+// window of a template.
+template <typename T>
+bool GetTemplateGrid2D(const T *data, unsigned width, unsigned height, T r,
+                       unsigned m, unsigned moving_step_size,
+                       unsigned dilation_factor, TemplateGrid2D<T> &grid) {
+  const unsigned window_size = dilation_factor * m + 1;
+  if (width < window_size || height < window_size)
+    return false;
+  const unsigned end_x = width - window_size + 1;
+  const unsigned end_y = height - window_size + 1;
+  grid = {data, width, r, m, moving_step_size, dilation_factor,
+          (end_x + moving_step_size - 1) / moving_step_size,
+          (end_y + moving_step_size - 1) / moving_step_size};
+  return true;
+}
+
+/*
+ * The templates as points of (K + 1)^2 coordinates, sorted by the first one.
+ * The first K^2 coordinates are the K x K window row by row, and the other
+ * 2K + 1 the pixels which extend it to (K + 1) x (K + 1): the last column
+ * (K + 1 pixels), and then the rest of the last row (K pixels).
+ */
+template <typename T>
+KDPointSet<T> GetSortedPoints2D(const TemplateGrid2D<T> &grid) {
+  const unsigned K = grid.K, s = grid.step, d = grid.dilation;
+  const unsigned dim = (K + 1) * (K + 1);
+  const unsigned n = grid.num_x * grid.num_y;
+  const auto pixel = [&grid, s, d](unsigned index, unsigned a, unsigned b) {
+    const unsigned y = s * (index / grid.num_x) + d * a;
+    const unsigned x = s * (index % grid.num_x) + d * b;
+    return grid.data[static_cast<size_t>(y) * grid.width + x];
+  };
+  vector<unsigned> order(n);
+  std::iota(order.begin(), order.end(), 0);
+  std::sort(order.begin(), order.end(),
+            [&pixel](unsigned i1, unsigned i2) {
+              return pixel(i1, 0, 0) < pixel(i2, 0, 0);
+            });
+  KDPointSet<T> points(n, dim);
+  for (unsigned i = 0; i < n; ++i) {
+    T *point = points.mutable_point(i);
+    for (unsigned a = 0; a < K; ++a)
+      for (unsigned b = 0; b < K; ++b)
+        *point++ = pixel(order[i], a, b);
+    for (unsigned a = 0; a <= K; ++a)
+      *point++ = pixel(order[i], a, K);
+    for (unsigned b = 0; b < K; ++b)
+      *point++ = pixel(order[i], K, b);
+  }
+  return points;
+}
+
+/*
+ * Count the matched pairs between the points first <= i < last and the
+ * points after them, the same way as SlidingCountAB of the 1D kd trees: the
+ * points are inserted into the tree once their first coordinate is within
+ * the range of the current point, and closed when they become the current
+ * point. The tree is built over the points up to the range of the last
+ * query only, so the chunks of queries can be counted independently.
+ */
+template <typename T>
+vector<long long> SlidingCountAB2D(const TemplateView<T> &points, T r,
+                                   unsigned K, unsigned first,
+                                   unsigned last) {
+  const unsigned n = points.size();
+  const T upper_last = points[last - 1][0] + r;
+  unsigned end = last;
+  while (end < n && points[end][0] <= upper_last)
+    ++end;
+  const unsigned num_last_axes = 2 * K + 1;
+  ImplicitKDTree<T> tree(K * K, points.Slice(first, end), Silent,
+                         num_last_axes);
+
+  const unsigned n_local = end - first;
+  vector<long long> result({0, 0});
+  long long num_nodes = 0;
+  for (unsigned i = 0, j = 1; i < last - first; ++i) {
+    tree.Close(i);
+    if (j <= i)
+      j = i + 1;
+    const T upper = points[first + i][0] + r;
+    while (j < n_local && points[first + j][0] <= upper) {
+      tree.UpdateCount(j, 1);
+      ++j;
+    }
+    const vector<long long> ab =
+        tree.CountRange(GetHyperCubeR(points[first + i], r), num_nodes);
+    result[0] += ab[0];
+    result[1] += ab[1];
+  }
+  return result;
+}
+} // namespace
+
+template <typename T>
+vector<long long> ComputeAB2DSampled(
+    const T *data, unsigned width, T r, unsigned m, unsigned dilation_factor,
+    const vector<std::array<unsigned, 2> > &origins) {
+  const unsigned K = m, d = dilation_factor;
+  const unsigned n = origins.size();
+  // The coordinates in the same order as the points of ComputeAB2DKD: the
+  // K x K window, and then the pixels extending it to (K + 1) x (K + 1).
+  vector<size_t> offsets;
+  for (unsigned a = 0; a < K; ++a)
+    for (unsigned b = 0; b < K; ++b)
+      offsets.push_back(static_cast<size_t>(d * a) * width + d * b);
+  for (unsigned a = 0; a <= K; ++a)
+    offsets.push_back(static_cast<size_t>(d * a) * width + d * K);
+  for (unsigned b = 0; b < K; ++b)
+    offsets.push_back(static_cast<size_t>(d * K) * width + d * b);
+  const unsigned num_coords = offsets.size();
+  const unsigned num_coords_k = K * K;
+
+  // The templates are sorted by the first coordinate, so that the ones
+  // following a template within r of it in the first coordinate come
+  // first, and the others need no comparison.
+  vector<const T *> sorted(n);
+  for (unsigned i = 0; i < n; ++i)
+    sorted[i] = data + static_cast<size_t>(origins[i][0]) * width +
+                origins[i][1];
+  std::sort(sorted.begin(), sorted.end(),
+            [](const T *p1, const T *p2) { return *p1 < *p2; });
+  // packed[c * n + i] is the coordinate c of the template i.
+  vector<T> packed(static_cast<size_t>(num_coords) * n);
+  for (unsigned i = 0; i < n; ++i) {
+    for (unsigned c = 0; c < num_coords; ++c)
+      packed[static_cast<size_t>(c) * n + i] = sorted[i][offsets[c]];
+  }
+
+  const unsigned kBlockSize = 256;
+  uint8_t matched[kBlockSize];
+  long long a = 0, b = 0;
+  for (unsigned i = 0, end = 1; i + 1 < n; ++i) {
+    if (end <= i)
+      end = i + 1;
+    while (end < n && packed[end] <= packed[i] + r)
+      ++end;
+    for (unsigned first = i + 1; first < end; first += kBlockSize) {
+      const unsigned count = std::min(kBlockSize, end - first);
+      std::fill(matched, matched + count, 1);
+      unsigned c = 0;
+      uint8_t alive = 1;
+      for (; c < num_coords_k && alive; ++c) {
+        const T *column = packed.data() + static_cast<size_t>(c) * n;
+        const T x = column[i];
+        const T *y = column + first;
+        alive = 0;
+        for (unsigned j = 0; j < count; ++j) {
+          matched[j] &= (x <= y[j] + r) & (y[j] <= x + r);
+          alive |= matched[j];
+        }
+      }
+      if (!alive)
+        continue;
+      b += std::accumulate(matched, matched + count, 0u);
+      for (; c < num_coords && alive; ++c) {
+        const T *column = packed.data() + static_cast<size_t>(c) * n;
+        const T x = column[i];
+        const T *y = column + first;
+        alive = 0;
+        for (unsigned j = 0; j < count; ++j) {
+          matched[j] &= (x <= y[j] + r) & (y[j] <= x + r);
+          alive |= matched[j];
+        }
+      }
+      if (alive)
+        a += std::accumulate(matched, matched + count, 0u);
+    }
+  }
+  return {a, b};
+}
+
+template <typename T>
+vector<long long> ComputeAB2DKD(const T *data, unsigned width,
+                                unsigned height, T r, unsigned m,
+                                unsigned moving_step_size,
+                                unsigned dilation_factor,
+                                unsigned num_threads) {
+  TemplateGrid2D<T> grid;
+  if (!GetTemplateGrid2D(data, width, height, r, m, moving_step_size,
+                         dilation_factor, grid))
+    return vector<long long>(2, 0);
+  const KDPointSet<T> point_set = GetSortedPoints2D(grid);
+  const TemplateView<T> points(point_set);
+  const unsigned n = points.size();
+  if (n < 2)
+    return vector<long long>(2, 0);
+
+  // The chunks are not equally expensive, so there are a few more chunks
+  // than threads.
+  unsigned num_chunks = num_threads > 1 ? 4 * num_threads : 1;
+  if (num_chunks > n)
+    num_chunks = n;
+  vector<vector<long long> > chunk_results(num_chunks);
+  ParallelFor(num_chunks, num_threads, [&](unsigned c) {
+    const unsigned first = static_cast<unsigned long long>(n) * c / num_chunks;
+    const unsigned last =
+        static_cast<unsigned long long>(n) * (c + 1) / num_chunks;
+    chunk_results[c] = SlidingCountAB2D(points, r, m, first, last);
+  });
+  vector<long long> result({0, 0});
+  for (const vector<long long> &ab : chunk_results) {
+    result[0] += ab[0];
+    result[1] += ab[1];
+  }
+  return result;
+}
+
+template <typename T>
+vector<long long> ComputeAB2DDirect(const T *data, unsigned width,
+                                    unsigned height, T r, unsigned m,
+                                    unsigned moving_step_size,
+                                    unsigned dilation_factor,
+                                    unsigned num_threads) {
+  TemplateGrid2D<T> grid;
+  if (!GetTemplateGrid2D(data, width, height, r, m, moving_step_size,
+                         dilation_factor, grid))
+    return vector<long long>(2, 0);
+
+  // Each pair is counted once, with the displacement (dy, dx) where dx > 0,
+  // or dx = 0 and dy > 0. The tasks are the values of dx, the first ones
+  // being the most expensive.
+  const int num_y = static_cast<int>(grid.num_y);
+  vector<long long> a(grid.num_x, 0), b(grid.num_x, 0);
+  ParallelFor(grid.num_x, num_threads, [&](unsigned dx) {
+    DisplacementScratch scratch;
+    for (int dy = dx ? 1 - num_y : 1; dy < num_y; ++dy)
+      CountDisplacement(grid, dy, dx, scratch, a[dx], b[dx]);
+  });
+  return {std::accumulate(a.cbegin(), a.cend(), 0ll),
+          std::accumulate(b.cbegin(), b.cend(), 0ll)};
+}
+
+template vector<long long> ComputeAB2DDirect<int>(
+    const int *data, unsigned width, unsigned height, int r, unsigned m,
+    unsigned moving_step_size, unsigned dilation_factor,
+    unsigned num_threads);
+template vector<long long> ComputeAB2DDirect<double>(
+    const double *data, unsigned width, unsigned height, double r, unsigned m,
+    unsigned moving_step_size, unsigned dilation_factor,
+    unsigned num_threads);
+
+template vector<long long> ComputeAB2DSampled<int>(
+    const int *data, unsigned width, int r, unsigned m,
+    unsigned dilation_factor,
+    const vector<std::array<unsigned, 2> > &origins);
+template vector<long long> ComputeAB2DSampled<double>(
+    const double *data, unsigned width, double r, unsigned m,
+    unsigned dilation_factor,
+    const vector<std::array<unsigned, 2> > &origins);
+template vector<long long> ComputeAB2DKD<int>(
+    const int *data, unsigned width, unsigned height, int r, unsigned m,
+    unsigned moving_step_size, unsigned dilation_factor,
+    unsigned num_threads);
+template vector<long long> ComputeAB2DKD<double>(
+    const double *data, unsigned width, unsigned height, double r,
+    unsigned m, unsigned moving_step_size, unsigned dilation_factor,
+    unsigned num_threads);
+
+} // namespace sampen
@@ -1,8 +1,17 @@
 #include "sample_entropy_calculator_direct.h"
 
+#include "parallel.h"
 #include "utils.h"
+#include <algorithm>
+#include <cstdint>
+#include <numeric>
 #include <vector>
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SAMPEN_X86_SIMD
+#include <immintrin.h>
+#endif
+
 namespace sampen {
 template <typename T>
 vector<long long> _ComputeABFastDirect(const T *y, unsigned n, T r, unsigned K) {
@@ -54,21 +63,566 @@ vector<long long> _ComputeABFastDirect(const T *y, unsigned n, T r, unsigned K)
 }
 
 
+namespace {
+// Instruction sets for the counting kernels of the fast direct method.
+enum SimdLevel { kScalar, kAVX2, kAVX512 };
+
+SimdLevel GetSimdLevel() {
+#ifdef SAMPEN_X86_SIMD
+  static const SimdLevel level =
+      __builtin_cpu_supports("avx512f")
+          ? kAVX512
+          : (__builtin_cpu_supports("avx2") ? kAVX2 : kScalar);
+  return level;
+#else
+  return kScalar;
+#endif
+}
+
+/*
+ * The kernels below process one row of the fast direct method: for
+ * k = 0, ..., count - 1, they update run[k], the length of the run of
+ * matches ending at the pair (y1, yj[k]), and count the runs of length at
+ * least K + 1 (into a) and at least K (into b). Runs are saturated at K + 1
+ * so that they fit in 32 bits.
+ */
+template <typename T>
+void UpdateRunsScalar(const T *yj, T y1, T r, unsigned count, unsigned *run,
+                      unsigned K, long long &a, long long &b) {
+  const unsigned M = K + 1;
+  long long a_row = 0, b_row = 0;
+  for (unsigned k = 0; k < count; ++k) {
+    const unsigned in = ((yj[k] - y1) <= r) & ((y1 - yj[k]) <= r);
+    unsigned v = run[k] + 1;
+    v = v < M ? v : M;
+    v &= 0u - in;
+    run[k] = v;
+    a_row += v == M;
+    b_row += v >= K;
+  }
+  a += a_row;
+  b += b_row;
+}
+
+#ifdef SAMPEN_X86_SIMD
+__attribute__((target("avx2")))
+void UpdateRunsAVX2(const int *yj, int y1, int r, unsigned count,
+                    unsigned *run, unsigned K, long long &a, long long &b) {
+  const __m256i vy1 = _mm256_set1_epi32(y1);
+  const __m256i vr = _mm256_set1_epi32(r);
+  const __m256i one = _mm256_set1_epi32(1);
+  const __m256i vM = _mm256_set1_epi32(K + 1);
+  const __m256i vK1 = _mm256_set1_epi32(K - 1);
+  unsigned k = 0;
+  for (; k + 8 <= count; k += 8) {
+    const __m256i y = _mm256_loadu_si256((const __m256i *)(yj + k));
+    const __m256i out =
+        _mm256_or_si256(_mm256_cmpgt_epi32(_mm256_sub_epi32(y, vy1), vr),
+                        _mm256_cmpgt_epi32(_mm256_sub_epi32(vy1, y), vr));
+    __m256i v = _mm256_loadu_si256((const __m256i *)(run + k));
+    v = _mm256_min_epu32(_mm256_add_epi32(v, one), vM);
+    v = _mm256_andnot_si256(out, v);
+    _mm256_storeu_si256((__m256i *)(run + k), v);
+    a += __builtin_popcount(
+        _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(v, vM))));
+    b += __builtin_popcount(
+        _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(v, vK1))));
+  }
+  UpdateRunsScalar(yj + k, y1, r, count - k, run + k, K, a, b);
+}
+
+__attribute__((target("avx2")))
+void UpdateRunsAVX2(const double *yj, double y1, double r, unsigned count,
+                    unsigned *run, unsigned K, long long &a, long long &b) {
+  const __m256d vy1 = _mm256_set1_pd(y1);
+  const __m256d vr = _mm256_set1_pd(r);
+  const __m256i one = _mm256_set1_epi32(1);
+  const __m256i vM = _mm256_set1_epi32(K + 1);
+  const __m256i vK1 = _mm256_set1_epi32(K - 1);
+  // Takes the lower halves of the 64-bit masks.
+  const __m256i lower = _mm256_setr_epi32(0, 2, 4, 6, 0, 2, 4, 6);
+  unsigned k = 0;
+  for (; k + 8 <= count; k += 8) {
+    const __m256d y0 = _mm256_loadu_pd(yj + k);
+    const __m256d y1_ = _mm256_loadu_pd(yj + k + 4);
+    const __m256d in0 = _mm256_and_pd(
+        _mm256_cmp_pd(_mm256_sub_pd(y0, vy1), vr, _CMP_LE_OQ),
+        _mm256_cmp_pd(_mm256_sub_pd(vy1, y0), vr, _CMP_LE_OQ));
+    const __m256d in1 = _mm256_and_pd(
+        _mm256_cmp_pd(_mm256_sub_pd(y1_, vy1), vr, _CMP_LE_OQ),
+        _mm256_cmp_pd(_mm256_sub_pd(vy1, y1_), vr, _CMP_LE_OQ));
+    const __m256i in = _mm256_blend_epi32(
+        _mm256_permutevar8x32_epi32(_mm256_castpd_si256(in0), lower),
+        _mm256_permutevar8x32_epi32(_mm256_castpd_si256(in1), lower), 0xF0);
+    __m256i v = _mm256_loadu_si256((const __m256i *)(run + k));
+    v = _mm256_min_epu32(_mm256_add_epi32(v, one), vM);
+    v = _mm256_and_si256(in, v);
+    _mm256_storeu_si256((__m256i *)(run + k), v);
+    a += __builtin_popcount(
+        _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(v, vM))));
+    b += __builtin_popcount(
+        _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(v, vK1))));
+  }
+  UpdateRunsScalar(yj + k, y1, r, count - k, run + k, K, a, b);
+}
+
+__attribute__((target("avx512f")))
+void UpdateRunsAVX512(const int *yj, int y1, int r, unsigned count,
+                      unsigned *run, unsigned K, long long &a, long long &b) {
+  const __m512i vy1 = _mm512_set1_epi32(y1);
+  const __m512i vr = _mm512_set1_epi32(r);
+  const __m512i one = _mm512_set1_epi32(1);
+  const __m512i vM = _mm512_set1_epi32(K + 1);
+  const __m512i vK = _mm512_set1_epi32(K);
+  unsigned k = 0;
+  for (; k + 16 <= count; k += 16) {
+    const __m512i y = _mm512_loadu_si512(yj + k);
+    const __mmask16 in =
+        _mm512_cmple_epi32_mask(_mm512_sub_epi32(y, vy1), vr) &
+        _mm512_cmple_epi32_mask(_mm512_sub_epi32(vy1, y), vr);
+    __m512i v = _mm512_loadu_si512(run + k);
+    v = _mm512_maskz_min_epu32(in, _mm512_add_epi32(v, one), vM);
+    _mm512_storeu_si512(run + k, v);
+    a += __builtin_popcount(_mm512_cmpeq_epu32_mask(v, vM));
+    b += __builtin_popcount(_mm512_cmpge_epu32_mask(v, vK));
+  }
+  UpdateRunsScalar(yj + k, y1, r, count - k, run + k, K, a, b);
+}
+
+__attribute__((target("avx512f")))
+void UpdateRunsAVX512(const double *yj, double y1, double r, unsigned count,
+                      unsigned *run, unsigned K, long long &a, long long &b) {
+  const __m512d vy1 = _mm512_set1_pd(y1);
+  const __m512d vr = _mm512_set1_pd(r);
+  const __m512i one = _mm512_set1_epi32(1);
+  const __m512i vM = _mm512_set1_epi32(K + 1);
+  const __m512i vK = _mm512_set1_epi32(K);
+  unsigned k = 0;
+  for (; k + 16 <= count; k += 16) {
+    const __m512d y0 = _mm512_loadu_pd(yj + k);
+    const __m512d y1_ = _mm512_loadu_pd(yj + k + 8);
+    const __mmask8 in0 =
+        _mm512_cmp_pd_mask(_mm512_sub_pd(y0, vy1), vr, _CMP_LE_OQ) &
+        _mm512_cmp_pd_mask(_mm512_sub_pd(vy1, y0), vr, _CMP_LE_OQ);
+    const __mmask8 in1 =
+        _mm512_cmp_pd_mask(_mm512_sub_pd(y1_, vy1), vr, _CMP_LE_OQ) &
+        _mm512_cmp_pd_mask(_mm512_sub_pd(vy1, y1_), vr, _CMP_LE_OQ);
+    const __mmask16 in = static_cast<__mmask16>(in0 | (in1 << 8));
+    __m512i v = _mm512_loadu_si512(run + k);
+    v = _mm512_maskz_min_epu32(in, _mm512_add_epi32(v, one), vM);
+    _mm512_storeu_si512(run + k, v);
+    a += __builtin_popcount(_mm512_cmpeq_epu32_mask(v, vM));
+    b += __builtin_popcount(_mm512_cmpge_epu32_mask(v, vK));
+  }
+  UpdateRunsScalar(yj + k, y1, r, count - k, run + k, K, a, b);
+}
+#endif
+
+template <typename T>
+void UpdateRuns(SimdLevel, const T *yj, T y1, T r, unsigned count,
+                unsigned *run, unsigned K, long long &a, long long &b) {
+  UpdateRunsScalar(yj, y1, r, count, run, K, a, b);
+}
+
+#ifdef SAMPEN_X86_SIMD
+template <typename T>
+void UpdateRunsX86(SimdLevel level, const T *yj, T y1, T r, unsigned count,
+                   unsigned *run, unsigned K, long long &a, long long &b) {
+  switch (level) {
+  case kAVX512: UpdateRunsAVX512(yj, y1, r, count, run, K, a, b); break;
+  case kAVX2: UpdateRunsAVX2(yj, y1, r, count, run, K, a, b); break;
+  default: UpdateRunsScalar(yj, y1, r, count, run, K, a, b);
+  }
+}
+
+void UpdateRuns(SimdLevel level, const int *yj, int y1, int r,
+                unsigned count, unsigned *run, unsigned K, long long &a,
+                long long &b) {
+  UpdateRunsX86(level, yj, y1, r, count, run, K, a, b);
+}
+
+void UpdateRuns(SimdLevel level, const double *yj, double y1, double r,
+                unsigned count, unsigned *run, unsigned K, long long &a,
+                long long &b) {
+  UpdateRunsX86(level, yj, y1, r, count, run, K, a, b);
+}
+#endif
+
+// The integer type of the same width as T.
+template <typename T> struct MultiRLevel {
+  typedef typename std::conditional<sizeof(T) == 8, long long, int>::type
+      type;
+};
+
+/*
+ * The kernel of ComputeABDirectMultiR: for the count pairs of templates
+ * starting at y0[i] and y1[i], it adds one to hist_a and hist_b at the
+ * levels of the pairs in K + 1 and K coordinates respectively. The level of
+ * a pair of values is the number of thresholds below their difference, and
+ * the level of a pair of templates is the maximum level of their values, so
+ * the pair is matched with thresholds[k] iff its level is at most k.
+ *
+ * The levels are integers of the same width as T and the loops have no
+ * branches, so that they can be vectorized. The histograms are kept in four
+ * interleaved copies of num_r + 1 bins, so that consecutive increments of
+ * the same bin do not wait for each other. The body is inlined into copies
+ * compiled for AVX2 and AVX-512 below.
+ */
+template <typename T>
+inline __attribute__((always_inline)) void CountLevelsBody(
+    const T *y0, const T *y1, unsigned count, unsigned K,
+    const T *thresholds, unsigned num_r, T *diff,
+    typename MultiRLevel<T>::type *level, long long *hist_a,
+    long long *hist_b) {
+  typedef typename MultiRLevel<T>::type Level;
+  const unsigned len = count + K;
+  for (unsigned i = 0; i < len; ++i) {
+    const T x = y1[i] - y0[i];
+    diff[i] = x < 0 ? -x : x;
+    level[i] = 0;
+  }
+  for (unsigned k = 0; k < num_r; ++k) {
+    const T t = thresholds[k];
+    for (unsigned i = 0; i < len; ++i)
+      level[i] += diff[i] > t ? 1 : 0;
+  }
+  Level *level_a = level + len, *level_b = level + 2 * len;
+  for (unsigned i = 0; i < count; ++i)
+    level_b[i] = level[i];
+  for (unsigned k = 1; k < K; ++k) {
+    for (unsigned i = 0; i < count; ++i)
+      level_b[i] = level_b[i] > level[i + k] ? level_b[i] : level[i + k];
+  }
+  for (unsigned i = 0; i < count; ++i)
+    level_a[i] = level_b[i] > level[i + K] ? level_b[i] : level[i + K];
+  const unsigned num_bins = num_r + 1;
+  unsigned i = 0;
+  for (; i + 4 <= count; i += 4) {
+    for (unsigned l = 0; l < 4; ++l) {
+      ++hist_a[l * num_bins + level_a[i + l]];
+      ++hist_b[l * num_bins + level_b[i + l]];
+    }
+  }
+  for (; i < count; ++i) {
+    ++hist_a[level_a[i]];
+    ++hist_b[level_b[i]];
+  }
+}
+
+template <typename T>
+void CountLevelsScalar(const T *y0, const T *y1, unsigned count, unsigned K,
+                       const T *thresholds, unsigned num_r, T *diff,
+                       typename MultiRLevel<T>::type *level,
+                       long long *hist_a, long long *hist_b) {
+  CountLevelsBody(y0, y1, count, K, thresholds, num_r, diff, level, hist_a,
+                  hist_b);
+}
+
+#ifdef SAMPEN_X86_SIMD
+template <typename T>
+__attribute__((target("avx2")))
+void CountLevelsAVX2(const T *y0, const T *y1, unsigned count, unsigned K,
+                     const T *thresholds, unsigned num_r, T *diff,
+                     typename MultiRLevel<T>::type *level,
+                     long long *hist_a, long long *hist_b) {
+  CountLevelsBody(y0, y1, count, K, thresholds, num_r, diff, level, hist_a,
+                  hist_b);
+}
+
+template <typename T>
+__attribute__((target("avx512f")))
+void CountLevelsAVX512(const T *y0, const T *y1, unsigned count, unsigned K,
+                       const T *thresholds, unsigned num_r, T *diff,
+                       typename MultiRLevel<T>::type *level,
+                       long long *hist_a, long long *hist_b) {
+  CountLevelsBody(y0, y1, count, K, thresholds, num_r, diff, level, hist_a,
+                  hist_b);
+}
+#endif
+
+template <typename T>
+void CountLevels(SimdLevel simd_level, const T *y0, const T *y1,
+                 unsigned count, unsigned K, const T *thresholds,
+                 unsigned num_r, T *diff, typename MultiRLevel<T>::type *level,
+                 long long *hist_a, long long *hist_b) {
+#ifdef SAMPEN_X86_SIMD
+  switch (simd_level) {
+  case kAVX512:
+    CountLevelsAVX512(y0, y1, count, K, thresholds, num_r, diff, level,
+                      hist_a, hist_b);
+    return;
+  case kAVX2:
+    CountLevelsAVX2(y0, y1, count, K, thresholds, num_r, diff, level, hist_a,
+                    hist_b);
+    return;
+  default:
+    break;
+  }
+#endif
+  CountLevelsScalar(y0, y1, count, K, thresholds, num_r, diff, level, hist_a,
+                    hist_b);
+}
+
+/*
+ * The kernel of ComputeABDirectMultiM. It updates the runs of one row as
+ * UpdateRunsScalar does, saturated at M, and adds to count_ge[L] the number
+ * of runs of length at least L for L = 1, ..., M.
+ */
+template <typename T>
+inline __attribute__((always_inline)) void UpdateRunsMultiMBody(
+    const T *yj, T y1, T r, unsigned count, unsigned *run, unsigned M,
+    long long *count_ge) {
+  for (unsigned k = 0; k < count; ++k) {
+    const unsigned in = ((yj[k] - y1) <= r) & ((y1 - yj[k]) <= r);
+    unsigned v = run[k] + 1;
+    v = v < M ? v : M;
+    v &= 0u - in;
+    run[k] = v;
+  }
+  for (unsigned L = 1; L <= M; ++L) {
+    long long c = 0;
+    for (unsigned k = 0; k < count; ++k)
+      c += run[k] >= L;
+    count_ge[L] += c;
+  }
+}
+
+template <typename T>
+void UpdateRunsMultiMScalar(const T *yj, T y1, T r, unsigned count,
+                            unsigned *run, unsigned M, long long *count_ge) {
+  UpdateRunsMultiMBody(yj, y1, r, count, run, M, count_ge);
+}
+
+#ifdef SAMPEN_X86_SIMD
+template <typename T>
+__attribute__((target("avx2")))
+void UpdateRunsMultiMAVX2(const T *yj, T y1, T r, unsigned count,
+                          unsigned *run, unsigned M, long long *count_ge) {
+  UpdateRunsMultiMBody(yj, y1, r, count, run, M, count_ge);
+}
+
+template <typename T>
+__attribute__((target("avx512f")))
+void UpdateRunsMultiMAVX512(const T *yj, T y1, T r, unsigned count,
+                            unsigned *run, unsigned M, long long *count_ge) {
+  UpdateRunsMultiMBody(yj, y1, r, count, run, M, count_ge);
+}
+#endif
+
+template <typename T>
+void UpdateRunsMultiM(SimdLevel simd_level, const T *yj, T y1, T r,
+                      unsigned count, unsigned *run, unsigned M,
+                      long long *count_ge) {
+#ifdef SAMPEN_X86_SIMD
+  switch (simd_level) {
+  case kAVX512:
+    UpdateRunsMultiMAVX512(yj, y1, r, count, run, M, count_ge);
+    return;
+  case kAVX2:
+    UpdateRunsMultiMAVX2(yj, y1, r, count, run, M, count_ge);
+    return;
+  default:
+    break;
+  }
+#endif
+  UpdateRunsMultiMScalar(yj, y1, r, count, run, M, count_ge);
+}
+
+// The number of lags processed together in ComputeABFastDirect. The runs of
+// one block (16 KB) stay in the L1 cache.
+const unsigned kLagBlockSize = 4096;
+// The number of templates of a lag processed at once by
+// ComputeABDirectMultiR.
+const unsigned kMultiRChunkSize = 1024;
+// The number of thresholds from which ComputeABDirectMultiR is faster than a
+// call of ComputeABFastDirect per threshold. Its histogram costs as much as
+// 13-17 calls with 1 threshold, and about breaks even at 24-32 thresholds.
+const unsigned kMultiRMinThresholds = 32;
+} // namespace
+
+
+template <typename T>
+vector<long long> ComputeABFastDirect(const T *y, unsigned n, T r, unsigned K,
+                                      unsigned num_threads) {
+  vector<long long> result(2, 0);
+  if (n < 2)
+    return result;
+  const SimdLevel level = GetSimdLevel();
+  // The pairs (i, i + d) with the lag d in [1, n) are split into blocks of
+  // consecutive lags, which are independent of each other.
+  const unsigned num_lags = n - 1;
+  const unsigned num_blocks = (num_lags - 1) / kLagBlockSize + 1;
+  vector<long long> a_blocks(num_blocks, 0), b_blocks(num_blocks, 0);
+  ParallelFor(num_blocks, num_threads, [&](unsigned block) {
+    const unsigned d0 = 1 + block * kLagBlockSize;
+    const unsigned d1 = std::min(d0 + kLagBlockSize, n);
+    vector<unsigned> run(d1 - d0, 0);
+    long long a = 0, b = 0;
+    for (unsigned i = 0; i + d0 < n; ++i) {
+      const unsigned count = std::min(d1, n - i) - d0;
+      UpdateRuns(level, y + i + d0, y[i], r, count, run.data(), K, a, b);
+      // The pair ending at y[n - 1] does not count for b.
+      if (i + d1 >= n && run[count - 1] >= K)
+        --b;
+    }
+    a_blocks[block] = a;
+    b_blocks[block] = b;
+  });
+  for (unsigned block = 0; block < num_blocks; ++block) {
+    result[0] += a_blocks[block];
+    result[1] += b_blocks[block];
+  }
+  return result;
+}
+
+
+template <typename T>
+vector<long long> ComputeABDirectMultiR(const T *y, unsigned n,
+                                        const vector<T> &r, unsigned K,
+                                        unsigned num_threads) {
+  const unsigned num_r = r.size();
+  vector<long long> result(2 * num_r, 0);
+  if (n < K + 2 || num_r == 0)
+    return result;
+  vector<T> thresholds(r);
+  std::sort(thresholds.begin(), thresholds.end());
+  const SimdLevel simd_level = GetSimdLevel();
+
+  // The pairs of templates (i, i + d) with i + d < n - K, split into blocks
+  // of consecutive lags as in ComputeABFastDirect.
+  const unsigned num_templates = n - K;
+  const unsigned num_lags = num_templates - 1;
+  const unsigned num_blocks = (num_lags - 1) / kLagBlockSize + 1;
+  vector<vector<long long> > a_blocks(num_blocks), b_blocks(num_blocks);
+  ParallelFor(num_blocks, num_threads, [&](unsigned block) {
+    const unsigned d0 = 1 + block * kLagBlockSize;
+    const unsigned d1 = std::min(d0 + kLagBlockSize, num_templates);
+    vector<T> diff(kMultiRChunkSize + K);
+    vector<typename MultiRLevel<T>::type> level(3 * (kMultiRChunkSize + K));
+    // The histograms have one more bin (num_r) for the pairs matched with
+    // none of the thresholds.
+    vector<long long> hist_a(4 * (num_r + 1), 0), hist_b(4 * (num_r + 1), 0);
+    for (unsigned d = d0; d < d1; ++d) {
+      // The templates of a lag are processed in chunks which stay in the L1
+      // cache.
+      for (unsigned i0 = 0; i0 + d < num_templates; i0 += kMultiRChunkSize) {
+        const unsigned count =
+            std::min(kMultiRChunkSize, num_templates - d - i0);
+        CountLevels(simd_level, y + i0, y + i0 + d, count, K,
+                    thresholds.data(), num_r, diff.data(), level.data(),
+                    hist_a.data(), hist_b.data());
+      }
+    }
+    vector<long long> a(num_r, 0), b(num_r, 0);
+    for (unsigned k = 0; k < num_r; ++k) {
+      for (unsigned l = 0; l < 4; ++l) {
+        a[k] += hist_a[l * (num_r + 1) + k];
+        b[k] += hist_b[l * (num_r + 1) + k];
+      }
+      if (k) {
+        a[k] += a[k - 1];
+        b[k] += b[k - 1];
+      }
+    }
+    a_blocks[block] = std::move(a);
+    b_blocks[block] = std::move(b);
+  });
+
+  vector<long long> a_sorted(num_r, 0), b_sorted(num_r, 0);
+  for (unsigned block = 0; block < num_blocks; ++block) {
+    for (unsigned k = 0; k < num_r; ++k) {
+      a_sorted[k] += a_blocks[block][k];
+      b_sorted[k] += b_blocks[block][k];
+    }
+  }
+  for (unsigned q = 0; q < num_r; ++q) {
+    const unsigned k =
+        std::lower_bound(thresholds.cbegin(), thresholds.cend(), r[q]) -
+        thresholds.cbegin();
+    result[2 * q] = a_sorted[k];
+    result[2 * q + 1] = b_sorted[k];
+  }
+  return result;
+}
+
+
+template <typename T>
+vector<long long> ComputeABFastDirectMultiR(const T *y, unsigned n,
+                                            const vector<T> &r, unsigned K,
+                                            unsigned num_threads) {
+  if (r.size() >= kMultiRMinThresholds)
+    return ComputeABDirectMultiR<T>(y, n, r, K, num_threads);
+  vector<long long> result;
+  for (T r_k : r) {
+    const vector<long long> ab = ComputeABFastDirect<T>(y, n, r_k, K,
+                                                        num_threads);
+    result.insert(result.end(), ab.begin(), ab.end());
+  }
+  return result;
+}
+
+
 template <typename T>
-vector<long long> ComputeABDirect(const vector<KDPoint<T> > &points,
-                                  T r) {
+vector<long long> ComputeABDirectMultiM(const T *y, unsigned n, T r,
+                                        unsigned min_m, unsigned max_m,
+                                        unsigned num_threads) {
+  assert(1 <= min_m && min_m <= max_m);
+  const unsigned num_m = max_m - min_m + 1;
+  vector<long long> result(2 * num_m, 0);
+  if (n < 2)
+    return result;
+  const SimdLevel simd_level = GetSimdLevel();
+  // A run of length L counts for A of m < L and for B of m <= L.
+  const unsigned M = max_m + 1;
+  const unsigned num_lags = n - 1;
+  const unsigned num_blocks = (num_lags - 1) / kLagBlockSize + 1;
+  vector<vector<long long> > ge_blocks(num_blocks), last_blocks(num_blocks);
+  ParallelFor(num_blocks, num_threads, [&](unsigned block) {
+    const unsigned d0 = 1 + block * kLagBlockSize;
+    const unsigned d1 = std::min(d0 + kLagBlockSize, n);
+    vector<unsigned> run(d1 - d0, 0);
+    // count_ge[L] is the number of runs of length at least L, and last[L]
+    // the number of those ending at y[n - 1], which do not count for B.
+    vector<long long> count_ge(M + 1, 0), last(M + 1, 0);
+    for (unsigned i = 0; i + d0 < n; ++i) {
+      const unsigned count = std::min(d1, n - i) - d0;
+      UpdateRunsMultiM(simd_level, y + i + d0, y[i], r, count, run.data(), M,
+                       count_ge.data());
+      if (i + d1 >= n) {
+        for (unsigned L = 1; L <= run[count - 1]; ++L)
+          ++last[L];
+      }
+    }
+    ge_blocks[block] = std::move(count_ge);
+    last_blocks[block] = std::move(last);
+  });
+  for (unsigned block = 0; block < num_blocks; ++block) {
+    for (unsigned m = min_m; m <= max_m; ++m) {
+      result[2 * (m - min_m)] += ge_blocks[block][m + 1];
+      result[2 * (m - min_m) + 1] +=
+          ge_blocks[block][m] - last_blocks[block][m];
+    }
+  }
+  return result;
+}
+
+
+template <typename T>
+vector<long long> ComputeABDirect(const TemplateView<T> &points, T r) {
   const unsigned n = points.size();
   if (n == 0) {
     return vector<long long>(2, 0ll);
   }
-  const unsigned K = points[0].dim() - 1;
+  const unsigned K = points.dim() - 1;
   vector<long long> results(2);
   long long a = 0LL, b = 0LL;
   for (unsigned i = 0; i < n; ++i) {
+    const KDPointRef<T> point_i = points[i];
     for (unsigned j = i + 1; j < n; ++j) {
-      if (points[i].Within(points[j], r, K)) {
+      const KDPointRef<T> point_j = points[j];
+      if (point_i.Within(point_j, r, K)) {
         ++b;
-        T diff = points[j][K] - points[i][K];
+        T diff = point_j[K] - point_i[K];
         if (-r <= diff && diff <= r)
           ++a;
       }
@@ -81,8 +635,7 @@ vector<long long> ComputeABDirect(const vector<KDPoint<T> > &points,
 
 template <typename T>
 void SampleEntropyCalculatorDirect<T>::_ComputeSampleEntropy() {
-  vector<KDPoint<T> > points =
-      GetKDPoints<T>(_data.cbegin(), _data.cend(), K + 1);
+  const TemplateView<T> points(_data.data(), _data.size(), K + 1);
   vector<long long> ab = ComputeABDirect<T>(points, _r);
   _a = ab[0];
   _b = ab[1];
@@ -96,68 +649,133 @@ void SampleEntropyCalculatorFastDirect<T>::_ComputeSampleEntropy() {
     exit(-1);
   }
 
-  vector<long long> ab =
-      _ComputeABFastDirect<T>(_data.data(), _data.size(), _r, K);
+  vector<long long> ab = ComputeABFastDirect<T>(_data.data(), _data.size(),
+                                                _r, K, _num_threads);
   _a = ab[0], _b = ab[1];
 }
 
 
+namespace {
+/*
+ * The sampled templates, given in ascending order of their first values, are
+ * gathered into one buffer before the pairs are compared, so that the
+ * comparisons read contiguous memory instead of scattered places of the
+ * series. The templates following a template within r of it in the first
+ * value form a window found with two pointers, as in GetRankBounds, and the
+ * others need no comparison. The window is compared in blocks, one
+ * coordinate at a time, which the compiler vectorizes.
+ */
 template <typename T>
-std::vector<long long> ComputeABSample(
-    const std::vector<T> &data, const std::vector<unsigned> &sample_indices,
-    const unsigned m, const T r) {
-  const unsigned n0 = sample_indices.size();
+vector<long long> ComputeABSortedSample(const vector<T> &data,
+                                        const vector<unsigned> &sorted_indices,
+                                        const unsigned m, const T r) {
+  const unsigned n0 = sorted_indices.size();
+  const unsigned dim = m + 1;
+  // packed[k * n0 + i] is the coordinate k of the template i.
+  vector<T> packed(static_cast<size_t>(dim) * n0);
+  for (unsigned i = 0; i < n0; ++i) {
+    for (unsigned k = 0; k < dim; ++k)
+      packed[static_cast<size_t>(k) * n0 + i] = data[sorted_indices[i] + k];
+  }
+
+  const unsigned kBlockSize = 256;
+  uint8_t matched[kBlockSize];
+  // Compares the coordinate k of the template i with those of the count
+  // templates from first, and returns whether any of them still matches.
+  const auto match_coordinate = [&](unsigned k, unsigned i, unsigned first,
+                                    unsigned count) {
+    const T *column = packed.data() + static_cast<size_t>(k) * n0;
+    const T x = column[i];
+    const T *y = column + first;
+    uint8_t alive = 0;
+    for (unsigned j = 0; j < count; ++j) {
+      matched[j] &= (x <= y[j] + r) & (y[j] <= x + r);
+      alive |= matched[j];
+    }
+    return alive != 0;
+  };
   long long a = 0;
   long long b = 0;
-  for (unsigned i = 0; i < n0 - 1; ++i) {
-    const unsigned ii = sample_indices[i];
-    for (unsigned j = i + 1; j < n0; ++j) {
-      const unsigned jj = sample_indices[j];
-      bool in = true;
-      for (unsigned k = 0; k < m; ++k) {
-        const unsigned ik = ii + k;
-        const unsigned jk = jj + k;
-        if (data[jk] > data[ik] + r || data[ik] > data[jk] + r) {
-          in = false;
-          break;
-        }
-      }
-      if (in) {
-        ++b;
-        if (data[jj + m] <= data[ii + m] + r
-            && data[ii + m] <= data[jj + m] + r) {
-          ++a;
-        }
-      }
+  for (unsigned i = 0, end = 1; i + 1 < n0; ++i) {
+    if (end <= i)
+      end = i + 1;
+    while (end < n0 && packed[end] <= packed[i] + r)
+      ++end;
+    for (unsigned first = i + 1; first < end; first += kBlockSize) {
+      const unsigned count = std::min(kBlockSize, end - first);
+      std::fill(matched, matched + count, 1);
+      // The first coordinates are within r in the window.
+      bool alive = true;
+      for (unsigned k = 1; k < m && alive; ++k)
+        alive = match_coordinate(k, i, first, count);
+      if (!alive)
+        continue;
+      b += std::accumulate(matched, matched + count, 0u);
+      if (match_coordinate(m, i, first, count))
+        a += std::accumulate(matched, matched + count, 0u);
     }
   }
-  std::vector<long long> result(2);
+  vector<long long> result(2);
   result[0] = a;
   result[1] = b;
   return result;
 }
-
+} // namespace
 
 template <typename T>
 void SampleEntropyCalculatorSamplingDirect<T>::_ComputeSampleEntropy() {
-  const vector<vector<unsigned> > indices =
-      GetSampleIndices(_rtype, _n - K, _sample_size, _sample_num, _random);
-  _a_vec = vector<long long>(_sample_num);
-  _b_vec = vector<long long>(_sample_num);
   Timer timer;
   timer.SetStartingPointNow();
+  const vector<vector<unsigned> > indices =
+      GetSampleIndices(_rtype, _n - K, _sample_size, _sample_num, _random);
   timer.StopTimer();
   if (_output_level == Debug) {
     std::cout << "[INFO] Time consumed in sampling: " << timer.ElapsedSeconds()
               << " seconds.\n";
   }
 
+  // With presorting, the templates are ranked by their first values once,
+  // and each sample is sorted by the ranks instead of the values scattered
+  // in the series.
+  vector<unsigned> rank2index, index2rank;
+  if (_presort) {
+    timer.SetStartingPointNow();
+    rank2index = SortTemplates(_data.data(), _n - K, 1);
+    index2rank.resize(rank2index.size());
+    for (unsigned rank = 0; rank < rank2index.size(); ++rank)
+      index2rank[rank2index[rank]] = rank;
+    timer.StopTimer();
+    if (_output_level == Debug) {
+      std::cout << "[INFO] Time consumed in presorting: "
+                << timer.ElapsedSeconds() << " seconds.\n";
+    }
+  }
+
+  _a_vec = vector<long long>(_sample_num);
+  _b_vec = vector<long long>(_sample_num);
   timer.SetStartingPointNow();
-  for (unsigned i = 0; i < _sample_num; ++i) {
-    auto ab = ComputeABSample(_data, indices[i], K, _r);
+  // The samples are independent. Each result is stored at the position of
+  // its sample, so that _a_vec and _b_vec do not depend on the scheduling.
+  ParallelFor(_sample_num, _num_threads, [&](unsigned i) {
+    vector<unsigned> sorted(indices[i]);
+    if (_presort) {
+      for (unsigned &index : sorted)
+        index = index2rank[index];
+      std::sort(sorted.begin(), sorted.end());
+      for (unsigned &index : sorted)
+        index = rank2index[index];
+    } else {
+      std::sort(sorted.begin(), sorted.end(),
+                [this](unsigned i1, unsigned i2) {
+                  return _data[i1] < _data[i2];
+                });
+    }
+    auto ab = ComputeABSortedSample(_data, sorted, K, _r);
     _a_vec[i] = ab[0], _b_vec[i] = ab[1];
-    _a += ab[0];
-    _b += ab[1];
+  });
+  for (unsigned i = 0; i < _sample_num; ++i) {
+    _a += _a_vec[i];
+    _b += _b_vec[i];
   }
 
   timer.StopTimer();
@@ -170,8 +788,19 @@ void SampleEntropyCalculatorSamplingDirect<T>::_ComputeSampleEntropy() {
 #define INSTANTIATE_DIRECT_CALCULATOR(TYPE) \
 template vector<long long> _ComputeABFastDirect<TYPE>( \
     const TYPE *y, unsigned n, TYPE r, unsigned K); \
+template vector<long long> ComputeABFastDirect<TYPE>( \
+    const TYPE *y, unsigned n, TYPE r, unsigned K, unsigned num_threads); \
+template vector<long long> ComputeABFastDirectMultiR<TYPE>( \
+    const TYPE *y, unsigned n, const vector<TYPE> &r, unsigned K, \
+    unsigned num_threads); \
+template vector<long long> ComputeABDirectMultiR<TYPE>( \
+    const TYPE *y, unsigned n, const vector<TYPE> &r, unsigned K, \
+    unsigned num_threads); \
+template vector<long long> ComputeABDirectMultiM<TYPE>( \
+    const TYPE *y, unsigned n, TYPE r, unsigned min_m, unsigned max_m, \
+    unsigned num_threads); \
 template vector<long long> ComputeABDirect<TYPE>( \
-    const vector<KDPoint<TYPE> > &points, TYPE r); \
+    const TemplateView<TYPE> &points, TYPE r); \
 template class SampleEntropyCalculatorDirect<TYPE>; \
 template class SampleEntropyCalculatorSamplingDirect<TYPE>; \
 template class SampleEntropyCalculatorFastDirect<TYPE>;
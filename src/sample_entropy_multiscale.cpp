@@ -0,0 +1,86 @@
+#include "sample_entropy_multiscale.h"
+
+#include <atomic>
+
+#include "parallel.h"
+#include "sample_entropy_calculator_direct.h"
+#include "sample_entropy_calculator_kd.h"
+
+namespace sampen {
+
+namespace {
+// Sums up every scale consecutive samples of data into buffer, which is
+// reused for every scale.
+template <typename T>
+void CoarseGrain(const vector<T> &data, unsigned scale, vector<T> &buffer) {
+  const unsigned n = data.size() / scale;
+  buffer.resize(n);
+  const T *x = data.data();
+  for (unsigned i = 0; i < n; ++i, x += scale) {
+    T sum = x[0];
+    for (unsigned k = 1; k < scale; ++k)
+      sum += x[k];
+    buffer[i] = sum;
+  }
+}
+} // namespace
+
+template <typename T>
+vector<MultiscaleSampleEntropyResult> ComputeMultiscaleSampleEntropy(
+    const vector<T> &data, T r, unsigned m, unsigned max_scale,
+    unsigned num_threads, unsigned kd_min_length) {
+  // The scales with more than m + 1 samples.
+  unsigned num_scales = 0;
+  while (num_scales < max_scale && data.size() / (num_scales + 1) > m + 1)
+    ++num_scales;
+  vector<MultiscaleSampleEntropyResult> results(num_scales);
+  if (num_scales == 0)
+    return results;
+
+  // The scales are handed out in increasing order, i.e., from the longest
+  // series to the shortest, so that the threads end at about the same time.
+  std::atomic<unsigned> next(0);
+  const unsigned num_workers = std::min(std::max(num_threads, 1u), num_scales);
+  ParallelFor(num_workers, num_workers, [&](unsigned) {
+    vector<T> buffer;
+    buffer.reserve(data.size() / 2);
+    unsigned s;
+    while ((s = next.fetch_add(1)) < num_scales) {
+      const unsigned scale = s + 1;
+      // The original series needs no copy.
+      if (scale > 1)
+        CoarseGrain(data, scale, buffer);
+      const vector<T> &y = scale > 1 ? buffer : data;
+      const T r_scale = static_cast<T>(r * scale);
+
+      MultiscaleSampleEntropyResult &result = results[s];
+      result.scale = scale;
+      result.n = y.size();
+      // The kd trees have m - 1 dimensions.
+      result.kd = result.n >= kd_min_length && m >= 2;
+      vector<long long> ab;
+      if (result.kd) {
+        ABCalculatorRKD<T> calculator(m, Silent);
+        ab = calculator.ComputeAB(y.cbegin(), y.cend(), r_scale);
+      } else {
+        ab = ComputeABFastDirect<T>(y.data(), y.size(), r_scale, m);
+      }
+      result.a = ab[0];
+      result.b = ab[1];
+      result.entropy = ComputeSampen(static_cast<double>(result.a),
+                                     static_cast<double>(result.b),
+                                     result.n - m, m);
+    }
+  });
+  return results;
+}
+
+#define INSTANTIATE_MULTISCALE_SAMPLE_ENTROPY(TYPE) \
+template vector<MultiscaleSampleEntropyResult> \
+ComputeMultiscaleSampleEntropy<TYPE>( \
+    const vector<TYPE> &data, TYPE r, unsigned m, unsigned max_scale, \
+    unsigned num_threads, unsigned kd_min_length);
+
+INSTANTIATE_MULTISCALE_SAMPLE_ENTROPY(double);
+INSTANTIATE_MULTISCALE_SAMPLE_ENTROPY(int);
+} // namespace sampen
@@ -0,0 +1,102 @@
+#include "sample_entropy_streaming.h"
+
+#include <assert.h>
+
+namespace sampen {
+
+template <typename T>
+StreamingSampleEntropy<T>::StreamingSampleEntropy(unsigned window, T r,
+                                                  unsigned m)
+    : _window(window), _r(r), K(m), _num_pushed(0), _a(0), _b(0),
+      _samples_offset(0), _num_nodes(0) {
+  if (window <= m) {
+    MSG_ERROR(-1, "The window (%u) should be greater than m (%u).\n", window,
+              m);
+  }
+}
+
+template <typename T> void StreamingSampleEntropy<T>::Push(T x) {
+  _samples.push_back(x);
+  const unsigned long long last = _num_pushed++;
+  // The template starting at the sample that has just left the window.
+  if (_num_pushed > _window)
+    _Remove(_num_pushed - 1 - _window);
+  if (_num_pushed > K)
+    _Insert(last - K);
+
+  // Drop the samples before the window once they take as much room as the
+  // window does.
+  if (_num_pushed > _window) {
+    const unsigned long long first = _num_pushed - _window;
+    if (first - _samples_offset >= _window) {
+      _samples.erase(_samples.begin(),
+                     _samples.begin() + (first - _samples_offset));
+      _samples_offset = first;
+    }
+  }
+}
+
+template <typename T>
+void StreamingSampleEntropy<T>::_Count(unsigned long long index, int sign) {
+  const Range<T> range =
+      GetHyperCubeR(KDPointRef<T>(_Template(index), K + 1), _r);
+  for (Block &block : _blocks) {
+    const vector<long long> ab = block.tree.CountRange(range, _num_nodes);
+    _a += sign * ab[0];
+    _b += sign * ab[1];
+  }
+}
+
+template <typename T>
+void StreamingSampleEntropy<T>::_Insert(unsigned long long index) {
+  _Count(index, 1);
+  _blocks.push_back(_Build(index, index + 1));
+  while (_blocks.size() > 1) {
+    const unsigned i = _blocks.size() - 2;
+    if (_blocks[i].live() > 2 * _blocks[i + 1].live())
+      break;
+    _Merge(i);
+  }
+}
+
+template <typename T>
+void StreamingSampleEntropy<T>::_Remove(unsigned long long index) {
+  // Templates leave in the order they came, so the template is the first
+  // open one of the oldest tree.
+  Block &block = _blocks.front();
+  assert(index == block.first + block.num_closed);
+  block.tree.Close(index - block.first);
+  ++block.num_closed;
+  _Count(index, -1);
+
+  if (block.live() == 0) {
+    _blocks.erase(_blocks.begin());
+  } else if (2 * block.num_closed >= block.size) {
+    block = _Build(block.first + block.num_closed, block.first + block.size);
+    while (_blocks.size() > 1 && _blocks[0].live() <= 2 * _blocks[1].live())
+      _Merge(0);
+  }
+}
+
+template <typename T>
+typename StreamingSampleEntropy<T>::Block
+StreamingSampleEntropy<T>::_Build(unsigned long long first,
+                                  unsigned long long last) {
+  const unsigned size = static_cast<unsigned>(last - first);
+  const TemplateView<T> points(_Template(first), size + K, K + 1);
+  Block block(first, size, points);
+  for (unsigned i = 0; i < size; ++i)
+    block.tree.UpdateCount(i, 1);
+  return block;
+}
+
+// Rebuild the open templates of the i-th and (i + 1)-th trees into one.
+template <typename T> void StreamingSampleEntropy<T>::_Merge(unsigned i) {
+  const Block &older = _blocks[i], &newer = _blocks[i + 1];
+  _blocks[i] = _Build(older.first + older.num_closed, newer.first + newer.size);
+  _blocks.erase(_blocks.begin() + i + 1);
+}
+
+template class StreamingSampleEntropy<double>;
+template class StreamingSampleEntropy<int>;
+} // namespace sampen
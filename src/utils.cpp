@@ -8,11 +8,23 @@
  * @details
  */
 #include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
 #include <fstream>
 #include <iostream>
 #include <math.h>
 #include <stdexcept>
 
+#ifdef __unix__
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "parallel.h"
 #include "utils.h"
 
 namespace sampen {
@@ -34,6 +46,503 @@ void ReportVmPeak() {
 #endif
 }
 
+namespace {
+// A file mapped into memory read-only (or read into memory where mmap is not
+// available). If the file can not be read, error() tells why and the file is
+// empty.
+class MappedFile {
+public:
+  explicit MappedFile(const string &filename) : _data(nullptr), _size(0) {
+#ifdef __unix__
+    const int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+      _error = "Cannot open file " + filename + ".";
+      return;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+      close(fd);
+      _error = "Cannot stat file " + filename + ".";
+      return;
+    }
+    _size = st.st_size;
+    if (_size) {
+      void *p = mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (p == MAP_FAILED) {
+        close(fd);
+        _size = 0;
+        _error = "Cannot map file " + filename + ".";
+        return;
+      }
+      madvise(p, _size, MADV_SEQUENTIAL);
+      _data = static_cast<const char *>(p);
+    }
+    close(fd);
+#else
+    ifstream ifs(filename, std::ios::binary);
+    if (!ifs.is_open()) {
+      _error = "Cannot open file " + filename + ".";
+      return;
+    }
+    _buffer.assign(std::istreambuf_iterator<char>(ifs),
+                   std::istreambuf_iterator<char>());
+    _data = _buffer.data();
+    _size = _buffer.size();
+#endif
+  }
+  ~MappedFile() {
+#ifdef __unix__
+    if (_data)
+      munmap(const_cast<char *>(_data), _size);
+#endif
+  }
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  const char *data() const { return _data; }
+  size_t size() const { return _size; }
+  const string &error() const { return _error; }
+
+private:
+  const char *_data;
+  size_t _size;
+  string _error;
+#ifndef __unix__
+  vector<char> _buffer;
+#endif
+};
+
+// Converts count little-endian values of type V at p.
+template <typename V, typename T>
+void ConvertLittleEndian(const char *p, size_t count, vector<T> &result) {
+  result.resize(count);
+  for (size_t i = 0; i < count; ++i, p += sizeof(V)) {
+    unsigned char bytes[sizeof(V)];
+    memcpy(bytes, p, sizeof(V));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    std::reverse(bytes, bytes + sizeof(V));
+#endif
+    V x;
+    memcpy(&x, bytes, sizeof(V));
+    result[i] = static_cast<T>(x);
+  }
+}
+
+size_t BinaryValueSize(const string &value_type) {
+  if (value_type == "int16")
+    return 2;
+  if (value_type == "int32" || value_type == "float32")
+    return 4;
+  if (value_type == "float64")
+    return 8;
+  return 0;
+}
+} // namespace
+
+bool IsBinaryValueType(const string &value_type) {
+  return BinaryValueSize(value_type) > 0;
+}
+
+namespace {
+// The body of ReadBinaryData and TryReadBinaryData. Sets error (and reads
+// nothing) if the file can not be read.
+template <typename T>
+size_t ReadBinaryData(vector<T> &result, const string &filename,
+                      const string &value_type, unsigned n, unsigned offset,
+                      string &error) {
+  const size_t value_size = BinaryValueSize(value_type);
+  if (value_size == 0) {
+    error = "Invalid binary value type: " + value_type + ".";
+    return 0;
+  }
+  const MappedFile file(filename);
+  if (file.error().size()) {
+    error = file.error();
+    return 0;
+  }
+  const size_t total = file.size() / value_size;
+  if (file.size() % value_size) {
+    MSG_WARNING(-1, "The size of %s is not a multiple of %zu bytes.\n",
+                filename.c_str(), value_size);
+  }
+  const size_t first = std::min<size_t>(offset, total);
+  size_t count = total - first;
+  if (n) {
+    if (n > count) {
+      MSG_WARNING(-1, "Cannot read %u element from file %s. Only %zu read.\n",
+                  n, filename.c_str(), count);
+    } else {
+      count = n;
+    }
+  }
+  const char *p = file.data() + first * value_size;
+  if (value_type == "int16")
+    ConvertLittleEndian<int16_t>(p, count, result);
+  else if (value_type == "int32")
+    ConvertLittleEndian<int32_t>(p, count, result);
+  else if (value_type == "float32")
+    ConvertLittleEndian<float>(p, count, result);
+  else
+    ConvertLittleEndian<double>(p, count, result);
+  return count * value_size;
+}
+} // namespace
+
+template <typename T>
+size_t ReadBinaryData(vector<T> &result, const string &filename,
+                      const string &value_type, unsigned n, unsigned offset) {
+  string error;
+  const size_t num_bytes =
+      ReadBinaryData(result, filename, value_type, n, offset, error);
+  if (error.size()) {
+    MSG_ERROR(-1, "%s\n", error.c_str());
+  }
+  return num_bytes;
+}
+
+template <typename T>
+bool TryReadBinaryData(vector<T> &result, size_t &num_bytes,
+                       const string &filename, const string &value_type,
+                       unsigned n, unsigned offset) {
+  string error;
+  num_bytes = ReadBinaryData(result, filename, value_type, n, offset, error);
+  if (error.size()) {
+    MSG_WARNING(-1, "%s\n", error.c_str());
+    return false;
+  }
+  return true;
+}
+
+template size_t ReadBinaryData<int>(vector<int> &result,
+                                    const string &filename,
+                                    const string &value_type, unsigned n,
+                                    unsigned offset);
+template size_t ReadBinaryData<double>(vector<double> &result,
+                                       const string &filename,
+                                       const string &value_type, unsigned n,
+                                       unsigned offset);
+template bool TryReadBinaryData<int>(vector<int> &result, size_t &num_bytes,
+                                     const string &filename,
+                                     const string &value_type, unsigned n,
+                                     unsigned offset);
+template bool TryReadBinaryData<double>(vector<double> &result,
+                                        size_t &num_bytes,
+                                        const string &filename,
+                                        const string &value_type, unsigned n,
+                                        unsigned offset);
+
+namespace {
+// The size of the chunks of a text file parsed by one thread at a time.
+const size_t kMinParseChunkSize = 1 << 16;
+const size_t kMaxParseChunkSize = 1 << 22;
+
+inline bool IsSpace(char c) {
+  return c == ' ' || c == '\n' || c == '\t' || c == '\r' || c == '\v' ||
+         c == '\f';
+}
+
+inline const char *SkipSpaces(const char *p, const char *last) {
+  while (p < last && IsSpace(*p))
+    ++p;
+  return p;
+}
+
+inline const char *SkipToken(const char *p, const char *last) {
+  while (p < last && !IsSpace(*p))
+    ++p;
+  return p;
+}
+
+// Parses the whole token [first, last) into x. The file is not terminated
+// with '\0', so strtod gets a copy of the token.
+bool ParseValue(const char *first, const char *last, double &x) {
+  char buffer[64];
+  const size_t length = last - first;
+  if (length < sizeof(buffer)) {
+    memcpy(buffer, first, length);
+    buffer[length] = '\0';
+    char *end;
+    x = strtod(buffer, &end);
+    return end == buffer + length;
+  }
+  const string token(first, last);
+  char *end;
+  x = strtod(token.c_str(), &end);
+  return end == token.c_str() + length;
+}
+
+bool ParseValue(const char *first, const char *last, int &x) {
+  const char *p = first;
+  const bool negative = p < last && *p == '-';
+  if (p < last && (*p == '-' || *p == '+'))
+    ++p;
+  if (p == last)
+    return false;
+  const long long limit =
+      static_cast<long long>(std::numeric_limits<int>::max()) + negative;
+  long long value = 0;
+  for (; p < last; ++p) {
+    const unsigned digit = static_cast<unsigned char>(*p) - '0';
+    if (digit > 9)
+      return false;
+    value = value * 10 + digit;
+    if (value > limit)
+      return false;
+  }
+  x = static_cast<int>(negative ? -value : value);
+  return true;
+}
+
+template <typename T> struct TextChunk {
+  const char *first;
+  const char *last;
+  vector<T> values;
+  // Where the first value (simple) or line (multirecord) that cannot be
+  // parsed starts, or nullptr. The values before it are kept.
+  const char *error;
+};
+
+// Moves p forward to the start of the next value (simple) or line
+// (multirecord), so that no value is split between two chunks.
+const char *AlignChunkBoundary(const char *p, const char *begin,
+                               const char *end, bool multirecord) {
+  if (p == begin || p == end)
+    return p;
+  if (multirecord) {
+    if (p[-1] == '\n')
+      return p;
+    const void *eol = memchr(p, '\n', end - p);
+    return eol ? static_cast<const char *>(eol) + 1 : end;
+  }
+  return IsSpace(p[-1]) ? p : SkipToken(p, end);
+}
+
+template <typename T> void ParseSimpleChunk(TextChunk<T> &chunk) {
+  const char *p = chunk.first;
+  T x;
+  while ((p = SkipSpaces(p, chunk.last)) < chunk.last) {
+    const char *token = p;
+    p = SkipToken(p, chunk.last);
+    if (!ParseValue(token, p, x)) {
+      chunk.error = token;
+      return;
+    }
+    chunk.values.push_back(x);
+  }
+}
+
+// Each line holds a record number and a value, of which the value is kept.
+template <typename T> void ParseMultirecordChunk(TextChunk<T> &chunk) {
+  const char *p = chunk.first;
+  T x;
+  while (p < chunk.last) {
+    const void *eol = memchr(p, '\n', chunk.last - p);
+    const char *line_end =
+        eol ? static_cast<const char *>(eol) : chunk.last;
+    const char *first = SkipSpaces(p, line_end);
+    const char *first_end = SkipToken(first, line_end);
+    const char *second = SkipSpaces(first_end, line_end);
+    const char *second_end = SkipToken(second, line_end);
+    if (!ParseValue(first, first_end, x) ||
+        !ParseValue(second, second_end, x)) {
+      chunk.error = p;
+      return;
+    }
+    chunk.values.push_back(x);
+    p = eol ? line_end + 1 : chunk.last;
+  }
+}
+
+// The body of ReadData and TryReadData. Sets error (and reads nothing) if
+// the file can not be read or parsed.
+template <typename T>
+size_t ReadData(vector<T> &result, const string &filename,
+                const string &input_type, unsigned n, unsigned line_offset,
+                unsigned num_threads, string &error) {
+  const bool multirecord = input_type == "multirecord";
+  if (!multirecord && input_type != "simple") {
+    error = "Invalid input-type: " + input_type + ".";
+    return 0;
+  }
+  num_threads = std::max(num_threads, 1u);
+  const MappedFile file(filename);
+  if (file.error().size()) {
+    error = file.error();
+    return 0;
+  }
+  const char *const begin = file.data();
+  const char *const end = begin + file.size();
+  const size_t chunk_size =
+      std::min(std::max(file.size() / (4 * num_threads), kMinParseChunkSize),
+               kMaxParseChunkSize);
+  // The number of values (including the skipped ones) that are needed, or 0
+  // for all of them.
+  const size_t wanted = n ? static_cast<size_t>(n) + line_offset : 0;
+
+  // Each wave gives every thread a few chunks, and the parsing stops after
+  // the wave in which enough values are found (or an error is hit).
+  vector<TextChunk<T> > chunks;
+  size_t num_values = 0;
+  const char *p = begin;
+  const char *error_at = nullptr;
+  while (p < end && !error_at && (!wanted || num_values < wanted)) {
+    const size_t first_chunk = chunks.size();
+    for (unsigned i = 0; i < 4 * num_threads && p < end; ++i) {
+      const char *q = AlignChunkBoundary(
+          p + std::min<size_t>(chunk_size, end - p), begin, end, multirecord);
+      chunks.push_back(TextChunk<T>{p, q, vector<T>(), nullptr});
+      // The first chunk is parsed into the storage of result, which is
+      // reused when the same vector reads many files.
+      if (chunks.size() == 1) {
+        chunks[0].values.swap(result);
+        chunks[0].values.clear();
+      }
+      p = q;
+    }
+    ParallelFor(chunks.size() - first_chunk, num_threads, [&](unsigned i) {
+      TextChunk<T> &chunk = chunks[first_chunk + i];
+      if (multirecord)
+        ParseMultirecordChunk(chunk);
+      else
+        ParseSimpleChunk(chunk);
+    });
+    for (size_t i = first_chunk; i < chunks.size(); ++i) {
+      num_values += chunks[i].values.size();
+      if (chunks[i].error) {
+        error_at = chunks[i].error;
+        chunks.resize(i + 1);
+        break;
+      }
+    }
+  }
+  if (error_at && (!wanted || num_values < wanted)) {
+    const size_t line = std::count(begin, error_at, '\n') + 1;
+    error = "Input file format error (file: " + filename +
+            ", line: " + std::to_string(line) + ").";
+    return 0;
+  }
+
+  size_t count = num_values > line_offset ? num_values - line_offset : 0;
+  if (n) {
+    if (n > count) {
+      MSG_WARNING(-1, "Cannot read %u element from file %s. Only %zu read.\n",
+                  n, filename.c_str(), count);
+    } else {
+      count = n;
+    }
+  }
+  if (chunks.size() <= 1 && line_offset == 0) {
+    if (chunks.empty())
+      result.clear();
+    else
+      result.swap(chunks[0].values);
+    result.resize(count);
+    return p - begin;
+  }
+  // Copy the part of each chunk in [line_offset, line_offset + count).
+  result.resize(count);
+  vector<size_t> chunk_begin(chunks.size() + 1, 0);
+  for (size_t i = 0; i < chunks.size(); ++i)
+    chunk_begin[i + 1] = chunk_begin[i] + chunks[i].values.size();
+  ParallelFor(chunks.size(), num_threads, [&](unsigned i) {
+    const size_t first = std::max<size_t>(chunk_begin[i], line_offset);
+    const size_t last = std::min(chunk_begin[i + 1], line_offset + count);
+    if (first < last) {
+      std::copy(chunks[i].values.begin() + (first - chunk_begin[i]),
+                chunks[i].values.begin() + (last - chunk_begin[i]),
+                result.begin() + (first - line_offset));
+    }
+  });
+  return p - begin;
+}
+} // namespace
+
+template <typename T>
+size_t ReadData(vector<T> &result, const string &filename,
+                const string &input_type, unsigned n, unsigned line_offset,
+                unsigned num_threads) {
+  string error;
+  const size_t num_bytes = ReadData(result, filename, input_type, n,
+                                    line_offset, num_threads, error);
+  if (error.size()) {
+    MSG_ERROR(-1, "%s\n", error.c_str());
+  }
+  return num_bytes;
+}
+
+template <typename T>
+bool TryReadData(vector<T> &result, size_t &num_bytes, const string &filename,
+                 const string &input_type, unsigned n, unsigned line_offset,
+                 unsigned num_threads) {
+  string error;
+  num_bytes = ReadData(result, filename, input_type, n, line_offset,
+                       num_threads, error);
+  if (error.size()) {
+    MSG_WARNING(-1, "%s\n", error.c_str());
+    return false;
+  }
+  return true;
+}
+
+template size_t ReadData<int>(vector<int> &result, const string &filename,
+                              const string &input_type, unsigned n,
+                              unsigned line_offset, unsigned num_threads);
+template size_t ReadData<double>(vector<double> &result,
+                                 const string &filename,
+                                 const string &input_type, unsigned n,
+                                 unsigned line_offset, unsigned num_threads);
+template bool TryReadData<int>(vector<int> &result, size_t &num_bytes,
+                               const string &filename,
+                               const string &input_type, unsigned n,
+                               unsigned line_offset, unsigned num_threads);
+template bool TryReadData<double>(vector<double> &result, size_t &num_bytes,
+                                  const string &filename,
+                                  const string &input_type, unsigned n,
+                                  unsigned line_offset, unsigned num_threads);
+
+vector<string> GetBatchInputFiles(const string &path) {
+  vector<string> files;
+#ifdef __unix__
+  struct stat st;
+  if (stat(path.c_str(), &st) < 0) {
+    MSG_ERROR(-1, "Cannot open %s.\n", path.c_str());
+  }
+  if (S_ISDIR(st.st_mode)) {
+    DIR *dir = opendir(path.c_str());
+    if (!dir) {
+      MSG_ERROR(-1, "Cannot open directory %s.\n", path.c_str());
+    }
+    while (const struct dirent *entry = readdir(dir)) {
+      if (entry->d_name[0] == '.')
+        continue;
+      const string filename = path + "/" + entry->d_name;
+      if (stat(filename.c_str(), &st) == 0 && S_ISREG(st.st_mode))
+        files.push_back(filename);
+    }
+    closedir(dir);
+    std::sort(files.begin(), files.end());
+    return files;
+  }
+#endif
+  ifstream ifs(path);
+  if (!ifs.is_open()) {
+    MSG_ERROR(-1, "Cannot open manifest %s.\n", path.c_str());
+  }
+  const size_t slash = path.find_last_of('/');
+  const string dirname =
+      slash == string::npos ? string() : path.substr(0, slash + 1);
+  string line;
+  while (std::getline(ifs, line)) {
+    const size_t first = line.find_first_not_of(" \t\r");
+    if (first == string::npos || line[first] == '#')
+      continue;
+    const size_t last = line.find_last_not_of(" \t\r");
+    const string filename = line.substr(first, last - first + 1);
+    files.push_back(filename[0] == '/' ? filename : dirname + filename);
+  }
+  return files;
+}
+
 double ComputeSampen(double A, double B, unsigned N, unsigned m) {
   if (A > 0 && B > 0) {
     return -log(A / B);
@@ -123,6 +632,34 @@ vector<int> ArgumentParser::getArgIntArray(const string &arg) {
   return result;
 }
 
+vector<double> ParseDoubleArrayFromString(const string &arg) {
+  vector<double> result;
+  if (arg.empty())
+    return result;
+  size_t curr = 0;
+  while (true) {
+    const size_t next = arg.find(',', curr);
+    result.push_back(std::stod(arg.substr(curr, next - curr)));
+    if (next == string::npos)
+      break;
+    curr = next + 1;
+  }
+  return result;
+}
+
+vector<double> ArgumentParser::getArgDoubleArray(const string &arg) {
+  std::string arg_v = getArg(arg);
+  vector<double> result;
+  try {
+    result = ParseDoubleArrayFromString(arg_v);
+  } catch (const std::invalid_argument &e) {
+    std::cerr << "Invalid argument: " << arg << " " << arg_v;
+    std::cerr << "\n" << e.what() << "\n";
+    exit(-1);
+  }
+  return result;
+}
+
 void PrintSeperator(char x) {
   const int kCount = 80;
   for (unsigned i = 0; i < kCount; ++i) {
@@ -142,4 +679,189 @@ Range<unsigned> GetHyperCube(const KDPoint<unsigned> &point,
   return result;
 }
 
+namespace {
+// Unsigned keys whose order is that of the values.
+uint32_t RadixKey(int x) { return static_cast<uint32_t>(x) ^ 0x80000000u; }
+
+uint64_t RadixKey(double x) {
+  // -0.0 and 0.0 are equal.
+  if (x == 0)
+    x = 0;
+  uint64_t bits;
+  memcpy(&bits, &x, sizeof(bits));
+  return (bits >> 63) ? ~bits : bits | (1ull << 63);
+}
+
+// Sorts the indices 0, ..., n - 1 by the keys with LSD radix sort on bytes.
+// The keys are destroyed, and keys_tmp and order_tmp are work space.
+template <typename Key>
+void RadixSortIndices(vector<Key> &keys, vector<Key> &keys_tmp,
+                      vector<unsigned> &order, vector<unsigned> &order_tmp) {
+  const size_t n = keys.size();
+  order.resize(n);
+  order_tmp.resize(n);
+  for (size_t i = 0; i < n; ++i)
+    order[i] = i;
+  keys_tmp.resize(n);
+  for (unsigned shift = 0; shift < 8 * sizeof(Key); shift += 8) {
+    size_t count[257] = {0};
+    for (size_t i = 0; i < n; ++i)
+      ++count[((keys[i] >> shift) & 255) + 1];
+    // Skip the bytes shared by all the keys.
+    if (std::find(count + 1, count + 257, n) != count + 257)
+      continue;
+    for (unsigned d = 0; d < 256; ++d)
+      count[d + 1] += count[d];
+    for (size_t i = 0; i < n; ++i) {
+      const size_t p = count[(keys[i] >> shift) & 255]++;
+      order_tmp[p] = order[i];
+      keys_tmp[p] = keys[i];
+    }
+    order.swap(order_tmp);
+    keys.swap(keys_tmp);
+  }
+}
+} // namespace
+
+template <typename T>
+vector<unsigned> SortTemplates(const T *data, unsigned n, unsigned dim) {
+  SortTemplatesBuffers<T> buffers;
+  vector<unsigned> order;
+  SortTemplates(data, n, dim, order, buffers);
+  return order;
+}
+
+template <typename T>
+void SortTemplates(const T *data, unsigned n, unsigned dim,
+                   vector<unsigned> &order,
+                   SortTemplatesBuffers<T> &buffers) {
+  static_assert(std::is_same<typename SortTemplatesBuffers<T>::Key,
+                             decltype(RadixKey(data[0]))>::value,
+                "The radix keys do not fit SortTemplatesBuffers::Key.");
+  order.clear();
+  if (n == 0)
+    return;
+  // Sort the values, i.e. the templates of length 1.
+  vector<typename SortTemplatesBuffers<T>::Key> &keys = buffers.keys;
+  keys.resize(n);
+  for (unsigned i = 0; i < n; ++i)
+    keys[i] = RadixKey(data[i]);
+  vector<unsigned> &order_tmp = buffers.order_tmp;
+  RadixSortIndices(keys, buffers.keys_tmp, order, order_tmp);
+  // rank[i] is the number of distinct templates (of the current length)
+  // smaller than that at i.
+  vector<unsigned> &rank = buffers.rank;
+  rank.resize(n);
+  unsigned num_ranks = 1;
+  rank[order[0]] = 0;
+  for (unsigned p = 1; p < n; ++p) {
+    if (data[order[p - 1]] < data[order[p]])
+      ++num_ranks;
+    rank[order[p]] = num_ranks - 1;
+  }
+
+  vector<unsigned> &rank_tmp = buffers.rank_tmp;
+  vector<unsigned> &count = buffers.count;
+  rank_tmp.resize(n);
+  // The templates of length k are sorted in order.
+  for (unsigned k = 1; k < dim && num_ranks < n; ) {
+    // The template of length k + step at i is (k at i, step at i + step),
+    // and the latter is ranked as the template of length k at i + step,
+    // which has the same first step values.
+    const unsigned step = std::min(k, dim - k);
+    // Sort by the second half first: the empty ones, then the others in the
+    // order of their second half.
+    unsigned q = 0;
+    for (unsigned i = n - step; i < n; ++i)
+      order_tmp[q++] = i;
+    for (unsigned p = 0; p < n; ++p) {
+      if (order[p] >= step)
+        order_tmp[q++] = order[p] - step;
+    }
+    // Then stably by the first half.
+    count.assign(num_ranks + 1, 0);
+    for (unsigned i = 0; i < n; ++i)
+      ++count[rank[i] + 1];
+    for (unsigned r = 0; r < num_ranks; ++r)
+      count[r + 1] += count[r];
+    for (unsigned p = 0; p < n; ++p)
+      order[count[rank[order_tmp[p]]]++] = order_tmp[p];
+    // Rank the templates of length k + step.
+    auto second = [&rank, n, step](unsigned i) {
+      return i + step < n ? rank[i + step] + 1 : 0;
+    };
+    num_ranks = 1;
+    rank_tmp[order[0]] = 0;
+    for (unsigned p = 1; p < n; ++p) {
+      const unsigned i0 = order[p - 1], i1 = order[p];
+      if (rank[i0] != rank[i1] || second(i0) != second(i1))
+        ++num_ranks;
+      rank_tmp[i1] = num_ranks - 1;
+    }
+    rank.swap(rank_tmp);
+    k += step;
+  }
+}
+
+template vector<unsigned> SortTemplates<int>(const int *data, unsigned n,
+                                             unsigned dim);
+template vector<unsigned> SortTemplates<double>(const double *data,
+                                                unsigned n, unsigned dim);
+template void SortTemplates<int>(const int *data, unsigned n, unsigned dim,
+                                 vector<unsigned> &order,
+                                 SortTemplatesBuffers<int> &buffers);
+template void SortTemplates<double>(const double *data, unsigned n,
+                                    unsigned dim, vector<unsigned> &order,
+                                    SortTemplatesBuffers<double> &buffers);
+
+vector<unsigned> GetInverseMapCyclic(const vector<unsigned> &rank2index,
+                                     unsigned dim) {
+  vector<unsigned> result;
+  GetInverseMapCyclic(rank2index, dim, result);
+  return result;
+}
+
+void GetInverseMapCyclic(const vector<unsigned> &rank2index, unsigned dim,
+                         vector<unsigned> &result) {
+  const size_t n = rank2index.size();
+  result.resize(n + dim);
+  for (size_t i = 0; i < n; ++i) {
+    result[rank2index[i]] = i;
+  }
+  for (size_t i = n; i < n + dim; ++i) {
+    result[i] = result[i % n];
+  }
+}
+
+TemplateView<unsigned> Map2Grid(const vector<unsigned> &index2rank,
+                                const vector<unsigned> &rank2index,
+                                const vector<unsigned> &ranks, unsigned dim) {
+  return Map2Grid(index2rank, rank2index, ranks, dim, vector<unsigned>());
+}
+
+TemplateView<unsigned> Map2Grid(const vector<unsigned> &index2rank,
+                                const vector<unsigned> &rank2index,
+                                const vector<unsigned> &ranks, unsigned dim,
+                                vector<unsigned> &&offsets) {
+  const size_t n = ranks.size();
+  assert(index2rank.size() >= rank2index.size() + dim);
+  offsets.resize(n);
+  for (size_t i = 0; i < n; ++i) {
+    offsets[i] = rank2index[ranks[i]] + 1;
+  }
+  return TemplateView<unsigned>(index2rank.data(), index2rank.size(), dim,
+                                std::move(offsets));
+}
+
+Range<unsigned> GetHyperCube(const KDPointRef<unsigned> &point,
+                             const Bounds &bounds) {
+  const unsigned K = point.dim();
+  Range<unsigned> result(K);
+  for (size_t i = 0; i < K; ++i) {
+    result.lower_ranges[i] = bounds.lower_bounds[point[i]];
+    result.upper_ranges[i] = bounds.upper_bounds[point[i]];
+  }
+  return result;
+}
+
 } // namespace sampen
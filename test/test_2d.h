@@ -0,0 +1,109 @@
+/**
+ * @file test_2d.h
+ *
+ * @brief The pairwise reference and the parameter sweep shared by the 2D
+ * tests.
+ */
+
+#ifndef __FAST_SAMPEN_TEST_2D__
+#define __FAST_SAMPEN_TEST_2D__
+
+#include <algorithm>
+#include <array>
+#include <random>
+#include <vector>
+
+/**
+ * @brief Get the origins {y, x} of the templates of the grid, as the 2D
+ * calculators take them.
+ */
+inline std::vector<std::array<unsigned, 2> >
+GetGridOrigins2D(unsigned width, unsigned height, unsigned m, unsigned step,
+                 unsigned dilation) {
+  const unsigned window_size = dilation * m + 1;
+  std::vector<std::array<unsigned, 2> > origins;
+  for (unsigned i = 0; i + window_size <= height; i += step)
+    for (unsigned j = 0; j + window_size <= width; j += step)
+      origins.push_back({i, j});
+  return origins;
+}
+
+/**
+ * @brief Compare every pair of the templates with the given origins {y, x}.
+ *
+ * @return {A, B}.
+ */
+template <typename T>
+std::vector<long long>
+ComputeAB2DPairwise(const std::vector<T> &data, unsigned width, T r,
+                    unsigned m, unsigned dilation,
+                    const std::vector<std::array<unsigned, 2> > &origins) {
+  const auto matched = [&](unsigned p, unsigned q, unsigned length) {
+    for (unsigned a = 0; a < length; ++a) {
+      for (unsigned b = 0; b < length; ++b) {
+        const T x = data[(origins[p][0] + dilation * a) * width +
+                         origins[p][1] + dilation * b];
+        const T y = data[(origins[q][0] + dilation * a) * width +
+                         origins[q][1] + dilation * b];
+        if (x > y + r || y > x + r)
+          return false;
+      }
+    }
+    return true;
+  };
+  std::vector<long long> ab(2, 0);
+  for (unsigned p = 0; p < origins.size(); ++p) {
+    for (unsigned q = p + 1; q < origins.size(); ++q) {
+      if (matched(p, q, m)) {
+        ++ab[1];
+        ab[0] += matched(p, q, m + 1);
+      }
+    }
+  }
+  return ab;
+}
+
+/**
+ * @brief Compare every pair of the templates of the grid.
+ */
+template <typename T>
+std::vector<long long>
+ComputeAB2DPairwise(const std::vector<T> &data, unsigned width,
+                    unsigned height, T r, unsigned m, unsigned step,
+                    unsigned dilation) {
+  return ComputeAB2DPairwise(
+      data, width, r, m, dilation,
+      GetGridOrigins2D(width, height, m, step, dilation));
+}
+
+/**
+ * @brief Call f(data, width, height, m, step, dilation) for a random image
+ * of values in [0, 7] of each of the sizes, and each m in {1, 2, 3}, step in
+ * {1, 2, 3} and dilation in {1, 2} whose templates fit in the image.
+ *
+ * @param seed: The seed of the values of the images.
+ */
+template <typename F>
+void ForEach2DCase(const std::vector<unsigned> &widths,
+                   const std::vector<unsigned> &heights, unsigned seed, F f) {
+  std::mt19937 engine(seed);
+  std::uniform_int_distribution<int> dist(0, 7);
+  for (unsigned width : widths) {
+    for (unsigned height : heights) {
+      std::vector<int> data(width * height);
+      for (int &x : data)
+        x = dist(engine);
+      for (unsigned m : {1u, 2u, 3u}) {
+        for (unsigned step : {1u, 2u, 3u}) {
+          for (unsigned dilation : {1u, 2u}) {
+            if (dilation * m + 1 > std::min(width, height))
+              continue;
+            f(data, width, height, m, step, dilation);
+          }
+        }
+      }
+    }
+  }
+}
+
+#endif // !__FAST_SAMPEN_TEST_2D__
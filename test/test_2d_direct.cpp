@@ -0,0 +1,42 @@
+#include "gtest/gtest.h"
+#include <random>
+#include <vector>
+
+#include "sample_entropy_calculator2d.h"
+#include "test_2d.h"
+
+using namespace sampen;
+
+TEST(TestComputeAB2DDirect, Int) {
+  ForEach2DCase({9, 23}, {8, 17}, 7,
+                [](const std::vector<int> &data, unsigned width,
+                   unsigned height, unsigned m, unsigned step,
+                   unsigned dilation) {
+                  const std::vector<long long> expected = ComputeAB2DPairwise(
+                      data, width, height, 2, m, step, dilation);
+                  EXPECT_EQ(ComputeAB2DDirect(data.data(), width, height, 2,
+                                              m, step, dilation),
+                            expected)
+                      << width << "x" << height << ", m: " << m
+                      << ", step: " << step << ", dilation: " << dilation;
+                  EXPECT_EQ(ComputeAB2DDirect(data.data(), width, height, 2,
+                                              m, step, dilation, 3),
+                            expected);
+                });
+}
+
+TEST(TestComputeAB2DDirect, Calculator) {
+  std::mt19937 engine(11);
+  std::normal_distribution<double> dist(0., 1.);
+  const unsigned width = 31, height = 26;
+  std::vector<double> data(width * height);
+  for (double &x : data)
+    x = dist(engine);
+  const std::vector<long long> expected =
+      ComputeAB2DPairwise(data, width, height, 0.5, 2, 1, 1);
+  SampleEntropyCalculator2DDirect<double> calculator(data, 0.5, 2, width,
+                                                     height, 1, 1, Silent);
+  calculator.set_num_threads(2);
+  EXPECT_EQ(calculator.get_a(), expected[0]);
+  EXPECT_EQ(calculator.get_b(), expected[1]);
+}
@@ -0,0 +1,44 @@
+#include "gtest/gtest.h"
+#include <random>
+#include <vector>
+
+#include "sample_entropy_calculator2d.h"
+#include "test_2d.h"
+
+using namespace sampen;
+
+TEST(TestComputeAB2DKD, SameAsDirect) {
+  ForEach2DCase({9, 23, 40}, {8, 17}, 5,
+                [](const std::vector<int> &data, unsigned width,
+                   unsigned height, unsigned m, unsigned step,
+                   unsigned dilation) {
+                  const std::vector<long long> expected = ComputeAB2DDirect(
+                      data.data(), width, height, 2, m, step, dilation);
+                  EXPECT_EQ(ComputeAB2DKD(data.data(), width, height, 2, m,
+                                          step, dilation),
+                            expected)
+                      << width << "x" << height << ", m: " << m
+                      << ", step: " << step << ", dilation: " << dilation;
+                  EXPECT_EQ(ComputeAB2DKD(data.data(), width, height, 2, m,
+                                          step, dilation, 3),
+                            expected);
+                });
+}
+
+TEST(TestComputeAB2DKD, Calculator) {
+  std::mt19937 engine(13);
+  std::uniform_int_distribution<int> dist(-8, 8);
+  const unsigned width = 37, height = 29;
+  // Multiples of 1/4, so that the ranges of the tree are exact.
+  std::vector<double> data(width * height);
+  for (double &x : data)
+    x = dist(engine) / 4.;
+  const std::vector<long long> expected =
+      ComputeAB2DDirect(data.data(), width, height, 1.25, 2, 1, 1);
+  SampleEntropyCalculator2DKD<double> calculator(data, 1.25, 2, width, height,
+                                                 1, 1, Silent);
+  calculator.set_num_threads(2);
+  EXPECT_EQ(calculator.get_a(), expected[0]);
+  EXPECT_EQ(calculator.get_b(), expected[1]);
+  EXPECT_GT(expected[0], 0);
+}
@@ -0,0 +1,75 @@
+#include "gtest/gtest.h"
+#include <array>
+#include <random>
+#include <vector>
+
+#include "random_sampler.h"
+#include "sample_entropy_calculator2d.h"
+#include "test_2d.h"
+
+using namespace sampen;
+
+TEST(TestComputeAB2DSampled, SameAsPairwise) {
+  std::mt19937 engine(3);
+  std::uniform_int_distribution<int> dist(0, 5);
+  const unsigned width = 40, height = 33;
+  std::vector<int> data(width * height);
+  for (int &x : data)
+    x = dist(engine);
+  for (unsigned m : {1u, 2u, 3u}) {
+    for (unsigned dilation : {1u, 2u}) {
+      const unsigned window_size = dilation * m + 1;
+      std::uniform_int_distribution<unsigned> y_dist(0, height - window_size);
+      std::uniform_int_distribution<unsigned> x_dist(0, width - window_size);
+      // More templates than a block, some of them repeated.
+      for (unsigned n : {0u, 1u, 2u, 50u, 700u}) {
+        std::vector<std::array<unsigned, 2> > origins(n);
+        for (auto &origin : origins)
+          origin = {y_dist(engine), x_dist(engine)};
+        EXPECT_EQ(ComputeAB2DSampled(data.data(), width, 1, m, dilation,
+                                     origins),
+                  ComputeAB2DPairwise(data, width, 1, m, dilation, origins))
+            << "m: " << m << ", dilation: " << dilation << ", n: " << n;
+      }
+    }
+  }
+}
+
+TEST(TestComputeAB2DSampled, Calculator) {
+  std::mt19937 engine(17);
+  std::normal_distribution<double> dist(0., 1.);
+  const unsigned width = 45, height = 38, m = 2, step = 2;
+  const unsigned sample_size = 200, sample_num = 5;
+  const double r = 0.6;
+  std::vector<double> data(width * height);
+  for (double &x : data)
+    x = dist(engine);
+
+  // The calculator draws the same samples with a fixed seed.
+  const unsigned window_size = m + 1;
+  const unsigned num_steps_x = (width - window_size + 1) / step;
+  const unsigned num_steps_y = (height - window_size + 1) / step;
+  RandomIndicesSamplerWR sampler(num_steps_x * num_steps_y, sample_size,
+                                 sample_num, RandomType::SWR_UNIFORM, false);
+  const auto samples = sampler.GetSampleArrays();
+  std::vector<long long> expected_a, expected_b;
+  for (const auto &indices : samples) {
+    std::vector<std::array<unsigned, 2> > origins;
+    for (unsigned index : indices)
+      origins.push_back(
+          {step * (index / num_steps_x), step * (index % num_steps_x)});
+    const std::vector<long long> ab =
+        ComputeAB2DPairwise(data, width, r, m, 1, origins);
+    expected_a.push_back(ab[0]);
+    expected_b.push_back(ab[1]);
+  }
+
+  for (unsigned num_threads : {1u, 3u}) {
+    SampleEntropyCalculator2DSamplingDirect<double> calculator(
+        data.cbegin(), data.cend(), r, m, width, height, step, 1, sample_size,
+        sample_num, 0., 0., 0., false, Silent);
+    calculator.set_num_threads(num_threads);
+    EXPECT_EQ(calculator.get_a_vec(), expected_a);
+    EXPECT_EQ(calculator.get_b_vec(), expected_b);
+  }
+}
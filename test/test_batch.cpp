@@ -0,0 +1,96 @@
+#include "gtest/gtest.h"
+#include <vector>
+
+#include "parallel.h"
+#include "sample_entropy_calculator_direct.h"
+#include "sample_entropy_calculator_kd.h"
+#include "test_signal.h"
+
+using namespace sampen;
+
+TEST(TestBatch, OrderedOutput) {
+  const unsigned num_tasks = 200;
+  for (unsigned num_threads : {1, 2, 4}) {
+    std::vector<unsigned> emitted;
+    ParallelForOrdered<std::vector<unsigned> >(
+        num_tasks, num_threads,
+        [](unsigned, unsigned i) {
+          // Tasks of unequal cost, so that they finish out of order.
+          volatile unsigned x = 0;
+          for (unsigned k = 0; k < (i % 7) * 20000; ++k)
+            x = x + k;
+          return std::vector<unsigned>(1, i);
+        },
+        [&emitted](unsigned i, const std::vector<unsigned> &result) {
+          EXPECT_EQ(result, std::vector<unsigned>(1, i));
+          emitted.push_back(i);
+        });
+    ASSERT_EQ(emitted.size(), num_tasks) << "num_threads = " << num_threads;
+    for (unsigned i = 0; i < num_tasks; ++i)
+      EXPECT_EQ(emitted[i], i) << "num_threads = " << num_threads;
+  }
+}
+
+namespace {
+// {A, B} of r[0] by RKD and by Liu, then those of all of r by RKD and by Liu.
+std::vector<long long> GetRow(ABCalculatorRKD<int> &rkd,
+                              ABCalculatorLiu<int> &liu,
+                              const std::vector<int> &data,
+                              const std::vector<int> &r) {
+  std::vector<long long> row;
+  for (const std::vector<long long> &ab :
+       {rkd.ComputeAB(data.cbegin(), data.cend(), r[0]),
+        liu.ComputeAB(data.cbegin(), data.cend(), r[0]),
+        rkd.ComputeAB(data.cbegin(), data.cend(), r),
+        liu.ComputeAB(data.cbegin(), data.cend(), r)})
+    row.insert(row.end(), ab.begin(), ab.end());
+  return row;
+}
+} // namespace
+
+// The calculators kept by each worker over its series, as in the batch mode,
+// should give the same results in the same order as a new calculator for
+// each series.
+TEST(TestBatch, ReusedCalculators) {
+  const unsigned m = 2;
+  const std::vector<unsigned> lengths{3000, 400, 4000, 20, 3, 2500,
+                                      1000, 3500, 50, 2000, 3000, 800};
+  std::vector<std::vector<int> > signals;
+  for (unsigned i = 0; i < lengths.size(); ++i)
+    signals.push_back(GetSignal<int>(lengths[i], 64, 9000 + i));
+  const std::vector<int> r{3, 6, 0};
+
+  std::vector<std::vector<long long> > expected;
+  for (const std::vector<int> &data : signals) {
+    ABCalculatorRKD<int> rkd(m, Silent);
+    ABCalculatorLiu<int> liu(m, Silent);
+    expected.push_back(GetRow(rkd, liu, data, r));
+    if (data.size() > m + 1) {
+      EXPECT_EQ(
+          std::vector<long long>(expected.back().begin(),
+                                 expected.back().begin() + 2),
+          _ComputeABFastDirect<int>(data.data(), data.size(), r[0], m));
+    }
+  }
+
+  for (unsigned num_threads : {1, 3}) {
+    std::vector<ABCalculatorRKD<int> > rkd(num_threads,
+                                           ABCalculatorRKD<int>(m, Silent));
+    std::vector<ABCalculatorLiu<int> > liu(num_threads,
+                                           ABCalculatorLiu<int>(m, Silent));
+    std::vector<std::vector<long long> > rows;
+    ParallelForOrdered<std::vector<long long> >(
+        signals.size(), num_threads,
+        [&](unsigned w, unsigned i) {
+          return GetRow(rkd[w], liu[w], signals[i], r);
+        },
+        [&rows](unsigned, const std::vector<long long> &row) {
+          rows.push_back(row);
+        });
+    ASSERT_EQ(rows.size(), expected.size());
+    for (unsigned i = 0; i < rows.size(); ++i) {
+      EXPECT_EQ(rows[i], expected[i])
+          << "num_threads = " << num_threads << ", series " << i;
+    }
+  }
+}
@@ -0,0 +1,34 @@
+#include "gtest/gtest.h"
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <sys/stat.h>
+#include <vector>
+
+#include "utils.h"
+
+using namespace sampen;
+
+TEST(TestGetBatchInputFiles, Directory) {
+  char dirname[] = "/tmp/test_batch_input_files_XXXXXX";
+  ASSERT_NE(mkdtemp(dirname), nullptr);
+  const std::string dir(dirname);
+  for (const char *name : {"b.txt", "a.txt", ".hidden", "c.bin"})
+    std::ofstream(dir + "/" + name) << "1\n";
+  mkdir((dir + "/subdir").c_str(), 0700);
+
+  EXPECT_EQ(GetBatchInputFiles(dir),
+            std::vector<std::string>(
+                {dir + "/a.txt", dir + "/b.txt", dir + "/c.bin"}));
+
+  // A manifest in the same directory, with names relative to it.
+  std::ofstream(dir + "/list") << "# records\nb.txt\n\n  c.bin \r\n/abs/x\n";
+  EXPECT_EQ(GetBatchInputFiles(dir + "/list"),
+            std::vector<std::string>(
+                {dir + "/b.txt", dir + "/c.bin", "/abs/x"}));
+
+  for (const char *name : {"b.txt", "a.txt", ".hidden", "c.bin", "list"})
+    std::remove((dir + "/" + name).c_str());
+  rmdir((dir + "/subdir").c_str());
+  rmdir(dirname);
+}
@@ -0,0 +1,47 @@
+#include "gtest/gtest.h"
+#include <numeric>
+#include <thread>
+#include <vector>
+
+#include "parallel.h"
+
+using namespace sampen;
+
+TEST(TestBoundedQueue, Order) {
+  BoundedQueue<int> queue(4);
+  for (int i = 0; i < 4; ++i)
+    queue.Push(i);
+  queue.Close();
+  int x;
+  for (int i = 0; i < 4; ++i) {
+    ASSERT_TRUE(queue.Pop(x));
+    EXPECT_EQ(x, i);
+  }
+  EXPECT_FALSE(queue.Pop(x));
+}
+
+TEST(TestBoundedQueue, ProducersAndConsumers) {
+  const int kNumItems = 10000;
+  BoundedQueue<int> queue(3);
+  std::vector<long long> sums(4, 0);
+  std::vector<std::thread> consumers;
+  for (unsigned t = 0; t < sums.size(); ++t) {
+    consumers.emplace_back([&queue, &sums, t]() {
+      int x;
+      while (queue.Pop(x))
+        sums[t] += x;
+    });
+  }
+  std::thread producer([&queue]() {
+    for (int i = 1; i <= kNumItems / 2; ++i)
+      queue.Push(i);
+  });
+  for (int i = kNumItems / 2 + 1; i <= kNumItems; ++i)
+    queue.Push(i);
+  producer.join();
+  queue.Close();
+  for (std::thread &t : consumers)
+    t.join();
+  EXPECT_EQ(std::accumulate(sums.begin(), sums.end(), 0ll),
+            static_cast<long long>(kNumItems) * (kNumItems + 1) / 2);
+}
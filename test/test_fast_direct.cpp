@@ -0,0 +1,40 @@
+#include "gtest/gtest.h"
+#include <cmath>
+#include <vector>
+
+#include "sample_entropy_calculator_direct.h"
+#include "test_signal.h"
+
+using namespace sampen;
+
+namespace {
+template <typename T>
+void ExpectSameAsScalar(const std::vector<T> &data, T r, unsigned m) {
+  const vector<long long> expected =
+      _ComputeABFastDirect<T>(data.data(), data.size(), r, m);
+  for (unsigned num_threads : {1, 3}) {
+    const vector<long long> result =
+        ComputeABFastDirect<T>(data.data(), data.size(), r, m, num_threads);
+    EXPECT_EQ(result, expected) << "n = " << data.size() << ", m = " << m;
+  }
+}
+} // namespace
+
+TEST(TestFastDirect, Int) {
+  // Lengths around the SIMD width and the block size of lags.
+  for (unsigned n : {2, 3, 17, 100, 4097, 4099, 9000}) {
+    const std::vector<int> data = GetSignal<int>(n, 32, 2021);
+    for (unsigned m = 1; m <= 4; ++m)
+      ExpectSameAsScalar(data, 3, m);
+  }
+}
+
+TEST(TestFastDirect, Double) {
+  for (unsigned n : {2, 3, 17, 100, 4097, 4099, 9000}) {
+    std::vector<double> data = GetSignal<double>(n, 1000, 2021);
+    for (double &x : data)
+      x = std::sin(x);
+    for (unsigned m = 1; m <= 4; ++m)
+      ExpectSameAsScalar(data, 0.3, m);
+  }
+}
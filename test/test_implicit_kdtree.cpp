@@ -0,0 +1,43 @@
+#include "gtest/gtest.h"
+#include <vector>
+
+#include "implicit_kdtree.h"
+#include "kdtree.h"
+#include "test_signal.h"
+
+using namespace sampen;
+
+// Update, close and query both trees in the same order.
+TEST(TestImplicitKDTree, SameAsPointerTrees) {
+  for (unsigned n : {1, 7, 8, 9, 100, 1000}) {
+    const std::vector<int> data = GetSignal<int>(n + 3, 16, 54321);
+    for (unsigned K = 1; K <= 3; ++K) {
+      TemplateView<int> points(data.data(), data.size(), K + 1);
+      ASSERT_EQ(points.size(), n + 3 - K);
+      KDCountingTree2K<int> counting_tree(K, points, Silent);
+      ImplicitKDCountingTree<int> implicit_counting_tree(K, points, Silent);
+      KDTree2K<int> tree(K, points, Silent);
+      ImplicitKDTree<int> implicit_tree(K, points, Silent);
+      long long num_nodes = 0;
+      for (unsigned i = 0; i < points.size(); ++i) {
+        const int d = 1 + i % 3;
+        counting_tree.UpdateCount(i, d);
+        implicit_counting_tree.UpdateCount(i, d);
+        // KDTree2K counts A by points rather than by weights.
+        tree.UpdateCount(i, 1);
+        implicit_tree.UpdateCount(i, 1);
+        if (i % 5 == 4) {
+          counting_tree.Close(i - 2);
+          implicit_counting_tree.Close(i - 2);
+          tree.Close(i - 2);
+          implicit_tree.Close(i - 2);
+        }
+        const Range<int> range = GetHyperCubeR(points[i / 2], 2);
+        EXPECT_EQ(implicit_counting_tree.CountRange(range, num_nodes),
+                  counting_tree.CountRange(range, num_nodes));
+        EXPECT_EQ(implicit_tree.CountRange(range, num_nodes),
+                  tree.CountRange(range, num_nodes));
+      }
+    }
+  }
+}
@@ -0,0 +1,165 @@
+#include "gtest/gtest.h"
+#include <vector>
+
+#include "sample_entropy_calculator_direct.h"
+#include "sample_entropy_calculator_kd.h"
+#include "test_signal.h"
+
+using namespace sampen;
+
+namespace {
+void ExpectSameAB(SampleEntropyCalculator<int> &sec,
+                  SampleEntropyCalculator<int> &expected) {
+  EXPECT_EQ(sec.get_a(), expected.get_a());
+  EXPECT_EQ(sec.get_b(), expected.get_b());
+}
+} // namespace
+
+TEST(TestKDThreads, Liu) {
+  const std::vector<int> data = GetSignal<int>(3000, 64, 12345);
+  for (unsigned m = 2; m <= 4; ++m) {
+    SampleEntropyCalculatorDirect<int> direct(data, 6, m, Silent);
+    for (unsigned num_threads : {1, 2, 5}) {
+      SampleEntropyCalculatorLiu<int> liu(data, 6, m, Silent);
+      liu.set_num_threads(num_threads);
+      ExpectSameAB(liu, direct);
+    }
+  }
+}
+
+TEST(TestKDThreads, RKD) {
+  const std::vector<int> data = GetSignal<int>(3000, 64, 12345);
+  for (unsigned m = 2; m <= 4; ++m) {
+    SampleEntropyCalculatorDirect<int> direct(data, 6, m, Silent);
+    for (unsigned num_threads : {1, 2, 5}) {
+      SampleEntropyCalculatorRKD<int> rkd(data, 6, m, Silent);
+      rkd.set_num_threads(num_threads);
+      ExpectSameAB(rkd, direct);
+      SampleEntropyCalculatorRKD<int> rkd_cascade(data, 6, m, Silent);
+      rkd_cascade.set_num_threads(num_threads);
+      rkd_cascade.set_cascade_counts(true);
+      ExpectSameAB(rkd_cascade, direct);
+    }
+  }
+}
+
+TEST(TestKDThreads, ShortSignal) {
+  const std::vector<int> data{1, 2, 1, 2, 1};
+  SampleEntropyCalculatorDirect<int> direct(data, 0, 2, Silent);
+  SampleEntropyCalculatorRKD<int> rkd(data, 0, 2, Silent);
+  rkd.set_num_threads(4);
+  ExpectSameAB(rkd, direct);
+}
+
+TEST(TestKDThreads, Sampling) {
+  const std::vector<int> data = GetSignal<int>(3000, 64, 12345);
+  const unsigned m = 2, sample_size = 400, sample_num = 5;
+  vector<long long> a_vec, b_vec;
+  for (unsigned num_threads : {1, 3}) {
+    SampleEntropyCalculatorSamplingLiu<int> liu(
+        data, 6, m, sample_size, sample_num, -1, -1, -1, SWR_UNIFORM, false,
+        Silent);
+    SampleEntropyCalculatorSamplingRKD<int> rkd(
+        data, 6, m, sample_size, sample_num, -1, -1, -1, SWR_UNIFORM, false,
+        Silent);
+    SampleEntropyCalculatorSamplingRKD<int> rkd_cascade(
+        data, 6, m, sample_size, sample_num, -1, -1, -1, SWR_UNIFORM, false,
+        Silent);
+    liu.set_num_threads(num_threads);
+    rkd.set_num_threads(num_threads);
+    rkd_cascade.set_num_threads(num_threads);
+    rkd_cascade.set_cascade_counts(true);
+    if (a_vec.empty()) {
+      a_vec = liu.get_a_vec();
+      b_vec = liu.get_b_vec();
+      EXPECT_EQ(a_vec.size(), sample_num);
+    }
+    EXPECT_EQ(liu.get_a_vec(), a_vec);
+    EXPECT_EQ(liu.get_b_vec(), b_vec);
+    EXPECT_EQ(rkd.get_a_vec(), a_vec);
+    EXPECT_EQ(rkd.get_b_vec(), b_vec);
+    EXPECT_EQ(rkd_cascade.get_a_vec(), a_vec);
+    EXPECT_EQ(rkd_cascade.get_b_vec(), b_vec);
+  }
+}
+
+TEST(TestKDThreads, SamplingDirect) {
+  const std::vector<int> data = GetSignal<int>(3000, 64, 12345);
+  SampleEntropyCalculatorSamplingDirect<int> serial(
+      data, 6, 2, 400, 7, -1, -1, -1, UNIFORM, false, false, Silent);
+  SampleEntropyCalculatorSamplingDirect<int> parallel(
+      data, 6, 2, 400, 7, -1, -1, -1, UNIFORM, false, false, Silent);
+  parallel.set_num_threads(3);
+  EXPECT_EQ(parallel.get_a_vec(), serial.get_a_vec());
+  EXPECT_EQ(parallel.get_b_vec(), serial.get_b_vec());
+}
+
+TEST(TestKDThreads, SamplingMao) {
+  const std::vector<int> data = GetSignal<int>(3000, 64, 12345);
+  const unsigned sample_size = 300, sample_num = 4;
+  for (unsigned m = 2; m <= 3; ++m) {
+    const std::vector<unsigned> indices = Flatten(GetSampleIndices(
+        SWR_UNIFORM, data.size() - m, sample_size, sample_num, false));
+    // Each sample on its own.
+    std::vector<long long> expected;
+    for (unsigned k = 0; k < sample_num; ++k) {
+      std::vector<unsigned> sample(indices.begin() + k * sample_size,
+                                   indices.begin() + (k + 1) * sample_size);
+      MatchedPairsCalculatorSampling2<int> cal(m, Silent);
+      expected.push_back(cal.ComputeA(data.cbegin(), data.cend(), 6, sample));
+    }
+    for (unsigned num_threads : {1, 3}) {
+      MatchedPairsCalculatorSampling2<int> cal(m, Silent, num_threads);
+      EXPECT_EQ(cal.ComputeA(data.cbegin(), data.cend(), 6, sample_num,
+                             indices),
+                expected);
+    }
+    SampleEntropyCalculatorSamplingMao<int> serial(
+        data, 6, m, sample_size, sample_num, -1, -1, -1, SWR_UNIFORM, false,
+        Silent);
+    SampleEntropyCalculatorSamplingMao<int> parallel(
+        data, 6, m, sample_size, sample_num, -1, -1, -1, SWR_UNIFORM, false,
+        Silent);
+    parallel.set_num_threads(3);
+    EXPECT_EQ(parallel.get_a_vec(), serial.get_a_vec());
+    EXPECT_EQ(parallel.get_b_vec(), serial.get_b_vec());
+    EXPECT_EQ(serial.get_b_vec().size(), sample_num);
+  }
+}
+
+TEST(TestKDThreads, SamplingRepeated) {
+  const std::vector<int> data = GetSignal<int>(2000, 64, 12345);
+  const unsigned m = 3, n = data.size();
+  // The non-auxiliary templates in sorted order, which the sample indices
+  // refer to.
+  std::vector<unsigned> sorted;
+  for (unsigned index : SortTemplates(data.data(), n, m)) {
+    if (index < n - m + 1)
+      sorted.push_back(index);
+  }
+  // Samples with repeated indices.
+  const unsigned sample_size = 500, sample_num = 3;
+  const std::vector<unsigned> indices =
+      GetSignal<unsigned>(sample_size * sample_num, 400, 7);
+  std::vector<long long> expected(sample_num, 0);
+  for (unsigned k = 0; k < sample_num; ++k) {
+    const unsigned *sample = indices.data() + k * sample_size;
+    for (unsigned p = 0; p < sample_size; ++p) {
+      for (unsigned q = p + 1; q < sample_size; ++q) {
+        bool matched = true;
+        for (unsigned d = 0; d < m; ++d) {
+          const int diff =
+              data[sorted[sample[p]] + d] - data[sorted[sample[q]] + d];
+          matched = matched && -6 <= diff && diff <= 6;
+        }
+        expected[k] += matched;
+      }
+    }
+  }
+  for (unsigned num_threads : {1, 2}) {
+    MatchedPairsCalculatorSampling<int> cal(m, Silent, num_threads);
+    EXPECT_EQ(
+        cal.ComputeA(data.cbegin(), data.cend(), 6, sample_num, indices),
+        expected);
+  }
+}
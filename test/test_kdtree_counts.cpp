@@ -0,0 +1,96 @@
+#include "gtest/gtest.h"
+#include <vector>
+
+#include "implicit_kdtree.h"
+#include "kdtree.h"
+#include "test_signal.h"
+
+using namespace sampen;
+
+// All the counts backends of RangeKDTree2K agree with KDTree2K.
+TEST(TestKDTreeCounts, RangeKDTreeBackends) {
+  for (unsigned n : {1, 2, 3, 10, 500}) {
+    const std::vector<int> data = GetSignal<int>(n + 3, 16, 2468);
+    for (unsigned K = 1; K <= 3; ++K) {
+      TemplateView<int> points(data.data(), data.size(), K + 1);
+      KDTree2K<int> tree(K, points, Silent);
+      RangeKDTree2K<int, LastAxisTreeCounts<int> > pointer_tree(K, points,
+                                                                Silent);
+      RangeKDTree2K<int, LastAxisFenwickCounts<int> > fenwick_tree(K, points,
+                                                                   Silent);
+      RangeKDTree2K<int, LastAxisCascadeCounts<int> > cascade_tree(K, points,
+                                                                   Silent);
+      long long num_nodes = 0;
+      for (unsigned i = 0; i < points.size(); ++i) {
+        tree.UpdateCount(i, 1);
+        pointer_tree.UpdateCount(i, 1);
+        fenwick_tree.UpdateCount(i, 1);
+        cascade_tree.UpdateCount(i, 1);
+        if (i % 4 == 3) {
+          tree.Close(i - 3);
+          pointer_tree.Close(i - 3);
+          fenwick_tree.Close(i - 3);
+          cascade_tree.Close(i - 3);
+        }
+        const Range<int> range = GetHyperCubeR(points[i / 2], 3);
+        const std::vector<long long> expected = tree.CountRange(range,
+                                                                num_nodes);
+        EXPECT_EQ(pointer_tree.CountRange(range, num_nodes), expected);
+        EXPECT_EQ(fenwick_tree.CountRange(range, num_nodes), expected);
+        EXPECT_EQ(cascade_tree.CountRange(range, num_nodes), expected);
+      }
+    }
+  }
+}
+
+namespace {
+// A copy made after some updates counts on its own from then on.
+template <typename Tree>
+void ExpectIndependentCopies(const TemplateView<int> &points, unsigned K) {
+  Tree tree(K, points, Silent);
+  const unsigned n = points.size();
+  for (unsigned i = 0; i < n / 2; ++i)
+    tree.UpdateCount(i, 1);
+  Tree copy(tree);
+  EXPECT_EQ(copy.num_nodes(), tree.num_nodes());
+  // The original closes the first half and opens the second one, and the
+  // copy closes every third point of the first half.
+  Tree expected_tree(K, points, Silent), expected_copy(K, points, Silent);
+  for (unsigned i = 0; i < n / 2; ++i) {
+    tree.Close(i);
+    if (i % 3 == 0)
+      copy.Close(i);
+    else
+      expected_copy.UpdateCount(i, 1);
+  }
+  for (unsigned i = n / 2; i < n; ++i) {
+    tree.UpdateCount(i, 1);
+    expected_tree.UpdateCount(i, 1);
+  }
+  long long num_nodes = 0;
+  for (unsigned i = 0; i < n; i += 7) {
+    const Range<int> range = GetHyperCubeR(points[i], 3);
+    EXPECT_EQ(tree.CountRange(range, num_nodes),
+              expected_tree.CountRange(range, num_nodes));
+    EXPECT_EQ(copy.CountRange(range, num_nodes),
+              expected_copy.CountRange(range, num_nodes));
+  }
+}
+} // namespace
+
+TEST(TestKDTreeCounts, IndependentCopies) {
+  const std::vector<int> data = GetSignal<int>(503, 16, 2468);
+  for (unsigned K = 1; K <= 3; ++K) {
+    TemplateView<int> points(data.data(), data.size(), K + 1);
+    ExpectIndependentCopies<KDCountingTree2K<int> >(points, K);
+    ExpectIndependentCopies<KDTree2K<int> >(points, K);
+    ExpectIndependentCopies<RangeKDTree2K<int, LastAxisTreeCounts<int> > >(
+        points, K);
+    ExpectIndependentCopies<RangeKDTree2K<int, LastAxisFenwickCounts<int> > >(
+        points, K);
+    ExpectIndependentCopies<RangeKDTree2K<int, LastAxisCascadeCounts<int> > >(
+        points, K);
+    ExpectIndependentCopies<ImplicitKDCountingTree<int> >(points, K);
+    ExpectIndependentCopies<ImplicitKDTree<int> >(points, K);
+  }
+}
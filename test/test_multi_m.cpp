@@ -0,0 +1,75 @@
+#include "gtest/gtest.h"
+#include <cmath>
+#include <vector>
+
+#include "sample_entropy_calculator_direct.h"
+#include "sample_entropy_calculator_kd.h"
+#include "test_signal.h"
+
+using namespace sampen;
+
+namespace {
+// The results for a range of template lengths should equal those computed
+// one template length at a time.
+template <typename T>
+void ExpectSameAsSingleM(const std::vector<T> &data, T r, unsigned min_m,
+                         unsigned max_m) {
+  std::vector<long long> expected;
+  for (unsigned m = min_m; m <= max_m; ++m) {
+    const vector<long long> ab =
+        _ComputeABFastDirect<T>(data.data(), data.size(), r, m);
+    expected.insert(expected.end(), ab.begin(), ab.end());
+  }
+  for (unsigned num_threads : {1, 2}) {
+    EXPECT_EQ(ComputeABDirectMultiM<T>(data.data(), data.size(), r, min_m,
+                                       max_m, num_threads),
+              expected)
+        << "n = " << data.size() << ", m = " << min_m << ".." << max_m;
+    // The kd trees have m - 1 dimensions.
+    if (min_m < 2)
+      continue;
+    ABCalculatorLiu<T> liu(min_m, Silent, num_threads);
+    EXPECT_EQ(liu.ComputeABMultiM(data.cbegin(), data.cend(), r, max_m),
+              expected)
+        << "n = " << data.size() << ", m = " << min_m << ".." << max_m;
+    ABCalculatorRKD<T> rkd(min_m, Silent, num_threads);
+    EXPECT_EQ(rkd.ComputeABMultiM(data.cbegin(), data.cend(), r, max_m),
+              expected)
+        << "n = " << data.size() << ", m = " << min_m << ".." << max_m;
+    ABCalculatorRKD<T> rkd_cascade(min_m, Silent, num_threads, true);
+    EXPECT_EQ(
+        rkd_cascade.ComputeABMultiM(data.cbegin(), data.cend(), r, max_m),
+        expected)
+        << "n = " << data.size() << ", m = " << min_m << ".." << max_m;
+  }
+}
+} // namespace
+
+TEST(TestMultiM, Int) {
+  for (unsigned n : {3, 7, 50, 3000}) {
+    const std::vector<int> data = GetSignal<int>(n, 8, 2718);
+    ExpectSameAsSingleM(data, 1, 1, 5);
+    ExpectSameAsSingleM(data, 2, 2, 4);
+    ExpectSameAsSingleM(data, 0, 3, 3);
+  }
+}
+
+TEST(TestMultiM, Double) {
+  std::vector<double> data = GetSignal<double>(2000, 1000, 2718);
+  for (double &x : data)
+    x = std::sin(x);
+  ExpectSameAsSingleM(data, 0.2, 1, 4);
+}
+
+TEST(TestMultiM, DirectLagBlocks) {
+  // More than one block of lags.
+  const std::vector<int> data = GetSignal<int>(9000, 4, 2718);
+  std::vector<long long> expected;
+  for (unsigned m = 2; m <= 6; ++m) {
+    const vector<long long> ab =
+        _ComputeABFastDirect<int>(data.data(), data.size(), 1, m);
+    expected.insert(expected.end(), ab.begin(), ab.end());
+  }
+  EXPECT_EQ(ComputeABDirectMultiM<int>(data.data(), data.size(), 1, 2, 6, 2),
+            expected);
+}
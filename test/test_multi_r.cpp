@@ -0,0 +1,84 @@
+#include "gtest/gtest.h"
+#include <cmath>
+#include <vector>
+
+#include "sample_entropy_calculator_direct.h"
+#include "sample_entropy_calculator_kd.h"
+#include "test_signal.h"
+
+using namespace sampen;
+
+namespace {
+// The results for several thresholds should equal those computed one
+// threshold at a time.
+template <typename T>
+void ExpectSameAsSingleR(const std::vector<T> &data, const std::vector<T> &r,
+                         unsigned m) {
+  std::vector<long long> expected;
+  for (T r_k : r) {
+    const vector<long long> ab =
+        _ComputeABFastDirect<T>(data.data(), data.size(), r_k, m);
+    expected.insert(expected.end(), ab.begin(), ab.end());
+  }
+  for (unsigned num_threads : {1, 2}) {
+    EXPECT_EQ(ComputeABDirectMultiR<T>(data.data(), data.size(), r, m,
+                                       num_threads),
+              expected)
+        << "n = " << data.size() << ", m = " << m;
+    EXPECT_EQ(ComputeABFastDirectMultiR<T>(data.data(), data.size(), r, m,
+                                           num_threads),
+              expected)
+        << "n = " << data.size() << ", m = " << m;
+    ABCalculatorLiu<T> liu(m, Silent, num_threads);
+    EXPECT_EQ(liu.ComputeAB(data.cbegin(), data.cend(), r), expected)
+        << "n = " << data.size() << ", m = " << m;
+    ABCalculatorRKD<T> rkd(m, Silent, num_threads);
+    EXPECT_EQ(rkd.ComputeAB(data.cbegin(), data.cend(), r), expected)
+        << "n = " << data.size() << ", m = " << m;
+    ABCalculatorRKD<T> rkd_cascade(m, Silent, num_threads, true);
+    EXPECT_EQ(rkd_cascade.ComputeAB(data.cbegin(), data.cend(), r), expected)
+        << "n = " << data.size() << ", m = " << m;
+  }
+}
+} // namespace
+
+TEST(TestMultiR, Int) {
+  // Unsorted and repeated thresholds.
+  const std::vector<int> r{6, 0, 3, 12, 3};
+  for (unsigned n : {4, 50, 3000}) {
+    const std::vector<int> data = GetSignal<int>(n, 64, 4242);
+    for (unsigned m = 2; m <= 4; ++m)
+      ExpectSameAsSingleR(data, r, m);
+  }
+}
+
+TEST(TestMultiR, Double) {
+  std::vector<double> data = GetSignal<double>(2000, 1000, 4242);
+  for (double &x : data)
+    x = std::sin(x);
+  const std::vector<double> r{0.1, 0.2, 0.3, 0.05};
+  for (unsigned m = 2; m <= 3; ++m)
+    ExpectSameAsSingleR(data, r, m);
+}
+
+TEST(TestMultiR, ManyThresholds) {
+  // Enough thresholds for the histogram in ComputeABFastDirectMultiR.
+  std::vector<int> r;
+  for (int r_k = 0; r_k < 40; ++r_k)
+    r.push_back(r_k);
+  ExpectSameAsSingleR(GetSignal<int>(1000, 64, 4242), r, 2);
+}
+
+TEST(TestMultiR, DirectLagBlocks) {
+  // More than one block of lags.
+  const std::vector<int> data = GetSignal<int>(5000, 16, 4242);
+  const std::vector<int> r{0, 1, 2, 5, 20};
+  std::vector<long long> expected;
+  for (int r_k : r) {
+    const vector<long long> ab =
+        _ComputeABFastDirect<int>(data.data(), data.size(), r_k, 1);
+    expected.insert(expected.end(), ab.begin(), ab.end());
+  }
+  EXPECT_EQ(ComputeABDirectMultiR<int>(data.data(), data.size(), r, 1),
+            expected);
+}
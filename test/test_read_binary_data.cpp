@@ -0,0 +1,59 @@
+#include "gtest/gtest.h"
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "utils.h"
+
+using namespace sampen;
+
+namespace {
+// Writes the values to a temporary file in little-endian order (the tests
+// assume a little-endian host) and returns its name.
+template <typename V> std::string WriteTempFile(const std::vector<V> &values) {
+  char filename[] = "/tmp/test_read_binary_data_XXXXXX";
+  const int fd = mkstemp(filename);
+  EXPECT_GE(fd, 0);
+  FILE *f = fdopen(fd, "wb");
+  fwrite(values.data(), sizeof(V), values.size(), f);
+  fclose(f);
+  return filename;
+}
+} // namespace
+
+TEST(TestReadBinaryData, Int16) {
+  const std::vector<int16_t> values{-3, 7, 32767, -32768, 0, 12};
+  const std::string filename = WriteTempFile(values);
+  std::vector<int> data;
+  ReadBinaryData(data, filename, "int16");
+  EXPECT_EQ(data, std::vector<int>(values.begin(), values.end()));
+  // Skip two values and read three.
+  ReadBinaryData(data, filename, "int16", 3, 2);
+  EXPECT_EQ(data, std::vector<int>({32767, -32768, 0}));
+  // Only four values are left after the offset.
+  ReadBinaryData(data, filename, "int16", 10, 2);
+  EXPECT_EQ(data.size(), 4u);
+  std::remove(filename.c_str());
+}
+
+TEST(TestReadBinaryData, Float) {
+  const std::vector<float> values{0.5f, -1.25f, 3.f};
+  std::string filename = WriteTempFile(values);
+  std::vector<double> data;
+  ReadBinaryData(data, filename, "float32", 0, 1);
+  EXPECT_EQ(data, std::vector<double>({-1.25, 3.}));
+  std::remove(filename.c_str());
+
+  const std::vector<double> doubles{0.1, -2e300, 7.};
+  filename = WriteTempFile(doubles);
+  ReadBinaryData(data, filename, "float64");
+  EXPECT_EQ(data, doubles);
+  std::remove(filename.c_str());
+}
+
+TEST(TestReadBinaryData, ValueTypes) {
+  EXPECT_TRUE(IsBinaryValueType("int32"));
+  EXPECT_TRUE(IsBinaryValueType("float64"));
+  EXPECT_FALSE(IsBinaryValueType("double"));
+}
@@ -0,0 +1,93 @@
+#include "gtest/gtest.h"
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "utils.h"
+
+using namespace sampen;
+
+namespace {
+std::string WriteTempFile(const std::string &text) {
+  char filename[] = "/tmp/test_read_data_XXXXXX";
+  const int fd = mkstemp(filename);
+  EXPECT_GE(fd, 0);
+  FILE *f = fdopen(fd, "w");
+  fwrite(text.data(), 1, text.size(), f);
+  fclose(f);
+  return filename;
+}
+} // namespace
+
+TEST(TestReadData, Simple) {
+  const std::string filename = WriteTempFile("1 -2\n3\r\n\n  +4\t5\n-6");
+  std::vector<int> data;
+  ReadData(data, filename);
+  EXPECT_EQ(data, std::vector<int>({1, -2, 3, 4, 5, -6}));
+  ReadData(data, filename, "simple", 3, 2);
+  EXPECT_EQ(data, std::vector<int>({3, 4, 5}));
+  // Only one value is left after the offset.
+  ReadData(data, filename, "simple", 3, 5);
+  EXPECT_EQ(data, std::vector<int>({-6}));
+  std::remove(filename.c_str());
+}
+
+TEST(TestReadData, Multirecord) {
+  const std::string filename =
+      WriteTempFile("0 0.5\n1\t-1.25 7\r\n2 3e-1\n3 4");
+  std::vector<double> data;
+  ReadData(data, filename, "multirecord");
+  EXPECT_EQ(data, std::vector<double>({0.5, -1.25, 0.3, 4.}));
+  ReadData(data, filename, "multirecord", 2, 1);
+  EXPECT_EQ(data, std::vector<double>({-1.25, 0.3}));
+  std::remove(filename.c_str());
+}
+
+TEST(TestReadData, FormatError) {
+  const std::string filename = WriteTempFile("0 1\n1 2\n2\n3 4\n");
+  std::vector<int> data;
+  // The malformed line is not needed for the first two values.
+  ReadData(data, filename, "multirecord", 2);
+  EXPECT_EQ(data, std::vector<int>({1, 2}));
+  EXPECT_EXIT(ReadData(data, filename, "multirecord"),
+              ::testing::ExitedWithCode(255), "line: 3\\)");
+  std::remove(filename.c_str());
+}
+
+TEST(TestReadData, TryReadData) {
+  const std::string filename = WriteTempFile("0 1\n1 2\n2\n3 4\n");
+  std::vector<int> data;
+  size_t num_bytes = 0;
+  // A malformed or missing file gives false instead of exiting.
+  EXPECT_FALSE(TryReadData(data, num_bytes, filename, "multirecord"));
+  EXPECT_TRUE(data.empty());
+  EXPECT_FALSE(TryReadData(data, num_bytes, filename + ".missing"));
+  EXPECT_FALSE(
+      TryReadBinaryData(data, num_bytes, filename + ".missing", "int16"));
+  EXPECT_TRUE(TryReadData(data, num_bytes, filename, "multirecord", 2));
+  EXPECT_EQ(data, std::vector<int>({1, 2}));
+  EXPECT_GT(num_bytes, 0u);
+  std::remove(filename.c_str());
+}
+
+TEST(TestReadData, ManyThreads) {
+  // More values than the 2^20 that used to be the default capacity, so that
+  // the file is split into many chunks.
+  const unsigned n = 1200000;
+  std::string text;
+  std::vector<double> expected(n);
+  for (unsigned i = 0; i < n; ++i) {
+    expected[i] = static_cast<double>(i % 1000) / 8 - 50;
+    text += std::to_string(expected[i]) + "\n";
+  }
+  const std::string filename = WriteTempFile(text);
+  std::vector<double> data;
+  for (unsigned num_threads : {1u, 3u, 8u}) {
+    ReadData(data, filename, "simple", 0, 0, num_threads);
+    EXPECT_EQ(data, expected);
+    ReadData(data, filename, "simple", 1000, n - 1500, num_threads);
+    EXPECT_EQ(data, std::vector<double>(expected.end() - 1500,
+                                        expected.end() - 500));
+  }
+  std::remove(filename.c_str());
+}
@@ -0,0 +1,45 @@
+#include "gtest/gtest.h"
+#include <cmath>
+#include <vector>
+
+#include "sample_entropy_calculator_direct.h"
+#include "sample_entropy_multiscale.h"
+#include "test_signal.h"
+
+using namespace sampen;
+
+TEST(TestMultiscaleSampleEntropy, Int) {
+  const std::vector<int> data = GetSignal<int>(4000, 32, 1618);
+  const int r = 3;
+  const unsigned m = 2, max_scale = 8;
+  for (unsigned num_threads : {1, 3}) {
+    // The scales up to 2 with the range kd tree, the others directly.
+    const auto results = ComputeMultiscaleSampleEntropy(
+        data, r, m, max_scale, num_threads, data.size() / 2);
+    ASSERT_EQ(results.size(), max_scale);
+    for (unsigned s = 0; s < max_scale; ++s) {
+      const unsigned scale = s + 1;
+      std::vector<int> y(data.size() / scale, 0);
+      for (unsigned i = 0; i < y.size() * scale; ++i)
+        y[i / scale] += data[i];
+      const vector<long long> ab =
+          _ComputeABFastDirect<int>(y.data(), y.size(), r * scale, m);
+      EXPECT_EQ(results[s].scale, scale);
+      EXPECT_EQ(results[s].n, y.size());
+      EXPECT_EQ(results[s].kd, scale <= 2);
+      EXPECT_EQ(results[s].a, ab[0]) << "scale = " << scale;
+      EXPECT_EQ(results[s].b, ab[1]) << "scale = " << scale;
+      EXPECT_DOUBLE_EQ(
+          results[s].entropy,
+          ComputeSampen(ab[0], ab[1], y.size() - m, m));
+    }
+  }
+}
+
+TEST(TestMultiscaleSampleEntropy, ShortSeries) {
+  // Only the scales with more than m + 1 samples are computed.
+  const std::vector<double> data = GetSignal<double>(20, 10, 1618);
+  const auto results = ComputeMultiscaleSampleEntropy(data, 2., 2, 10);
+  ASSERT_EQ(results.size(), 5u);
+  EXPECT_EQ(results.back().n, 4u);
+}
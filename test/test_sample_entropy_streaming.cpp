@@ -0,0 +1,64 @@
+#include "gtest/gtest.h"
+#include <cmath>
+#include <vector>
+
+#include "sample_entropy_calculator_direct.h"
+#include "sample_entropy_streaming.h"
+#include "test_signal.h"
+
+using namespace sampen;
+
+namespace {
+// After every push, A and B should be those of the last W samples.
+template <typename T>
+void ExpectSameAsDirect(const std::vector<T> &data, unsigned window, T r,
+                        unsigned m) {
+  StreamingSampleEntropy<T> streaming(window, r, m);
+  for (unsigned i = 0; i < data.size(); ++i) {
+    streaming.Push(data[i]);
+    const unsigned n = streaming.size();
+    ASSERT_EQ(n, i + 1 < window ? i + 1 : window);
+    if (n <= m)
+      continue;
+    const vector<long long> expected =
+        _ComputeABFastDirect<T>(data.data() + i + 1 - n, n, r, m);
+    ASSERT_EQ(streaming.get_a(), expected[0])
+        << "i = " << i << ", W = " << window << ", m = " << m;
+    ASSERT_EQ(streaming.get_b(), expected[1])
+        << "i = " << i << ", W = " << window << ", m = " << m;
+  }
+}
+} // namespace
+
+TEST(TestStreamingSampleEntropy, Int) {
+  const std::vector<int> data = GetSignal<int>(1500, 16, 777);
+  for (unsigned window : {3, 10, 64, 257}) {
+    for (unsigned m = 1; m <= 3; ++m) {
+      if (window > m)
+        ExpectSameAsDirect(data, window, 2, m);
+    }
+  }
+}
+
+TEST(TestStreamingSampleEntropy, Double) {
+  std::vector<double> data = GetSignal<double>(1500, 1000, 777);
+  for (double &x : data)
+    x = std::sin(x);
+  for (unsigned window : {5, 100, 300}) {
+    for (unsigned m = 1; m <= 3; ++m)
+      ExpectSameAsDirect(data, window, 0.3, m);
+  }
+}
+
+TEST(TestStreamingSampleEntropy, Entropy) {
+  const std::vector<int> data = GetSignal<int>(600, 8, 777);
+  const unsigned window = 200, m = 2;
+  StreamingSampleEntropy<int> streaming(window, 1, m);
+  for (int x : data)
+    streaming.Push(x);
+  const std::vector<int> last(data.end() - window, data.end());
+  SampleEntropyCalculatorDirect<int> direct(last, 1, m, Silent);
+  EXPECT_EQ(streaming.get_a(), direct.get_a());
+  EXPECT_EQ(streaming.get_b(), direct.get_b());
+  EXPECT_DOUBLE_EQ(streaming.get_entropy(), direct.get_entropy());
+}
@@ -0,0 +1,109 @@
+#include "gtest/gtest.h"
+#include <random>
+#include <vector>
+
+#include "random_sampler.h"
+#include "sample_entropy_calculator_direct.h"
+
+using namespace sampen;
+
+namespace {
+// Compares every pair of the templates starting at the given indices.
+template <typename T>
+std::vector<long long> ComputeABSamplePairwise(
+    const std::vector<T> &data, const std::vector<unsigned> &indices,
+    unsigned m, T r) {
+  const auto matched = [&](unsigned p, unsigned q, unsigned length) {
+    for (unsigned k = 0; k < length; ++k) {
+      const T x = data[indices[p] + k], y = data[indices[q] + k];
+      if (x > y + r || y > x + r)
+        return false;
+    }
+    return true;
+  };
+  std::vector<long long> ab(2, 0);
+  for (unsigned p = 0; p < indices.size(); ++p) {
+    for (unsigned q = p + 1; q < indices.size(); ++q) {
+      if (matched(p, q, m)) {
+        ++ab[1];
+        ab[0] += matched(p, q, m + 1);
+      }
+    }
+  }
+  return ab;
+}
+
+template <typename T>
+void ExpectSameAsPairwise(const std::vector<T> &data, T r, unsigned m,
+                          RandomType rtype, unsigned sample_size,
+                          unsigned sample_num) {
+  const std::vector<std::vector<unsigned> > samples = GetSampleIndices(
+      rtype, data.size() - m, sample_size, sample_num, false);
+  std::vector<long long> expected_a, expected_b;
+  for (const auto &indices : samples) {
+    const std::vector<long long> ab =
+        ComputeABSamplePairwise(data, indices, m, r);
+    expected_a.push_back(ab[0]);
+    expected_b.push_back(ab[1]);
+  }
+  for (bool presort : {false, true}) {
+    SampleEntropyCalculatorSamplingDirect<T> calculator(
+        data, r, m, sample_size, sample_num, -1, -1, -1, rtype, false,
+        presort, Silent);
+    EXPECT_EQ(calculator.get_a_vec(), expected_a)
+        << "m: " << m << ", presort: " << presort;
+    EXPECT_EQ(calculator.get_b_vec(), expected_b)
+        << "m: " << m << ", presort: " << presort;
+  }
+}
+} // namespace
+
+TEST(TestSamplingDirect, Int) {
+  std::mt19937 engine(7);
+  std::uniform_int_distribution<int> dist(0, 20);
+  std::vector<int> data(5000);
+  for (int &x : data)
+    x = dist(engine);
+  // Windows longer than a block, and many repeated values.
+  for (unsigned m : {1u, 2u, 3u}) {
+    ExpectSameAsPairwise(data, 3, m, UNIFORM, 1500, 3);
+    ExpectSameAsPairwise(data, 3, m, SWR_UNIFORM, 700, 2);
+  }
+}
+
+TEST(TestSamplingDirect, Double) {
+  std::mt19937 engine(11);
+  std::normal_distribution<double> dist(0., 1.);
+  std::vector<double> data(4000);
+  for (double &x : data)
+    x = dist(engine);
+  for (unsigned m : {1u, 2u, 4u}) {
+    ExpectSameAsPairwise(data, 0.3, m, UNIFORM, 1000, 2);
+    ExpectSameAsPairwise(data, 0.3, m, GRID, 800, 2);
+  }
+}
+
+// The window of a template ends at the first template whose first value is
+// more than r above its own, so the templates exactly r above, and those
+// tied with it, are still compared.
+TEST(TestSamplingDirect, WindowBoundaries) {
+  std::mt19937 engine(13);
+  std::uniform_int_distribution<int> dist(0, 4);
+  std::vector<int> data(3000);
+  for (int &x : data)
+    x = dist(engine);
+  for (int r : {0, 1, 2}) {
+    for (unsigned m : {1u, 2u}) {
+      ExpectSameAsPairwise(data, r, m, SWR_UNIFORM, 900, 2);
+      ExpectSameAsPairwise(data, r, m, UNIFORM, 900, 2);
+    }
+  }
+  // Multiples of 0.25, so that r = 0.5 is met exactly.
+  std::vector<double> data_double(data.size());
+  for (unsigned i = 0; i < data.size(); ++i)
+    data_double[i] = 0.25 * data[i];
+  ExpectSameAsPairwise(data_double, 0.5, 2, SWR_UNIFORM, 900, 2);
+  // Samples too small to have a pair, or with only one.
+  for (unsigned sample_size : {1u, 2u, 3u})
+    ExpectSameAsPairwise(data, 1, 2, UNIFORM, sample_size, 4);
+}
@@ -0,0 +1,31 @@
+/**
+ * @file test_signal.h
+ *
+ * @brief The signal shared by the tests.
+ */
+
+#ifndef __FAST_SAMPEN_TEST_SIGNAL__
+#define __FAST_SAMPEN_TEST_SIGNAL__
+
+#include <vector>
+
+/**
+ * @brief Get n values in [0, modulus) from a 64-bit linear congruential
+ * generator, which gives the same signal on every platform (unlike the
+ * distributions of <random>).
+ *
+ * @param seed: Different seeds give different signals.
+ */
+template <typename T>
+std::vector<T> GetSignal(unsigned n, unsigned modulus,
+                         unsigned long long seed) {
+  std::vector<T> data(n);
+  unsigned long long x = seed;
+  for (unsigned i = 0; i < n; ++i) {
+    x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+    data[i] = static_cast<T>((x >> 33) % modulus);
+  }
+  return data;
+}
+
+#endif // !__FAST_SAMPEN_TEST_SIGNAL__
@@ -0,0 +1,55 @@
+#include "gtest/gtest.h"
+#include <algorithm>
+#include <vector>
+
+#include "kdpoint.h"
+#include "utils.h"
+#include "test_signal.h"
+
+using namespace sampen;
+
+namespace {
+// The result should be a permutation in the order of TemplateView::Less.
+template <typename T>
+void ExpectSorted(const std::vector<T> &data, unsigned dim) {
+  const unsigned n = data.size();
+  const std::vector<unsigned> rank2index =
+      SortTemplates(data.data(), n, dim);
+  ASSERT_EQ(rank2index.size(), n);
+  std::vector<unsigned> indices(rank2index);
+  std::sort(indices.begin(), indices.end());
+  for (unsigned i = 0; i < n; ++i)
+    ASSERT_EQ(indices[i], i);
+  const TemplateView<T> points(data.data(), n, dim, true);
+  for (unsigned p = 1; p < n; ++p) {
+    ASSERT_FALSE(points.Less(rank2index[p], rank2index[p - 1]))
+        << "n = " << n << ", dim = " << dim << ", p = " << p;
+  }
+}
+} // namespace
+
+TEST(TestSortTemplates, Int) {
+  for (unsigned n : {1, 2, 5, 100, 3000}) {
+    for (unsigned modulus : {1, 2, 7, 1000}) {
+      std::vector<int> data = GetSignal<int>(n, modulus, 31415);
+      for (unsigned i = 0; i < n; i += 3)
+        data[i] -= 500;
+      for (unsigned dim = 1; dim <= 11; ++dim)
+        ExpectSorted(data, dim);
+    }
+  }
+}
+
+TEST(TestSortTemplates, Double) {
+  for (unsigned n : {3, 100, 3000}) {
+    std::vector<double> data = GetSignal<double>(n, 5, 31415);
+    for (unsigned i = 0; i < n; ++i) {
+      data[i] = (data[i] - 2) * 0.25;
+      // -0.0 and 0.0 compare equal.
+      if (data[i] == 0 && i % 2)
+        data[i] = -0.0;
+    }
+    for (unsigned dim = 1; dim <= 11; ++dim)
+      ExpectSorted(data, dim);
+  }
+}